@@ -324,7 +324,7 @@ function client_error_description (error) {
         return _("Your session has been terminated.");
     else if (error == "no-session")
         return _("Your session has expired.  Please log in again.");
-    else if (error == "not-authorized")
+    else if (error == "not-authorized" || error == "authentication-failed")
         return _("Login failed");
     else if (error == "unknown-hostkey")
         return _("Untrusted host");
@@ -35,6 +35,13 @@
    * "object-paths": An array of object paths to start monitoring in
      the case of a non o.f.DBus.ObjectManager based service.
 
+   * "path-prefix": Only relay objects whose path is this one, or
+     below it.
+
+   * "interfaces": An array of interface names.  Only these interfaces
+     are relayed.  Objects are still listed, with just these
+     interfaces.
+
    * "proxies": When set to false, the client will not construct any
      proxy objects.  This is for advanced code that wants to construct
      its own proxies.  You should normally not specify this option.
@@ -306,13 +313,18 @@ DBusClient.prototype = {
         this._proxies = !options || options.proxies || options.proxies === undefined;
         this.error_details = {};
         this.byteorder = null;
+        this._property_deltas = false;
+        this._seed_data = null;
         this.connect();
     },
 
     connect: function() {
         var channel_opts = {
             "host" : this.target,
-            "payload" : "dbus-json2"
+            "payload" : "dbus-json2",
+            "property-deltas" : true,
+            "batch-window" : 50,
+            "chunked-seed" : true
         };
         $.extend(channel_opts, this.options);
 
@@ -331,6 +343,7 @@ DBusClient.prototype = {
         client._channel = channel;
 
         this._last_error = null;
+        this._seed_data = null;
 
         if (this.state !== null) {
             this.state = null;
@@ -339,30 +352,7 @@ DBusClient.prototype = {
         }
 
         $(client._channel).on("message", function(event, payload) {
-            var decoded = JSON.parse(payload);
-            dbus_debug("got message command=" + decoded.command);
-
-            if (decoded.command == "seed") {
-                client._handle_seed(decoded.data, decoded.options);
-            } else if (decoded.command == "interface-properties-changed") {
-                client._handle_properties_changed(decoded.data);
-            } else if (decoded.command == "object-added") {
-                client._handle_object_added(decoded.data);
-            } else if (decoded.command == "object-removed") {
-                client._handle_object_removed(decoded.data);
-            } else if (decoded.command == "interface-added") {
-                client._handle_interface_added(decoded.data);
-            } else if (decoded.command == "interface-removed") {
-                client._handle_interface_removed(decoded.data);
-            } else if (decoded.command == "call-reply") {
-                client._handle_call_reply(decoded.data);
-            } else if (decoded.command == "interface-signal") {
-                client._handle_interface_signal(decoded.data);
-            } else if (decoded.command == "error") {
-                client._handle_error(decoded.data);
-            } else {
-                dbus_warning("Unhandled command '" + decoded.command + "'");
-            }
+            client._handle_message(JSON.parse(payload));
         });
 
         $(client._channel).on("close", function(event, options) {
@@ -383,6 +373,37 @@ DBusClient.prototype = {
         });
     },
 
+    _handle_message: function(decoded) {
+        dbus_debug("got message command=" + decoded.command);
+
+        if (decoded.command == "seed") {
+            this._handle_seed(decoded.data, decoded.options);
+        } else if (decoded.command == "seed-chunk") {
+            this._handle_seed_chunk(decoded.data);
+        } else if (decoded.command == "changes") {
+            for (var i = 0; i < decoded.data.length; i++)
+                this._handle_message(decoded.data[i]);
+        } else if (decoded.command == "interface-properties-changed") {
+            this._handle_properties_changed(decoded.data);
+        } else if (decoded.command == "object-added") {
+            this._handle_object_added(decoded.data);
+        } else if (decoded.command == "object-removed") {
+            this._handle_object_removed(decoded.data);
+        } else if (decoded.command == "interface-added") {
+            this._handle_interface_added(decoded.data);
+        } else if (decoded.command == "interface-removed") {
+            this._handle_interface_removed(decoded.data);
+        } else if (decoded.command == "call-reply") {
+            this._handle_call_reply(decoded.data);
+        } else if (decoded.command == "interface-signal") {
+            this._handle_interface_signal(decoded.data);
+        } else if (decoded.command == "error") {
+            this._handle_error(decoded.data);
+        } else {
+            dbus_warning("Unhandled command '" + decoded.command + "'");
+        }
+    },
+
     _state_change: function() {
         $(this).trigger("state-change");
         phantom_checkpoint ();
@@ -392,24 +413,45 @@ DBusClient.prototype = {
         this._last_error = data;
     },
 
+    _seed_objects : function(data) {
+        for (var objpath in data) {
+            if (objpath in this._objmap) {
+                this._objmap[objpath]._reseed(data[objpath], this);
+            } else {
+                this._objmap[objpath] = new DBusObject(data[objpath], this);
+                $(this).trigger("objectAdded", this._objmap[objpath]);
+            }
+        }
+    },
+
+    _handle_seed_chunk : function(data) {
+        /* Objects show up as their chunk arrives, the "seed" comes last */
+        this._seed_data = $.extend(this._seed_data || { }, data);
+        if (this._proxies)
+            this._seed_objects(data);
+    },
+
     _handle_seed : function(data, options) {
         if (options && options.byteorder)
             this.byteorder = options.byteorder;
 
+        /* Older bridges ignore the option and send whole interfaces */
+        this._property_deltas = !!(options && options["property-deltas"]);
+
+        var last = data;
+        if (this._seed_data) {
+            data = $.extend(this._seed_data, last);
+            this._seed_data = null;
+        }
+
         $(this).trigger("seed", data);
 
         if (!this._proxies)
             return;
 
-        for (var objpath in data) {
-            if (objpath in this._objmap) {
-                this._objmap[objpath]._reseed(data[objpath], this);
-            } else {
-                this._objmap[objpath] = new DBusObject(data[objpath], this);
-                $(this).trigger("objectAdded", this._objmap[objpath]);
-            }
-        }
+        this._seed_objects(last);
 
+        var objpath;
         for (objpath in this._objmap) {
             if (!(objpath in data)) {
                 var obj = this._objmap[objpath];
@@ -424,13 +466,23 @@ DBusClient.prototype = {
     },
 
     _handle_properties_changed : function(data) {
-        $(this).trigger("properties-changed", [ data.objpath, data.iface_name, data.iface[iface_name] ]);
+        var objpath = data.objpath;
+        var iface_name = data.iface_name;
+        var changed_properties, invalidated_properties;
+
+        if (this._property_deltas) {
+            changed_properties = data.changed;
+            invalidated_properties = data.invalidated || [];
+        } else {
+            changed_properties = data.iface[iface_name];
+            invalidated_properties = [];
+        }
+
+        $(this).trigger("properties-changed", [ objpath, iface_name, changed_properties, invalidated_properties ]);
 
         if (!this._proxies)
             return;
 
-        var objpath = data.objpath;
-        var iface_name = data.iface_name;
         var existing_obj = this._objmap[objpath];
         if (!existing_obj) {
             dbus_warning("Received interface-properties-changed for non-existing object path " + objpath);
@@ -439,12 +491,16 @@ DBusClient.prototype = {
             if (!existing_iface) {
                 dbus_warning("Received interface-properties-changed for existing object path " + objpath + " but non-existant interface " + iface_name);
             } else {
-                var changed_properties = data.iface[iface_name];
-                for (var key in changed_properties) {
+                var key;
+                for (key in changed_properties) {
                     // Update the property on the existing object
                     existing_iface[key] = changed_properties[key];
                     $(existing_iface).trigger("notify:" + key, changed_properties[key]);
-
+                }
+                for (var i = 0; i < invalidated_properties.length; i++) {
+                    key = invalidated_properties[i];
+                    delete existing_iface[key];
+                    $(existing_iface).trigger("notify:" + key, undefined);
                 }
                 $(existing_iface).trigger("notify");
                 $(this).trigger("propertiesChanged", [ existing_obj, existing_iface ]);
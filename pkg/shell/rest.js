@@ -61,6 +61,8 @@
  *   @params: optional, a plain object of query params
  *   Asks REST JSON bridge to check the result of the given GET request
  *   every @interval milliseconds. Any changes in the results are sent.
+ *   The bridge may only send what changed, but the whole result is
+ *   always passed to callbacks.
  *   If @watch is specified, watch another request for output, and when
  *   that request has output, perform the poll request.
  *
@@ -158,6 +160,48 @@ var cockpit = cockpit || { };
 
     var last_cookie = 3;
 
+    /* Apply a JSON patch from the bridge to a copy of the last result */
+    function apply_patch(last, patch) {
+        /*
+         * Earlier results have been handed out, so leave them alone. Only
+         * the containers along each patched path are copied, once each.
+         */
+        var root = { "": last };
+        var copied = [ root ];
+
+        function copy(value) {
+            if (value === null || typeof value !== "object" || copied.indexOf(value) !== -1)
+                return value;
+            value = $.isArray(value) ? value.slice() : $.extend({ }, value);
+            copied.push(value);
+            return value;
+        }
+
+        patch.forEach(function(op) {
+            var tokens = op.path.split("/").map(function(token) {
+                return token.replace(/~1/g, "/").replace(/~0/g, "~");
+            });
+            var parent = root;
+            var key = tokens.shift();
+            while (tokens.length) {
+                parent[key] = copy(parent[key]);
+                parent = parent[key];
+                key = tokens.shift();
+            }
+            if (op.op == "remove") {
+                if ($.isArray(parent))
+                    parent.splice(parseInt(key, 10), 1);
+                else
+                    delete parent[key];
+            } else if (op.op == "add" && $.isArray(parent)) {
+                parent.splice(parseInt(key, 10), 0, op.value);
+            } else {
+                parent[key] = op.value;
+            }
+        });
+        return root[""];
+    }
+
     function rest_perform(channel_get, req, cookie) {
         var dfd = new $.Deferred();
 
@@ -191,10 +235,18 @@ var cockpit = cockpit || { };
         /* Callbacks that want to stream response, see below */
         var streamers = null;
 
+        /* Last result, which poll patches apply to */
+        var last;
+
         function on_result(event, result) {
             if (result.cookie !== cookie)
                 return;
 
+            if (result.patch !== undefined)
+                result.body = apply_patch(last, result.patch);
+            if (result.body !== undefined)
+                last = result.body;
+
             /* An error, fail here */
             if (result.status < 200 || result.status > 299) {
                 var httpex = new RestError(result.status, result.message);
@@ -308,7 +360,7 @@ var cockpit = cockpit || { };
                 "method": "GET",
                 "params": params,
                 "path": path,
-                "poll": { "interval": interval || 0, "watch": watch }
+                "poll": { "interval": interval || 0, "watch": watch, "patch": true }
             });
         };
         this.post = function(path, params, body) {
@@ -21,6 +21,7 @@
 #include "cockpitchannel.h"
 #include "cockpitdbusjson.h"
 #include "cockpitpolkitagent.h"
+#include "cockpitresource.h"
 
 #include "common/cockpitjson.h"
 #include "common/cockpitlog.h"
@@ -43,6 +44,10 @@
 
 static GHashTable *channels;
 static gboolean init_received;
+static gboolean throttled;
+
+/* Frames smaller than this aren't worth compressing */
+#define COMPRESS_THRESHOLD 1024
 
 static void
 on_channel_closed (CockpitChannel *channel,
@@ -56,15 +61,22 @@ static void
 process_init (CockpitTransport *transport,
               JsonObject *options)
 {
+  const gchar *compress;
   gint64 version;
 
   if (!cockpit_json_get_int (options, "version", -1, &version))
     version = -1;
+  if (!cockpit_json_get_string (options, "compress", NULL, &compress))
+    compress = NULL;
 
   if (version == 0)
     {
       g_debug ("received init message");
       init_received = TRUE;
+
+      /* The other end can handle compressed frames */
+      if (compress && !cockpit_transport_set_compress (transport, compress, COMPRESS_THRESHOLD))
+        g_debug ("unsupported compression: %s", compress);
     }
   else
     {
@@ -95,9 +107,22 @@ process_open (CockpitTransport *transport,
       channel = cockpit_channel_open (transport, channel_id, options);
       g_hash_table_insert (channels, g_strdup (channel_id), channel);
       g_signal_connect (channel, "closed", G_CALLBACK (on_channel_closed), NULL);
+
+      /* A channel opened while output is backed up starts out throttled */
+      if (throttled)
+        cockpit_channel_throttle (channel, TRUE);
     }
 }
 
+static void
+on_transport_queued (GObject *object,
+                     GParamSpec *pspec,
+                     gpointer user_data)
+{
+  gsize queued = cockpit_pipe_transport_get_queued (COCKPIT_PIPE_TRANSPORT (object));
+  cockpit_channel_throttle_queued (channels, queued, &throttled);
+}
+
 static void
 process_close (CockpitTransport *transport,
                const gchar *channel_id,
@@ -135,6 +160,28 @@ process_close (CockpitTransport *transport,
     }
 }
 
+static void
+process_pause (CockpitTransport *transport,
+               const gchar *channel_id,
+               gboolean paused)
+{
+  CockpitChannel *channel;
+
+  if (!channel_id)
+    {
+      g_warning ("Caller tried to pause or resume channel without an id");
+      cockpit_transport_close (transport, "protocol-error");
+      return;
+    }
+
+  /* As with close, the channel may have just gone away */
+  channel = g_hash_table_lookup (channels, channel_id);
+  if (channel)
+    cockpit_channel_pause (channel, paused);
+  else
+    g_debug ("can't pause or resume closed channel %s", channel_id);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const char *command,
@@ -159,6 +206,10 @@ on_transport_control (CockpitTransport *transport,
     process_open (transport, channel_id, options);
   else if (g_str_equal (command, "close"))
     process_close (transport, channel_id, options);
+  else if (g_str_equal (command, "pause"))
+    process_pause (transport, channel_id, TRUE);
+  else if (g_str_equal (command, "resume"))
+    process_pause (transport, channel_id, FALSE);
   else
     return FALSE;
   return TRUE; /* handled */
@@ -176,7 +227,7 @@ on_closed_set_flag (CockpitTransport *transport,
 static void
 send_init_command (CockpitTransport *transport)
 {
-  const gchar *response = "\n{ \"command\": \"init\", \"version\": 0 }";
+  const gchar *response = "\n{ \"command\": \"init\", \"version\": 0, \"compress\": \"zlib\" }";
   GBytes *bytes = g_bytes_new_static (response, strlen (response));
   cockpit_transport_send (transport, NULL, bytes);
   g_bytes_unref (bytes);
@@ -287,6 +338,25 @@ out:
   return pid;
 }
 
+static void
+setup_resource_cache (void)
+{
+  const gchar *env;
+  guint64 size;
+  gchar *end;
+
+  /* Kilobytes of memory for caching expanded resources */
+  env = g_getenv ("COCKPIT_BRIDGE_RESOURCE_CACHE");
+  if (env == NULL || env[0] == '\0')
+    return;
+
+  size = g_ascii_strtoull (env, &end, 10);
+  if (end[0] != '\0' || size > G_MAXSIZE / 1024)
+    g_warning ("invalid COCKPIT_BRIDGE_RESOURCE_CACHE value: %s", env);
+  else
+    cockpit_resource_set_cache_size (size * 1024);
+}
+
 static gboolean
 on_signal_done (gpointer data)
 {
@@ -346,6 +416,8 @@ main (int argc,
 
   g_type_init ();
 
+  setup_resource_cache ();
+
   transport = cockpit_pipe_transport_new_fds ("stdio", 0, outfd);
   g_signal_connect (transport, "control", G_CALLBACK (on_transport_control), NULL);
   g_signal_connect (transport, "closed", G_CALLBACK (on_closed_set_flag), &closed);
@@ -367,9 +439,17 @@ main (int argc,
   /* Owns the channels */
   channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
 
+  /*
+   * Channels read as fast as their sources allow, so bound what piles
+   * up on our stdout when cockpit-ws doesn't keep up reading it.
+   */
+  g_signal_connect (transport, "notify::queued", G_CALLBACK (on_transport_queued), NULL);
+
   while (!terminated && !closed)
     g_main_context_iteration (NULL, TRUE);
 
+  g_signal_handlers_disconnect_by_func (transport, on_transport_queued, NULL);
+
   if (polkit_agent)
     cockpit_polkit_agent_unregister (polkit_agent);
   if (connection)
@@ -51,13 +51,17 @@
  * See doc/protocol.md for information about channels.
  */
 
+/* Throttle channels while this much output to the transport is queued */
+#define OUTPUT_HIGH_WATER  (4 * 1024 * 1024)
+#define OUTPUT_LOW_WATER   (1024 * 1024)
+
 struct _CockpitChannelPrivate {
   gulong recv_sig;
   gulong close_sig;
 
   /* Construct arguments */
   CockpitTransport *transport;
-  gchar *id;
+  const gchar *id;
   JsonObject *open_options;
 
   /* Queued messages before channel is ready */
@@ -70,6 +74,12 @@ struct _CockpitChannelPrivate {
   /* Whether the transport closed (before we did) */
   gboolean transport_closed;
 
+  /* Whether the other end asked us to stop sending */
+  gboolean paused;
+
+  /* Whether our own output to the transport is backed up */
+  gboolean throttled;
+
   /* Other state */
   JsonObject *close_options;
 };
@@ -101,7 +111,8 @@ on_transport_recv (CockpitTransport *transport,
   CockpitChannel *self = user_data;
   CockpitChannelClass *klass;
 
-  if (g_strcmp0 (channel_id, self->priv->id) != 0)
+  /* Both are interned, see cockpit_transport_intern_channel() */
+  if (channel_id != self->priv->id)
     return FALSE;
 
   if (self->priv->ready)
@@ -182,7 +193,8 @@ cockpit_channel_set_property (GObject *object,
         self->priv->transport = g_value_dup_object (value);
         break;
       case PROP_ID:
-        self->priv->id = g_value_dup_string (value);
+        if (g_value_get_string (value))
+          self->priv->id = cockpit_transport_intern_channel (g_value_get_string (value), -1);
         break;
       case PROP_OPTIONS:
         self->priv->open_options = g_value_dup_boxed (value);
@@ -225,7 +237,8 @@ cockpit_channel_finalize (GObject *object)
   json_object_unref (self->priv->open_options);
   if (self->priv->close_options)
     json_object_unref (self->priv->close_options);
-  g_free (self->priv->id);
+  if (self->priv->id)
+    cockpit_transport_release_channel (self->priv->id);
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->finalize (object);
 }
@@ -265,7 +278,7 @@ cockpit_channel_real_close (CockpitChannel *self,
       message = cockpit_json_write_bytes (object);
       json_object_unref (object);
 
-      cockpit_transport_send (self->priv->transport, 0, message);
+      cockpit_transport_send_control (self->priv->transport, self->priv->id, message);
       g_bytes_unref (message);
     }
 
@@ -419,8 +432,126 @@ cockpit_channel_close (CockpitChannel *self,
   (klass->close) (self, reason);
 }
 
+static void
+update_paused (CockpitChannel *self,
+               gboolean was)
+{
+  CockpitChannelClass *klass;
+  gboolean now;
+
+  now = self->priv->paused || self->priv->throttled;
+  if (now == was)
+    return;
+
+  g_debug ("%s: %s channel", self->priv->id, now ? "pausing" : "resuming");
+
+  klass = COCKPIT_CHANNEL_GET_CLASS (self);
+  if (klass->pause)
+    (klass->pause) (self, now);
+}
+
+/**
+ * cockpit_channel_pause:
+ * @self: a channel
+ * @paused: whether to pause or resume
+ *
+ * Called when the other end can't keep up with the data this channel
+ * sends, and again when it can. Implementations that read from a pipe
+ * or socket stop doing so while paused.
+ */
+void
+cockpit_channel_pause (CockpitChannel *self,
+                       gboolean paused)
+{
+  gboolean was;
+
+  g_return_if_fail (COCKPIT_IS_CHANNEL (self));
+
+  was = cockpit_channel_is_paused (self);
+  self->priv->paused = paused ? TRUE : FALSE;
+  update_paused (self, was);
+}
+
+/**
+ * cockpit_channel_throttle:
+ * @self: a channel
+ * @throttled: whether to throttle or not
+ *
+ * Called when too much of what the channels have sent is still
+ * queued to be written to the transport, and again once it has
+ * been written. This pauses the channel just like
+ * cockpit_channel_pause(), independently of whether the other end
+ * has paused it.
+ */
+void
+cockpit_channel_throttle (CockpitChannel *self,
+                          gboolean throttled)
+{
+  gboolean was;
+
+  g_return_if_fail (COCKPIT_IS_CHANNEL (self));
+
+  was = cockpit_channel_is_paused (self);
+  self->priv->throttled = throttled ? TRUE : FALSE;
+  update_paused (self, was);
+}
+
+/**
+ * cockpit_channel_throttle_queued:
+ * @channels: (element-type utf8 CockpitChannel): channels sending on a transport
+ * @queued: the bytes of output queued on the transport
+ * @throttled: (inout): whether the channels are throttled
+ *
+ * Throttle all the @channels once @queued reaches the high water
+ * mark, and release them once it drops to the low water mark. In
+ * between nothing changes, so the channels don't flip back and
+ * forth with each frame written.
+ */
+void
+cockpit_channel_throttle_queued (GHashTable *channels,
+                                 gsize queued,
+                                 gboolean *throttled)
+{
+  GHashTableIter iter;
+  gpointer channel;
+
+  g_return_if_fail (channels != NULL);
+  g_return_if_fail (throttled != NULL);
+
+  if (!*throttled && queued >= OUTPUT_HIGH_WATER)
+    *throttled = TRUE;
+  else if (*throttled && queued <= OUTPUT_LOW_WATER)
+    *throttled = FALSE;
+  else
+    return;
+
+  g_debug ("%s channels with %" G_GSIZE_FORMAT " bytes of output queued",
+           *throttled ? "throttling" : "unthrottling", queued);
+
+  g_hash_table_iter_init (&iter, channels);
+  while (g_hash_table_iter_next (&iter, NULL, &channel))
+    cockpit_channel_throttle (channel, *throttled);
+}
+
 /* Used by implementations */
 
+/**
+ * cockpit_channel_is_paused:
+ * @self: a channel
+ *
+ * Check whether this channel should stop sending data for now,
+ * either because the other end asked it to or because the
+ * transport is backed up.
+ *
+ * Returns: whether paused
+ */
+gboolean
+cockpit_channel_is_paused (CockpitChannel *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_CHANNEL (self), FALSE);
+  return self->priv->paused || self->priv->throttled;
+}
+
 /**
  * cockpit_channel_ready:
  * @self: a pipe
@@ -59,6 +59,9 @@ struct _CockpitChannelClass
 
   void        (* close)       (CockpitChannel *channel,
                                const gchar *problem);
+
+  void        (* pause)       (CockpitChannel *channel,
+                               gboolean paused);
 };
 
 GType               cockpit_channel_get_type          (void) G_GNUC_CONST;
@@ -72,10 +75,22 @@ void                cockpit_channel_close             (CockpitChannel *self,
 
 const gchar *       cockpit_channel_get_id            (CockpitChannel *self);
 
+void                cockpit_channel_pause             (CockpitChannel *self,
+                                                       gboolean paused);
+
+void                cockpit_channel_throttle          (CockpitChannel *self,
+                                                       gboolean throttled);
+
+void                cockpit_channel_throttle_queued   (GHashTable *channels,
+                                                       gsize queued,
+                                                       gboolean *throttled);
+
 /* Used by implementations */
 
 void                cockpit_channel_ready             (CockpitChannel *self);
 
+gboolean            cockpit_channel_is_paused         (CockpitChannel *self);
+
 void                cockpit_channel_send              (CockpitChannel *self,
                                                        GBytes *payload);
 
@@ -0,0 +1,646 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusconverter.h"
+
+#include "common/cockpitjson.h"
+
+#include <gio/gio.h>
+
+/**
+ * CockpitDBusConverter:
+ *
+ * Turns JSON into a GVariant of a given DBus type. The type is walked
+ * once when the converter is built, into a tree of nodes that each know
+ * what kind of value they make. Converting a value then only follows
+ * that tree, rather than looking at the signature again.
+ *
+ * Converters for signatures are cached and shared between all
+ * callers, since they never change once built.
+ */
+
+/* Most signatures we keep converters around for */
+#define MAX_CACHED_CONVERTERS 512
+
+typedef enum {
+  CONVERT_UNSUPPORTED,
+  CONVERT_INDEFINITE,
+  CONVERT_BOOLEAN,
+  CONVERT_BYTE,
+  CONVERT_INT16,
+  CONVERT_UINT16,
+  CONVERT_INT32,
+  CONVERT_UINT32,
+  CONVERT_INT64,
+  CONVERT_UINT64,
+  CONVERT_DOUBLE,
+  CONVERT_STRING,
+  CONVERT_OBJECT_PATH,
+  CONVERT_SIGNATURE,
+  CONVERT_VARIANT,
+  CONVERT_ARRAY,
+  CONVERT_DICTIONARY,
+  CONVERT_TUPLE,
+} ConvertKind;
+
+typedef struct _ConvertNode ConvertNode;
+
+struct _ConvertNode {
+  ConvertKind kind;
+  GVariantType *type;
+
+  /* Arrays and dictionaries: the type of each child */
+  const GVariantType *child_type;
+
+  /* Arrays: the elements. Dictionaries: the values */
+  ConvertNode *element;
+
+  /* Dictionaries */
+  ConvertNode *key;
+  gboolean key_is_string;
+
+  /* Tuples */
+  ConvertNode **items;
+  guint n_items;
+};
+
+struct _CockpitDBusConverter {
+  gint refs;
+  ConvertNode *root;
+};
+
+G_LOCK_DEFINE_STATIC (converters);
+static GHashTable *converters = NULL;
+
+static void
+convert_node_free (ConvertNode *node)
+{
+  guint i;
+
+  if (!node)
+    return;
+
+  for (i = 0; i < node->n_items; i++)
+    convert_node_free (node->items[i]);
+  g_free (node->items);
+  convert_node_free (node->element);
+  convert_node_free (node->key);
+  g_variant_type_free (node->type);
+  g_free (node);
+}
+
+static ConvertKind
+basic_kind (const GVariantType *type)
+{
+  switch (g_variant_type_peek_string (type)[0])
+    {
+    case 'b':
+      return CONVERT_BOOLEAN;
+    case 'y':
+      return CONVERT_BYTE;
+    case 'n':
+      return CONVERT_INT16;
+    case 'q':
+      return CONVERT_UINT16;
+    case 'i':
+      return CONVERT_INT32;
+    case 'u':
+      return CONVERT_UINT32;
+    case 'x':
+      return CONVERT_INT64;
+    case 't':
+      return CONVERT_UINT64;
+    case 'd':
+      return CONVERT_DOUBLE;
+    case 's':
+      return CONVERT_STRING;
+    case 'o':
+      return CONVERT_OBJECT_PATH;
+    case 'g':
+      return CONVERT_SIGNATURE;
+    default:
+      return CONVERT_UNSUPPORTED;
+    }
+}
+
+/*
+ * Types we can't convert still get a node, and fail when a value
+ * actually reaches them. An empty array of file descriptors converts
+ * fine, for example.
+ */
+static ConvertNode *
+compile_node (const GVariantType *type)
+{
+  const GVariantType *item;
+  ConvertNode *node;
+  guint i;
+
+  node = g_new0 (ConvertNode, 1);
+  node->type = g_variant_type_copy (type);
+
+  if (!g_variant_type_is_definite (type))
+    {
+      node->kind = CONVERT_INDEFINITE;
+    }
+  else if (g_variant_type_is_basic (type))
+    {
+      node->kind = basic_kind (type);
+    }
+  else if (g_variant_type_is_variant (type))
+    {
+      node->kind = CONVERT_VARIANT;
+    }
+  else if (g_variant_type_is_array (type))
+    {
+      node->child_type = g_variant_type_element (node->type);
+      if (g_variant_type_is_dict_entry (node->child_type))
+        {
+          node->kind = CONVERT_DICTIONARY;
+          node->key = compile_node (g_variant_type_key (node->child_type));
+          node->element = compile_node (g_variant_type_value (node->child_type));
+          node->key_is_string = (node->key->kind == CONVERT_STRING ||
+                                 node->key->kind == CONVERT_OBJECT_PATH ||
+                                 node->key->kind == CONVERT_SIGNATURE);
+        }
+      else
+        {
+          node->kind = CONVERT_ARRAY;
+          node->element = compile_node (node->child_type);
+        }
+    }
+  else if (g_variant_type_is_tuple (type))
+    {
+      node->kind = CONVERT_TUPLE;
+      node->n_items = g_variant_type_n_items (type);
+      node->items = g_new0 (ConvertNode *, node->n_items);
+      for (i = 0, item = g_variant_type_first (type); item != NULL;
+           i++, item = g_variant_type_next (item))
+        node->items[i] = compile_node (item);
+    }
+  else
+    {
+      node->kind = CONVERT_UNSUPPORTED;
+    }
+
+  return node;
+}
+
+/**
+ * cockpit_dbus_converter_new:
+ * @type: the type of values to make
+ *
+ * Build a converter for @type, without looking in or adding to
+ * the cache.
+ *
+ * Returns: (transfer full): the new converter
+ */
+CockpitDBusConverter *
+cockpit_dbus_converter_new (const GVariantType *type)
+{
+  CockpitDBusConverter *converter;
+
+  g_return_val_if_fail (type != NULL, NULL);
+
+  converter = g_new0 (CockpitDBusConverter, 1);
+  converter->refs = 1;
+  converter->root = compile_node (type);
+  return converter;
+}
+
+/**
+ * cockpit_dbus_converter_lookup:
+ * @signature: a GVariant type string
+ *
+ * Get the converter for @signature, building and caching it if this
+ * is the first time it's been asked for.
+ *
+ * Returns: (transfer full): the converter, or %NULL if @signature is
+ *          not a valid type string
+ */
+CockpitDBusConverter *
+cockpit_dbus_converter_lookup (const gchar *signature)
+{
+  CockpitDBusConverter *converter;
+  GVariantType *type;
+
+  g_return_val_if_fail (signature != NULL, NULL);
+
+  G_LOCK (converters);
+
+  if (converters == NULL)
+    {
+      converters = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)cockpit_dbus_converter_unref);
+    }
+
+  converter = g_hash_table_lookup (converters, signature);
+  if (converter)
+    {
+      cockpit_dbus_converter_ref (converter);
+    }
+  else if (g_variant_type_string_is_valid (signature))
+    {
+      type = g_variant_type_new (signature);
+      converter = cockpit_dbus_converter_new (type);
+      g_variant_type_free (type);
+
+      /* Callers can send any signature they like, so don't let them fill memory */
+      if (g_hash_table_size (converters) < MAX_CACHED_CONVERTERS)
+        {
+          g_hash_table_insert (converters, g_strdup (signature),
+                               cockpit_dbus_converter_ref (converter));
+        }
+    }
+
+  G_UNLOCK (converters);
+
+  return converter;
+}
+
+/**
+ * cockpit_dbus_converter_ref:
+ * @converter: a converter
+ *
+ * Returns: (transfer full): the same @converter
+ */
+CockpitDBusConverter *
+cockpit_dbus_converter_ref (CockpitDBusConverter *converter)
+{
+  g_return_val_if_fail (converter != NULL, NULL);
+  g_atomic_int_inc (&converter->refs);
+  return converter;
+}
+
+/**
+ * cockpit_dbus_converter_unref:
+ * @converter: a converter
+ *
+ * Release a reference, freeing the converter when it was the last one.
+ */
+void
+cockpit_dbus_converter_unref (CockpitDBusConverter *converter)
+{
+  g_return_if_fail (converter != NULL);
+
+  if (g_atomic_int_dec_and_test (&converter->refs))
+    {
+      convert_node_free (converter->root);
+      g_free (converter);
+    }
+}
+
+static gboolean
+check_type (JsonNode *node,
+            JsonNodeType type,
+            GType sub_type,
+            GError **error)
+{
+  if (JSON_NODE_TYPE (node) != type ||
+      (type == JSON_NODE_VALUE && (json_node_get_value_type (node) != sub_type)))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unexpected type '%s' in JSON node",
+                   g_type_name (json_node_get_value_type (node)));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static GVariant *
+parse_json (ConvertNode *conv,
+            JsonNode *node,
+            GError **error);
+
+static GVariant *
+parse_json_tuple (ConvertNode *conv,
+                  JsonNode *node,
+                  GError **error)
+{
+  GVariant *result = NULL;
+  GVariant **children;
+  JsonArray *array;
+  guint length;
+  guint i = 0;
+
+  if (!check_type (node, JSON_NODE_ARRAY, 0, error))
+    return NULL;
+
+  array = json_node_get_array (node);
+  length = json_array_get_length (array);
+
+  if (length > conv->n_items)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Too many values in tuple/struct");
+      return NULL;
+    }
+
+  children = g_newa (GVariant *, conv->n_items + 1);
+  for (i = 0; i < length; i++)
+    {
+      children[i] = parse_json (conv->items[i], json_array_get_element (array, i), error);
+      if (!children[i])
+        goto out;
+    }
+
+  if (length < conv->n_items)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Too few values in tuple/struct");
+      goto out;
+    }
+
+  result = g_variant_new_tuple (children, length);
+  i = 0;
+
+out:
+  while (i > 0)
+    g_variant_unref (children[--i]);
+  return result;
+}
+
+static GVariant *
+parse_json_array (ConvertNode *conv,
+                  JsonNode *node,
+                  GError **error)
+{
+  GVariant *result = NULL;
+  GPtrArray *children;
+  GVariant *child;
+  JsonArray *array;
+  guint length;
+  guint i;
+
+  if (!check_type (node, JSON_NODE_ARRAY, 0, error))
+    return NULL;
+
+  array = json_node_get_array (node);
+  length = json_array_get_length (array);
+  children = g_ptr_array_sized_new (length);
+
+  for (i = 0; i < length; i++)
+    {
+      child = parse_json (conv->element, json_array_get_element (array, i), error);
+      if (!child)
+        goto out;
+
+      g_ptr_array_add (children, child);
+    }
+
+  result = g_variant_new_array (conv->child_type,
+                                (GVariant *const *)children->pdata,
+                                children->len);
+  children->len = 0;
+
+out:
+  g_ptr_array_foreach (children, (GFunc)g_variant_unref, NULL);
+  g_ptr_array_free (children, TRUE);
+  return result;
+}
+
+static GVariant *
+parse_json_with_sig (JsonObject *object,
+                     GError **error)
+{
+  CockpitDBusConverter *converter;
+  GVariant *inner;
+  JsonNode *val;
+  const gchar *sig;
+
+  val = json_object_get_member (object, "val");
+  if (val == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "JSON did not contain a 'val' field");
+      return NULL;
+    }
+  if (!cockpit_json_get_string (object, "sig", NULL, &sig) || !sig)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "JSON did not contain valid 'sig' fields");
+      return NULL;
+    }
+
+  converter = cockpit_dbus_converter_lookup (sig);
+  if (!converter)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "JSON 'sig' field '%s' is invalid", sig);
+      return NULL;
+    }
+
+  inner = parse_json (converter->root, val, error);
+  cockpit_dbus_converter_unref (converter);
+
+  if (!inner)
+    return NULL;
+
+  return g_variant_new_variant (inner);
+}
+
+static GVariant *
+parse_string (ConvertNode *conv,
+              const gchar *str,
+              GError **error)
+{
+  switch (conv->kind)
+    {
+    case CONVERT_STRING:
+      return g_variant_new_string (str);
+    case CONVERT_OBJECT_PATH:
+      if (g_variant_is_object_path (str))
+        return g_variant_new_object_path (str);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid object path '%s'", str);
+      return NULL;
+    case CONVERT_SIGNATURE:
+      if (g_variant_is_signature (str))
+        return g_variant_new_signature (str);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid signature '%s'", str);
+      return NULL;
+    default:
+      g_return_val_if_reached (NULL);
+    }
+}
+
+static GVariant *
+parse_json_dictionary (ConvertNode *conv,
+                       JsonNode *node,
+                       GError **error)
+{
+  GVariant *result = NULL;
+  GPtrArray *children = NULL;
+  JsonObject *object;
+  JsonNode *key_node;
+  GList *members = NULL;
+  GVariant *value;
+  GVariant *key;
+  GList *l;
+
+  if (!check_type (node, JSON_NODE_OBJECT, 0, error))
+    return NULL;
+
+  object = json_node_get_object (node);
+  children = g_ptr_array_sized_new (json_object_get_size (object));
+
+  members = json_object_get_members (object);
+  for (l = members; l != NULL; l = g_list_next (l))
+    {
+      if (conv->key_is_string)
+        {
+          key = parse_string (conv->key, l->data, error);
+        }
+      else
+        {
+          key_node = cockpit_json_parse (l->data, -1, NULL);
+          if (key_node == NULL)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Unexpected key '%s' in JSON object", (gchar *)l->data);
+              goto out;
+            }
+          key = parse_json (conv->key, key_node, error);
+          json_node_free (key_node);
+        }
+
+      if (!key)
+        goto out;
+
+      value = parse_json (conv->element, json_object_get_member (object, l->data), error);
+      if (!value)
+        {
+          g_variant_unref (key);
+          goto out;
+        }
+
+      g_ptr_array_add (children, g_variant_new_dict_entry (key, value));
+    }
+
+  result = g_variant_new_array (conv->child_type,
+                                (GVariant *const *)children->pdata,
+                                children->len);
+  children->len = 0;
+
+out:
+  g_list_free (members);
+  g_ptr_array_foreach (children, (GFunc)g_variant_unref, NULL);
+  g_ptr_array_free (children, TRUE);
+  return result;
+}
+
+static GVariant *
+parse_json (ConvertNode *conv,
+            JsonNode *node,
+            GError **error)
+{
+  switch (conv->kind)
+    {
+    case CONVERT_BOOLEAN:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_BOOLEAN, error))
+        return g_variant_new_boolean (json_node_get_boolean (node));
+      return NULL;
+    case CONVERT_BYTE:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_byte (json_node_get_int (node));
+      return NULL;
+    case CONVERT_INT16:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_int16 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_UINT16:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_uint16 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_INT32:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_int32 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_UINT32:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_uint32 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_INT64:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_int64 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_UINT64:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
+        return g_variant_new_uint64 (json_node_get_int (node));
+      return NULL;
+    case CONVERT_DOUBLE:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, NULL))
+        return g_variant_new_double (json_node_get_int (node));
+      else if (check_type (node, JSON_NODE_VALUE, G_TYPE_DOUBLE, error))
+        return g_variant_new_double (json_node_get_double (node));
+      return NULL;
+    case CONVERT_STRING:
+    case CONVERT_OBJECT_PATH:
+    case CONVERT_SIGNATURE:
+      if (check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
+        return parse_string (conv, json_node_get_string (node), error);
+      return NULL;
+    case CONVERT_VARIANT:
+      if (check_type (node, JSON_NODE_OBJECT, 0, error))
+        return parse_json_with_sig (json_node_get_object (node), error);
+      return NULL;
+    case CONVERT_ARRAY:
+      return parse_json_array (conv, node, error);
+    case CONVERT_DICTIONARY:
+      return parse_json_dictionary (conv, node, error);
+    case CONVERT_TUPLE:
+      return parse_json_tuple (conv, node, error);
+    case CONVERT_INDEFINITE:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Indefinite type '%.*s' is not supported",
+                   (int)g_variant_type_get_string_length (conv->type),
+                   g_variant_type_peek_string (conv->type));
+      return NULL;
+    case CONVERT_UNSUPPORTED:
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "DBus type '%.*s' is unknown or not supported",
+                   (int)g_variant_type_get_string_length (conv->type),
+                   g_variant_type_peek_string (conv->type));
+      return NULL;
+    }
+}
+
+/**
+ * cockpit_dbus_converter_parse:
+ * @converter: a converter
+ * @node: the JSON to convert
+ * @error: location to place an error
+ *
+ * Convert @node into a GVariant of the converter's type. Variants
+ * are expected as {"sig": ..., "val": ...} objects.
+ *
+ * Returns: (transfer floating): the value, or %NULL with @error set
+ */
+GVariant *
+cockpit_dbus_converter_parse (CockpitDBusConverter *converter,
+                              JsonNode *node,
+                              GError **error)
+{
+  g_return_val_if_fail (converter != NULL, NULL);
+  g_return_val_if_fail (node != NULL, NULL);
+  return parse_json (converter->root, node, error);
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_DBUS_CONVERTER_H__
+#define __COCKPIT_DBUS_CONVERTER_H__
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitDBusConverter CockpitDBusConverter;
+
+CockpitDBusConverter * cockpit_dbus_converter_new     (const GVariantType *type);
+
+CockpitDBusConverter * cockpit_dbus_converter_lookup  (const gchar *signature);
+
+CockpitDBusConverter * cockpit_dbus_converter_ref     (CockpitDBusConverter *converter);
+
+void                   cockpit_dbus_converter_unref   (CockpitDBusConverter *converter);
+
+GVariant *             cockpit_dbus_converter_parse   (CockpitDBusConverter *converter,
+                                                       JsonNode *node,
+                                                       GError **error);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_DBUS_CONVERTER_H__ */
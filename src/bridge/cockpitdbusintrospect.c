@@ -0,0 +1,450 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusintrospect.h"
+
+#include <string.h>
+
+/*
+ * Introspection data for DBus objects, shared by everything in the
+ * bridge that needs it, so that each channel doesn't introspect the
+ * same services over again.
+ *
+ * Data is looked up by the unique name of the service, the object path
+ * and the interface. Since a service gets a new unique name when it
+ * restarts, stale data is never handed out. The entries for a unique
+ * name are dropped when NameOwnerChanged says it's gone.
+ *
+ * One Introspect call answers for all the interfaces on an object, so
+ * that's what is stored. While a call is in flight, others asking
+ * about the same object wait for it rather than making their own.
+ */
+
+typedef struct {
+  /* "owner\npath" -> GDBusNodeInfo */
+  GHashTable *nodes;
+
+  /* "owner\npath" -> GPtrArray of Waiter for an Introspect call */
+  GHashTable *pending;
+
+  guint subscription;
+} IntrospectCache;
+
+typedef struct {
+  GSimpleAsyncResult *async;
+  gchar *interface_name;
+} Waiter;
+
+typedef struct {
+  GDBusConnection *connection;
+  IntrospectCache *cache;
+  gchar *key;
+  gchar *object_path;
+} IntrospectCall;
+
+G_LOCK_DEFINE_STATIC (caches);
+
+/*
+ * GDBusConnection -> IntrospectCache. The bus connections live as long
+ * as the bridge does, so we just hold a reference to them.
+ */
+static GHashTable *caches = NULL;
+
+static void
+waiter_free (gpointer data)
+{
+  Waiter *waiter = data;
+  g_object_unref (waiter->async);
+  g_free (waiter->interface_name);
+  g_free (waiter);
+}
+
+static gchar *
+build_key (const gchar *name_owner,
+           const gchar *object_path)
+{
+  return g_strconcat (name_owner, "\n", object_path, NULL);
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar *sender_name,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *signal_name,
+                       GVariant *parameters,
+                       gpointer user_data)
+{
+  IntrospectCache *cache = user_data;
+  const gchar *old_owner;
+  const gchar *new_owner;
+  const gchar *name;
+  GHashTableIter iter;
+  gchar *prefix;
+  gsize length;
+  gpointer key;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+    return;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+
+  /* Only unique names going away matter, the rest is keyed by them */
+  if (name[0] != ':' || new_owner[0] != '\0')
+    return;
+
+  prefix = g_strconcat (name, "\n", NULL);
+  length = strlen (prefix);
+
+  G_LOCK (caches);
+  g_hash_table_iter_init (&iter, cache->nodes);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (strncmp (key, prefix, length) == 0)
+        g_hash_table_iter_remove (&iter);
+    }
+  G_UNLOCK (caches);
+
+  g_free (prefix);
+}
+
+/* Called with the lock held */
+static IntrospectCache *
+get_cache (GDBusConnection *connection)
+{
+  IntrospectCache *cache;
+
+  if (caches == NULL)
+    caches = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+
+  cache = g_hash_table_lookup (caches, connection);
+  if (!cache)
+    {
+      cache = g_new0 (IntrospectCache, 1);
+      cache->nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)g_dbus_node_info_unref);
+      cache->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      cache->subscription = g_dbus_connection_signal_subscribe (connection,
+                                                                "org.freedesktop.DBus",
+                                                                "org.freedesktop.DBus",
+                                                                "NameOwnerChanged",
+                                                                "/org/freedesktop/DBus",
+                                                                NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                on_name_owner_changed,
+                                                                cache, NULL);
+      g_hash_table_insert (caches, g_object_ref (connection), cache);
+    }
+
+  return cache;
+}
+
+/* Called with the lock held */
+static GDBusInterfaceInfo *
+lookup_interface (IntrospectCache *cache,
+                  const gchar *key,
+                  const gchar *interface_name)
+{
+  GDBusInterfaceInfo *iface = NULL;
+  GDBusNodeInfo *node;
+
+  node = g_hash_table_lookup (cache->nodes, key);
+  if (node)
+    iface = g_dbus_node_info_lookup_interface (node, interface_name);
+  if (iface)
+    g_dbus_interface_info_ref (iface);
+  return iface;
+}
+
+/**
+ * cockpit_dbus_introspect_lookup:
+ * @connection: the bus connection
+ * @name_owner: unique name of the service
+ * @object_path: the object
+ * @interface_name: the interface
+ *
+ * Look for introspection data that's already known, without making
+ * any DBus calls.
+ *
+ * Returns: (transfer full): the interface info, or %NULL
+ */
+GDBusInterfaceInfo *
+cockpit_dbus_introspect_lookup (GDBusConnection *connection,
+                                const gchar *name_owner,
+                                const gchar *object_path,
+                                const gchar *interface_name)
+{
+  GDBusInterfaceInfo *iface;
+  gchar *key;
+
+  g_return_val_if_fail (G_IS_DBUS_CONNECTION (connection), NULL);
+  g_return_val_if_fail (name_owner != NULL, NULL);
+  g_return_val_if_fail (object_path != NULL, NULL);
+  g_return_val_if_fail (interface_name != NULL, NULL);
+
+  key = build_key (name_owner, object_path);
+
+  G_LOCK (caches);
+  iface = lookup_interface (get_cache (connection), key, interface_name);
+  G_UNLOCK (caches);
+
+  g_free (key);
+  return iface;
+}
+
+static void
+on_introspect_reply (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  IntrospectCall *call = user_data;
+  GDBusInterfaceInfo *iface;
+  GDBusNodeInfo *node = NULL;
+  GPtrArray *waiting;
+  GError *error = NULL;
+  const gchar *xml;
+  gboolean expected;
+  gboolean not_found;
+  Waiter *waiter;
+  GVariant *val;
+  gchar *remote;
+  guint i;
+
+  not_found = FALSE;
+
+  val = g_dbus_connection_call_finish (call->connection, result, &error);
+  if (error)
+    {
+      /*
+       * Note that many DBus implementations don't return errors when
+       * an unknown object path is introspected. They just return empty
+       * introspect data. GDBus is one of these.
+       */
+
+      expected = FALSE;
+      remote = g_dbus_error_get_remote_error (error);
+      if (remote)
+        {
+          /*
+           * DBus used to only have the UnknownMethod error. It didn't have
+           * specific errors for UnknownObject and UnknownInterface. So we're
+           * pretty liberal on what we treat as an expected error here.
+           *
+           * HACK: GDBus also doesn't understand the newer error codes :S
+           *
+           * https://bugzilla.gnome.org/show_bug.cgi?id=727900
+           */
+          expected = (g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownMethod") ||
+                      g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownObject") ||
+                      g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownInterface"));
+          not_found = TRUE;
+          g_free (remote);
+        }
+
+      if (expected)
+        {
+          g_debug ("no introspect data found for object %s", call->object_path);
+        }
+      else
+        {
+          g_message ("Couldn't look up introspection for object %s: %s",
+                     call->object_path, error->message);
+        }
+    }
+
+  if (val)
+    {
+      g_debug ("got introspect data for %s", call->object_path);
+
+      g_variant_get (val, "(&s)", &xml);
+      node = g_dbus_node_info_new_for_xml (xml, &error);
+      if (error)
+        {
+          g_message ("Invalid DBus introspect data received for object %s: %s",
+                     call->object_path, error->message);
+        }
+      g_variant_unref (val);
+    }
+
+  G_LOCK (caches);
+  waiting = g_hash_table_lookup (call->cache->pending, call->key);
+  g_hash_table_remove (call->cache->pending, call->key);
+  if (node)
+    {
+      g_hash_table_replace (call->cache->nodes, g_strdup (call->key),
+                            g_dbus_node_info_ref (node));
+    }
+  G_UNLOCK (caches);
+
+  for (i = 0; i < waiting->len; i++)
+    {
+      waiter = waiting->pdata[i];
+      iface = NULL;
+      if (node)
+        iface = g_dbus_node_info_lookup_interface (node, waiter->interface_name);
+
+      if (iface)
+        {
+          g_simple_async_result_set_op_res_gpointer (waiter->async, g_dbus_interface_info_ref (iface),
+                                                     (GDestroyNotify)g_dbus_interface_info_unref);
+        }
+      else if (node || not_found)
+        {
+          g_simple_async_result_set_error (waiter->async, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                           "No interface %s on object %s",
+                                           waiter->interface_name, call->object_path);
+        }
+      else
+        {
+          g_simple_async_result_set_from_error (waiter->async, error);
+        }
+
+      /* Each waiter hears back in its own main context */
+      g_simple_async_result_complete_in_idle (waiter->async);
+    }
+
+  g_ptr_array_free (waiting, TRUE);
+  if (node)
+    g_dbus_node_info_unref (node);
+  g_clear_error (&error);
+
+  g_object_unref (call->connection);
+  g_free (call->object_path);
+  g_free (call->key);
+  g_free (call);
+}
+
+/**
+ * cockpit_dbus_introspect_async:
+ * @connection: the bus connection
+ * @name_owner: unique name of the service
+ * @object_path: the object
+ * @interface_name: the interface
+ * @callback: called when the data is ready
+ * @user_data: data for @callback
+ *
+ * Get introspection data for an interface, introspecting the object
+ * if it isn't known yet, or if the interface is missing from what we
+ * knew about the object.
+ *
+ * If the service answered but doesn't have the interface on the object,
+ * the operation fails with %G_IO_ERROR_NOT_FOUND.
+ */
+void
+cockpit_dbus_introspect_async (GDBusConnection *connection,
+                               const gchar *name_owner,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  GSimpleAsyncResult *async;
+  GDBusInterfaceInfo *iface;
+  IntrospectCache *cache;
+  IntrospectCall *call;
+  GPtrArray *waiting;
+  Waiter *waiter;
+  gchar *key;
+
+  g_return_if_fail (G_IS_DBUS_CONNECTION (connection));
+  g_return_if_fail (name_owner != NULL);
+  g_return_if_fail (object_path != NULL);
+  g_return_if_fail (interface_name != NULL);
+
+  async = g_simple_async_result_new (G_OBJECT (connection), callback, user_data,
+                                     cockpit_dbus_introspect_async);
+
+  key = build_key (name_owner, object_path);
+
+  G_LOCK (caches);
+
+  cache = get_cache (connection);
+  iface = lookup_interface (cache, key, interface_name);
+  if (iface)
+    {
+      G_UNLOCK (caches);
+      g_simple_async_result_set_op_res_gpointer (async, iface,
+                                                 (GDestroyNotify)g_dbus_interface_info_unref);
+      g_simple_async_result_complete_in_idle (async);
+      g_object_unref (async);
+      g_free (key);
+      return;
+    }
+
+  waiter = g_new0 (Waiter, 1);
+  waiter->async = async;
+  waiter->interface_name = g_strdup (interface_name);
+
+  waiting = g_hash_table_lookup (cache->pending, key);
+  if (waiting)
+    {
+      g_debug ("waiting for introspection of %s already in progress", object_path);
+      g_ptr_array_add (waiting, waiter);
+      G_UNLOCK (caches);
+      g_free (key);
+      return;
+    }
+
+  waiting = g_ptr_array_new_with_free_func (waiter_free);
+  g_ptr_array_add (waiting, waiter);
+  g_hash_table_insert (cache->pending, g_strdup (key), waiting);
+
+  G_UNLOCK (caches);
+
+  g_debug ("introspecting %s", object_path);
+
+  call = g_new0 (IntrospectCall, 1);
+  call->connection = g_object_ref (connection);
+  call->cache = cache;
+  call->key = key;
+  call->object_path = g_strdup (object_path);
+
+  g_dbus_connection_call (connection, name_owner, object_path,
+                          "org.freedesktop.DBus.Introspectable", "Introspect",
+                          NULL, G_VARIANT_TYPE ("(s)"),
+                          G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                          -1, /* timeout */
+                          NULL, /* GCancellable */
+                          on_introspect_reply, call);
+}
+
+/**
+ * cockpit_dbus_introspect_finish:
+ * @result: the result passed to the callback
+ * @error: location to place an error
+ *
+ * Returns: (transfer full): the interface info, or %NULL with @error set
+ */
+GDBusInterfaceInfo *
+cockpit_dbus_introspect_finish (GAsyncResult *result,
+                                GError **error)
+{
+  GSimpleAsyncResult *async;
+  GDBusInterfaceInfo *iface;
+
+  g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), NULL);
+
+  async = G_SIMPLE_ASYNC_RESULT (result);
+  if (g_simple_async_result_propagate_error (async, error))
+    return NULL;
+
+  iface = g_simple_async_result_get_op_res_gpointer (async);
+  return g_dbus_interface_info_ref (iface);
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_DBUS_INTROSPECT_H__
+#define __COCKPIT_DBUS_INTROSPECT_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+GDBusInterfaceInfo *  cockpit_dbus_introspect_lookup   (GDBusConnection *connection,
+                                                        const gchar *name_owner,
+                                                        const gchar *object_path,
+                                                        const gchar *interface_name);
+
+void                  cockpit_dbus_introspect_async    (GDBusConnection *connection,
+                                                        const gchar *name_owner,
+                                                        const gchar *object_path,
+                                                        const gchar *interface_name,
+                                                        GAsyncReadyCallback callback,
+                                                        gpointer user_data);
+
+GDBusInterfaceInfo *  cockpit_dbus_introspect_finish   (GAsyncResult *result,
+                                                        GError **error);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_DBUS_INTROSPECT_H__ */
@@ -22,7 +22,9 @@
 #include "cockpitdbusjson.h"
 
 #include "cockpitchannel.h"
-#include "cockpitfakemanager.h"
+#include "cockpitdbusconverter.h"
+#include "cockpitdbusintrospect.h"
+#include "cockpitdbusmanager.h"
 
 #include "common/cockpitjson.h"
 
@@ -49,6 +51,15 @@
 
 #define COCKPIT_DBUS_JSON(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_DBUS_JSON, CockpitDBusJson))
 
+/* Size at which a chunked seed starts a new message */
+#define SEED_CHUNK_SIZE 65536
+
+/* Largest message buffer that is kept around for the next message */
+#define MAX_BUFFER_RETAIN (256 * 1024)
+
+/* Longest a caller may ask us to hold back changes, in milliseconds */
+#define MAX_BATCH_WINDOW 5000
+
 typedef struct {
   CockpitChannel parent;
   GDBusObjectManager       *object_manager;
@@ -56,6 +67,24 @@ typedef struct {
   GCancellable             *cancellable;
   GList                    *active_calls;
   GHashTable               *introspect_cache;
+  GHashTable               *method_plans;
+  gboolean                  property_deltas;
+  gboolean                  chunked_seed;
+
+  /* Only objects under this path, and only these interfaces */
+  gchar                    *path_prefix;
+  GHashTable               *interfaces;
+
+  /* Changes waiting to go out together in a "changes" message */
+  guint                     batch_window;
+  GSource                  *batch_source;
+  GQueue                    batch;
+
+  /* Object path -> (interface -> pending property BatchEntry) */
+  GHashTable               *batch_props;
+
+  /* Reused for writing each outgoing message */
+  GString                  *buffer;
 } CockpitDBusJson;
 
 typedef struct {
@@ -65,445 +94,160 @@ typedef struct {
 
 G_DEFINE_TYPE (CockpitDBusJson, cockpit_dbus_json, COCKPIT_TYPE_CHANNEL);
 
-static gboolean
-check_type (JsonNode *node,
-            JsonNodeType type,
-            GType sub_type,
-            GError **error)
-{
-  if (JSON_NODE_TYPE (node) != type ||
-      (type == JSON_NODE_VALUE && (json_node_get_value_type (node) != sub_type)))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "Unexpected type '%s' in JSON node",
-                   g_type_name (json_node_get_value_type (node)));
-      return FALSE;
-    }
-  return TRUE;
-}
-
-static GVariant *
-parse_json (JsonNode *node,
-            const GVariantType *type,
-            GError **error);
-
-static GVariant *
-parse_json_tuple (JsonNode *node,
-                  const GVariantType *child_type,
-                  GError **error)
-{
-  GVariant *result = NULL;
-  GPtrArray *children;
-  GVariant *value;
-  JsonArray *array;
-  guint length;
-  guint i;
-
-  children = g_ptr_array_new ();
-
-  if (!check_type (node, JSON_NODE_ARRAY, 0, error))
-    goto out;
-
-  array = json_node_get_array (node);
-  length = json_array_get_length (array);
-
-  for (i = 0; i < length; i++)
-    {
-      value = NULL;
-      if (child_type == NULL)
-        {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                       "Too many values in tuple/struct");
-        }
-      else
-        {
-          value = parse_json (json_array_get_element (array, i),
-                              child_type, error);
-        }
-
-      if (!value)
-        goto out;
-
-      g_ptr_array_add (children, value);
-      child_type = g_variant_type_next (child_type);
-    }
-
-  if (child_type)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "Too few values in tuple/struct");
-      goto out;
-    }
-
-  result = g_variant_new_tuple ((GVariant *const *)children->pdata,
-                                children->len);
-  children->len = 0;
-
-out:
-  g_ptr_array_foreach (children, (GFunc)g_variant_unref, NULL);
-  g_ptr_array_free (children, TRUE);
-  return result;
-}
-
-static GVariant *
-parse_json_array (JsonNode *node,
-                  const GVariantType *child_type,
-                  GError **error)
-{
-  GVariant *result = NULL;
-  GPtrArray *children;
-  GVariant *child;
-  JsonArray *array;
-  guint length;
-  guint i;
-
-  children = g_ptr_array_new ();
-
-  if (!check_type (node, JSON_NODE_ARRAY, 0, error))
-    goto out;
-
-  array = json_node_get_array (node);
-  length = json_array_get_length (array);
-
-  for (i = 0; i < length; i++)
-    {
-      child = parse_json (json_array_get_element (array, i),
-                          child_type,
-                          error);
-      if (!child)
-        goto out;
-
-      g_ptr_array_add (children, child);
-    }
-
-  result = g_variant_new_array (child_type,
-                                (GVariant *const *)children->pdata,
-                                children->len);
-  children->len = 0;
-
-out:
-  g_ptr_array_foreach (children, (GFunc)g_variant_unref, NULL);
-  g_ptr_array_free (children, TRUE);
-  return result;
-}
+static void
+write_json (GString *out,
+            GVariant *value);
 
-static GVariant *
-parse_json_with_sig (JsonObject *object,
-                     GError **error)
+static void
+write_int (GString *out,
+           gint64 value)
 {
-  GVariantType *inner_type;
-  GVariant *inner;
-  JsonNode *val;
-  const gchar *sig;
-
-  val = json_object_get_member (object, "val");
-  if (val == NULL)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "JSON did not contain a 'val' field");
-      return NULL;
-    }
-  if (!cockpit_json_get_string (object, "sig", NULL, &sig) || !sig)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "JSON did not contain valid 'sig' fields");
-      return NULL;
-    }
-  if (!g_variant_type_string_is_valid (sig))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "JSON 'sig' field '%s' is invalid", sig);
-      return NULL;
-    }
-
-  inner_type = g_variant_type_new (sig);
-  inner = parse_json (val, inner_type, error);
-  g_variant_type_free (inner_type);
-
-  if (!inner)
-    return NULL;
-
-  return g_variant_new_variant (inner);
+  gchar buf[32];
+  g_snprintf (buf, sizeof (buf), "%" G_GINT64_FORMAT, value);
+  g_string_append (out, buf);
 }
 
-static GVariant *
-parse_json_variant (JsonNode *node,
-                    GError **error)
+static void
+write_uint (GString *out,
+            guint64 value)
 {
-  if (check_type (node, JSON_NODE_OBJECT, 0, error))
-    return parse_json_with_sig (json_node_get_object (node), error);
-  return NULL;
-}
-
-static GVariant *
-parse_json_dictionary (JsonNode *node,
-                       const GVariantType *entry_type,
-                       GError **error)
-{
-  const GVariantType *key_type;
-  const GVariantType *value_type;
-  GVariant *result = NULL;
-  GPtrArray *children;
-  JsonObject *object;
-  JsonNode *key_node;
-  GList *members = NULL;
-  gboolean is_string;
-  GVariant *value;
-  GVariant *key;
-  GVariant *child;
-  GList *l;
-
-  children = g_ptr_array_new ();
-
-  if (!check_type (node, JSON_NODE_OBJECT, 0, error))
-    goto out;
-
-  object = json_node_get_object (node);
-  key_type = g_variant_type_key (entry_type);
-  value_type = g_variant_type_value (entry_type);
-
-  is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE));
-
-  members = json_object_get_members (object);
-  for (l = members; l != NULL; l = g_list_next (l))
-    {
-      if (is_string)
-        {
-          key_node = json_node_init_string (json_node_alloc (), l->data);
-        }
-      else
-        {
-          key_node = cockpit_json_parse (l->data, -1, NULL);
-          if (key_node == NULL)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                           "Unexpected key '%s' in JSON object", (gchar *)l->data);
-              goto out;
-            }
-        }
-
-      key = parse_json (key_node, key_type, error);
-      json_node_free (key_node);
-
-      if (!key)
-        goto out;
-
-      value = parse_json (json_object_get_member (object, l->data),
-                          value_type, error);
-      if (!value)
-        {
-          g_variant_unref (key);
-          goto out;
-        }
-
-      child = g_variant_new_dict_entry (key, value);
-      g_ptr_array_add (children, child);
-    }
-
-  result = g_variant_new_array (entry_type,
-                                (GVariant *const *)children->pdata,
-                                children->len);
-  children->len = 0;
-
-out:
-  g_list_free (members);
-  g_ptr_array_foreach (children, (GFunc)g_variant_unref, NULL);
-  g_ptr_array_free (children, TRUE);
-  return result;
+  gchar buf[32];
+  g_snprintf (buf, sizeof (buf), "%" G_GUINT64_FORMAT, value);
+  g_string_append (out, buf);
 }
 
 static void
-parse_not_supported (const GVariantType *type,
-                     GError **error)
+write_double (GString *out,
+              gdouble value)
 {
-  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-               "DBus type '%.*s' is unknown or not supported",
-               (int)g_variant_type_get_string_length (type),
-               g_variant_type_peek_string (type));
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+  g_string_append (out, g_ascii_dtostr (buf, sizeof (buf), value));
 }
 
-static GVariant *
-parse_json (JsonNode *node,
-            const GVariantType *type,
-            GError **error)
+static void
+write_json_variant (GString *out,
+                    GVariant *value)
 {
-  const GVariantType *element_type;
-  const gchar *str;
-
-  if (!g_variant_type_is_definite (type))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                   "Indefinite type '%.*s' is not supported",
-                   (int)g_variant_type_get_string_length (type),
-                   g_variant_type_peek_string (type));
-      return NULL;
-    }
-
-  if (g_variant_type_is_basic (type))
-    {
-      if (g_variant_type_equal (type, G_VARIANT_TYPE_BOOLEAN))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_BOOLEAN, error))
-            return g_variant_new_boolean (json_node_get_boolean (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_BYTE))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_byte (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT16))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_int16 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT16))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_uint16 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT32))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_int32 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT32))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_uint32 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_INT64))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_int64 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_UINT64))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, error))
-            return g_variant_new_uint64 (json_node_get_int (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_DOUBLE))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_INT64, NULL))
-            return g_variant_new_double (json_node_get_int (node));
-          else if (check_type (node, JSON_NODE_VALUE, G_TYPE_DOUBLE, error))
-            return g_variant_new_double (json_node_get_double (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_STRING))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
-            return g_variant_new_string (json_node_get_string (node));
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_OBJECT_PATH))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
-            {
-              str = json_node_get_string (node);
-              if (g_variant_is_object_path (str))
-                return g_variant_new_object_path (str);
-              else
-                {
-                  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                               "Invalid object path '%s'", str);
-                  return NULL;
-                }
-            }
-        }
-      else if (g_variant_type_equal (type, G_VARIANT_TYPE_SIGNATURE))
-        {
-          if (check_type (node, JSON_NODE_VALUE, G_TYPE_STRING, error))
-            {
-              str = json_node_get_string (node);
-              if (g_variant_is_signature (str))
-                return g_variant_new_signature (str);
-              else
-                {
-                  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                               "Invalid signature '%s'", str);
-                  return NULL;
-                }
-            }
-        }
-      else
-        {
-          parse_not_supported (type, error);
-        }
-    }
-  else if (g_variant_type_is_variant (type))
-    {
-      return parse_json_variant (node, error);
-    }
-  else if (g_variant_type_is_array (type))
-    {
-      element_type = g_variant_type_element (type);
-      if (g_variant_type_is_dict_entry (element_type))
-        return parse_json_dictionary (node, element_type, error);
-      else
-        return parse_json_array (node, element_type, error);
-    }
-  else if (g_variant_type_is_tuple (type))
-    {
-      return parse_json_tuple (node, g_variant_type_first (type), error);
-    }
-  else
-    {
-      parse_not_supported (type, error);
-    }
+  GVariant *child;
 
-  return NULL;
-}
+  child = g_variant_get_variant (value);
 
-static void
-build_json (JsonBuilder *builder,
-            GVariant *value);
+  g_string_append (out, "{\"sig\":");
+  cockpit_json_append_string (out, g_variant_get_type_string (child));
+  g_string_append (out, ",\"val\":");
+  write_json (out, child);
+  g_string_append_c (out, '}');
 
-static void
-build_json_with_sig (JsonBuilder *builder,
-                     GVariant *value)
-{
-  json_builder_set_member_name (builder, "sig");
-  json_builder_add_string_value (builder, g_variant_get_type_string (value));
-  json_builder_set_member_name (builder, "val");
-  build_json (builder, value);
+  g_variant_unref (child);
 }
 
 static void
-build_json_array_or_tuple (JsonBuilder *builder,
+write_json_array_or_tuple (GString *out,
                            GVariant *value)
 {
   GVariantIter iter;
   GVariant *child;
+  gboolean first = TRUE;
 
-  json_builder_begin_array (builder);
+  g_string_append_c (out, '[');
 
   g_variant_iter_init (&iter, value);
   while ((child = g_variant_iter_next_value (&iter)) != NULL)
     {
-      build_json (builder, child);
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+      write_json (out, child);
       g_variant_unref (child);
     }
 
-  json_builder_end_array (builder);
+  g_string_append_c (out, ']');
 }
 
-static void
-build_json_variant (JsonBuilder *builder,
-                    GVariant *value)
+/*
+ * Arrays of fixed size numbers are read straight out of the serialized
+ * data, rather than allocating a GVariant for each element.
+ */
+static gboolean
+write_json_fixed_array (GString *out,
+                        const GVariantType *element_type,
+                        GVariant *value)
 {
-  GVariant *child;
+  gconstpointer elements;
+  gsize n_elements;
+  gsize size;
+  gchar type;
+  gsize i;
+
+  type = g_variant_type_peek_string (element_type)[0];
+  switch (type)
+    {
+    case 'y':
+      size = sizeof (guint8);
+      break;
+    case 'n':
+    case 'q':
+      size = sizeof (guint16);
+      break;
+    case 'i':
+    case 'u':
+    case 'h':
+      size = sizeof (guint32);
+      break;
+    case 'x':
+    case 't':
+      size = sizeof (guint64);
+      break;
+    case 'd':
+      size = sizeof (gdouble);
+      break;
+    default:
+      return FALSE;
+    }
 
-  child = g_variant_get_variant (value);
-  json_builder_begin_object (builder);
+  elements = g_variant_get_fixed_array (value, &n_elements, size);
 
-  build_json_with_sig (builder, child);
+  g_string_append_c (out, '[');
+  for (i = 0; i < n_elements; i++)
+    {
+      if (i > 0)
+        g_string_append_c (out, ',');
+      switch (type)
+        {
+        case 'y':
+          write_int (out, ((const guint8 *)elements)[i]);
+          break;
+        case 'n':
+          write_int (out, ((const gint16 *)elements)[i]);
+          break;
+        case 'q':
+          write_int (out, ((const guint16 *)elements)[i]);
+          break;
+        case 'i':
+        case 'h':
+          write_int (out, ((const gint32 *)elements)[i]);
+          break;
+        case 'u':
+          write_int (out, ((const guint32 *)elements)[i]);
+          break;
+        case 'x':
+          write_int (out, ((const gint64 *)elements)[i]);
+          break;
+        case 't':
+          write_uint (out, ((const guint64 *)elements)[i]);
+          break;
+        case 'd':
+          write_double (out, ((const gdouble *)elements)[i]);
+          break;
+        }
+    }
+  g_string_append_c (out, ']');
 
-  json_builder_end_object (builder);
-  g_variant_unref (child);
+  return TRUE;
 }
 
 static void
-build_json_dictionary (JsonBuilder *builder,
+write_json_dictionary (GString *out,
                        const GVariantType *entry_type,
                        GVariant *dict)
 {
@@ -513,9 +257,10 @@ build_json_dictionary (JsonBuilder *builder,
   GVariant *key;
   GVariant *value;
   gboolean is_string;
+  gboolean first = TRUE;
   gchar *key_string;
 
-  json_builder_begin_object (builder);
+  g_string_append_c (out, '{');
   key_type = g_variant_type_key (entry_type);
 
   is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
@@ -528,107 +273,100 @@ build_json_dictionary (JsonBuilder *builder,
       key = g_variant_get_child_value (child, 0);
       value = g_variant_get_child_value (child, 1);
 
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+
       if (is_string)
         {
-          json_builder_set_member_name (builder, g_variant_get_string (key, NULL));
+          cockpit_json_append_string (out, g_variant_get_string (key, NULL));
         }
       else
         {
           key_string = g_variant_print (key, FALSE);
-          json_builder_set_member_name (builder, key_string);
+          cockpit_json_append_string (out, key_string);
           g_free (key_string);
         }
 
-      build_json (builder, value);
+      g_string_append_c (out, ':');
+      write_json (out, value);
 
       g_variant_unref (key);
       g_variant_unref (value);
+      g_variant_unref (child);
     }
 
-  json_builder_end_object (builder);
+  g_string_append_c (out, '}');
 }
 
 static void
-build_json (JsonBuilder *builder,
+write_json (GString *out,
             GVariant *value)
 {
-  const GVariantType *type;
   const GVariantType *element_type;
 
-  g_variant_ref_sink (value);
-
   switch (g_variant_classify (value))
     {
     case G_VARIANT_CLASS_BOOLEAN:
-      json_builder_add_boolean_value (builder, g_variant_get_boolean (value));
+      g_string_append (out, g_variant_get_boolean (value) ? "true" : "false");
       break;
 
     case G_VARIANT_CLASS_BYTE:
-      json_builder_add_int_value (builder, g_variant_get_byte (value));
+      write_int (out, g_variant_get_byte (value));
       break;
 
     case G_VARIANT_CLASS_INT16:
-      json_builder_add_int_value (builder, g_variant_get_int16 (value));
+      write_int (out, g_variant_get_int16 (value));
       break;
 
     case G_VARIANT_CLASS_UINT16:
-      json_builder_add_int_value (builder, g_variant_get_uint16 (value));
+      write_int (out, g_variant_get_uint16 (value));
       break;
 
     case G_VARIANT_CLASS_INT32:
-      json_builder_add_int_value (builder, g_variant_get_int32 (value));
+      write_int (out, g_variant_get_int32 (value));
       break;
 
     case G_VARIANT_CLASS_UINT32:
-      json_builder_add_int_value (builder, g_variant_get_uint32 (value));
+      write_int (out, g_variant_get_uint32 (value));
       break;
 
     case G_VARIANT_CLASS_INT64:
-      json_builder_add_int_value (builder, g_variant_get_int64 (value));
+      write_int (out, g_variant_get_int64 (value));
       break;
 
     case G_VARIANT_CLASS_UINT64:
-      json_builder_add_int_value (builder, g_variant_get_uint64 (value));
+      write_uint (out, g_variant_get_uint64 (value));
       break;
 
     case G_VARIANT_CLASS_HANDLE:
-      json_builder_add_int_value (builder, g_variant_get_handle (value));
+      write_int (out, g_variant_get_handle (value));
       break;
 
     case G_VARIANT_CLASS_DOUBLE:
-      json_builder_add_double_value (builder, g_variant_get_double (value));
+      write_double (out, g_variant_get_double (value));
       break;
 
     case G_VARIANT_CLASS_STRING:      /* explicit fall-through */
     case G_VARIANT_CLASS_OBJECT_PATH: /* explicit fall-through */
     case G_VARIANT_CLASS_SIGNATURE:
-      {
-        /* HACK: We can't use json_builder_add_string_value here since
-           it turns empty strings into 'null' values inside arrays.
-
-           https://bugzilla.gnome.org/show_bug.cgi?id=730803
-        */
-        JsonNode *string_element = json_node_alloc ();
-        json_node_init_string (string_element, g_variant_get_string (value, NULL));
-        json_builder_add_value (builder, string_element);
-      }
+      cockpit_json_append_string (out, g_variant_get_string (value, NULL));
       break;
 
     case G_VARIANT_CLASS_VARIANT:
-      build_json_variant (builder, value);
+      write_json_variant (out, value);
       break;
 
     case G_VARIANT_CLASS_ARRAY:
-      type = g_variant_get_type (value);
-      element_type = g_variant_type_element (type);
+      element_type = g_variant_type_element (g_variant_get_type (value));
       if (g_variant_type_is_dict_entry (element_type))
-        build_json_dictionary (builder, element_type, value);
-      else
-        build_json_array_or_tuple (builder, value);
+        write_json_dictionary (out, element_type, value);
+      else if (!write_json_fixed_array (out, element_type, value))
+        write_json_array_or_tuple (out, value);
       break;
 
     case G_VARIANT_CLASS_TUPLE:
-      build_json_array_or_tuple (builder, value);
+      write_json_array_or_tuple (out, value);
       break;
 
     case G_VARIANT_CLASS_DICT_ENTRY:
@@ -637,163 +375,486 @@ build_json (JsonBuilder *builder,
       g_return_if_reached ();
       break;
     }
+}
 
+/**
+ * cockpit_dbus_json_write_variant:
+ * @out: the buffer to append to
+ * @value: the value to encode
+ *
+ * Append @value to @out in the dbus-json2 encoding, without building
+ * an intermediate JsonNode tree.
+ */
+void
+cockpit_dbus_json_write_variant (GString *out,
+                                 GVariant *value)
+{
+  g_return_if_fail (out != NULL);
+  g_return_if_fail (value != NULL);
+
+  g_variant_ref_sink (value);
+  write_json (out, value);
   g_variant_unref (value);
 }
 
-static JsonBuilder *
-prepare_builder (const gchar *command)
+/* ---------------------------------------------------------------------------------------------------- */
+
+/*
+ * All messages are written straight into self->buffer, which is kept
+ * around between messages to avoid reallocating it every time.
+ */
+
+static void
+send_buffer (CockpitDBusJson *self)
+{
+  GBytes *bytes;
+
+  bytes = g_bytes_new (self->buffer->str, self->buffer->len);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes);
+  g_bytes_unref (bytes);
+
+  /* Don't hang onto the memory of an unusually large message */
+  if (self->buffer->allocated_len > MAX_BUFFER_RETAIN)
+    {
+      g_string_free (self->buffer, TRUE);
+      self->buffer = g_string_sized_new (4096);
+    }
+  else
+    {
+      g_string_truncate (self->buffer, 0);
+    }
+}
+
+static void
+write_header (GString *out,
+              const gchar *command)
 {
-  JsonBuilder *builder;
-  builder = json_builder_new ();
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "command");
-  json_builder_add_string_value (builder, command);
-  json_builder_set_member_name (builder, "data");
-  return builder;
+  g_string_truncate (out, 0);
+  g_string_append (out, "{\"command\":\"");
+  g_string_append (out, command);
+  g_string_append (out, "\",\"data\":");
 }
 
 static void
-write_builder (CockpitDBusJson *self,
-               JsonBuilder *builder)
+write_properties (GString *out,
+                  GVariant *properties)
 {
-  GBytes *bytes;
-  JsonNode *root;
-  gsize length;
-  gchar *ret;
+  GVariantIter iter;
+  const gchar *property_name;
+  GVariant *value;
+  gboolean first = TRUE;
+
+  g_string_append_c (out, '{');
+  g_variant_iter_init (&iter, properties);
+  while (g_variant_iter_next (&iter, "{&sv}", &property_name, &value))
+    {
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+      cockpit_json_append_string (out, property_name);
+      g_string_append_c (out, ':');
+      write_json (out, value);
+      g_variant_unref (value);
+    }
+  g_string_append_c (out, '}');
+}
 
-  json_builder_end_object (builder);
+static void
+write_properties_changed (CockpitDBusJson *self,
+                          GString *out,
+                          const gchar *object_path,
+                          const gchar *interface_name,
+                          GVariant *changed_properties,
+                          const gchar * const *invalidated_properties)
+{
+  guint i;
 
-  root = json_builder_get_root (builder);
-  ret = cockpit_json_write (root, &length);
-  json_node_free (root);
+  g_string_append (out, "{\"objpath\":");
+  cockpit_json_append_string (out, object_path);
+  g_string_append (out, ",\"iface_name\":");
+  cockpit_json_append_string (out, interface_name);
 
-  bytes = g_bytes_new_take (ret, length);
-  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes);
-  g_bytes_unref (bytes);
+  /*
+   * In delta mode the properties go out flat, along with the names of
+   * invalidated properties, which the older format can't express.
+   */
+  if (self->property_deltas)
+    {
+      g_string_append (out, ",\"changed\":");
+      write_properties (out, changed_properties);
+      g_string_append (out, ",\"invalidated\":[");
+      for (i = 0; invalidated_properties && invalidated_properties[i]; i++)
+        {
+          if (i > 0)
+            g_string_append_c (out, ',');
+          cockpit_json_append_string (out, invalidated_properties[i]);
+        }
+      g_string_append_c (out, ']');
+    }
+  else
+    {
+      g_string_append (out, ",\"iface\":{");
+      cockpit_json_append_string (out, interface_name);
+      g_string_append_c (out, ':');
+      write_properties (out, changed_properties);
+      g_string_append_c (out, '}');
+    }
+
+  g_string_append_c (out, '}');
 }
 
-/* ---------------------------------------------------------------------------------------------------- */
+typedef struct {
+  /* A change that has already been written out */
+  gchar *message;
+  gsize length;
+
+  /* Or property changes that later ones can still be merged into */
+  gchar *object_path;
+  gchar *interface_name;
+  GVariant *changed;
+  GPtrArray *invalidated;
+} BatchEntry;
+
+static void
+batch_entry_free (gpointer data)
+{
+  BatchEntry *entry = data;
+  g_free (entry->message);
+  g_free (entry->object_path);
+  g_free (entry->interface_name);
+  if (entry->changed)
+    g_variant_unref (entry->changed);
+  if (entry->invalidated)
+    g_ptr_array_free (entry->invalidated, TRUE);
+  g_free (entry);
+}
+
+static void
+drop_batch (CockpitDBusJson *self)
+{
+  if (self->batch_source)
+    {
+      g_source_destroy (self->batch_source);
+      g_source_unref (self->batch_source);
+      self->batch_source = NULL;
+    }
+  g_hash_table_remove_all (self->batch_props);
+  while (!g_queue_is_empty (&self->batch))
+    batch_entry_free (g_queue_pop_head (&self->batch));
+}
 
 static void
-add_interface (JsonBuilder *builder,
-               GDBusInterface *interface,
-               GVariant *changed_properties)
+flush_batch (CockpitDBusJson *self)
 {
-  gchar *s;
+  GString *out = self->buffer;
+  BatchEntry *entry;
+  gboolean first = TRUE;
+
+  if (self->batch_source)
+    {
+      g_source_destroy (self->batch_source);
+      g_source_unref (self->batch_source);
+      self->batch_source = NULL;
+    }
 
-  json_builder_set_member_name (builder, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
-  json_builder_begin_object (builder);
+  if (g_queue_is_empty (&self->batch))
+    return;
 
-  if (changed_properties == NULL)
+  g_hash_table_remove_all (self->batch_props);
+
+  g_string_truncate (out, 0);
+  g_string_append (out, "{\"command\":\"changes\",\"data\":[");
+  while ((entry = g_queue_pop_head (&self->batch)) != NULL)
     {
-      gchar **properties;
-      guint n;
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
 
-      properties = g_dbus_proxy_get_cached_property_names (G_DBUS_PROXY (interface));
-      for (n = 0; properties != NULL && properties[n] != NULL; n++)
+      if (entry->message)
         {
-          const gchar *property_name = properties[n];
-          GVariant *value;
-          value = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), property_name);
-          if (value != NULL)
-            {
-              s = g_strconcat ("dbus_prop_", property_name, NULL);
-              json_builder_set_member_name (builder, s);
-              g_free (s);
-              build_json (builder, value);
-              g_variant_unref (value);
-            }
+          g_string_append_len (out, entry->message, entry->length);
         }
-      g_strfreev (properties);
-
-      if (properties == NULL)
+      else
         {
-          json_builder_set_member_name (builder, "HackEmpty");
-          json_builder_add_string_value (builder, "HackEmpty");
+          g_string_append (out, "{\"command\":\"interface-properties-changed\",\"data\":");
+          g_ptr_array_add (entry->invalidated, NULL);
+          write_properties_changed (self, out, entry->object_path, entry->interface_name,
+                                    entry->changed, (const gchar * const *)entry->invalidated->pdata);
+          g_string_append_c (out, '}');
         }
+
+      batch_entry_free (entry);
     }
-  else
+  g_string_append (out, "]}");
+
+  send_buffer (self);
+}
+
+static gboolean
+on_batch_timeout (gpointer user_data)
+{
+  CockpitDBusJson *self = user_data;
+  flush_batch (self);
+  return FALSE;
+}
+
+static void
+push_batch (CockpitDBusJson *self,
+            BatchEntry *entry)
+{
+  g_queue_push_tail (&self->batch, entry);
+
+  if (!self->batch_source)
     {
-      GVariantIter iter;
-      const gchar *property_name;
+      /* The channel may live in a thread with its own main context */
+      self->batch_source = g_timeout_source_new (self->batch_window);
+      g_source_set_callback (self->batch_source, on_batch_timeout, self, NULL);
+      g_source_attach (self->batch_source, g_main_context_get_thread_default ());
+    }
+}
+
+/*
+ * Messages other than changes to the object tree go out right away,
+ * after any changes that are being held back.
+ */
+static GString *
+start_message (CockpitDBusJson *self,
+               const gchar *command)
+{
+  flush_batch (self);
+  write_header (self->buffer, command);
+  return self->buffer;
+}
+
+static void
+end_message (CockpitDBusJson *self)
+{
+  g_string_append_c (self->buffer, '}');
+  send_buffer (self);
+}
+
+/*
+ * Changes to the object tree are held back for the batch window, if
+ * the caller asked for one, and sent together.
+ */
+static GString *
+start_change (CockpitDBusJson *self,
+              const gchar *command)
+{
+  write_header (self->buffer, command);
+  return self->buffer;
+}
+
+static void
+end_change (CockpitDBusJson *self)
+{
+  BatchEntry *entry;
+
+  g_string_append_c (self->buffer, '}');
+
+  if (self->batch_window == 0)
+    {
+      send_buffer (self);
+      return;
+    }
+
+  entry = g_new0 (BatchEntry, 1);
+  entry->length = self->buffer->len;
+  entry->message = g_strndup (self->buffer->str, self->buffer->len);
+  g_string_truncate (self->buffer, 0);
+  push_batch (self, entry);
+}
+
+/*
+ * Property changes for an object can't be merged across the object
+ * or its interfaces being added or removed.
+ */
+static void
+batch_object_changed (CockpitDBusJson *self,
+                      const gchar *object_path)
+{
+  if (self->batch_window)
+    g_hash_table_remove (self->batch_props, object_path);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gboolean
+path_wanted (CockpitDBusJson *self,
+             const gchar *object_path)
+{
+  gsize length;
+
+  if (!self->path_prefix)
+    return TRUE;
+
+  /* The prefix "/a/b" matches "/a/b" and "/a/b/c" but not "/a/bc" */
+  length = strlen (self->path_prefix);
+  if (strncmp (object_path, self->path_prefix, length) != 0)
+    return FALSE;
+  return object_path[length] == '\0' || object_path[length] == '/' ||
+         self->path_prefix[length - 1] == '/';
+}
+
+static gboolean
+interface_wanted (CockpitDBusJson *self,
+                  const gchar *interface_name)
+{
+  return !self->interfaces || g_hash_table_lookup (self->interfaces, interface_name);
+}
+
+static void
+write_interface (GString *out,
+                 GDBusInterface *interface)
+{
+  gchar **properties;
+  gboolean first = TRUE;
+  guint n;
+
+  cockpit_json_append_string (out, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
+  g_string_append (out, ":{");
+
+  properties = g_dbus_proxy_get_cached_property_names (G_DBUS_PROXY (interface));
+  for (n = 0; properties != NULL && properties[n] != NULL; n++)
+    {
+      const gchar *property_name = properties[n];
       GVariant *value;
-      g_variant_iter_init (&iter, changed_properties);
-      while (g_variant_iter_next (&iter, "{&sv}", &property_name, &value))
+      value = g_dbus_proxy_get_cached_property (G_DBUS_PROXY (interface), property_name);
+      if (value != NULL)
         {
-          s = g_strconcat ("dbus_prop_", property_name, NULL);
-          json_builder_set_member_name (builder, property_name);
-          g_free (s);
-          build_json (builder, value);
+          if (!first)
+            g_string_append_c (out, ',');
+          first = FALSE;
+
+          /* D-Bus member names never need escaping */
+          g_string_append (out, "\"dbus_prop_");
+          g_string_append (out, property_name);
+          g_string_append (out, "\":");
+          write_json (out, value);
           g_variant_unref (value);
         }
     }
+  g_strfreev (properties);
+
+  if (properties == NULL)
+    g_string_append (out, "\"HackEmpty\":\"HackEmpty\"");
 
-  json_builder_end_object (builder);
+  g_string_append_c (out, '}');
 }
 
 static void
-add_object (JsonBuilder *builder,
-            GDBusObject *object)
+write_object (CockpitDBusJson *self,
+              GString *out,
+              GDBusObject *object)
 {
+  gboolean first = TRUE;
   GList *interfaces;
   GList *l;
 
-  json_builder_set_member_name (builder, "objpath");
-  json_builder_add_string_value (builder, g_dbus_object_get_object_path (G_DBUS_OBJECT (object)));
-
-  json_builder_set_member_name (builder, "ifaces");
-  json_builder_begin_object (builder);
+  g_string_append (out, "{\"objpath\":");
+  cockpit_json_append_string (out, g_dbus_object_get_object_path (G_DBUS_OBJECT (object)));
+  g_string_append (out, ",\"ifaces\":{");
 
   interfaces = g_dbus_object_get_interfaces (object);
   for (l = interfaces; l != NULL; l = l->next)
     {
-      GDBusInterface *interface = G_DBUS_INTERFACE (l->data);
-      add_interface (builder, interface, NULL);
+      if (!interface_wanted (self, g_dbus_proxy_get_interface_name (l->data)))
+        continue;
+      if (!first)
+        g_string_append_c (out, ',');
+      first = FALSE;
+      write_interface (out, G_DBUS_INTERFACE (l->data));
     }
   g_list_foreach (interfaces, (GFunc)g_object_unref, NULL);
   g_list_free (interfaces);
 
-  json_builder_end_object (builder);
+  g_string_append (out, "}}");
+}
+
+static void
+write_object_member (CockpitDBusJson *self,
+                     GString *out,
+                     GDBusObject *object)
+{
+  cockpit_json_append_string (out, g_dbus_object_get_object_path (object));
+  g_string_append_c (out, ':');
+  write_object (self, out, object);
 }
 
 static void
 send_seed (CockpitDBusJson *self)
 {
-  gs_unref_object JsonBuilder *builder = json_builder_new ();
+  GString *out = self->buffer;
+  gboolean first = TRUE;
+  GList *objects, *l;
+
+  flush_batch (self);
+  g_string_truncate (out, 0);
+
+  objects = g_dbus_object_manager_get_objects (self->object_manager);
+
+  /*
+   * With a chunked seed the objects go out in bounded messages, and the
+   * final "seed" message has none. Either way only the text of one
+   * message is in memory at a time.
+   */
+  if (self->chunked_seed)
+    {
+      for (l = objects; l != NULL; l = l->next)
+        {
+          if (!path_wanted (self, g_dbus_object_get_object_path (l->data)))
+            continue;
+          if (out->len == 0)
+            g_string_append (out, "{\"command\":\"seed-chunk\",\"data\":{");
+          else
+            g_string_append_c (out, ',');
+          write_object_member (self, out, G_DBUS_OBJECT (l->data));
+
+          if (out->len >= SEED_CHUNK_SIZE)
+            {
+              g_string_append (out, "}}");
+              send_buffer (self);
+              out = self->buffer;
+            }
+        }
 
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "command");
-  json_builder_add_string_value (builder, "seed");
+      if (out->len > 0)
+        {
+          g_string_append (out, "}}");
+          send_buffer (self);
+          out = self->buffer;
+        }
+    }
 
-  json_builder_set_member_name (builder, "options");
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "byteorder");
+  g_string_append (out, "{\"command\":\"seed\",\"options\":{\"byteorder\":");
   if (G_BYTE_ORDER == G_LITTLE_ENDIAN)
-    json_builder_add_string_value (builder, "le");
+    g_string_append (out, "\"le\"");
   else if (G_BYTE_ORDER == G_BIG_ENDIAN)
-    json_builder_add_string_value (builder, "be");
+    g_string_append (out, "\"be\"");
   else
-    json_builder_add_string_value (builder, "");
-  json_builder_end_object (builder);
-
-  json_builder_set_member_name (builder, "data");
-  json_builder_begin_object (builder);
+    g_string_append (out, "\"\"");
+  if (self->property_deltas)
+    g_string_append (out, ",\"property-deltas\":true");
+  g_string_append (out, "},\"data\":{");
 
-  GList *objects = g_dbus_object_manager_get_objects (self->object_manager);
-  for (GList *l = objects; l != NULL; l = l->next)
+  if (!self->chunked_seed)
     {
-      GDBusObject *object = G_DBUS_OBJECT (l->data);
-      json_builder_set_member_name (builder, g_dbus_object_get_object_path (object));
-      json_builder_begin_object (builder);
-      add_object (builder, object);
-      json_builder_end_object (builder);
+      for (l = objects; l != NULL; l = l->next)
+        {
+          if (!path_wanted (self, g_dbus_object_get_object_path (l->data)))
+            continue;
+          if (!first)
+            g_string_append_c (out, ',');
+          first = FALSE;
+          write_object_member (self, out, G_DBUS_OBJECT (l->data));
+        }
     }
+
+  g_string_append (out, "}}");
+  send_buffer (self);
+
   g_list_foreach (objects, (GFunc)g_object_unref, NULL);
   g_list_free (objects);
-  json_builder_end_object (builder);
-
-  write_builder (self, builder);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -804,16 +865,18 @@ on_object_added (GDBusObjectManager *manager,
                  gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("object-added");
+  GString *out;
+
+  if (!path_wanted (self, g_dbus_object_get_object_path (object)))
+    return;
 
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "object");
-  json_builder_begin_object (builder);
-  add_object (builder, object);
-  json_builder_end_object (builder);
-  json_builder_end_object (builder);
+  out = start_change (self, "object-added");
+  g_string_append (out, "{\"object\":");
+  write_object (self, out, object);
+  g_string_append_c (out, '}');
 
-  write_builder (self, builder);
+  end_change (self);
+  batch_object_changed (self, g_dbus_object_get_object_path (object));
 }
 
 static void
@@ -822,13 +885,18 @@ on_object_removed (GDBusObjectManager *manager,
                    gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("object-removed");
+  GString *out;
 
-  json_builder_begin_array (builder);
-  json_builder_add_string_value (builder, g_dbus_object_get_object_path (object));
-  json_builder_end_array (builder);
+  if (!path_wanted (self, g_dbus_object_get_object_path (object)))
+    return;
 
-  write_builder (self, builder);
+  out = start_change (self, "object-removed");
+  g_string_append_c (out, '[');
+  cockpit_json_append_string (out, g_dbus_object_get_object_path (object));
+  g_string_append_c (out, ']');
+
+  end_change (self);
+  batch_object_changed (self, g_dbus_object_get_object_path (object));
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -840,20 +908,23 @@ on_interface_added (GDBusObjectManager *manager,
                     gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("interface-added");
-
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "objpath");
-  json_builder_add_string_value (builder, g_dbus_object_get_object_path (object));
-  json_builder_set_member_name (builder, "iface_name");
-  json_builder_add_string_value (builder, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
-  json_builder_set_member_name (builder, "iface");
-  json_builder_begin_object (builder);
-  add_interface (builder, interface, NULL);
-  json_builder_end_object (builder);
-  json_builder_end_object (builder);
-
-  write_builder (self, builder);
+  GString *out;
+
+  if (!path_wanted (self, g_dbus_object_get_object_path (object)) ||
+      !interface_wanted (self, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface))))
+    return;
+
+  out = start_change (self, "interface-added");
+  g_string_append (out, "{\"objpath\":");
+  cockpit_json_append_string (out, g_dbus_object_get_object_path (object));
+  g_string_append (out, ",\"iface_name\":");
+  cockpit_json_append_string (out, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
+  g_string_append (out, ",\"iface\":{");
+  write_interface (out, interface);
+  g_string_append (out, "}}");
+
+  end_change (self);
+  batch_object_changed (self, g_dbus_object_get_object_path (object));
 }
 
 static void
@@ -863,16 +934,92 @@ on_interface_removed (GDBusObjectManager *manager,
                       gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("interface-removed");
+  GString *out;
+
+  if (!path_wanted (self, g_dbus_object_get_object_path (object)) ||
+      !interface_wanted (self, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface))))
+    return;
 
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "objpath");
-  json_builder_add_string_value (builder, g_dbus_object_get_object_path (object));
-  json_builder_set_member_name (builder, "iface_name");
-  json_builder_add_string_value (builder, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
-  json_builder_end_object (builder);
+  out = start_change (self, "interface-removed");
+  g_string_append (out, "{\"objpath\":");
+  cockpit_json_append_string (out, g_dbus_object_get_object_path (object));
+  g_string_append (out, ",\"iface_name\":");
+  cockpit_json_append_string (out, g_dbus_proxy_get_interface_name (G_DBUS_PROXY (interface)));
+  g_string_append_c (out, '}');
 
-  write_builder (self, builder);
+  end_change (self);
+  batch_object_changed (self, g_dbus_object_get_object_path (object));
+}
+
+static gboolean
+remove_string (GPtrArray *array,
+               const gchar *string)
+{
+  guint i;
+
+  for (i = 0; i < array->len; i++)
+    {
+      if (g_str_equal (array->pdata[i], string))
+        {
+          g_ptr_array_remove_index (array, i);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/*
+ * Fold another change to the same interface into an
+ * "interface-properties-changed" message that hasn't gone out yet.
+ * Later values win, and a property is either changed or invalidated,
+ * whichever happened last.
+ */
+static void
+merge_properties_changed (BatchEntry *entry,
+                          GVariant *changed_properties,
+                          const gchar * const *invalidated_properties)
+{
+  GVariantBuilder builder;
+  GHashTable *merged;
+  GHashTableIter hiter;
+  GVariantIter iter;
+  const gchar *name;
+  GVariant *value;
+  GVariant *old;
+  gpointer key;
+  guint i;
+
+  merged = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_variant_unref);
+
+  g_variant_iter_init (&iter, entry->changed);
+  while (g_variant_iter_next (&iter, "{&sv}", &name, &value))
+    g_hash_table_replace (merged, (gpointer)name, value);
+
+  for (i = 0; invalidated_properties && invalidated_properties[i]; i++)
+    {
+      g_hash_table_remove (merged, invalidated_properties[i]);
+      remove_string (entry->invalidated, invalidated_properties[i]);
+      g_ptr_array_add (entry->invalidated, g_strdup (invalidated_properties[i]));
+    }
+
+  g_variant_iter_init (&iter, changed_properties);
+  while (g_variant_iter_next (&iter, "{&sv}", &name, &value))
+    {
+      g_hash_table_replace (merged, (gpointer)name, value);
+      remove_string (entry->invalidated, name);
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_hash_table_iter_init (&hiter, merged);
+  while (g_hash_table_iter_next (&hiter, &key, (gpointer *)&value))
+    g_variant_builder_add (&builder, "{sv}", key, value);
+
+  /* The names in @merged point into the old value */
+  old = entry->changed;
+  entry->changed = g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_hash_table_destroy (merged);
+  g_variant_unref (old);
 }
 
 static void
@@ -884,23 +1031,50 @@ on_interface_proxy_properties_changed (GDBusObjectManager *manager,
                                        gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("interface-properties-changed");
-
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "objpath");
-  json_builder_add_string_value (builder, g_dbus_object_get_object_path (G_DBUS_OBJECT (object_proxy)));
-  json_builder_set_member_name (builder, "iface_name");
-  json_builder_add_string_value (builder, g_dbus_proxy_get_interface_name (interface_proxy));
-  /* It's a bit of a waste to send all properties - would be cheaper to just
-   * send @changed_properties and @invalidated_properties. But this is simpler.
-   */
-  json_builder_set_member_name (builder, "iface");
-  json_builder_begin_object (builder);
-  add_interface (builder, G_DBUS_INTERFACE (interface_proxy), changed_properties);
-  json_builder_end_object (builder);
-  json_builder_end_object (builder);
+  const gchar *object_path = g_dbus_object_get_object_path (G_DBUS_OBJECT (object_proxy));
+  const gchar *interface_name = g_dbus_proxy_get_interface_name (interface_proxy);
+  GHashTable *pending;
+  BatchEntry *entry = NULL;
+  GString *out;
+  guint i;
+
+  if (!path_wanted (self, object_path) || !interface_wanted (self, interface_name))
+    return;
+
+  if (self->batch_window)
+    {
+      pending = g_hash_table_lookup (self->batch_props, object_path);
+      if (pending)
+        entry = g_hash_table_lookup (pending, interface_name);
+      if (entry)
+        {
+          merge_properties_changed (entry, changed_properties, invalidated_properties);
+        }
+      else
+        {
+          entry = g_new0 (BatchEntry, 1);
+          entry->object_path = g_strdup (object_path);
+          entry->interface_name = g_strdup (interface_name);
+          entry->changed = g_variant_ref (changed_properties);
+          entry->invalidated = g_ptr_array_new_with_free_func (g_free);
+          for (i = 0; invalidated_properties && invalidated_properties[i]; i++)
+            g_ptr_array_add (entry->invalidated, g_strdup (invalidated_properties[i]));
+          if (!pending)
+            {
+              /* The entries are owned by the batch queue */
+              pending = g_hash_table_new (g_str_hash, g_str_equal);
+              g_hash_table_insert (self->batch_props, g_strdup (object_path), pending);
+            }
+          g_hash_table_insert (pending, entry->interface_name, entry);
+          push_batch (self, entry);
+        }
+      return;
+    }
 
-  write_builder (self, builder);
+  out = start_change (self, "interface-properties-changed");
+  write_properties_changed (self, out, object_path, interface_name,
+                            changed_properties, invalidated_properties);
+  end_change (self);
 }
 
 static void
@@ -913,45 +1087,43 @@ on_connection_signal (GDBusConnection *connection,
                       gpointer user_data)
 {
   CockpitDBusJson *self = user_data;
-  gs_unref_object JsonBuilder *builder = prepare_builder ("interface-signal");
+  GString *out;
 
-  GVariantIter iter;
-  GVariant *child;
+  if (!path_wanted (self, object_path) || !interface_wanted (self, interface_name))
+    return;
 
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "objpath");
-  json_builder_add_string_value (builder, object_path);
-  json_builder_set_member_name (builder, "iface_name");
-  json_builder_add_string_value (builder, interface_name);
-  json_builder_set_member_name (builder, "signal_name");
-  json_builder_add_string_value (builder, signal_name);
-
-  json_builder_set_member_name (builder, "args");
-  json_builder_begin_array (builder);
-  g_variant_iter_init (&iter, parameters);
-  while ((child = g_variant_iter_next_value (&iter)) != NULL)
-    {
-      build_json (builder, child);
-      g_variant_unref (child);
-    }
-  json_builder_end_array (builder);
+  out = start_message (self, "interface-signal");
+  g_string_append (out, "{\"objpath\":");
+  cockpit_json_append_string (out, object_path);
+  g_string_append (out, ",\"iface_name\":");
+  cockpit_json_append_string (out, interface_name);
+  g_string_append (out, ",\"signal_name\":");
+  cockpit_json_append_string (out, signal_name);
 
-  json_builder_end_object (builder);
+  /* The parameters are a tuple, which is written as an array */
+  g_string_append (out, ",\"args\":");
+  write_json (out, parameters);
+  g_string_append_c (out, '}');
 
-  write_builder (self, builder);
+  end_message (self);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
-send_dbus_reply (CockpitDBusJson *self, const gchar *cookie, GVariant *result, GError *error)
+write_dbus_reply (GString *out,
+                  const gchar *cookie,
+                  GVariant *result,
+                  GError *error)
 {
-  gs_unref_object JsonBuilder *builder = NULL;
-  builder = prepare_builder ("call-reply");
+  g_string_append_c (out, '{');
 
-  json_builder_begin_object (builder);
-  json_builder_set_member_name (builder, "cookie");
-  json_builder_add_string_value (builder, cookie);
+  if (cookie)
+    {
+      g_string_append (out, "\"cookie\":");
+      cockpit_json_append_string (out, cookie);
+      g_string_append_c (out, ',');
+    }
 
   if (result == NULL)
     {
@@ -959,22 +1131,88 @@ send_dbus_reply (CockpitDBusJson *self, const gchar *cookie, GVariant *result, G
       error_name = g_dbus_error_get_remote_error (error);
       g_dbus_error_strip_remote_error (error);
 
-      json_builder_set_member_name (builder, "error_name");
-      json_builder_add_string_value (builder, error_name != NULL ? error_name : "");
+      g_string_append (out, "\"error_name\":");
+      cockpit_json_append_string (out, error_name != NULL ? error_name : "");
 
-      json_builder_set_member_name (builder, "error_message");
-      json_builder_add_string_value (builder, error->message);
+      g_string_append (out, ",\"error_message\":");
+      cockpit_json_append_string (out, error->message);
 
       g_free (error_name);
     }
   else
     {
-      json_builder_set_member_name (builder, "result");
-      build_json (builder, result);
+      g_string_append (out, "\"result\":");
+      write_json (out, result);
+    }
+  g_string_append_c (out, '}');
+}
+
+static void
+send_dbus_reply (CockpitDBusJson *self, const gchar *cookie, GVariant *result, GError *error)
+{
+  GString *out = start_message (self, "call-reply");
+  write_dbus_reply (out, cookie, result, error);
+  end_message (self);
+}
+
+/*
+ * The calls of a "call-batch" command. Each call holds a reference.
+ * Unless the replies are streamed, they're collected here in the order
+ * of the calls, and sent together once the last one is in.
+ */
+typedef struct {
+  gint refs;
+  gchar *cookie;
+  gboolean stream;
+  GPtrArray *replies;
+  guint replied;
+} CallBatch;
+
+static CallBatch *
+call_batch_new (const gchar *cookie,
+                gboolean stream,
+                guint n_calls)
+{
+  CallBatch *batch;
+
+  batch = g_new0 (CallBatch, 1);
+  batch->refs = 1;
+  batch->cookie = g_strdup (cookie);
+  batch->stream = stream;
+  batch->replies = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_set_size (batch->replies, n_calls);
+  return batch;
+}
+
+static void
+call_batch_unref (CallBatch *batch)
+{
+  if (--batch->refs > 0)
+    return;
+  g_free (batch->cookie);
+  g_ptr_array_free (batch->replies, TRUE);
+  g_free (batch);
+}
+
+static void
+send_call_batch_reply (CockpitDBusJson *self,
+                       CallBatch *batch)
+{
+  GString *out = start_message (self, "call-batch-reply");
+  guint i;
+
+  g_string_append (out, "{\"cookie\":");
+  cockpit_json_append_string (out, batch->cookie);
+  g_string_append (out, ",\"replies\":[");
+  for (i = 0; i < batch->replies->len; i++)
+    {
+      if (i > 0)
+        g_string_append_c (out, ',');
+      g_string_append (out, batch->replies->pdata[i]);
     }
-  json_builder_end_object (builder);
+  g_string_append (out, "]}");
 
-  write_builder (self, builder);
+  end_message (self);
 }
 
 static GVariantType *
@@ -1006,6 +1244,70 @@ compute_complete_signature (GDBusArgInfo **args)
   return g_variant_type_new_tuple (arg_types, n);
 }
 
+/*
+ * What we need to make a call to a method, worked out from its
+ * introspection data the first time it's called. Later calls skip
+ * straight to converting the arguments.
+ */
+typedef struct {
+  GDBusMethodInfo *method_info;
+  CockpitDBusConverter *params;
+  GVariantType *reply_type;
+} MethodPlan;
+
+static void
+method_plan_free (gpointer data)
+{
+  MethodPlan *plan = data;
+  g_dbus_method_info_unref (plan->method_info);
+  if (plan->params)
+    cockpit_dbus_converter_unref (plan->params);
+  if (plan->reply_type)
+    g_variant_type_free (plan->reply_type);
+  g_free (plan);
+}
+
+static MethodPlan *
+lookup_method_plan (CockpitDBusJson *self,
+                    const gchar *iface_name,
+                    GDBusMethodInfo *method_info)
+{
+  GVariantType *param_type;
+  MethodPlan *plan;
+  gchar *signature;
+  gchar *key;
+
+  key = g_strconcat (iface_name, "\n", method_info->name, NULL);
+
+  /*
+   * The plan holds a reference to the introspection data it was made
+   * from, so if that's been replaced since, the pointers won't match.
+   */
+  plan = g_hash_table_lookup (self->method_plans, key);
+  if (plan && plan->method_info == method_info)
+    {
+      g_free (key);
+      return plan;
+    }
+
+  plan = g_new0 (MethodPlan, 1);
+  plan->method_info = g_dbus_method_info_ref (method_info);
+
+  param_type = compute_complete_signature (method_info->in_args);
+  if (param_type)
+    {
+      signature = g_variant_type_dup_string (param_type);
+      plan->params = cockpit_dbus_converter_lookup (signature);
+      g_variant_type_free (param_type);
+      g_free (signature);
+    }
+
+  plan->reply_type = compute_complete_signature (method_info->out_args);
+
+  g_hash_table_replace (self->method_plans, key, plan);
+  return plan;
+}
+
 typedef struct
 {
   /* Cleared by dispose */
@@ -1025,6 +1327,10 @@ typedef struct
   const gchar *method_name;
   const gchar *objpath;
   JsonNode *args;
+
+  /* When part of a "call-batch" */
+  CallBatch *batch;
+  guint index;
 } CallData;
 
 static void
@@ -1033,11 +1339,44 @@ call_data_free (CallData *data)
   if (data->dbus_json)
     data->dbus_json->active_calls = g_list_delete_link (data->dbus_json->active_calls, data->link);
 
-  g_object_unref (data->connection);
+  if (data->batch)
+    call_batch_unref (data->batch);
+  if (data->connection)
+    g_object_unref (data->connection);
   json_object_unref (data->request);
   g_free (data);
 }
 
+/* Sends or collects the reply, and frees the call data */
+static void
+complete_dbus_call (CallData *data,
+                    GVariant *result,
+                    GError *error)
+{
+  CallBatch *batch = data->batch;
+  GString *out;
+
+  if (!data->dbus_json)
+    {
+      /* Channel has gone away */
+    }
+  else if (!batch || batch->stream)
+    {
+      send_dbus_reply (data->dbus_json, data->cookie, result, error);
+    }
+  else
+    {
+      out = g_string_new ("");
+      write_dbus_reply (out, data->cookie, result, error);
+      batch->replies->pdata[data->index] = g_string_free (out, FALSE);
+      batch->replied++;
+      if (batch->replied == batch->replies->len)
+        send_call_batch_reply (data->dbus_json, batch);
+    }
+
+  call_data_free (data);
+}
+
 static void
 dbus_call_cb (GDBusConnection *connection,
               GAsyncResult *res,
@@ -1050,13 +1389,11 @@ dbus_call_cb (GDBusConnection *connection,
   error = NULL;
   result = g_dbus_connection_call_finish (connection, res, &error);
 
-  if (data->dbus_json)
-    send_dbus_reply (data->dbus_json, data->cookie, result, error);
+  complete_dbus_call (data, result, error);
 
   if (result)
     g_variant_unref (result);
   g_clear_error (&error);
-  call_data_free (data);
 }
 
 
@@ -1065,9 +1402,8 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
                                CallData *call_data)
 {
   GDBusMethodInfo *method_info = NULL;
-  GVariantType *param_type;
-  GVariantType *reply_type;
   GVariant *parameters = NULL;
+  MethodPlan *plan;
   GError *error = NULL;
   gchar *owner;
 
@@ -1080,10 +1416,16 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
                    call_data->iface_name, call_data->method_name);
       goto out;
     }
-  param_type = compute_complete_signature (method_info->in_args);
-  parameters = parse_json (call_data->args, param_type, &error);
-  g_variant_type_free (param_type);
 
+  plan = lookup_method_plan (self, call_data->iface_name, method_info);
+  if (plan->params == NULL)
+    {
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Invalid signature for method '%s'", call_data->method_name);
+      goto out;
+    }
+
+  parameters = cockpit_dbus_converter_parse (plan->params, call_data->args, &error);
   if (!parameters)
     {
       g_prefix_error (&error, "Failed to convert parameters for '%s': ", call_data->method_name);
@@ -1094,29 +1436,24 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
 
   g_object_get (self->object_manager, "name-owner", &owner, NULL);
 
-  reply_type = compute_complete_signature (method_info->out_args);
-
   /* and now, issue the call */
   g_dbus_connection_call (call_data->connection, owner, call_data->objpath,
                           call_data->iface_name, call_data->method_name,
                           parameters,
-                          reply_type,
+                          plan->reply_type,
                           G_DBUS_CALL_FLAGS_NO_AUTO_START,
                           G_MAXINT, /* timeout */
                           self->cancellable,
                           (GAsyncReadyCallback)dbus_call_cb,
                           call_data); /* user_data*/
 
-  g_variant_type_free (reply_type);
-
   g_free (owner);
 
 out:
   if (error)
     {
-      send_dbus_reply (self, call_data->cookie, NULL, error);
+      complete_dbus_call (call_data, NULL, error);
       g_error_free (error);
-      call_data_free (call_data);
     }
 }
 
@@ -1127,97 +1464,27 @@ on_introspect_ready (GObject *source,
 {
   CallData *call_data = (CallData *)user_data;
   CockpitDBusJson *self;
-  GVariant *val = NULL;
-  GDBusNodeInfo *node = NULL;
-  GDBusInterfaceInfo *iface = NULL;
-  const gchar *xml = NULL;
+  GDBusInterfaceInfo *iface;
   GError *error = NULL;
   gboolean not_found;
-  gboolean expected;
-  gchar *remote;
-  gint i;
+
+  iface = cockpit_dbus_introspect_finish (result, &error);
+  not_found = g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
 
   /* Cancelled? */
   if (!call_data->dbus_json)
     {
+      if (iface)
+        g_dbus_interface_info_unref (iface);
       call_data_free (call_data);
       return;
     }
 
-  not_found = FALSE;
-
   self = COCKPIT_DBUS_JSON (call_data->dbus_json);
-  val = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
-  if (error)
-    {
-      /*
-       * Note that many DBus implementations don't return errors when
-       * an unknown object path is introspected. They just return empty
-       * introspect data. GDBus is one of these.
-       */
-
-      expected = FALSE;
-      remote = g_dbus_error_get_remote_error (error);
-      if (remote)
-        {
-          /*
-           * DBus used to only have the UnknownMethod error. It didn't have
-           * specific errors for UnknownObject and UnknownInterface. So we're
-           * pretty liberal on what we treat as an expected error here.
-           *
-           * HACK: GDBus also doesn't understand the newer error codes :S
-           *
-           * https://bugzilla.gnome.org/show_bug.cgi?id=727900
-           */
-          expected = (g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownMethod") ||
-                      g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownObject") ||
-                      g_str_equal (remote, "org.freedesktop.DBus.Error.UnknownInterface"));
-          not_found = TRUE;
-          g_free (remote);
-        }
-
-      if (expected)
-        {
-          g_debug ("no introspect data found for object %s", call_data->objpath);
-        }
-      else
-        {
-          g_message ("Couldn't look up introspection for object %s: %s",
-                     call_data->objpath, error->message);
-        }
-      g_clear_error (&error);
-    }
 
-  if (val)
-    {
-      g_debug ("got introspect data for %s", call_data->objpath);
-
-      g_variant_get (val, "(&s)", &xml);
-      node = g_dbus_node_info_new_for_xml (xml, &error);
-      if (error)
-        {
-          g_message ("Invalid DBus introspect data received for object %s: %s",
-                     call_data->objpath, error->message);
-          g_clear_error (&error);
-        }
-      else if (node)
-        {
-          not_found = TRUE;
-          for (i = 0; node->interfaces && node->interfaces[i] != NULL; i++)
-            {
-              iface = node->interfaces[i];
-              if (iface->name)
-                {
-                  g_hash_table_replace (self->introspect_cache, iface->name,
-                                        g_dbus_interface_info_ref (iface));
-                  if (g_str_equal (iface->name, call_data->iface_name))
-                    not_found = FALSE;
-                }
-            }
-          g_dbus_node_info_unref (node);
-        }
-      g_variant_unref (val);
-    }
+  if (iface)
+    g_hash_table_replace (self->introspect_cache, iface->name, iface);
 
   /*
    * If we got introspect data *but* the service didn't know about the object, then
@@ -1232,9 +1499,8 @@ on_introspect_ready (GObject *source,
       g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "No iface for objpath %s and iface %s calling %s",
                    call_data->objpath, call_data->iface_name, call_data->method_name);
-      send_dbus_reply (self, call_data->cookie, NULL, error);
+      complete_dbus_call (call_data, NULL, error);
       g_error_free (error);
-      call_data_free (call_data);
       return;
     }
 
@@ -1242,34 +1508,44 @@ on_introspect_ready (GObject *source,
   handle_dbus_call_on_interface (self, call_data);
 }
 
-static gboolean
-handle_dbus_call (CockpitDBusJson *self,
-                  JsonObject *root)
+static CallData *
+parse_dbus_call (JsonObject *request,
+                 gboolean need_cookie)
 {
-  GDBusInterface *iface_proxy;
-  gchar *owner = NULL;
   CallData *call_data;
 
   call_data = g_new0 (CallData, 1);
-  call_data->objpath = json_object_get_string_member (root, "objpath");
-  call_data->iface_name = json_object_get_string_member (root, "iface");
-  call_data->method_name = json_object_get_string_member (root, "method");
-  call_data->cookie = json_object_get_string_member (root, "cookie");
-  call_data->args = json_object_get_member (root, "args");
+  call_data->objpath = json_object_get_string_member (request, "objpath");
+  call_data->iface_name = json_object_get_string_member (request, "iface");
+  call_data->method_name = json_object_get_string_member (request, "method");
+  call_data->cookie = json_object_get_string_member (request, "cookie");
+  call_data->args = json_object_get_member (request, "args");
 
   if (!(g_variant_is_object_path (call_data->objpath) &&
         g_dbus_is_interface_name (call_data->iface_name) &&
         g_dbus_is_member_name (call_data->method_name) &&
-        call_data->cookie != NULL &&
+        (call_data->cookie != NULL || !need_cookie) &&
         call_data->args != NULL))
     {
       g_warning ("Invalid data in call message");
       g_free (call_data);
-      return FALSE;
+      return NULL;
     }
 
+  call_data->request = json_object_ref (request);
+  return call_data;
+}
+
+static void
+start_dbus_call (CockpitDBusJson *self,
+                 CallData *call_data)
+{
+  GDBusInterfaceInfo *iface_info;
+  GDBusInterface *iface_proxy;
+  GError *error = NULL;
+  gchar *owner = NULL;
+
   call_data->dbus_json = self;
-  call_data->request = json_object_ref (root);
   self->active_calls = g_list_prepend (self->active_calls, call_data);
   call_data->link = g_list_find (self->active_calls, call_data);
   g_object_get (self->object_manager, "connection", &call_data->connection, NULL);
@@ -1292,33 +1568,141 @@ handle_dbus_call (CockpitDBusJson *self,
         }
     }
 
+  /* Another channel may have already introspected this object */
+  if (call_data->iface_info == NULL)
+    {
+      g_object_get (self->object_manager,
+                    "name-owner", &owner,
+                    NULL);
+
+      if (owner)
+        {
+          iface_info = cockpit_dbus_introspect_lookup (call_data->connection, owner,
+                                                       call_data->objpath,
+                                                       call_data->iface_name);
+          if (iface_info)
+            {
+              g_hash_table_replace (self->introspect_cache, iface_info->name, iface_info);
+              call_data->iface_info = iface_info;
+            }
+        }
+    }
+
   if (call_data->iface_info != NULL)
     {
       /* Frees call data when done */
       handle_dbus_call_on_interface (self, call_data);
     }
+  else if (owner == NULL)
+    {
+      g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "No iface for objpath %s and iface %s calling %s",
+                   call_data->objpath, call_data->iface_name, call_data->method_name);
+      complete_dbus_call (call_data, NULL, error);
+      g_error_free (error);
+    }
   else
     {
       g_debug ("no introspect data for %s %s", call_data->objpath, call_data->iface_name);
 
-      g_object_get (self->object_manager,
-                    "name-owner", &owner,
-                    NULL);
+      cockpit_dbus_introspect_async (call_data->connection, owner,
+                                     call_data->objpath, call_data->iface_name,
+                                     on_introspect_ready, call_data);
+    }
 
-      g_dbus_connection_call (call_data->connection, owner, call_data->objpath,
-                              "org.freedesktop.DBus.Introspectable", "Introspect",
-                              NULL, G_VARIANT_TYPE ("(s)"),
-                              G_DBUS_CALL_FLAGS_NO_AUTO_START,
-                              -1, /* timeout */
-                              NULL, /* GCancellable */
-                              on_introspect_ready, call_data);
+  g_free (owner);
+}
 
-      g_free (owner);
-    }
+static gboolean
+handle_dbus_call (CockpitDBusJson *self,
+                  JsonObject *root)
+{
+  CallData *call_data;
+
+  call_data = parse_dbus_call (root, TRUE);
+  if (!call_data)
+    return FALSE;
 
+  /* Frees call data when done */
+  start_dbus_call (self, call_data);
   return TRUE;
 }
 
+/*
+ * Many independent calls in one message, all of which are in flight at
+ * once. The replies come back together in a "call-batch-reply", or as
+ * individual "call-reply" messages in the order the calls complete.
+ */
+static gboolean
+handle_dbus_call_batch (CockpitDBusJson *self,
+                        JsonObject *root)
+{
+  CallData **calls = NULL;
+  const gchar *cookie;
+  gboolean stream = FALSE;
+  gboolean ret = FALSE;
+  CallBatch *batch;
+  JsonArray *array;
+  JsonNode *node;
+  guint length = 0;
+  guint i;
+
+  node = json_object_get_member (root, "calls");
+  if (!cockpit_json_get_string (root, "cookie", NULL, &cookie) ||
+      !cockpit_json_get_bool (root, "stream", FALSE, &stream) ||
+      (cookie == NULL && !stream) || !node || !JSON_NODE_HOLDS_ARRAY (node))
+    {
+      g_warning ("Invalid data in call-batch message");
+      return FALSE;
+    }
+
+  /* Check all the calls before any of them go out */
+  array = json_node_get_array (node);
+  length = json_array_get_length (array);
+  calls = g_new0 (CallData *, length);
+  for (i = 0; i < length; i++)
+    {
+      node = json_array_get_element (array, i);
+      if (!JSON_NODE_HOLDS_OBJECT (node))
+        {
+          g_warning ("Invalid data in call-batch message");
+          goto out;
+        }
+
+      /* Streamed replies are told apart by their cookies */
+      calls[i] = parse_dbus_call (json_node_get_object (node), stream);
+      if (!calls[i])
+        goto out;
+    }
+
+  batch = call_batch_new (cookie, stream, length);
+  if (length == 0 && !stream)
+    send_call_batch_reply (self, batch);
+
+  for (i = 0; i < length; i++)
+    {
+      batch->refs++;
+      calls[i]->batch = batch;
+      calls[i]->index = i;
+
+      /* Frees call data when done */
+      start_dbus_call (self, calls[i]);
+      calls[i] = NULL;
+    }
+
+  call_batch_unref (batch);
+  ret = TRUE;
+
+out:
+  for (i = 0; i < length; i++)
+    {
+      if (calls[i])
+        call_data_free (calls[i]);
+    }
+  g_free (calls);
+  return ret;
+}
+
 static void
 cockpit_dbus_json_recv (CockpitChannel *channel,
                           GBytes *message)
@@ -1340,6 +1724,11 @@ cockpit_dbus_json_recv (CockpitChannel *channel,
       if (!handle_dbus_call (self, root))
         goto close;
     }
+  else if (g_strcmp0 (json_object_get_string_member (root, "command"), "call-batch") == 0)
+    {
+      if (!handle_dbus_call_batch (self, root))
+        goto close;
+    }
   else
     {
       g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown command in JSON");
@@ -1366,28 +1755,27 @@ on_object_manager_ready (GObject *source,
 {
   CockpitDBusJson *self = user_data;
   CockpitChannel *channel = COCKPIT_CHANNEL (self);
-  GAsyncInitable *initable;
   GError *error = NULL;
 
-  initable = G_ASYNC_INITABLE (source);
-  self->object_manager = G_DBUS_OBJECT_MANAGER (g_async_initable_new_finish (initable, result, &error));
+  self->object_manager = cockpit_dbus_manager_get_finish (result, &error);
 
-  if (self->object_manager == NULL)
+  /* Other channels may still be using the manager, so it's not cancelled */
+  if (g_cancellable_is_cancelled (self->cancellable))
     {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
-          g_cancellable_is_cancelled (self->cancellable))
-        {
-          g_debug ("%s", error->message);
-        }
-      else
-        {
-          g_warning ("%s", error->message);
-          cockpit_channel_close (channel, "internal-error");
-        }
+      g_debug ("channel closed while waiting for object manager");
+      g_clear_object (&self->object_manager);
+      g_clear_error (&error);
+    }
+  else if (self->object_manager == NULL)
+    {
+      g_warning ("%s", error->message);
+      cockpit_channel_close (channel, "internal-error");
     }
   else
     {
       GDBusConnection *connection;
+      const gchar *dbus_interface = NULL;
+      GHashTableIter iter;
       gchar *dbus_service;
 
       g_signal_connect (self->object_manager,
@@ -1416,9 +1804,16 @@ on_object_manager_ready (GObject *source,
                     "name", &dbus_service,
                     NULL);
 
+      /* With only one interface wanted, the bus can leave out the rest */
+      if (self->interfaces && g_hash_table_size (self->interfaces) == 1)
+        {
+          g_hash_table_iter_init (&iter, self->interfaces);
+          g_hash_table_iter_next (&iter, (gpointer *)&dbus_interface, NULL);
+        }
+
       self->signal_id = g_dbus_connection_signal_subscribe (connection,
                                                             dbus_service,
-                                                            NULL,
+                                                            dbus_interface,
                                                             NULL,
                                                             NULL,
                                                             NULL,
@@ -1443,6 +1838,10 @@ cockpit_dbus_json_init (CockpitDBusJson *self)
   self->cancellable = g_cancellable_new ();
   self->introspect_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
                                                   (GDestroyNotify)g_dbus_interface_info_unref);
+  self->method_plans = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, method_plan_free);
+  self->batch_props = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_hash_table_unref);
+  self->buffer = g_string_sized_new (4096);
 }
 
 static gboolean
@@ -1471,10 +1870,12 @@ cockpit_dbus_json_constructed (GObject *object)
   const gchar *dbus_service;
   const gchar *dbus_path;
   const gchar *bus;
-  const gchar *new_prop_name;
-  GType object_manager_type;
-  gconstpointer new_prop_value;
+  gint64 batch_window;
+  const gchar **dbus_paths = NULL;
+  const gchar **interfaces;
+  const gchar *path_prefix;
   GBusType bus_type;
+  gint i;
 
   G_OBJECT_CLASS (cockpit_dbus_json_parent_class)->constructed (object);
 
@@ -1492,12 +1893,52 @@ cockpit_dbus_json_constructed (GObject *object)
       return;
     }
 
+  self->property_deltas = cockpit_channel_get_bool_option (channel, "property-deltas");
+  self->chunked_seed = cockpit_channel_get_bool_option (channel, "chunked-seed");
+
+  batch_window = cockpit_channel_get_int_option (channel, "batch-window");
+  if (batch_window == G_MAXINT64)
+    batch_window = 0;
+  if (batch_window < 0 || batch_window > MAX_BATCH_WINDOW)
+    {
+      g_warning ("bridge got invalid batch-window");
+      protocol_error_later (self);
+      return;
+    }
+  self->batch_window = batch_window;
+
+  path_prefix = cockpit_channel_get_option (channel, "path-prefix");
+  if (path_prefix != NULL)
+    {
+      if (!g_variant_is_object_path (path_prefix))
+        {
+          g_warning ("bridge got invalid path-prefix");
+          protocol_error_later (self);
+          return;
+        }
+      self->path_prefix = g_strdup (path_prefix);
+    }
+
+  interfaces = cockpit_channel_get_strv_option (channel, "interfaces");
+  if (interfaces != NULL)
+    {
+      self->interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      for (i = 0; interfaces[i] != NULL; i++)
+        {
+          if (!g_dbus_is_interface_name (interfaces[i]))
+            {
+              g_warning ("bridge got invalid interface in interfaces");
+              protocol_error_later (self);
+              return;
+            }
+          g_hash_table_add (self->interfaces, g_strdup (interfaces[i]));
+        }
+    }
+
   dbus_path = cockpit_channel_get_option (channel, "object-manager");
   if (dbus_path == NULL)
     {
-      new_prop_value = cockpit_channel_get_strv_option (channel, "object-paths");
-      new_prop_name = "object-paths";
-      object_manager_type = COCKPIT_TYPE_FAKE_MANAGER;
+      dbus_paths = cockpit_channel_get_strv_option (channel, "object-paths");
     }
   else if (!g_variant_is_object_path (dbus_path))
     {
@@ -1505,12 +1946,6 @@ cockpit_dbus_json_constructed (GObject *object)
       protocol_error_later (self);
       return;
     }
-  else
-    {
-      new_prop_value = dbus_path;
-      new_prop_name = "object-path";
-      object_manager_type = G_TYPE_DBUS_OBJECT_MANAGER_CLIENT;
-    }
 
   /*
    * The default bus is the "user" bus which doesn't exist in many
@@ -1534,17 +1969,24 @@ cockpit_dbus_json_constructed (GObject *object)
       return;
     }
 
-  /* Both GDBusObjectManager and CockpitFakeManager have similar props */
-  g_async_initable_new_async (object_manager_type,
-                              G_PRIORITY_DEFAULT,
-                              self->cancellable,
-                              on_object_manager_ready,
-                              g_object_ref (self),
-                              "bus-type", bus_type,
-                              "flags", G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
-                              "name", dbus_service,
-                              new_prop_name, new_prop_value,
-                              NULL);
+  /* Shared with other channels watching the same service */
+  cockpit_dbus_manager_get_async (bus_type, dbus_service, dbus_path, dbus_paths,
+                                  on_object_manager_ready, g_object_ref (self));
+}
+
+static void
+cockpit_dbus_json_close (CockpitChannel *channel,
+                         const gchar *problem)
+{
+  CockpitDBusJson *self = COCKPIT_DBUS_JSON (channel);
+
+  /* Changes that were held back go out before a clean close */
+  if (problem)
+    drop_batch (self);
+  else
+    flush_batch (self);
+
+  COCKPIT_CHANNEL_CLASS (cockpit_dbus_json_parent_class)->close (channel, problem);
 }
 
 static void
@@ -1577,6 +2019,8 @@ cockpit_dbus_json_dispose (GObject *object)
       g_object_unref (connection);
     }
 
+  drop_batch (self);
+
   /* Divorce ourselves the outstanding calls */
   for (l = self->active_calls; l != NULL; l = g_list_next (l))
     ((CallData *)l->data)->dbus_json = NULL;
@@ -1598,6 +2042,12 @@ cockpit_dbus_json_finalize (GObject *object)
     g_object_unref (self->object_manager);
   g_object_unref (self->cancellable);
   g_hash_table_destroy (self->introspect_cache);
+  g_hash_table_destroy (self->method_plans);
+  g_hash_table_destroy (self->batch_props);
+  if (self->interfaces)
+    g_hash_table_destroy (self->interfaces);
+  g_free (self->path_prefix);
+  g_string_free (self->buffer, TRUE);
 
   G_OBJECT_CLASS (cockpit_dbus_json_parent_class)->finalize (object);
 }
@@ -1613,6 +2063,7 @@ cockpit_dbus_json_class_init (CockpitDBusJsonClass *klass)
   gobject_class->finalize = cockpit_dbus_json_finalize;
 
   channel_class->recv = cockpit_dbus_json_recv;
+  channel_class->close = cockpit_dbus_json_close;
 }
 
 /**
@@ -35,4 +35,7 @@ CockpitChannel *   cockpit_dbus_json_open       (CockpitTransport *transport,
                                                  const gchar *dbus_service,
                                                  const gchar *dbus_path);
 
+void               cockpit_dbus_json_write_variant (GString *out,
+                                                    GVariant *value);
+
 #endif /* COCKPIT_DBUS_JSON_H__ */
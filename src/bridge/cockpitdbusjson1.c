@@ -22,7 +22,7 @@
 #include "cockpitdbusjson1.h"
 
 #include "cockpitchannel.h"
-#include "cockpitfakemanager.h"
+#include "cockpitdbusmanager.h"
 
 #include "common/cockpitjson.h"
 
@@ -1080,11 +1080,9 @@ on_object_manager_ready (GObject *source,
 {
   CockpitDBusJson1 *self = user_data;
   CockpitChannel *channel = COCKPIT_CHANNEL (self);
-  GAsyncInitable *initable;
   GError *error = NULL;
 
-  initable = G_ASYNC_INITABLE (source);
-  self->object_manager = G_DBUS_OBJECT_MANAGER (g_async_initable_new_finish (initable, result, &error));
+  self->object_manager = cockpit_dbus_manager_get_finish (result, &error);
 
   if (self->object_manager == NULL)
     {
@@ -1148,9 +1146,7 @@ cockpit_dbus_json1_constructed (GObject *object)
   const gchar *dbus_service;
   const gchar *dbus_path;
   const gchar *bus;
-  const gchar *new_prop_name;
-  GType object_manager_type;
-  gconstpointer new_prop_value;
+  const gchar **dbus_paths = NULL;
   GBusType bus_type;
 
   G_OBJECT_CLASS (cockpit_dbus_json1_parent_class)->constructed (object);
@@ -1172,9 +1168,7 @@ cockpit_dbus_json1_constructed (GObject *object)
   dbus_path = cockpit_channel_get_option (channel, "object-manager");
   if (dbus_path == NULL)
     {
-      new_prop_value = cockpit_channel_get_strv_option (channel, "paths");
-      new_prop_name = "object-paths";
-      object_manager_type = COCKPIT_TYPE_FAKE_MANAGER;
+      dbus_paths = cockpit_channel_get_strv_option (channel, "paths");
     }
   else if (!g_variant_is_object_path (dbus_path))
     {
@@ -1182,12 +1176,6 @@ cockpit_dbus_json1_constructed (GObject *object)
       g_idle_add (on_idle_protocol_error, channel);
       return;
     }
-  else
-    {
-      new_prop_value = dbus_path;
-      new_prop_name = "object-path";
-      object_manager_type = G_TYPE_DBUS_OBJECT_MANAGER_CLIENT;
-    }
 
   /*
    * The default bus is the "user" bus which doesn't exist in many
@@ -1211,16 +1199,9 @@ cockpit_dbus_json1_constructed (GObject *object)
       return;
     }
 
-  /* Both GDBusObjectManager and CockpitFakeManager have similar props */
-  g_async_initable_new_async (object_manager_type,
-                              G_PRIORITY_DEFAULT, NULL,
-                              on_object_manager_ready,
-                              g_object_ref (self),
-                              "bus-type", bus_type,
-                              "flags", G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
-                              "name", dbus_service,
-                              new_prop_name, new_prop_value,
-                              NULL);
+  /* Shared with other channels watching the same service */
+  cockpit_dbus_manager_get_async (bus_type, dbus_service, dbus_path, dbus_paths,
+                                  on_object_manager_ready, g_object_ref (self));
 }
 
 static void
@@ -0,0 +1,267 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusmanager.h"
+
+#include "cockpitfakemanager.h"
+
+/*
+ * Object managers shared between all the DBus channels watching the
+ * same thing. An object manager keeps proxies and properties for all
+ * the objects of a service, and match rules on the bus, so there's no
+ * point in having one of those per channel.
+ *
+ * Managers are shared by bus, name and object manager path, or the list
+ * of paths for a CockpitFakeManager. They only get shared within one
+ * main context, since that's where their signals are emitted.
+ *
+ * Callers hold references to the managers. We only keep a weak
+ * reference, and forget about a manager when the last caller lets go.
+ */
+
+typedef struct {
+  gchar *key;
+
+  /* Not owned, a weak reference once ready */
+  GDBusObjectManager *manager;
+
+  /* GSimpleAsyncResult waiting while the manager initializes */
+  GPtrArray *waiting;
+} SharedManager;
+
+G_LOCK_DEFINE_STATIC (managers);
+
+/* key -> SharedManager */
+static GHashTable *managers = NULL;
+
+static void
+shared_manager_free (gpointer data)
+{
+  SharedManager *shared = data;
+  g_assert (shared->waiting == NULL);
+  g_free (shared->key);
+  g_free (shared);
+}
+
+static gchar *
+build_key (GBusType bus_type,
+           const gchar *name,
+           const gchar *object_path,
+           const gchar **object_paths)
+{
+  GString *key;
+  guint i;
+
+  key = g_string_new ("");
+  g_string_append_printf (key, "%p\n%d\n%s\n", g_main_context_get_thread_default (),
+                          (gint)bus_type, name);
+
+  if (object_path)
+    {
+      g_string_append (key, object_path);
+    }
+  else
+    {
+      /* Fake managers, object_paths is a list */
+      g_string_append_c (key, '\n');
+      for (i = 0; object_paths && object_paths[i] != NULL; i++)
+        {
+          g_string_append (key, object_paths[i]);
+          g_string_append_c (key, '\n');
+        }
+    }
+
+  return g_string_free (key, FALSE);
+}
+
+static void
+on_manager_finalized (gpointer user_data,
+                      GObject *where_the_object_was)
+{
+  SharedManager *shared = user_data;
+
+  G_LOCK (managers);
+  g_hash_table_remove (managers, shared->key);
+  G_UNLOCK (managers);
+}
+
+static void
+on_manager_ready (GObject *source,
+                  GAsyncResult *result,
+                  gpointer user_data)
+{
+  SharedManager *shared = user_data;
+  GSimpleAsyncResult *async;
+  GDBusObjectManager *manager;
+  GError *error = NULL;
+  GPtrArray *waiting;
+  guint i;
+
+  manager = G_DBUS_OBJECT_MANAGER (g_async_initable_new_finish (G_ASYNC_INITABLE (source),
+                                                                result, &error));
+
+  G_LOCK (managers);
+  waiting = shared->waiting;
+  shared->waiting = NULL;
+  if (manager)
+    {
+      shared->manager = manager;
+      g_object_weak_ref (G_OBJECT (manager), on_manager_finalized, shared);
+    }
+  else
+    {
+      /* Frees shared */
+      g_hash_table_remove (managers, shared->key);
+    }
+  G_UNLOCK (managers);
+
+  for (i = 0; i < waiting->len; i++)
+    {
+      async = waiting->pdata[i];
+      if (manager)
+        g_simple_async_result_set_op_res_gpointer (async, g_object_ref (manager), g_object_unref);
+      else
+        g_simple_async_result_set_from_error (async, error);
+      g_simple_async_result_complete (async);
+    }
+
+  g_ptr_array_free (waiting, TRUE);
+  g_clear_error (&error);
+
+  /* The callers now hold the references */
+  if (manager)
+    g_object_unref (manager);
+}
+
+/**
+ * cockpit_dbus_manager_get_async:
+ * @bus_type: the bus to use
+ * @name: the bus name of the service
+ * @object_path: (allow-none): path of the service's object manager
+ * @object_paths: (allow-none): paths to watch when @object_path is %NULL
+ * @callback: called when the manager is ready
+ * @user_data: data for @callback
+ *
+ * Get an object manager for a service. If there's no object manager
+ * path then a #CockpitFakeManager watches @object_paths instead.
+ *
+ * When someone else in this main context is already using a manager
+ * for the same thing, that one is returned, with all the objects it
+ * already knows about.
+ */
+void
+cockpit_dbus_manager_get_async (GBusType bus_type,
+                                const gchar *name,
+                                const gchar *object_path,
+                                const gchar **object_paths,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+  GSimpleAsyncResult *async;
+  SharedManager *shared;
+  gchar *key;
+
+  g_return_if_fail (name != NULL);
+
+  async = g_simple_async_result_new (NULL, callback, user_data, cockpit_dbus_manager_get_async);
+  key = build_key (bus_type, name, object_path, object_paths);
+
+  G_LOCK (managers);
+
+  if (managers == NULL)
+    managers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, shared_manager_free);
+
+  shared = g_hash_table_lookup (managers, key);
+  if (shared)
+    {
+      if (shared->manager)
+        {
+          g_debug ("sharing object manager for %s", name);
+          g_simple_async_result_set_op_res_gpointer (async, g_object_ref (shared->manager),
+                                                     g_object_unref);
+          g_simple_async_result_complete_in_idle (async);
+        }
+      else
+        {
+          g_ptr_array_add (shared->waiting, g_object_ref (async));
+        }
+
+      G_UNLOCK (managers);
+      g_object_unref (async);
+      g_free (key);
+      return;
+    }
+
+  shared = g_new0 (SharedManager, 1);
+  shared->key = key;
+  shared->waiting = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (shared->waiting, async);
+  g_hash_table_insert (managers, shared->key, shared);
+
+  G_UNLOCK (managers);
+
+  /* Both GDBusObjectManager and CockpitFakeManager have similar props */
+  if (object_path)
+    {
+      g_async_initable_new_async (G_TYPE_DBUS_OBJECT_MANAGER_CLIENT,
+                                  G_PRIORITY_DEFAULT, NULL,
+                                  on_manager_ready, shared,
+                                  "bus-type", bus_type,
+                                  "flags", G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
+                                  "name", name,
+                                  "object-path", object_path,
+                                  NULL);
+    }
+  else
+    {
+      g_async_initable_new_async (COCKPIT_TYPE_FAKE_MANAGER,
+                                  G_PRIORITY_DEFAULT, NULL,
+                                  on_manager_ready, shared,
+                                  "bus-type", bus_type,
+                                  "flags", G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
+                                  "name", name,
+                                  "object-paths", object_paths,
+                                  NULL);
+    }
+}
+
+/**
+ * cockpit_dbus_manager_get_finish:
+ * @result: the result passed to the callback
+ * @error: location to place an error
+ *
+ * Returns: (transfer full): the object manager, or %NULL with @error set
+ */
+GDBusObjectManager *
+cockpit_dbus_manager_get_finish (GAsyncResult *result,
+                                 GError **error)
+{
+  GSimpleAsyncResult *async;
+
+  g_return_val_if_fail (g_simple_async_result_is_valid (result, NULL,
+                        cockpit_dbus_manager_get_async), NULL);
+
+  async = G_SIMPLE_ASYNC_RESULT (result);
+  if (g_simple_async_result_propagate_error (async, error))
+    return NULL;
+
+  return g_object_ref (g_simple_async_result_get_op_res_gpointer (async));
+}
@@ -21,6 +21,8 @@
 
 #include "cockpitfakemanager.h"
 
+#include <string.h>
+
 /*
  * MT: This is not thread safe at all. It doesn't need to be for
  * running in cockpit-bridge
@@ -30,6 +32,9 @@
  * notion of "generations".
  */
 
+/* Most Introspect calls we have waiting on a service at once */
+#define MAX_INTROSPECT_IN_FLIGHT 16
+
 #define COCKPIT_TYPE_OBJECT_PROXY         (cockpit_object_proxy_get_type ())
 #define COCKPIT_OBJECT_PROXY(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_OBJECT_PROXY, CockpitObjectProxy))
 #define COCKPIT_IS_OBJECT_PROXY(k)        (G_TYPE_CHECK_INSTANCE_TYPE ((k), COCKPIT_TYPE_OBJECT_PROXY))
@@ -68,6 +73,8 @@ struct _CockpitFakeManager {
   GDBusConnection *connection;
   GSimpleAsyncResult *initializing;
   GHashTable *poking;
+  GQueue introspect_queue;
+  guint introspecting;
   GCancellable *cancellable;
   GHashTable *path_to_object;
 };
@@ -115,6 +122,7 @@ cockpit_fake_manager_init (CockpitFakeManager *self)
 {
   self->path_to_object = path_to_object_new_table ();
   self->poking = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&self->introspect_queue);
   self->cancellable = g_cancellable_new ();
 }
 
@@ -194,6 +202,9 @@ manager_remove_all (CockpitFakeManager *self)
   g_hash_table_destroy (path_to_object);
 }
 
+static void
+poke_dispatch (CockpitFakeManager *self);
+
 static void
 on_bus_name_appeared (GDBusConnection *connection,
                       const gchar *name,
@@ -252,6 +263,9 @@ on_bus_name_vanished (GDBusConnection *connection,
       self->cancellable = NULL;
     }
 
+  /* Finishes any pokes that haven't been sent yet */
+  poke_dispatch (self);
+
   manager_remove_all (self);
 
   g_object_notify (G_OBJECT (self), "connection");
@@ -353,6 +367,9 @@ cockpit_fake_manager_dispose (GObject *object)
   if (self->cancellable)
     g_cancellable_cancel (self->cancellable);
 
+  /* Finishes any pokes that haven't been sent yet */
+  poke_dispatch (self);
+
   maybe_complete_async_init (self);
 
   G_OBJECT_CLASS (cockpit_fake_manager_parent_class)->dispose (object);
@@ -368,6 +385,7 @@ cockpit_fake_manager_finalize (GObject *object)
 
   /* Each of these guys hold references to us, so must be empty */
   g_assert (g_hash_table_size (self->poking) == 0);
+  g_assert (g_queue_is_empty (&self->introspect_queue));
   g_hash_table_destroy (self->poking);
 
   /* The last poking guy should have completed async init */
@@ -677,6 +695,8 @@ typedef struct {
   GList *added;
   GList *removed;
   gint outstanding;
+  gboolean sent;
+  gboolean again;
 } PokeContext;
 
 static PokeContext *
@@ -708,6 +728,11 @@ poke_context_finish (CockpitFakeManager *self,
   g_debug ("fakemanager: poked: %s", poke->object_path);
 
   g_hash_table_remove (self->poking, poke->object_path);
+
+  /* Poked again while we were looking, so take another look */
+  if (poke->again && self->cancellable && !g_cancellable_is_cancelled (self->cancellable))
+    cockpit_fake_manager_poke (self, poke->object_path);
+
   maybe_complete_async_init (self);
 
   g_object_unref (poke->manager);
@@ -755,16 +780,44 @@ process_introspect_node (CockpitFakeManager *self,
                          PokeContext *poke,
                          GDBusNodeInfo *node);
 
+static gboolean
+is_direct_child (const gchar *object_path,
+                 const gchar *child_path)
+{
+  gsize len;
+
+  if (g_str_equal (object_path, "/"))
+    {
+      len = 0;
+    }
+  else
+    {
+      len = strlen (object_path);
+      if (strncmp (child_path, object_path, len) != 0)
+        return FALSE;
+    }
+
+  return child_path[len] == '/' && child_path[len + 1] != '\0' &&
+         strchr (child_path + len + 1, '/') == NULL;
+}
+
 static void
 process_introspect_children (CockpitFakeManager *self,
                              const gchar *object_path,
                              GDBusNodeInfo *node)
 {
   GDBusNodeInfo *child;
+  GHashTable *listed;
+  GHashTableIter iter;
+  const gchar *path;
   gchar *child_path;
   PokeContext *poke;
+  GList *gone = NULL;
+  GList *l;
   int i;
 
+  listed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
   /* Poke any additional child nodes discovered */
   for (i = 0; node->nodes && node->nodes[i]; i++)
     {
@@ -782,20 +835,42 @@ process_introspect_children (CockpitFakeManager *self,
       else
         child_path = g_strdup_printf ("%s/%s", object_path, child->path);
 
-      /* If the child has no interfaces, then poke it all over again */
-      if (!child->interfaces || !child->interfaces[0])
-        {
-          cockpit_fake_manager_poke (self, child_path);
-          g_free (child_path);
-        }
-      else
+      g_hash_table_add (listed, child_path);
+
+      /* If the child has interfaces, we already have everything */
+      if (child->interfaces && child->interfaces[0])
         {
           poke = poke_context_start (self, child_path);
           if (poke != NULL)
-            process_introspect_node (self, poke, child);
-          g_free (child_path);
+            {
+              poke->sent = TRUE;
+              process_introspect_node (self, poke, child);
+            }
+        }
+
+      /*
+       * Children we already know about get poked themselves when they
+       * change, so only go looking at new ones here.
+       */
+      else if (!g_hash_table_lookup (self->path_to_object, child_path))
+        {
+          cockpit_fake_manager_poke (self, child_path);
         }
     }
+
+  /* Known children that are no longer listed have probably gone away */
+  g_hash_table_iter_init (&iter, self->path_to_object);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&path, NULL))
+    {
+      if (!g_hash_table_contains (listed, path) && is_direct_child (object_path, path))
+        gone = g_list_prepend (gone, g_strdup (path));
+    }
+
+  for (l = gone; l != NULL; l = g_list_next (l))
+    cockpit_fake_manager_poke (self, l->data);
+
+  g_list_free_full (gone, g_free);
+  g_hash_table_destroy (listed);
 }
 
 static void
@@ -895,6 +970,48 @@ process_introspect_node (CockpitFakeManager *self,
     poke_apply_changes_and_finish (self, poke);
 }
 
+static void
+on_poke_introspected (GObject *source_object,
+                      GAsyncResult *result,
+                      gpointer user_data);
+
+/*
+ * Services don't take kindly to thousands of Introspect calls at once,
+ * and all those replies at once just sit in our queue. So only have a
+ * limited number of them in flight, and send the rest as those return.
+ */
+static void
+poke_dispatch (CockpitFakeManager *self)
+{
+  PokeContext *poke;
+
+  g_object_ref (self);
+
+  while (self->introspecting < MAX_INTROSPECT_IN_FLIGHT)
+    {
+      poke = g_queue_pop_head (&self->introspect_queue);
+      if (!poke)
+        break;
+
+      /* Bail fast if cancelled */
+      if (!self->cancellable || g_cancellable_is_cancelled (self->cancellable))
+        {
+          poke_context_finish (self, poke);
+          continue;
+        }
+
+      poke->sent = TRUE;
+      self->introspecting++;
+      g_dbus_connection_call (self->connection, self->bus_name, poke->object_path,
+                              "org.freedesktop.DBus.Introspectable", "Introspect",
+                              NULL, G_VARIANT_TYPE ("(s)"),
+                              G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, /* timeout */
+                              self->cancellable, on_poke_introspected, poke);
+    }
+
+  g_object_unref (self);
+}
+
 static void
 on_poke_introspected (GObject *source_object,
                       GAsyncResult *result,
@@ -909,7 +1026,12 @@ on_poke_introspected (GObject *source_object,
   GVariant *retval;
   gchar *remote;
 
-  retval = g_dbus_connection_call_finish (self->connection, result, &error);
+  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+
+  /* Make room for the next one */
+  g_assert (self->introspecting > 0);
+  self->introspecting--;
+  poke_dispatch (self);
 
   /* Bail fast if cancelled */
   if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
@@ -976,6 +1098,10 @@ on_poke_introspected (GObject *source_object,
  *
  * If it exists, add any new interfaces to this object manager.
  * Otherwise, remove the object from the object manager.
+ *
+ * Poking a path that is already being poked doesn't cause another
+ * Introspect call, unless the first one was already sent, in which
+ * case the path is looked at again once it completes.
  */
 void
 cockpit_fake_manager_poke (CockpitFakeManager *self,
@@ -986,15 +1112,17 @@ cockpit_fake_manager_poke (CockpitFakeManager *self,
   g_return_if_fail (COCKPIT_IS_FAKE_MANAGER (self));
   g_return_if_fail (g_variant_is_object_path (object_path));
 
-  if (g_hash_table_lookup (self->poking, object_path))
-    return;
+  poke = g_hash_table_lookup (self->poking, object_path);
+  if (poke)
+    {
+      if (poke->sent)
+        poke->again = TRUE;
+      return;
+    }
 
   poke = poke_context_start (self, object_path);
-  g_dbus_connection_call (self->connection, self->bus_name, object_path,
-                          "org.freedesktop.DBus.Introspectable", "Introspect",
-                          NULL, G_VARIANT_TYPE ("(s)"),
-                          G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, /* timeout */
-                          self->cancellable, on_poke_introspected, poke);
+  g_queue_push_tail (&self->introspect_queue, poke);
+  poke_dispatch (self);
 }
 
 /**
@@ -597,6 +597,17 @@ cockpit_package_listing (JsonArray **json)
   return listing;
 }
 
+const gchar *
+cockpit_package_checksum (GHashTable *listing,
+                          const gchar *package)
+{
+  CockpitPackage *mod;
+
+  /* Packages without a checksum can change at any time */
+  mod = g_hash_table_lookup (listing, package);
+  return mod ? mod->checksum : NULL;
+}
+
 gchar *
 cockpit_package_resolve (GHashTable *listing,
                          const gchar *package,
@@ -30,6 +30,9 @@ gchar *           cockpit_package_resolve            (GHashTable *mapping,
                                                       const gchar *package,
                                                       const gchar *path);
 
+const gchar *     cockpit_package_checksum           (GHashTable *mapping,
+                                                      const gchar *package);
+
 void              cockpit_package_expand             (GHashTable *mapping,
                                                       const gchar *host,
                                                       GBytes *input,
@@ -216,7 +216,7 @@ cockpit_polkit_agent_finalize (GObject *object)
 
 static void
 on_helper_read (CockpitPipe *pipe,
-                GByteArray *buffer,
+                CockpitPipeBuffer *buffer,
                 gboolean eof,
                 gpointer user_data)
 {
@@ -39,6 +39,9 @@
 
 #define COCKPIT_RESOURCE(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_RESOURCE, CockpitResource))
 
+/* Default bytes of expanded resources to keep around */
+#define RESOURCE_CACHE_SIZE (8 * 1024 * 1024)
+
 typedef struct {
   CockpitChannel parent;
   GQueue *queue;
@@ -102,6 +105,130 @@ cockpit_resource_init (CockpitResource *self)
 
 }
 
+/*
+ * Expanded resources are cached for all the channels in the bridge, so
+ * that popular files aren't expanded again for every tab and reload.
+ * Only resources from packages with a checksum are cached, as the
+ * checksum changes along with their contents.
+ */
+
+typedef struct {
+  gchar *key;
+  GPtrArray *blocks;
+  gsize size;
+  GList *link;
+} CachedResource;
+
+/* key -> CachedResource */
+static GHashTable *resource_cache = NULL;
+
+/* Most recently used at the head */
+static GQueue resource_lru = G_QUEUE_INIT;
+
+static gsize resource_cache_size = 0;
+static gsize resource_cache_max = RESOURCE_CACHE_SIZE;
+
+static void
+cached_resource_free (gpointer data)
+{
+  CachedResource *cached = data;
+  resource_cache_size -= cached->size;
+  g_queue_delete_link (&resource_lru, cached->link);
+  g_ptr_array_free (cached->blocks, TRUE);
+  g_free (cached->key);
+  g_free (cached);
+}
+
+static void
+resource_cache_trim (gsize max)
+{
+  CachedResource *cached;
+
+  while (resource_cache_size > max)
+    {
+      cached = g_queue_peek_tail (&resource_lru);
+      g_hash_table_remove (resource_cache, cached->key);
+    }
+}
+
+static GQueue *
+resource_cache_lookup (const gchar *key)
+{
+  CachedResource *cached;
+  GQueue *queue;
+  guint i;
+
+  if (!resource_cache)
+    return NULL;
+
+  cached = g_hash_table_lookup (resource_cache, key);
+  if (!cached)
+    return NULL;
+
+  g_queue_unlink (&resource_lru, cached->link);
+  g_queue_push_head_link (&resource_lru, cached->link);
+
+  queue = g_queue_new ();
+  for (i = 0; i < cached->blocks->len; i++)
+    g_queue_push_tail (queue, g_bytes_ref (cached->blocks->pdata[i]));
+  return queue;
+}
+
+static void
+resource_cache_insert (const gchar *key,
+                       GQueue *queue)
+{
+  CachedResource *cached;
+  GBytes *block;
+  GList *l;
+  gsize size = 0;
+
+  for (l = queue->head; l != NULL; l = g_list_next (l))
+    size += g_bytes_get_size (l->data);
+  if (resource_cache_max == 0 || size > resource_cache_max)
+    return;
+
+  if (!resource_cache)
+    resource_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cached_resource_free);
+
+  /* Replace an older copy of this one */
+  g_hash_table_remove (resource_cache, key);
+  resource_cache_trim (resource_cache_max - size);
+
+  /* Copy the blocks, they may point into a mapped file which could change */
+  cached = g_new0 (CachedResource, 1);
+  cached->key = g_strdup (key);
+  cached->blocks = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  for (l = queue->head; l != NULL; l = g_list_next (l))
+    {
+      block = l->data;
+      g_ptr_array_add (cached->blocks, g_bytes_new (g_bytes_get_data (block, NULL),
+                                                    g_bytes_get_size (block)));
+    }
+  cached->size = size;
+
+  g_queue_push_head (&resource_lru, cached);
+  cached->link = resource_lru.head;
+  resource_cache_size += size;
+  g_hash_table_insert (resource_cache, cached->key, cached);
+}
+
+/**
+ * cockpit_resource_set_cache_size:
+ * @size: the most bytes of expanded resources to cache
+ *
+ * Set how much memory may be used to cache expanded resources
+ * between resource channels. A size of zero disables the cache.
+ * Least recently used resources are dropped when over the limit.
+ */
+void
+cockpit_resource_set_cache_size (gsize size)
+{
+  resource_cache_max = size;
+  if (resource_cache)
+    resource_cache_trim (size);
+}
+
 static GHashTable *
 load_package_listing (JsonArray **json)
 {
@@ -207,6 +334,8 @@ on_prepare_channel (gpointer data)
   gchar *alternate = NULL;
   GMappedFile *mapped = NULL;
   gchar *string = NULL;
+  const gchar *checksum;
+  gchar *key = NULL;
   const gchar *pos;
   GBytes *bytes;
   gboolean retry;
@@ -253,6 +382,19 @@ on_prepare_channel (gpointer data)
       goto out;
     }
 
+  checksum = cockpit_package_checksum (listing, package);
+  if (checksum)
+    {
+      key = g_strdup_printf ("%s\n%s\n%s\n%s", checksum, path,
+                             accept ? accept : "", host ? host : "");
+      self->queue = resource_cache_lookup (key);
+      if (self->queue)
+        {
+          g_debug ("%s: serving expanded resource from cache", path);
+          goto ready;
+        }
+    }
+
   retry = TRUE;
   if (accept && g_str_equal (accept, "minified"))
     {
@@ -276,6 +418,10 @@ on_prepare_channel (gpointer data)
   cockpit_package_expand (listing, host, bytes, self->queue);
   g_bytes_unref (bytes);
 
+  if (key)
+    resource_cache_insert (key, self->queue);
+
+ready:
   self->idler = g_idle_add (on_idle_send_block, self);
   cockpit_channel_ready (channel);
 
@@ -285,6 +431,7 @@ out:
   if (listing)
     g_hash_table_unref (listing);
   g_free (string);
+  g_free (key);
   g_clear_error (&error);
   g_free (filename);
   g_free (alternate);
@@ -36,4 +36,6 @@ CockpitChannel *   cockpit_resource_open         (CockpitTransport *transport,
                                                   const gchar *path,
                                                   const gchar *accept);
 
+void               cockpit_resource_set_cache_size (gsize size);
+
 #endif /* COCKPIT_RESOURCE_H__ */
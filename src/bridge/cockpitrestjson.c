@@ -41,6 +41,24 @@
 
 #define COCKPIT_REST_JSON(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_REST_JSON, CockpitRestJson))
 
+/* Most idle keep-alive connections kept around for later requests */
+#define MAX_IDLE_CONNECTIONS 8
+
+/* Seconds after which an idle connection is closed */
+#define IDLE_TIMEOUT 15
+
+/* Most requests waiting on one connection when pipelining */
+#define MAX_PIPELINE_DEPTH 4
+
+/* States while decoding a chunked response body */
+enum {
+  CHUNK_SIZE,
+  CHUNK_DATA,
+  CHUNK_END,
+  CHUNK_TRAILER,
+  CHUNK_DONE
+};
+
 typedef struct _CockpitRestJson {
   CockpitChannel parent;
 
@@ -50,6 +68,9 @@ typedef struct _CockpitRestJson {
   /* The nickname for debugging and logging */
   gchar *name;
 
+  /* Value of the Host header in requests */
+  gchar *host;
+
   /*
    * A table of gint64 cookie -> CockpitRestRequest.
    *
@@ -66,22 +87,24 @@ typedef struct _CockpitRestJson {
   GHashTable *requests;
 
   /*
-   * A table of CockpitPipe* -> CockpitRestResponse.
+   * A table of CockpitPipe* -> CockpitRestConnection.
    *
-   * Stuff in this table is waiting for data on the given pipe.
+   * All the connections to the server, both those waiting for
+   * responses and idle ones.
    *
-   * CockpitRestResponse structs are owned by this hashtable.
-   * CockpitPipe objects are also owned by this hashtable, with
-   * the exception of the inactive CockpitPipe.
+   * CockpitRestConnection structs are owned by this hashtable,
+   * and they own their CockpitPipe.
    */
-  GHashTable *responses;
+  GHashTable *connections;
 
   /*
-   * If the server supported keep-alive, then we keep one pipe
-   * inactively cached around here for efficiency.
+   * Keep-alive connections with nothing to do, the most recently
+   * used at the tail. Also in the connections table above.
    */
-  CockpitPipe *inactive;
-  guint inactive_close;
+  GQueue idle;
+
+  /* Whether to send requests on connections that are still busy */
+  gboolean pipeline;
 
   /*
    * A table of gint64 -> GArray(gint64)
@@ -108,6 +131,7 @@ G_DEFINE_TYPE (CockpitRestJson, cockpit_rest_json, COCKPIT_TYPE_CHANNEL);
 typedef struct _CockpitRestRequest CockpitRestRequest;
 typedef struct _CockpitRestResponse CockpitRestResponse;
 typedef struct _CockpitRestPoll CockpitRestPoll;
+typedef struct _CockpitRestConnection CockpitRestConnection;
 
 struct _CockpitRestRequest {
   /* The cookie for the request, and key into requests table */
@@ -116,7 +140,10 @@ struct _CockpitRestRequest {
   /* Debugging label for the request */
   gchar *label;
 
-  /* An active response for this req, owned by responses table */
+  /* The HTTP method */
+  gchar *method;
+
+  /* An active response for this req, owned by its connection */
   CockpitRestResponse *resp;
 
   /* Weak reference back to channel (ie: self) */
@@ -142,19 +169,43 @@ struct _CockpitRestPoll {
 
   /* An other cookie being watched */
   gint64 watching;
+
+  /* Send changes as JSON patches against last */
+  gboolean patch;
 };
 
-struct _CockpitRestResponse {
+struct _CockpitRestConnection {
+  /* Weak ref to the channel */
+  CockpitRestJson *channel;
+
   /* The pipe we're talking on */
   CockpitPipe *pipe;
   guint sig_read;
   guint sig_close;
 
+  /* Responses expected on this pipe, in the order requests were sent */
+  GQueue responses;
+
+  /* Whether the server keeps the connection open after a response */
+  gboolean keep_alive;
+
+  /* Whether a complete response has been received on this connection */
+  gboolean served;
+
+  /* Closes the connection after it's been idle a while */
+  guint idle_timeout;
+};
+
+struct _CockpitRestResponse {
+  /* The connection we're talking on, owned by connections table */
+  CockpitRestConnection *conn;
+
   /* Corresponding req, owned by requests table */
   CockpitRestRequest *req;
 
   /* Status and headers received so far */
   gboolean got_status;
+  gboolean http11;
   guint status;
   gchar *message;
   GString *failure;
@@ -164,6 +215,15 @@ struct _CockpitRestResponse {
   /* Whether body is valid for parsing */
   gboolean skip_body;
 
+  /* How far the next JSON block has been scanned */
+  CockpitJsonSkip scan;
+
+  /* Chunked body, and decoded data not yet parsed */
+  gboolean chunked;
+  gint chunk_state;
+  gsize chunk_remaining;
+  GByteArray *chunk_body;
+
   /* Whether sent a completed response on channel */
   gboolean incomplete;
 };
@@ -172,6 +232,10 @@ static void
 cockpit_rest_request_notify (CockpitRestJson *self,
                              CockpitRestRequest *req);
 
+static void
+cockpit_rest_request_send (CockpitRestJson *self,
+                           CockpitRestRequest *req);
+
 static void
 cockpit_rest_watch_add (CockpitRestJson *self,
                         guint64 watched,
@@ -256,23 +320,38 @@ cockpit_rest_response_destroy (gpointer data)
            resp->req ? resp->req->label : "?");
 #endif
 
-  if (resp->pipe)
-    {
-      g_signal_handler_disconnect (resp->pipe, resp->sig_read);
-      g_signal_handler_disconnect (resp->pipe, resp->sig_close);
-      cockpit_pipe_close (resp->pipe, NULL);
-      g_object_unref (resp->pipe);
-    }
   if (resp->headers)
     g_hash_table_unref (resp->headers);
   if (resp->req)
     resp->req->resp = NULL;
   if (resp->failure)
     g_string_free (resp->failure, TRUE);
+  if (resp->chunk_body)
+    g_byte_array_unref (resp->chunk_body);
   g_free (resp->message);
   g_free (resp);
 }
 
+static void
+cockpit_rest_connection_destroy (gpointer data)
+{
+  CockpitRestConnection *conn = data;
+
+  g_signal_handler_disconnect (conn->pipe, conn->sig_read);
+  g_signal_handler_disconnect (conn->pipe, conn->sig_close);
+  if (conn->idle_timeout)
+    g_source_remove (conn->idle_timeout);
+
+  /* Destroying a connection, also destroys any responses in progress */
+  while (!g_queue_is_empty (&conn->responses))
+    cockpit_rest_response_destroy (g_queue_pop_head (&conn->responses));
+
+  cockpit_pipe_pause_input (conn->pipe, FALSE);
+  cockpit_pipe_close (conn->pipe, NULL);
+  g_object_unref (conn->pipe);
+  g_free (conn);
+}
+
 static void
 cockpit_rest_poll_destroy (CockpitRestRequest *req)
 {
@@ -298,25 +377,69 @@ cockpit_rest_request_destroy (gpointer data)
 {
   CockpitRestRequest *req = data;
   CockpitRestJson *self = req->channel; /* weak ref */
+  CockpitRestResponse *resp = req->resp;
 
   g_debug ("%s: %s: request destroyed", self->name, req->label);
 
-  /* Destroying a request, also destroys any response in progress */
-  if (req->resp)
+  /*
+   * Destroying a request, also destroys any response in progress
+   * along with its connection. But when other requests are pipelined
+   * on the connection, the rest of the response is read and dropped.
+   */
+  if (resp)
     {
-      req->resp->req = NULL;
-      g_hash_table_remove (self->responses, req->resp->pipe);
+      resp->req = NULL;
+      req->resp = NULL;
+      if (g_queue_get_length (&resp->conn->responses) == 1)
+        g_hash_table_remove (self->connections, resp->conn->pipe);
+      else
+        resp->skip_body = TRUE;
     }
 
   if (req->poll)
     cockpit_rest_poll_destroy (req);
 
   g_free (req->label);
+  g_free (req->method);
   g_bytes_unref (req->headers);
   g_bytes_unref (req->body);
   g_free (req);
 }
 
+static gchar *
+cockpit_rest_poll_patch (CockpitRestPoll *poll,
+                         JsonNode *body,
+                         gsize body_length,
+                         gsize *length)
+{
+  JsonNode *patch;
+  gchar *data;
+
+  if (!poll->patch || !poll->last)
+    return NULL;
+
+  patch = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (patch, cockpit_json_diff (poll->last, body));
+  data = cockpit_json_write (patch, length);
+  json_node_free (patch);
+
+  /* Only worth it when smaller than sending everything again */
+  if (*length >= body_length)
+    {
+      g_free (data);
+      return NULL;
+    }
+
+  return data;
+}
+
+/* Only requests that are safe to repeat are pipelined or sent again */
+static gboolean
+request_is_idempotent (CockpitRestRequest *req)
+{
+  return g_str_equal (req->method, "GET") || g_str_equal (req->method, "HEAD");
+}
+
 static void
 cockpit_rest_response_reply (CockpitRestJson *self,
                              CockpitRestResponse *resp,
@@ -324,9 +447,15 @@ cockpit_rest_response_reply (CockpitRestJson *self,
                              gboolean complete)
 {
   CockpitRestRequest *req = resp->req;
+  const gchar *member = NULL;
+  gchar *payload = NULL;
+  gsize payload_length = 0;
+  gchar *patch = NULL;
+  gsize patch_length;
   JsonBuilder *builder;
   JsonNode *node;
-  gchar *data;
+  GString *data;
+  gchar *envelope;
   gsize length;
   GBytes *bytes;
 
@@ -354,8 +483,18 @@ cockpit_rest_response_reply (CockpitRestJson *self,
               return; /* no change, no reply */
             }
 
-          g_debug ("%s: %s: poll found changed data, sending",
-                   self->name, req->label);
+          /* The body is only written out once, whether sent or compared */
+          payload = cockpit_json_write (body, &payload_length);
+          patch = cockpit_rest_poll_patch (req->poll, body, payload_length, &patch_length);
+          if (patch)
+            {
+              g_free (payload);
+              payload = patch;
+              payload_length = patch_length;
+            }
+
+          g_debug ("%s: %s: poll found changed data, sending%s",
+                   self->name, req->label, patch ? " patch" : "");
           if (req->poll->last)
             json_node_free (req->poll->last);
           req->poll->last = json_node_copy (body);
@@ -394,19 +533,39 @@ cockpit_rest_response_reply (CockpitRestJson *self,
       json_builder_add_boolean_value (builder, TRUE);
       resp->incomplete = FALSE;
     }
-  if (body)
-    {
-      json_builder_set_member_name (builder, "body");
-      json_builder_add_value (builder, json_node_copy (body));
-    }
   json_builder_end_object (builder);
 
   node = json_builder_get_root (builder);
-  data = cockpit_json_write (node, &length);
+  envelope = cockpit_json_write (node, &length);
   json_node_free (node);
   g_object_unref (builder);
 
-  bytes = g_bytes_new_take (data, length);
+  if (patch)
+    member = "patch";
+  else if (body)
+    member = "body";
+
+  if (member && !payload)
+    payload = cockpit_json_write (body, &payload_length);
+
+  /*
+   * Splice the already written body or patch in as the last member,
+   * rather than copying it into the builder and writing it again.
+   */
+  g_assert (length > 0 && envelope[length - 1] == '}');
+  data = g_string_sized_new (length + payload_length + 16);
+  g_string_append_len (data, envelope, length - 1);
+  if (member)
+    {
+      g_string_append_printf (data, ",\"%s\":", member);
+      g_string_append_len (data, payload, payload_length);
+    }
+  g_string_append_c (data, '}');
+  g_free (envelope);
+  g_free (payload);
+
+  length = data->len;
+  bytes = g_bytes_new_take (g_string_free (data, FALSE), length);
   cockpit_channel_send (COCKPIT_CHANNEL (self), bytes);
   g_bytes_unref (bytes);
 }
@@ -431,13 +590,16 @@ cockpit_rest_response_parse (CockpitRestJson *self,
         return total;
 
       spaces = 0;
-      block = cockpit_json_skip (data, limit, &spaces);
+      block = cockpit_json_skip_next (&resp->scan, data, limit, &spaces);
 
       if (block == 0)
         {
           /* likely invalid JSON, catch below */
           if (end_of_data)
-            block = limit;
+            {
+              block = limit;
+              cockpit_json_skip_init (&resp->scan);
+            }
 
           /* need more data */
           else
@@ -455,7 +617,7 @@ cockpit_rest_response_parse (CockpitRestJson *self,
             {
               g_debug ("%s", error->message);
               g_message ("%s: %s: invalid JSON received in response to REST request",
-                         self->name, resp->req->label);
+                         self->name, response_label (resp));
               g_error_free (error);
               return -1;
             }
@@ -470,16 +632,31 @@ cockpit_rest_response_parse (CockpitRestJson *self,
     }
 }
 
+static const gchar *
+response_label (CockpitRestResponse *resp)
+{
+  /* Requests can be cancelled while pipelined responses are still coming */
+  return resp->req ? resp->req->label : "cancelled";
+}
+
 static gboolean
-parse_content_length (CockpitRestRequest *req,
-                      GHashTable *headers,
+parse_content_length (CockpitRestJson *self,
+                      CockpitRestResponse *resp,
                       gssize *length)
 {
   const gchar *header;
   guint64 value;
   gchar *end;
 
-  header = g_hash_table_lookup (headers, "Content-Length");
+  /* These never have a body */
+  if ((resp->status >= 100 && resp->status <= 199) ||
+      resp->status == 204 || resp->status == 304)
+    {
+      *length = 0;
+      return TRUE;
+    }
+
+  header = g_hash_table_lookup (resp->headers, "Content-Length");
   if (header == NULL)
     {
       *length = -1;
@@ -490,13 +667,13 @@ parse_content_length (CockpitRestRequest *req,
   if (end[0] != '\0')
     {
       g_message ("%s: %s: received invalid Content-Length in REST JSON response",
-                 req->channel->name, req->label);
+                 self->name, response_label (resp));
       return FALSE;
     }
   else if (value > G_MAXSSIZE)
     {
       g_message ("%s: %s: received Content-Length that was too big",
-                 req->channel->name, req->label);
+                 self->name, response_label (resp));
       return FALSE;
     }
 
@@ -504,10 +681,126 @@ parse_content_length (CockpitRestRequest *req,
   return TRUE;
 }
 
+static gboolean
+cockpit_rest_response_feed (CockpitRestJson *self,
+                            CockpitRestResponse *resp,
+                            const gchar *data,
+                            gsize length,
+                            gboolean end_of_data,
+                            guint *replies)
+{
+  gssize off;
+
+  if (resp->skip_body)
+    {
+      if (resp->failure && g_utf8_validate (data, length, NULL))
+        g_string_append_len (resp->failure, data, length);
+      return TRUE;
+    }
+
+  /* JSON documents can span chunks, so collect the decoded data */
+  if (!resp->chunk_body)
+    resp->chunk_body = g_byte_array_new ();
+  g_byte_array_append (resp->chunk_body, (const guint8 *)data, length);
+
+  off = cockpit_rest_response_parse (self, resp, (const gchar *)resp->chunk_body->data,
+                                     resp->chunk_body->len, end_of_data, replies);
+  if (off < 0)
+    return FALSE;
+
+  g_byte_array_remove_range (resp->chunk_body, 0, off);
+  return TRUE;
+}
+
+static gboolean
+cockpit_rest_response_dechunk (CockpitRestJson *self,
+                               CockpitRestResponse *resp,
+                               CockpitPipeBuffer *buffer,
+                               gsize *at,
+                               guint *replies)
+{
+  const gchar *data;
+  const gchar *end;
+  guint64 size;
+  gchar *ep;
+  gsize block;
+
+  while (resp->chunk_state != CHUNK_DONE)
+    {
+      data = (const gchar *)buffer->data + *at;
+      block = buffer->len - *at;
+
+      if (resp->chunk_state == CHUNK_DATA)
+        {
+          if (block == 0)
+            break;
+          if (block > resp->chunk_remaining)
+            block = resp->chunk_remaining;
+          if (!cockpit_rest_response_feed (self, resp, data, block, FALSE, replies))
+            return FALSE;
+          *at += block;
+          resp->chunk_remaining -= block;
+          if (resp->chunk_remaining == 0)
+            resp->chunk_state = CHUNK_END;
+          continue;
+        }
+
+      /* Everything else is a line */
+      end = memchr (data, '\n', block);
+      if (end == NULL)
+        break;
+      *at += (end - data) + 1;
+
+      if (resp->chunk_state == CHUNK_SIZE)
+        {
+          /* Chunk extensions after the size are ignored */
+          size = g_ascii_strtoull (data, &ep, 16);
+          if (ep == data || !g_ascii_isxdigit (data[0]) || size > G_MAXSSIZE ||
+              (*ep != ';' && *ep != ' ' && *ep != '\r' && *ep != '\n'))
+            {
+              g_message ("%s: %s: received invalid chunk in REST JSON response",
+                         self->name, response_label (resp));
+              return FALSE;
+            }
+          if (size == 0)
+            {
+              resp->chunk_state = CHUNK_TRAILER;
+            }
+          else
+            {
+              resp->chunk_remaining = size;
+              resp->chunk_state = CHUNK_DATA;
+            }
+        }
+      else if (resp->chunk_state == CHUNK_END)
+        {
+          if (end != data && (end - data != 1 || data[0] != '\r'))
+            {
+              g_message ("%s: %s: received invalid chunk in REST JSON response",
+                         self->name, response_label (resp));
+              return FALSE;
+            }
+          resp->chunk_state = CHUNK_SIZE;
+        }
+      else
+        {
+          /* Trailer headers are skipped, until a blank line */
+          if (end == data || (end - data == 1 && data[0] == '\r'))
+            {
+              resp->chunk_state = CHUNK_DONE;
+              if (!cockpit_rest_response_feed (self, resp, "", 0, TRUE, replies))
+                return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
 static gboolean
 cockpit_rest_response_process (CockpitRestJson *self,
                                CockpitRestResponse *resp,
-                               GByteArray *buffer,
+                               CockpitPipeBuffer *buffer,
                                gboolean end_of_data)
 {
   gboolean done = FALSE;
@@ -515,6 +808,7 @@ cockpit_rest_response_process (CockpitRestJson *self,
   gssize off;
   gsize at = 0;
   const gchar *type;
+  const gchar *encoding;
   const gchar *data;
   gsize block;
 
@@ -528,7 +822,7 @@ cockpit_rest_response_process (CockpitRestJson *self,
       if (off < 0)
         {
           g_message ("%s: %s received response with bad HTTP status line",
-                     self->name, resp->req->label);
+                     self->name, response_label (resp));
           cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
           goto out;
         }
@@ -536,16 +830,8 @@ cockpit_rest_response_process (CockpitRestJson *self,
       resp->got_status = TRUE;
       at += off;
 
-      /* We expect HTTP/1.0 responses, at least for successful responses */
-      if (memcmp (buffer->data, "HTTP/1.0", 8) != 0)
-        {
-          if (resp->status >= 200 && resp->status <= 299)
-            {
-              g_message ("%s: %s: received response with unexpected HTTP version",
-                         self->name, resp->req->label);
-            }
-          resp->skip_body = TRUE;
-        }
+      /* The status line parser only accepts HTTP/1.0 and HTTP/1.1 */
+      resp->http11 = (memcmp (buffer->data, "HTTP/1.1", 8) == 0);
     }
 
   if (!resp->headers)
@@ -557,19 +843,42 @@ cockpit_rest_response_process (CockpitRestJson *self,
       if (off < 0)
         {
           g_message ("%s: %s received response with bad HTTP headers",
-                     self->name, resp->req->label);
+                     self->name, response_label (resp));
           cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
           goto out;
         }
       at += off;
 
       /* How much do we have to read? */
-      if (!parse_content_length (resp->req, resp->headers, &resp->remaining_length))
+      if (!parse_content_length (self, resp, &resp->remaining_length))
         {
           cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
           goto out;
         }
 
+      /* A chunked body overrides any Content-Length */
+      encoding = g_hash_table_lookup (resp->headers, "Transfer-Encoding");
+      if (!encoding || resp->remaining_length == 0 ||
+          g_ascii_strcasecmp (encoding, "identity") == 0)
+        {
+          /* Plain body */
+        }
+      else if (g_ascii_strcasecmp (encoding, "chunked") == 0)
+        {
+          resp->chunked = TRUE;
+          resp->chunk_state = CHUNK_SIZE;
+          resp->remaining_length = -1;
+        }
+
+      /* Other encodings are not understood, read them till the end of the pipe */
+      else
+        {
+          g_message ("%s: %s: received response with unsupported transfer encoding",
+                     self->name, response_label (resp));
+          resp->remaining_length = -1;
+          resp->skip_body = TRUE;
+        }
+
       /* If status is 2XX, then we expect json body */
       type = g_hash_table_lookup (resp->headers, "Content-Type");
       if (type == NULL)
@@ -598,8 +907,25 @@ cockpit_rest_response_process (CockpitRestJson *self,
         }
     }
 
-  /* Calculate how much of received data we should process */
   g_assert (at <= buffer->len);
+  replies = 0;
+
+  if (resp->chunked)
+    {
+      if (!cockpit_rest_response_dechunk (self, resp, buffer, &at, &replies))
+        {
+          cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+          goto out;
+        }
+
+      /* The response ended at a known point, and can be followed by others */
+      done = resp->chunk_state == CHUNK_DONE;
+      if (done)
+        resp->remaining_length = 0;
+      goto reply;
+    }
+
+  /* Calculate how much of received data we should process */
   block = buffer->len - at;
   if (resp->remaining_length >= 0)
     {
@@ -610,7 +936,6 @@ cockpit_rest_response_process (CockpitRestJson *self,
     }
 
   data = (const gchar *)buffer->data + at;
-  replies = 0;
   if (resp->skip_body)
     {
       off = block;
@@ -641,8 +966,12 @@ cockpit_rest_response_process (CockpitRestJson *self,
       done = resp->remaining_length == 0;
     }
 
-  /* If no replies sent yet, must have skipped body, or no body */
-  if (done && !replies)
+reply:
+  /*
+   * If no replies sent yet, must have skipped body, or no body. A chunked
+   * body is parsed as it arrives, so may not have completed the response.
+   */
+  if (done && resp->req && (!replies || resp->incomplete))
     cockpit_rest_response_reply (self, resp, NULL, TRUE);
 
 out:
@@ -651,62 +980,190 @@ out:
   return done;
 }
 
+static gboolean
+response_keep_alive (CockpitRestResponse *resp)
+{
+  const gchar *connection;
+
+  /* Only if we know where the response ended */
+  if (!resp->headers || resp->remaining_length != 0)
+    return FALSE;
+
+  /* HTTP/1.1 connections stay open unless told otherwise */
+  connection = g_hash_table_lookup (resp->headers, "Connection");
+  if (resp->http11)
+    return !connection || strstr (connection, "close") == NULL;
+  else
+    return connection && strstr (connection, "keep-alive") != NULL;
+}
+
+static gboolean
+on_idle_timeout (gpointer user_data)
+{
+  CockpitRestConnection *conn = user_data;
+  CockpitRestJson *self = conn->channel;
+
+  g_debug ("%s: closing idle connection", self->name);
+
+  conn->idle_timeout = 0;
+  g_queue_remove (&self->idle, conn);
+  g_hash_table_remove (self->connections, conn->pipe);
+  return FALSE;
+}
+
+static void
+cockpit_rest_connection_release (CockpitRestJson *self,
+                                 CockpitRestConnection *conn)
+{
+  CockpitRestConnection *oldest;
+
+  g_assert (g_queue_is_empty (&conn->responses));
+
+  /* Make room for this one, by closing the one unused the longest */
+  if (g_queue_get_length (&self->idle) >= MAX_IDLE_CONNECTIONS)
+    {
+      oldest = g_queue_pop_head (&self->idle);
+      g_hash_table_remove (self->connections, oldest->pipe);
+    }
+
+  /* Notice if the server closes it, even while the channel is paused */
+  cockpit_pipe_pause_input (conn->pipe, FALSE);
+  g_queue_push_tail (&self->idle, conn);
+  conn->idle_timeout = g_timeout_add_seconds (IDLE_TIMEOUT, on_idle_timeout, conn);
+}
+
+/*
+ * The server is done with this connection, but requests that it hasn't
+ * started to answer are still waiting on it. Send them again on other
+ * connections, and get rid of this one. The server may have acted on
+ * a request without answering, so only those safe to repeat are sent
+ * again, the others fail.
+ */
+static void
+cockpit_rest_connection_requeue (CockpitRestJson *self,
+                                 CockpitRestConnection *conn)
+{
+  GQueue requeue = G_QUEUE_INIT;
+  CockpitRestResponse *resp;
+  CockpitRestRequest *req;
+
+  while ((resp = g_queue_pop_head (&conn->responses)) != NULL)
+    {
+      req = resp->req;
+
+      if (req && !request_is_idempotent (req))
+        {
+          g_debug ("%s: %s: connection closed before response, not sending again",
+                   self->name, req->label);
+          resp->status = 502;
+          g_free (resp->message);
+          resp->message = g_strdup ("Connection closed before response");
+          cockpit_rest_response_reply (self, resp, NULL, TRUE);
+        }
+
+      /* This will remove the response from the request */
+      cockpit_rest_response_destroy (resp);
+
+      if (req && request_is_idempotent (req))
+        g_queue_push_tail (&requeue, req);
+      else if (req && !req->poll)
+        g_hash_table_remove (self->requests, &req->cookie);
+    }
+
+  g_hash_table_remove (self->connections, conn->pipe);
+
+  while ((req = g_queue_pop_head (&requeue)) != NULL)
+    {
+      g_debug ("%s: %s: sending again on another connection", self->name, req->label);
+      cockpit_rest_request_send (self, req);
+    }
+}
+
 static void
 on_pipe_read (CockpitPipe *pipe,
-              GByteArray *buffer,
+              CockpitPipeBuffer *buffer,
               gboolean end_of_data,
               gpointer user_data)
 {
   CockpitRestJson *self = user_data;
+  CockpitRestConnection *conn;
   CockpitRestResponse *resp;
   CockpitRestRequest *req;
-  const gchar *keep_alive;
+  gboolean done;
 
-  /* Lookup active response */
-  resp = g_hash_table_lookup (self->responses, pipe);
-  g_assert (resp != NULL);
+  /* Lookup the connection */
+  conn = g_hash_table_lookup (self->connections, pipe);
+  g_assert (conn != NULL);
 
-  req = resp->req;
-  g_assert (req != NULL);
+  /* Each pipelined response in turn */
+  while ((resp = g_queue_peek_head (&conn->responses)) != NULL)
+    {
+      req = resp->req;
+
+      /* Any polls watching this request should fire now */
+      if (req)
+        cockpit_rest_watch_notify (self, req->cookie);
 
-  /* Any polls watching this request should fire now */
-  cockpit_rest_watch_notify (self, req->cookie);
+      done = cockpit_rest_response_process (self, resp, buffer, end_of_data);
 
-  if (cockpit_rest_response_process (self, resp, buffer, end_of_data))
-    {
-      if (self->inactive == NULL && resp->headers)
+      /* Closing the channel has destroyed this connection */
+      if (self->closed)
+        return;
+
+      if (!done)
         {
-          keep_alive = g_hash_table_lookup (resp->headers, "Connection");
-          if (keep_alive && strstr (keep_alive, "keep-alive"))
+          /*
+           * Pipe is done. A server may close a keep-alive connection after
+           * any response, so if nothing at all arrived for this one, try
+           * again elsewhere. Otherwise the response is truncated.
+           */
+          if (end_of_data)
             {
-#if 0
-              g_debug ("%s: keeping pipe around due to keep-alive", self->name);
-#endif
-              g_signal_handler_disconnect (resp->pipe, resp->sig_read);
-              self->inactive = resp->pipe;
-              self->inactive_close = resp->sig_close;
-              resp->sig_read = resp->sig_close = 0;
-              resp->pipe = NULL;
+              if (conn->served && !resp->got_status && buffer->len == 0)
+                {
+                  cockpit_rest_connection_requeue (self, conn);
+                }
+              else
+                {
+                  g_message ("%s: %s: received truncated HTTP response",
+                             self->name, response_label (resp));
+                  cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+                }
             }
+          return;
         }
 
+      conn->keep_alive = response_keep_alive (resp);
+      conn->served = TRUE;
+
       /* This will destroy the response, and remove it from request */
-      g_hash_table_remove (self->responses, pipe);
+      g_queue_pop_head (&conn->responses);
+      cockpit_rest_response_destroy (resp);
 
       /* If this is not a poll request, then it can be destroyed */
-      if (!req->poll)
+      if (req && !req->poll)
         g_hash_table_remove (self->requests, &req->cookie);
-    }
-  else
-    {
-      /* Response not done, but pipe is done */
-      if (end_of_data)
+
+      /* Any requests pipelined behind this one need another connection */
+      if (!conn->keep_alive)
         {
-          g_message ("%s: %s: received truncated HTTP response",
-                     self->name, resp->req->label);
-          cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
+          cockpit_rest_connection_requeue (self, conn);
+          return;
         }
     }
+
+  /* Nothing more should come on this connection until asked */
+  if (end_of_data || buffer->len > 0)
+    {
+      if (buffer->len > 0)
+        g_debug ("%s: unexpected data on idle connection", self->name);
+      g_queue_remove (&self->idle, conn);
+      g_hash_table_remove (self->connections, pipe);
+    }
+  else if (!conn->idle_timeout)
+    {
+      cockpit_rest_connection_release (self, conn);
+    }
 }
 
 static void
@@ -715,21 +1172,21 @@ on_pipe_close (CockpitPipe *pipe,
                gpointer user_data)
 {
   CockpitRestJson *self = user_data;
-  CockpitRestResponse *resp;
+  CockpitRestConnection *conn;
 
-  if (pipe == self->inactive)
+  conn = g_hash_table_lookup (self->connections, pipe);
+  g_assert (conn != NULL);
+
+  if (g_queue_is_empty (&conn->responses))
     {
-      g_debug ("%s: inactive pipe closed%s%s",
+      g_debug ("%s: idle connection closed%s%s",
                self->name, problem ? ": " : "", problem ? problem : "");
-      self->inactive = NULL;
-      g_object_unref (pipe);
-      return;
+      g_queue_remove (&self->idle, conn);
+      g_hash_table_remove (self->connections, pipe);
     }
-
-  resp = g_hash_table_lookup (self->responses, pipe);
-  if (resp != NULL)
+  else
     {
-      g_debug ("%s: active pipe closed%s%s",
+      g_debug ("%s: active connection closed%s%s",
                self->name, problem ? ": " : "", problem ? problem : "");
       if (problem == NULL)
         on_pipe_read (pipe, cockpit_pipe_get_buffer (pipe), TRUE, self);
@@ -738,29 +1195,64 @@ on_pipe_close (CockpitPipe *pipe,
     }
 }
 
+static CockpitRestConnection *
+cockpit_rest_connection_acquire (CockpitRestJson *self,
+                                 CockpitRestRequest *req)
+{
+  CockpitRestConnection *conn;
+  CockpitRestConnection *busy;
+  GHashTableIter iter;
+  guint length;
+
+  /* The most recently used idle connection is least likely to have been closed */
+  conn = g_queue_pop_tail (&self->idle);
+  if (conn)
+    {
+      g_source_remove (conn->idle_timeout);
+      conn->idle_timeout = 0;
+      return conn;
+    }
+
+  /* Otherwise queue up behind the shortest line on a keep-alive connection */
+  if (self->pipeline && request_is_idempotent (req))
+    {
+      length = MAX_PIPELINE_DEPTH;
+      g_hash_table_iter_init (&iter, self->connections);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&busy))
+        {
+          if (busy->keep_alive && g_queue_get_length (&busy->responses) < length)
+            {
+              conn = busy;
+              length = g_queue_get_length (&busy->responses);
+            }
+        }
+      if (conn)
+        return conn;
+    }
+
+  conn = g_new0 (CockpitRestConnection, 1);
+  conn->channel = self;
+  conn->pipe = cockpit_pipe_connect (self->name, self->address);
+  conn->sig_read = g_signal_connect (conn->pipe, "read", G_CALLBACK (on_pipe_read), self);
+  conn->sig_close = g_signal_connect (conn->pipe, "close", G_CALLBACK (on_pipe_close), self);
+
+  /* Owns the connection */
+  g_hash_table_insert (self->connections, conn->pipe, conn);
+  return conn;
+}
+
 static void
 cockpit_rest_request_send (CockpitRestJson *self,
                            CockpitRestRequest *req)
 {
   CockpitRestResponse *resp;
+  CockpitRestConnection *conn;
 
   g_assert (req != NULL);
   g_assert (req->resp == NULL);
 
   resp = g_new0 (CockpitRestResponse, 1);
-
-  if (self->inactive)
-    {
-      resp->pipe = self->inactive;
-      self->inactive = NULL;
-      resp->sig_close = self->inactive_close;
-      self->inactive_close = 0;
-    }
-  else
-    {
-      resp->pipe = cockpit_pipe_connect (self->name, self->address);
-      resp->sig_close = g_signal_connect (resp->pipe, "close", G_CALLBACK (on_pipe_close), self);
-    }
+  cockpit_json_skip_init (&resp->scan);
 
   /*
    * poll responses are part of a greater set of responses
@@ -773,14 +1265,16 @@ cockpit_rest_request_send (CockpitRestJson *self,
     resp->incomplete = TRUE;
 
   /* Owns the response */
-  g_hash_table_insert (self->responses, resp->pipe, resp);
+  conn = cockpit_rest_connection_acquire (self, req);
+  g_queue_push_tail (&conn->responses, resp);
+  resp->conn = conn;
 
-  resp->sig_read = g_signal_connect (resp->pipe, "read", G_CALLBACK (on_pipe_read), self);
+  cockpit_pipe_pause_input (conn->pipe, cockpit_channel_is_paused (COCKPIT_CHANNEL (self)));
   resp->req = req;
   req->resp = resp;
-  cockpit_pipe_write (resp->pipe, req->headers);
+  cockpit_pipe_write (conn->pipe, req->headers);
   if (req->body)
-    cockpit_pipe_write (resp->pipe, req->body);
+    cockpit_pipe_write (conn->pipe, req->body);
 }
 
 static gboolean
@@ -849,6 +1343,7 @@ cockpit_rest_request_create (CockpitRestJson *self,
   JsonNode *node;
   gint64 interval;
   gint64 watch;
+  gboolean patch;
 
   if (!cockpit_json_get_int (json, "cookie", 0, &cookie) ||
       !cockpit_json_get_string (json, "path", NULL, &path) ||
@@ -920,11 +1415,16 @@ cockpit_rest_request_create (CockpitRestJson *self,
           g_warning ("Invalid \"watch\" member in REST JSON request: should be non-negative integer");
           goto out;
         }
+      if (!cockpit_json_get_bool (pollopts, "patch", FALSE, &patch))
+        {
+          g_warning ("Invalid \"patch\" member in REST JSON request: should be a boolean");
+          goto out;
+        }
     }
 
   string = g_string_sized_new (128);
-  g_string_printf (string, "%s %s HTTP/1.0\r\n", method, path);
-  g_string_append (string, "Connection: keep-alive\r\n");
+  g_string_printf (string, "%s %s HTTP/1.1\r\n", method, path);
+  g_string_append_printf (string, "Host: %s\r\n", self->host);
 
   req = g_new0 (CockpitRestRequest, 1);
   req->body = build_body_from_json (self, json);
@@ -940,6 +1440,7 @@ cockpit_rest_request_create (CockpitRestJson *self,
   g_string_append (string, "\r\n");
 
   req->label = g_strdup (path);
+  req->method = g_strdup (method);
   req->channel = self;
   req->cookie = cookie;
   req->headers = g_string_free_to_bytes (string);
@@ -965,6 +1466,7 @@ cockpit_rest_request_create (CockpitRestJson *self,
       else
         req->poll->timeout_id = g_timeout_add (interval, on_request_interval, req);
       req->poll->watching = watch;
+      req->poll->patch = patch;
       if (watch != 0)
         cockpit_rest_watch_add (self, watch, cookie);
     }
@@ -1003,27 +1505,35 @@ cockpit_rest_json_recv (CockpitChannel *channel,
   json_object_unref (object);
 }
 
+static void
+cockpit_rest_json_pause (CockpitChannel *channel,
+                         gboolean paused)
+{
+  CockpitRestJson *self = COCKPIT_REST_JSON (channel);
+  CockpitRestConnection *conn;
+  GHashTableIter iter;
+
+  /* Stop reading responses, idle keep-alive connections are left alone */
+  g_hash_table_iter_init (&iter, self->connections);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&conn))
+    {
+      if (!g_queue_is_empty (&conn->responses))
+        cockpit_pipe_pause_input (conn->pipe, paused);
+    }
+}
+
 static void
 cockpit_rest_json_close (CockpitChannel *channel,
                          const gchar *problem)
 {
   CockpitRestJson *self = COCKPIT_REST_JSON (channel);
-  CockpitPipe *pipe;
 
   self->closed = TRUE;
 
-  /* Closes any pipes involved in requests */
+  /* Closes any pipes involved in requests, and idle ones */
   g_hash_table_remove_all (self->requests);
-  g_hash_table_remove_all (self->responses);
-
-  if (self->inactive)
-    {
-      pipe = self->inactive;
-      self->inactive = NULL;
-      g_signal_handler_disconnect (pipe, self->inactive_close);
-      cockpit_pipe_close (pipe, NULL);
-      g_object_unref (pipe);
-    }
+  g_queue_clear (&self->idle);
+  g_hash_table_remove_all (self->connections);
 
   COCKPIT_CHANNEL_CLASS (cockpit_rest_json_parent_class)->close (channel, problem);
 }
@@ -1035,9 +1545,10 @@ cockpit_rest_json_init (CockpitRestJson *self)
   self->requests = g_hash_table_new_full (cockpit_json_int_hash, cockpit_json_int_equal,
                                           NULL, cockpit_rest_request_destroy);
 
-  /* Table of CockpitPipe* -> CockpitRestResponse */
-  self->responses = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                           NULL, cockpit_rest_response_destroy);
+  /* Table of CockpitPipe* -> CockpitRestConnection */
+  self->connections = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, cockpit_rest_connection_destroy);
+  g_queue_init (&self->idle);
 
   /* Table of gint64 -> GArray(gint64) */
   self->watches = g_hash_table_new_full (cockpit_json_int_hash, cockpit_json_int_equal, g_free, NULL);
@@ -1086,6 +1597,7 @@ initialize_in_idle (gpointer user_data)
 
   port = cockpit_channel_get_int_option (channel, "port");
   unix_path = cockpit_channel_get_option (channel, "unix");
+  self->pipeline = cockpit_channel_get_bool_option (channel, "pipeline");
 
   if (port != G_MAXINT64 && unix_path)
     {
@@ -1103,6 +1615,7 @@ initialize_in_idle (gpointer user_data)
       else
         {
           self->name = g_strdup_printf ("localhost:%d", (gint)port);
+          self->host = g_strdup (self->name);
           enumerator = g_socket_connectable_enumerate (connectable);
           g_object_unref (connectable);
           g_socket_address_enumerator_next_async (enumerator, NULL,
@@ -1114,6 +1627,7 @@ initialize_in_idle (gpointer user_data)
   else if (unix_path)
     {
       self->name = g_strdup (unix_path);
+      self->host = g_strdup ("localhost");
       self->address = g_unix_socket_address_new (unix_path);
       cockpit_channel_ready (channel);
     }
@@ -1155,13 +1669,14 @@ cockpit_rest_json_finalize (GObject *object)
   if (self->address)
     g_object_unref (self->address);
   g_hash_table_destroy (self->requests);
-  g_hash_table_destroy (self->responses);
+  g_hash_table_destroy (self->connections);
 
   g_assert (g_hash_table_size (self->watches) == 0);
   g_hash_table_destroy (self->watches);
 
-  g_assert (self->inactive == NULL);
+  g_assert (g_queue_is_empty (&self->idle));
   g_free (self->name);
+  g_free (self->host);
 
   G_OBJECT_CLASS (cockpit_rest_json_parent_class)->finalize (object);
 }
@@ -1178,6 +1693,7 @@ cockpit_rest_json_class_init (CockpitRestJsonClass *klass)
 
   channel_class->recv = cockpit_rest_json_recv;
   channel_class->close = cockpit_rest_json_close;
+  channel_class->pause = cockpit_rest_json_pause;
 }
 
 /**
@@ -109,7 +109,7 @@ cockpit_text_stream_recv (CockpitChannel *channel,
 
 static void
 process_pipe_buffer (CockpitTextStream *self,
-                     GByteArray *data)
+                     CockpitPipeBuffer *data)
 {
   CockpitChannel *channel = (CockpitChannel *)self;
   GBytes *message;
@@ -123,9 +123,7 @@ process_pipe_buffer (CockpitTextStream *self,
 
   if (data->len)
     {
-      /* When array is reffed, this just clears byte array */
-      g_byte_array_ref (data);
-      message = g_byte_array_free_to_bytes (data);
+      message = cockpit_pipe_consume (data, 0, data->len);
       clean = check_utf8_and_force_if_necessary (message);
       cockpit_channel_send (channel, clean);
       g_bytes_unref (message);
@@ -147,9 +145,26 @@ cockpit_text_stream_close (CockpitChannel *channel,
    * our pipe to close first, which will come back here.
   */
   if (self->open)
-    cockpit_pipe_close (self->pipe, problem);
+    {
+      /* An orderly close needs to read to the end */
+      cockpit_pipe_pause_input (self->pipe, FALSE);
+      cockpit_pipe_close (self->pipe, problem);
+    }
   else
-    COCKPIT_CHANNEL_CLASS (cockpit_text_stream_parent_class)->close (channel, problem);
+    {
+      COCKPIT_CHANNEL_CLASS (cockpit_text_stream_parent_class)->close (channel, problem);
+    }
+}
+
+static void
+cockpit_text_stream_pause (CockpitChannel *channel,
+                           gboolean paused)
+{
+  CockpitTextStream *self = COCKPIT_TEXT_STREAM (channel);
+
+  /* Data backs up in the process or socket we read from */
+  if (self->open)
+    cockpit_pipe_pause_input (self->pipe, paused);
 }
 
 static gboolean
@@ -163,7 +178,7 @@ on_batch_timeout (gpointer user_data)
 
 static void
 on_pipe_read (CockpitPipe *pipe,
-              GByteArray *data,
+              CockpitPipeBuffer *data,
               gboolean end_of_data,
               gpointer user_data)
 {
@@ -332,6 +347,7 @@ cockpit_text_stream_class_init (CockpitTextStreamClass *klass)
 
   channel_class->recv = cockpit_text_stream_recv;
   channel_class->close = cockpit_text_stream_close;
+  channel_class->pause = cockpit_text_stream_pause;
 }
 
 /**
@@ -23,11 +23,18 @@
 #include "mock-transport.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpittest.h"
 
 #include <json-glib/json-glib.h>
 
 #include <gio/gio.h>
+#include <glib-unix.h>
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <unistd.h>
 
 /* ----------------------------------------------------------------------------
  * Mock
@@ -293,6 +300,80 @@ test_close_transport (TestCase *tc,
   g_free (problem);
 }
 
+typedef struct {
+  GHashTable *channels;
+  gboolean throttled;
+} ThrottleState;
+
+static void
+on_transport_queued (GObject *object,
+                     GParamSpec *pspec,
+                     gpointer user_data)
+{
+  ThrottleState *state = user_data;
+  gsize queued = cockpit_pipe_transport_get_queued (COCKPIT_PIPE_TRANSPORT (object));
+  cockpit_channel_throttle_queued (state->channels, queued, &state->throttled);
+}
+
+static void
+test_throttle_queued (void)
+{
+  ThrottleState state = { NULL, FALSE };
+  CockpitTransport *transport;
+  CockpitChannel *one;
+  CockpitChannel *two;
+  GBytes *block;
+  gchar buffer[8192];
+  gsize sent = 0;
+  gssize ret;
+  int fds[2];
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+    g_error ("socketpair() failed: %s", g_strerror (errno));
+  g_assert (g_unix_set_fd_nonblocking (fds[1], TRUE, NULL));
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], fds[0]);
+  one = mock_echo_channel_open (transport, "1");
+  two = mock_echo_channel_open (transport, "2");
+
+  state.channels = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+  g_hash_table_insert (state.channels, "1", one);
+  g_hash_table_insert (state.channels, "2", two);
+  g_signal_connect (transport, "notify::queued", G_CALLBACK (on_transport_queued), &state);
+
+  /* Nothing reads the other end, so the output piles up */
+  block = g_bytes_new_take (g_malloc0 (64 * 1024), 64 * 1024);
+  while (sent < 5 * 1024 * 1024)
+    {
+      g_assert (state.throttled == (sent >= 4 * 1024 * 1024));
+      cockpit_channel_send (one, block);
+      sent += g_bytes_get_size (block);
+    }
+  g_bytes_unref (block);
+
+  g_assert (state.throttled);
+  g_assert (cockpit_channel_is_paused (one));
+  g_assert (cockpit_channel_is_paused (two));
+
+  /* Reading it lets the output drain, and the channels go again */
+  while (state.throttled)
+    {
+      ret = read (fds[1], buffer, sizeof (buffer));
+      if (ret < 0 && errno != EAGAIN)
+        g_assert_not_reached ();
+      g_main_context_iteration (NULL, FALSE);
+    }
+
+  g_assert_cmpuint (cockpit_pipe_transport_get_queued (COCKPIT_PIPE_TRANSPORT (transport)), <=, 1024 * 1024);
+  g_assert (!cockpit_channel_is_paused (one));
+  g_assert (!cockpit_channel_is_paused (two));
+
+  g_signal_handlers_disconnect_by_func (transport, on_transport_queued, &state);
+  g_hash_table_destroy (state.channels);
+  g_object_unref (transport);
+  close (fds[1]);
+}
+
 static void
 test_get_option (void)
 {
@@ -356,6 +437,7 @@ main (int argc,
 
   g_test_add_func ("/channel/get-option", test_get_option);
   g_test_add_func ("/channel/properties", test_properties);
+  g_test_add_func ("/channel/throttle-queued", test_throttle_queued);
 
   g_test_add ("/channel/recv-send", TestCase, NULL,
               setup, test_recv_and_send, teardown);
@@ -19,7 +19,10 @@
 
 #include "config.h"
 
+#include "cockpitdbusconverter.h"
+#include "cockpitdbusintrospect.h"
 #include "cockpitdbusjson.h"
+#include "cockpitdbusmanager.h"
 
 #include "common/cockpitjson.h"
 #include "common/cockpitpipetransport.h"
@@ -35,9 +38,23 @@
 
 typedef struct {
   int fd;
+  int server_fd;
+  gboolean property_deltas;
+  gint batch_window;
+  gboolean chunked_seed;
+  const gchar *path_prefix;
+  const gchar *interface;
   GThread *thread;
 } TestCase;
 
+typedef struct {
+  gboolean property_deltas;
+  gint batch_window;
+  gboolean chunked_seed;
+  const gchar *path_prefix;
+  const gchar *interface;
+} TestFixture;
+
 static void
 on_closed_set_flag (CockpitChannel *channel,
                     const gchar *problem,
@@ -50,9 +67,12 @@ on_closed_set_flag (CockpitChannel *channel,
 static gpointer
 dbus_server_thread (gpointer data)
 {
+  TestCase *tc = data;
   CockpitTransport *transport;
-  int fd = GPOINTER_TO_INT (data);
+  int fd = tc->server_fd;
   CockpitChannel *channel;
+  JsonObject *options;
+  JsonArray *interfaces;
   GMainContext *ctx;
   gboolean closed = FALSE;
 
@@ -61,8 +81,37 @@ dbus_server_thread (gpointer data)
 
   transport = cockpit_pipe_transport_new_fds ("mock", fd, fd);
 
-  channel = cockpit_dbus_json_open (transport, "444",
-                                    "com.redhat.Cockpit.DBusTests.Test", "/otree");
+  if (tc->property_deltas || tc->batch_window || tc->chunked_seed ||
+      tc->path_prefix || tc->interface)
+    {
+      options = json_object_new ();
+      json_object_set_string_member (options, "bus", "session");
+      json_object_set_string_member (options, "service", "com.redhat.Cockpit.DBusTests.Test");
+      json_object_set_string_member (options, "object-manager", "/otree");
+      json_object_set_string_member (options, "payload", "dbus-json2");
+      json_object_set_boolean_member (options, "property-deltas", tc->property_deltas);
+      json_object_set_int_member (options, "batch-window", tc->batch_window);
+      json_object_set_boolean_member (options, "chunked-seed", tc->chunked_seed);
+      if (tc->path_prefix)
+        json_object_set_string_member (options, "path-prefix", tc->path_prefix);
+      if (tc->interface)
+        {
+          interfaces = json_array_new ();
+          json_array_add_string_element (interfaces, tc->interface);
+          json_object_set_array_member (options, "interfaces", interfaces);
+        }
+      channel = g_object_new (COCKPIT_TYPE_DBUS_JSON,
+                              "transport", transport,
+                              "id", "444",
+                              "options", options,
+                              NULL);
+      json_object_unref (options);
+    }
+  else
+    {
+      channel = cockpit_dbus_json_open (transport, "444",
+                                        "com.redhat.Cockpit.DBusTests.Test", "/otree");
+    }
   g_signal_connect (channel, "closed", G_CALLBACK (on_closed_set_flag), &closed);
 
   /* Channel keeps itself alive until done */
@@ -78,15 +127,22 @@ dbus_server_thread (gpointer data)
 
 static void
 setup_dbus_server(TestCase *tc,
-                  gconstpointer unused)
+                  gconstpointer data)
 {
+  const TestFixture *fixture = data;
   int fds[2];
 
   if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
     g_error ("socketpair() failed: %s", g_strerror (errno));
 
   tc->fd = fds[0];
-  tc->thread = g_thread_new ("dbus-server", dbus_server_thread, GINT_TO_POINTER(fds[1]));
+  tc->server_fd = fds[1];
+  tc->property_deltas = fixture && fixture->property_deltas;
+  tc->batch_window = fixture ? fixture->batch_window : 0;
+  tc->chunked_seed = fixture && fixture->chunked_seed;
+  tc->path_prefix = fixture ? fixture->path_prefix : NULL;
+  tc->interface = fixture ? fixture->interface : NULL;
+  tc->thread = g_thread_new ("dbus-server", dbus_server_thread, tc);
 }
 
 static void
@@ -116,10 +172,28 @@ read_all (int fd,
       else if (ret == 0)
         g_error ("short read in test: %u != %u", (guint)len, (guint)off);
       else
-        off += len;
+        off += ret;
     }
 }
 
+static void
+send_message (TestCase *tc,
+              const gchar *json)
+{
+  gchar *frame;
+  guint32 size;
+  gsize len;
+
+  frame = g_strdup_printf ("....444\n%s", json);
+  len = strlen (frame);
+  size = GUINT32_TO_BE (len - 4);
+  memcpy (frame, &size, 4);
+
+  if (write (tc->fd, frame, len) != (gssize)len)
+    g_error ("write() failed: %s", g_strerror (errno));
+  g_free (frame);
+}
+
 static JsonObject *
 read_message (TestCase *tc)
 {
@@ -188,6 +262,713 @@ test_seed (TestCase *tc,
   json_object_unref (msg);
 }
 
+static void
+test_seed_filtered (TestCase *tc,
+                    gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  JsonObject *msg;
+  JsonObject *object;
+  JsonObject *ifaces;
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+
+  object = json_object_get_object_member (msg, "data");
+  g_assert (object != NULL);
+
+  if (fixture->path_prefix)
+    {
+      /* Nothing lives under the prefix */
+      g_assert_cmpuint (json_object_get_size (object), ==, 0);
+    }
+  else
+    {
+      /* The object is there, but not the interface that was left out */
+      object = json_object_get_object_member (object, "/otree/frobber");
+      g_assert (object != NULL);
+      ifaces = json_object_get_object_member (object, "ifaces");
+      g_assert (ifaces != NULL);
+      g_assert (!json_object_has_member (ifaces, "com.redhat.Cockpit.DBusTests.Frobber"));
+    }
+
+  json_object_unref (msg);
+}
+
+static void
+test_seed_chunked (TestCase *tc,
+                   gconstpointer unused)
+{
+  JsonObject *msg;
+  JsonObject *data;
+  JsonObject *object;
+  JsonObject *ifaces;
+  JsonObject *frobber;
+  gboolean found = FALSE;
+  guint chunks = 0;
+
+  for (;;)
+    {
+      msg = read_message (tc);
+      if (!g_str_equal (json_object_get_string_member (msg, "command"), "seed-chunk"))
+        break;
+
+      chunks++;
+      data = json_object_get_object_member (msg, "data");
+      g_assert (data != NULL);
+
+      object = json_object_get_object_member (data, "/otree/frobber");
+      if (object)
+        {
+          g_assert (!found);
+          found = TRUE;
+
+          g_assert_cmpstr (json_object_get_string_member (object, "objpath"), ==, "/otree/frobber");
+          ifaces = json_object_get_object_member (object, "ifaces");
+          frobber = json_object_get_object_member (ifaces, "com.redhat.Cockpit.DBusTests.Frobber");
+          g_assert (frobber != NULL);
+          g_assert_cmpstr (json_object_get_string_member (frobber, "dbus_prop_FinallyNormalName"), ==, "There aint no place like home");
+        }
+
+      json_object_unref (msg);
+    }
+
+  g_assert_cmpuint (chunks, >, 0);
+  g_assert (found);
+
+  /* The seed itself is the end marker */
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+  data = json_object_get_object_member (msg, "data");
+  g_assert (data != NULL);
+  g_assert_cmpuint (json_object_get_size (data), ==, 0);
+  g_assert (json_object_get_object_member (msg, "options") != NULL);
+
+  json_object_unref (msg);
+}
+
+static void
+test_properties_changed (TestCase *tc,
+                         gconstpointer unused)
+{
+  JsonObject *msg;
+  JsonObject *options;
+  JsonObject *data;
+  JsonObject *iface;
+  JsonArray *invalidated;
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+  options = json_object_get_object_member (msg, "options");
+  g_assert (json_object_has_member (options, "property-deltas") == tc->property_deltas);
+  json_object_unref (msg);
+
+  send_message (tc, "{ \"command\": \"call\", \"cookie\": \"1\","
+                    "  \"objpath\": \"/otree/frobber\","
+                    "  \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "  \"method\": \"RequestPropertyMods\", \"args\": [] }");
+
+  for (;;)
+    {
+      msg = read_message (tc);
+      if (g_str_equal (json_object_get_string_member (msg, "command"), "interface-properties-changed"))
+        break;
+      json_object_unref (msg);
+    }
+
+  data = json_object_get_object_member (msg, "data");
+  g_assert_cmpstr (json_object_get_string_member (data, "objpath"), ==, "/otree/frobber");
+  g_assert_cmpstr (json_object_get_string_member (data, "iface_name"), ==, "com.redhat.Cockpit.DBusTests.Frobber");
+
+  if (tc->property_deltas)
+    {
+      g_assert (!json_object_has_member (data, "iface"));
+      iface = json_object_get_object_member (data, "changed");
+      invalidated = json_object_get_array_member (data, "invalidated");
+      g_assert (invalidated != NULL);
+      g_assert_cmpuint (json_array_get_length (invalidated), ==, 0);
+    }
+  else
+    {
+      g_assert (!json_object_has_member (data, "changed"));
+      iface = json_object_get_object_member (data, "iface");
+      iface = json_object_get_object_member (iface, "com.redhat.Cockpit.DBusTests.Frobber");
+    }
+
+  g_assert (iface != NULL);
+  g_assert (json_object_has_member (iface, "y"));
+  g_assert (json_object_has_member (iface, "i"));
+  g_assert (!json_object_has_member (iface, "FinallyNormalName"));
+
+  json_object_unref (msg);
+}
+
+static void
+test_batch (TestCase *tc,
+            gconstpointer unused)
+{
+  JsonObject *msg;
+  JsonArray *changes;
+  JsonObject *change;
+  JsonObject *data;
+  guint i;
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+  json_object_unref (msg);
+
+  send_message (tc, "{ \"command\": \"call\", \"cookie\": \"1\","
+                    "  \"objpath\": \"/otree/frobber\","
+                    "  \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "  \"method\": \"RequestPropertyMods\", \"args\": [] }");
+
+  /* The batched changes must arrive before the reply that follows them */
+  for (;;)
+    {
+      msg = read_message (tc);
+      g_assert_cmpstr (json_object_get_string_member (msg, "command"), !=, "call-reply");
+      g_assert_cmpstr (json_object_get_string_member (msg, "command"), !=, "interface-properties-changed");
+      if (g_str_equal (json_object_get_string_member (msg, "command"), "changes"))
+        break;
+      json_object_unref (msg);
+    }
+
+  changes = json_object_get_array_member (msg, "data");
+  g_assert (changes != NULL);
+  g_assert_cmpuint (json_array_get_length (changes), >, 0);
+
+  data = NULL;
+  for (i = 0; i < json_array_get_length (changes); i++)
+    {
+      change = json_array_get_object_element (changes, i);
+      if (g_str_equal (json_object_get_string_member (change, "command"), "interface-properties-changed"))
+        {
+          g_assert (data == NULL);
+          data = json_object_get_object_member (change, "data");
+        }
+    }
+
+  g_assert (data != NULL);
+  g_assert_cmpstr (json_object_get_string_member (data, "objpath"), ==, "/otree/frobber");
+  data = json_object_get_object_member (data, "changed");
+  g_assert (json_object_has_member (data, "y"));
+  g_assert (json_object_has_member (data, "i"));
+  json_object_unref (msg);
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "call-reply");
+  json_object_unref (msg);
+}
+
+static void
+test_call_batch (TestCase *tc,
+                 gconstpointer unused)
+{
+  JsonObject *msg;
+  JsonObject *data;
+  JsonObject *reply;
+  JsonArray *replies;
+  JsonArray *result;
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+  json_object_unref (msg);
+
+  send_message (tc, "{ \"command\": \"call-batch\", \"cookie\": \"batch\", \"calls\": ["
+                    "  { \"objpath\": \"/otree/frobber\","
+                    "    \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "    \"method\": \"HelloWorld\", \"args\": [ \"one\" ] },"
+                    "  { \"objpath\": \"/otree/frobber\","
+                    "    \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "    \"method\": \"NotAMethod\", \"args\": [] },"
+                    "  { \"objpath\": \"/otree/frobber\", \"cookie\": \"3\","
+                    "    \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "    \"method\": \"HelloWorld\", \"args\": [ \"three\" ] } ] }");
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "call-batch-reply");
+  data = json_object_get_object_member (msg, "data");
+  g_assert_cmpstr (json_object_get_string_member (data, "cookie"), ==, "batch");
+
+  /* Replies are in the order of the calls, whatever order they completed in */
+  replies = json_object_get_array_member (data, "replies");
+  g_assert_cmpuint (json_array_get_length (replies), ==, 3);
+
+  reply = json_array_get_object_element (replies, 0);
+  result = json_object_get_array_member (reply, "result");
+  g_assert_cmpstr (json_array_get_string_element (result, 0), ==, "Word! You said `one'. I'm Skeleton, btw!");
+
+  reply = json_array_get_object_element (replies, 1);
+  g_assert (!json_object_has_member (reply, "result"));
+  g_assert (json_object_has_member (reply, "error_message"));
+
+  reply = json_array_get_object_element (replies, 2);
+  g_assert_cmpstr (json_object_get_string_member (reply, "cookie"), ==, "3");
+  result = json_object_get_array_member (reply, "result");
+  g_assert_cmpstr (json_array_get_string_element (result, 0), ==, "Word! You said `three'. I'm Skeleton, btw!");
+
+  json_object_unref (msg);
+}
+
+static void
+test_call_batch_stream (TestCase *tc,
+                        gconstpointer unused)
+{
+  JsonObject *msg;
+  JsonObject *data;
+  gboolean seen[2] = { FALSE, FALSE };
+  const gchar *cookie;
+  guint i;
+
+  msg = read_message (tc);
+  g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "seed");
+  json_object_unref (msg);
+
+  send_message (tc, "{ \"command\": \"call-batch\", \"stream\": true, \"calls\": ["
+                    "  { \"objpath\": \"/otree/frobber\", \"cookie\": \"0\","
+                    "    \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "    \"method\": \"HelloWorld\", \"args\": [ \"zero\" ] },"
+                    "  { \"objpath\": \"/otree/frobber\", \"cookie\": \"1\","
+                    "    \"iface\": \"com.redhat.Cockpit.DBusTests.Frobber\","
+                    "    \"method\": \"HelloWorld\", \"args\": [ \"one\" ] } ] }");
+
+  /* Each call gets its own reply, in whatever order they complete */
+  for (i = 0; i < 2; i++)
+    {
+      msg = read_message (tc);
+      g_assert_cmpstr (json_object_get_string_member (msg, "command"), ==, "call-reply");
+      data = json_object_get_object_member (msg, "data");
+      g_assert (json_object_has_member (data, "result"));
+      cookie = json_object_get_string_member (data, "cookie");
+      g_assert (g_str_equal (cookie, "0") || g_str_equal (cookie, "1"));
+      g_assert (!seen[g_ascii_digit_value (cookie[0])]);
+      seen[g_ascii_digit_value (cookie[0])] = TRUE;
+      json_object_unref (msg);
+    }
+}
+
+typedef struct {
+  const gchar *variant;
+  const gchar *json;
+} WriteFixture;
+
+static const WriteFixture write_fixtures[] = {
+  { "(5, true, 'x')", "[5,true,\"x\"]" },
+  { "@ay [1, 2, 255]", "[1,2,255]" },
+  { "@an [-2, 3]", "[-2,3]" },
+  { "@at [18446744073709551615]", "[18446744073709551615]" },
+  { "@ad [1.5, -0.25]", "[1.5,-0.25]" },
+  { "@ab [true, false]", "[true,false]" },
+  { "@as []", "[]" },
+  { "('',)", "[\"\"]" },
+  { "@s 'q\"\\\\\\n'", "\"q\\\"\\\\\\n\"" },
+  { "@o '/a/b'", "\"/a/b\"" },
+  { "@a{sv} {}", "{}" },
+  { "{'a': <'b'>, 'c': <@u 3>}", "{\"a\":{\"sig\":\"s\",\"val\":\"b\"},\"c\":{\"sig\":\"u\",\"val\":3}}" },
+  { "@a{is} {1: 'x'}", "{\"1\":\"x\"}" },
+  { "[@aay [[1], []]]", "[[[1],[]]]" },
+  { "@a(ss) [('a', 'b')]", "[[\"a\",\"b\"]]" },
+};
+
+static void
+test_write_variant (gconstpointer data)
+{
+  const WriteFixture *fixture = data;
+  GError *error = NULL;
+  GVariant *variant;
+  GString *out;
+
+  variant = g_variant_parse (NULL, fixture->variant, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  out = g_string_new ("");
+  cockpit_dbus_json_write_variant (out, variant);
+  g_assert_cmpstr (out->str, ==, fixture->json);
+
+  g_string_free (out, TRUE);
+  g_variant_unref (variant);
+}
+
+#define PERF_WRITE_MESSAGES 20000
+
+static GVariant *
+build_block_properties (guint i)
+{
+  GVariantBuilder builder;
+  gchar *device = g_strdup_printf ("/dev/sd%c%u", 'a' + (i % 26), i % 16);
+  gchar *path = g_strdup_printf ("/org/freedesktop/UDisks2/block_devices/sd%c%u", 'a' + (i % 26), i % 16);
+  gchar *uuid = g_strdup_printf ("%08x-1b2c-4d5e-8f90-%012x", i, i * 7919);
+  const gchar *symlinks[] = { device, path, NULL };
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "Device", g_variant_new_bytestring (device));
+  g_variant_builder_add (&builder, "{sv}", "PreferredDevice", g_variant_new_bytestring (device));
+  g_variant_builder_add (&builder, "{sv}", "Symlinks", g_variant_new_bytestring_array (symlinks, -1));
+  g_variant_builder_add (&builder, "{sv}", "DeviceNumber", g_variant_new_uint64 (2048 + i));
+  g_variant_builder_add (&builder, "{sv}", "Id", g_variant_new_string (uuid));
+  g_variant_builder_add (&builder, "{sv}", "Size", g_variant_new_uint64 (G_GUINT64_CONSTANT (500107862016) + i));
+  g_variant_builder_add (&builder, "{sv}", "ReadOnly", g_variant_new_boolean (FALSE));
+  g_variant_builder_add (&builder, "{sv}", "Drive", g_variant_new_object_path (path));
+  g_variant_builder_add (&builder, "{sv}", "IdUsage", g_variant_new_string ("filesystem"));
+  g_variant_builder_add (&builder, "{sv}", "IdType", g_variant_new_string ("xfs"));
+  g_variant_builder_add (&builder, "{sv}", "IdVersion", g_variant_new_string (""));
+  g_variant_builder_add (&builder, "{sv}", "IdLabel", g_variant_new_string ("Storage \"data\""));
+  g_variant_builder_add (&builder, "{sv}", "IdUUID", g_variant_new_string (uuid));
+  g_variant_builder_add (&builder, "{sv}", "Configuration",
+                         g_variant_new_parsed ("[('fstab', {'dir': <b'/srv/data'>, 'opts': <b'defaults'>})]"));
+  g_variant_builder_add (&builder, "{sv}", "HintPartitionable", g_variant_new_boolean (TRUE));
+  g_variant_builder_add (&builder, "{sv}", "HintIgnore", g_variant_new_boolean (FALSE));
+
+  g_free (device);
+  g_free (path);
+  g_free (uuid);
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+test_perf_write_variant (void)
+{
+  GVariant **values;
+  GVariant *value;
+  GString *out;
+  gchar *json;
+  gchar *str;
+  gsize written = 0;
+  gdouble direct;
+  gdouble dom;
+  guint i;
+
+  values = g_new0 (GVariant *, PERF_WRITE_MESSAGES);
+  for (i = 0; i < PERF_WRITE_MESSAGES; i++)
+    {
+      /* Serialized, like a value that arrived over the bus */
+      value = build_block_properties (i);
+      values[i] = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
+                                           g_memdup (g_variant_get_data (value), g_variant_get_size (value)),
+                                           g_variant_get_size (value), TRUE, g_free, NULL);
+      g_variant_ref_sink (values[i]);
+      g_variant_unref (value);
+    }
+
+  out = g_string_sized_new (4096);
+  str = out->str;
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_WRITE_MESSAGES; i++)
+    {
+      g_string_truncate (out, 0);
+      cockpit_dbus_json_write_variant (out, values[i]);
+      written += out->len;
+    }
+  direct = g_test_timer_elapsed ();
+
+  /* The output buffer is reused, and never needed to grow */
+  g_assert (out->str == str);
+
+  /* For comparison, going through a JsonNode tree */
+  g_test_timer_start ();
+  for (i = 0; i < PERF_WRITE_MESSAGES; i++)
+    {
+      JsonNode *node = json_gvariant_serialize (values[i]);
+      json = cockpit_json_write (node, NULL);
+      json_node_free (node);
+      g_free (json);
+    }
+  dom = g_test_timer_elapsed ();
+
+  g_test_maximized_result (PERF_WRITE_MESSAGES / direct, "direct: %.0f messages/s, %.1f MB/s",
+                           PERF_WRITE_MESSAGES / direct, written / direct / 1000000);
+  g_test_maximized_result (PERF_WRITE_MESSAGES / dom, "json tree: %.0f messages/s",
+                           PERF_WRITE_MESSAGES / dom);
+
+  for (i = 0; i < PERF_WRITE_MESSAGES; i++)
+    g_variant_unref (values[i]);
+  g_free (values);
+  g_string_free (out, TRUE);
+}
+
+typedef struct {
+  const gchar *signature;
+  const gchar *json;
+  const gchar *variant;
+  const gchar *error;
+} ParseFixture;
+
+static const ParseFixture parse_fixtures[] = {
+  { "(ibs)", "[5,true,\"x\"]", "(5, true, 'x')", NULL },
+  { "(ayd)", "[[1,2],3]", "([byte 1, 2], 3.0)", NULL },
+  { "(a{sv})", "[{\"a\":{\"sig\":\"s\",\"val\":\"b\"}}]", "({'a': <'b'>},)", NULL },
+  { "(a{is})", "[{\"1\":\"x\"}]", "({1: 'x'},)", NULL },
+  { "(a{oi})", "[{\"/a\":1}]", "({objectpath '/a': 1},)", NULL },
+  { "(ah)", "[[]]", "(@ah [],)", NULL },
+  { "(v)", "[{\"sig\":\"(ss)\",\"val\":[\"a\",\"b\"]}]", "(<('a', 'b')>,)", NULL },
+  { "(ii)", "[1]", NULL, "Too few values in tuple/struct" },
+  { "(i)", "[1,2]", NULL, "Too many values in tuple/struct" },
+  { "(o)", "[\"not a path\"]", NULL, "Invalid object path 'not a path'" },
+  { "(a{oi})", "[{\"bad\":1}]", NULL, "Invalid object path 'bad'" },
+  { "(ah)", "[[1]]", NULL, "DBus type 'h' is unknown or not supported" },
+  { "(v)", "[{\"sig\":\"?\",\"val\":1}]", NULL, "Indefinite type '?' is not supported" },
+  { "(v)", "[{\"sig\":\"(\",\"val\":1}]", NULL, "JSON 'sig' field '(' is invalid" },
+  { "(s)", "[5]", NULL, "Unexpected type 'gint64' in JSON node" },
+};
+
+static void
+test_parse_args (gconstpointer data)
+{
+  const ParseFixture *fixture = data;
+  CockpitDBusConverter *converter;
+  GError *error = NULL;
+  GVariant *expected;
+  GVariant *value;
+  JsonNode *node;
+
+  node = cockpit_json_parse (fixture->json, -1, &error);
+  g_assert_no_error (error);
+
+  converter = cockpit_dbus_converter_lookup (fixture->signature);
+  g_assert (converter != NULL);
+
+  value = cockpit_dbus_converter_parse (converter, node, &error);
+  if (fixture->error)
+    {
+      g_assert (value == NULL);
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+      g_assert_cmpstr (error->message, ==, fixture->error);
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_assert_no_error (error);
+      g_variant_ref_sink (value);
+      expected = g_variant_parse (NULL, fixture->variant, NULL, NULL, &error);
+      g_assert_no_error (error);
+      g_assert (g_variant_equal (value, expected));
+      g_variant_unref (expected);
+      g_variant_unref (value);
+    }
+
+  cockpit_dbus_converter_unref (converter);
+  json_node_free (node);
+}
+
+static void
+test_parse_cached (void)
+{
+  CockpitDBusConverter *one;
+  CockpitDBusConverter *two;
+
+  one = cockpit_dbus_converter_lookup ("(sa{sv})");
+  two = cockpit_dbus_converter_lookup ("(sa{sv})");
+  g_assert (one == two);
+  cockpit_dbus_converter_unref (one);
+  cockpit_dbus_converter_unref (two);
+
+  g_assert (cockpit_dbus_converter_lookup ("(s") == NULL);
+}
+
+#define PERF_PARSE_CALLS 50000
+
+static void
+test_perf_parse_args (void)
+{
+  /* Like the arguments of a UDisks2 Block.Format() call */
+  static const gchar *signature = "(sa{sv})";
+  static const gchar *json =
+    "[\"xfs\",{\"label\":{\"sig\":\"s\",\"val\":\"data\"},"
+    "\"take-ownership\":{\"sig\":\"b\",\"val\":true},"
+    "\"update-partition-type\":{\"sig\":\"b\",\"val\":true},"
+    "\"erase\":{\"sig\":\"s\",\"val\":\"zero\"},"
+    "\"config-items\":{\"sig\":\"a(sa{sv})\",\"val\":[[\"fstab\",{"
+    "\"dir\":{\"sig\":\"ay\",\"val\":[47,115,114,118]},"
+    "\"passno\":{\"sig\":\"i\",\"val\":2}}]]}}]";
+
+  CockpitDBusConverter *converter;
+  GVariantType *type;
+  GError *error = NULL;
+  GVariant *value;
+  JsonNode *node;
+  gdouble uncached;
+  gdouble cached;
+  guint i;
+
+  node = cockpit_json_parse (json, -1, &error);
+  g_assert_no_error (error);
+
+  /* What every call used to do: go through the signature again */
+  g_test_timer_start ();
+  for (i = 0; i < PERF_PARSE_CALLS; i++)
+    {
+      type = g_variant_type_new (signature);
+      converter = cockpit_dbus_converter_new (type);
+      value = cockpit_dbus_converter_parse (converter, node, &error);
+      g_variant_unref (g_variant_ref_sink (value));
+      cockpit_dbus_converter_unref (converter);
+      g_variant_type_free (type);
+    }
+  uncached = g_test_timer_elapsed ();
+
+  converter = cockpit_dbus_converter_lookup (signature);
+  g_test_timer_start ();
+  for (i = 0; i < PERF_PARSE_CALLS; i++)
+    {
+      value = cockpit_dbus_converter_parse (converter, node, &error);
+      g_variant_unref (g_variant_ref_sink (value));
+    }
+  cached = g_test_timer_elapsed ();
+  cockpit_dbus_converter_unref (converter);
+
+  g_assert_no_error (error);
+
+  g_test_maximized_result (PERF_PARSE_CALLS / cached, "cached: %.2f us per call",
+                           cached * 1000000 / PERF_PARSE_CALLS);
+  g_test_maximized_result (PERF_PARSE_CALLS / uncached, "uncached: %.2f us per call",
+                           uncached * 1000000 / PERF_PARSE_CALLS);
+
+  json_node_free (node);
+}
+
+static void
+on_result_store (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+  GAsyncResult **retval = user_data;
+  g_assert (*retval == NULL);
+  *retval = g_object_ref (result);
+}
+
+static void
+test_introspect_shared (void)
+{
+  GAsyncResult *one = NULL;
+  GAsyncResult *two = NULL;
+  GAsyncResult *missing = NULL;
+  GDBusInterfaceInfo *info1;
+  GDBusInterfaceInfo *info2;
+  GDBusInterfaceInfo *info3;
+  GDBusConnection *connection;
+  GError *error = NULL;
+  GVariant *reply;
+  gchar *owner;
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  reply = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "GetNameOwner",
+                                       g_variant_new ("(s)", "com.redhat.Cockpit.DBusTests.Test"),
+                                       G_VARIANT_TYPE ("(s)"), G_DBUS_CALL_FLAGS_NONE,
+                                       -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_get (reply, "(s)", &owner);
+  g_variant_unref (reply);
+
+  /* Both of these are answered by the same Introspect call */
+  cockpit_dbus_introspect_async (connection, owner, "/otree", "org.freedesktop.DBus.ObjectManager",
+                                 on_result_store, &one);
+  cockpit_dbus_introspect_async (connection, owner, "/otree", "org.freedesktop.DBus.ObjectManager",
+                                 on_result_store, &two);
+  cockpit_dbus_introspect_async (connection, owner, "/otree", "com.redhat.Cockpit.Nope",
+                                 on_result_store, &missing);
+  while (!one || !two || !missing)
+    g_main_context_iteration (NULL, TRUE);
+
+  info1 = cockpit_dbus_introspect_finish (one, &error);
+  g_assert_no_error (error);
+  info2 = cockpit_dbus_introspect_finish (two, &error);
+  g_assert_no_error (error);
+  g_assert (info1 != NULL);
+  g_assert (info1 == info2);
+
+  g_assert (cockpit_dbus_introspect_finish (missing, &error) == NULL);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+  g_clear_error (&error);
+
+  /* And now it's known without asking the service */
+  info3 = cockpit_dbus_introspect_lookup (connection, owner, "/otree", "org.freedesktop.DBus.ObjectManager");
+  g_assert (info3 == info1);
+
+  g_dbus_interface_info_unref (info1);
+  g_dbus_interface_info_unref (info2);
+  g_dbus_interface_info_unref (info3);
+  g_object_unref (one);
+  g_object_unref (two);
+  g_object_unref (missing);
+  g_object_unref (connection);
+  g_free (owner);
+}
+
+static void
+test_shared_manager (void)
+{
+  GAsyncResult *one = NULL;
+  GAsyncResult *two = NULL;
+  GAsyncResult *other = NULL;
+  GDBusObjectManager *manager1;
+  GDBusObjectManager *manager2;
+  GDBusObjectManager *manager3;
+  GDBusObjectManager *late;
+  const gchar *paths[] = { "/otree", NULL };
+  GError *error = NULL;
+  GList *objects;
+
+  cockpit_dbus_manager_get_async (G_BUS_TYPE_SESSION, "com.redhat.Cockpit.DBusTests.Test",
+                                  "/otree", NULL, on_result_store, &one);
+  cockpit_dbus_manager_get_async (G_BUS_TYPE_SESSION, "com.redhat.Cockpit.DBusTests.Test",
+                                  "/otree", NULL, on_result_store, &two);
+  cockpit_dbus_manager_get_async (G_BUS_TYPE_SESSION, "com.redhat.Cockpit.DBusTests.Test",
+                                  NULL, paths, on_result_store, &other);
+  while (!one || !two || !other)
+    g_main_context_iteration (NULL, TRUE);
+
+  manager1 = cockpit_dbus_manager_get_finish (one, &error);
+  g_assert_no_error (error);
+  manager2 = cockpit_dbus_manager_get_finish (two, &error);
+  g_assert_no_error (error);
+  manager3 = cockpit_dbus_manager_get_finish (other, &error);
+  g_assert_no_error (error);
+
+  /* Same service and path get the same manager, a fake one is separate */
+  g_assert (manager1 == manager2);
+  g_assert (manager1 != manager3);
+
+  g_object_unref (one);
+  g_object_unref (two);
+  g_object_unref (other);
+  one = NULL;
+
+  /* A late joiner gets the manager with all its objects already there */
+  cockpit_dbus_manager_get_async (G_BUS_TYPE_SESSION, "com.redhat.Cockpit.DBusTests.Test",
+                                  "/otree", NULL, on_result_store, &one);
+  while (!one)
+    g_main_context_iteration (NULL, TRUE);
+  late = cockpit_dbus_manager_get_finish (one, &error);
+  g_assert_no_error (error);
+  g_assert (late == manager1);
+  g_object_unref (one);
+
+  objects = g_dbus_object_manager_get_objects (late);
+  g_assert (objects != NULL);
+  g_list_free_full (objects, g_object_unref);
+
+  g_object_unref (manager1);
+  g_object_unref (manager2);
+  g_object_unref (manager3);
+  g_object_unref (late);
+  one = NULL;
+
+  /* Once everyone lets go, the next one is made fresh */
+  cockpit_dbus_manager_get_async (G_BUS_TYPE_SESSION, "com.redhat.Cockpit.DBusTests.Test",
+                                  "/otree", NULL, on_result_store, &one);
+  while (!one)
+    g_main_context_iteration (NULL, TRUE);
+  manager1 = cockpit_dbus_manager_get_finish (one, &error);
+  g_assert_no_error (error);
+  g_assert (G_IS_DBUS_OBJECT_MANAGER (manager1));
+  g_object_unref (manager1);
+  g_object_unref (one);
+}
+
 static void
 test_dispose_invalid (void)
 {
@@ -203,17 +984,79 @@ test_dispose_invalid (void)
   g_object_unref (channel);
 }
 
+static const TestFixture fixture_property_deltas = {
+  .property_deltas = TRUE
+};
+
+static const TestFixture fixture_chunked_seed = {
+  .chunked_seed = TRUE
+};
+
+static const TestFixture fixture_path_prefix = {
+  .path_prefix = "/otree/frob"
+};
+
+static const TestFixture fixture_interfaces = {
+  .interface = "com.redhat.Cockpit.DBusTests.Alpha"
+};
+
+static const TestFixture fixture_batch = {
+  .property_deltas = TRUE,
+  .batch_window = 100
+};
+
 int
 main (int argc,
       char *argv[])
 {
   GTestDBus *bus;
+  gchar *name;
   gint ret;
+  guint i;
 
   cockpit_test_init (&argc, &argv);
 
   g_test_add ("/dbus-server/seed", TestCase, NULL, setup_dbus_server, test_seed, teardown_dbus_server);
+  g_test_add ("/dbus-server/seed-chunked", TestCase, &fixture_chunked_seed,
+              setup_dbus_server, test_seed_chunked, teardown_dbus_server);
+  g_test_add ("/dbus-server/seed-path-prefix", TestCase, &fixture_path_prefix,
+              setup_dbus_server, test_seed_filtered, teardown_dbus_server);
+  g_test_add ("/dbus-server/seed-interfaces", TestCase, &fixture_interfaces,
+              setup_dbus_server, test_seed_filtered, teardown_dbus_server);
+  g_test_add ("/dbus-server/properties-changed", TestCase, NULL,
+              setup_dbus_server, test_properties_changed, teardown_dbus_server);
+  g_test_add ("/dbus-server/properties-changed-deltas", TestCase, &fixture_property_deltas,
+              setup_dbus_server, test_properties_changed, teardown_dbus_server);
+  g_test_add ("/dbus-server/batch", TestCase, &fixture_batch,
+              setup_dbus_server, test_batch, teardown_dbus_server);
+  g_test_add ("/dbus-server/call-batch", TestCase, NULL,
+              setup_dbus_server, test_call_batch, teardown_dbus_server);
+  g_test_add ("/dbus-server/call-batch-stream", TestCase, NULL,
+              setup_dbus_server, test_call_batch_stream, teardown_dbus_server);
   g_test_add_func ("/dbus-server/dispose-invalid", test_dispose_invalid);
+  g_test_add_func ("/dbus-server/introspect-shared", test_introspect_shared);
+  g_test_add_func ("/dbus-server/shared-manager", test_shared_manager);
+
+  for (i = 0; i < G_N_ELEMENTS (write_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-json/write-variant/%u", i);
+      g_test_add_data_func (name, write_fixtures + i, test_write_variant);
+      g_free (name);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (parse_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-json/parse-args/%u", i);
+      g_test_add_data_func (name, parse_fixtures + i, test_parse_args);
+      g_free (name);
+    }
+  g_test_add_func ("/dbus-json/parse-cached", test_parse_cached);
+
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/dbus-json/perf/write-variant", test_perf_write_variant);
+      g_test_add_func ("/dbus-json/perf/parse-args", test_perf_parse_args);
+    }
 
   /* This isolates us from affecting other processes during tests */
   bus = g_test_dbus_new (G_TEST_DBUS_NONE);
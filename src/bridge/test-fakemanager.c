@@ -831,6 +831,94 @@ test_properties_changed (TestCase *tc,
   g_object_unref (manager);
 }
 
+static void
+create_objects (guint count)
+{
+  GDBusConnection *connection;
+  GError *error = NULL;
+  GVariant *retval;
+  gchar *path;
+  guint i;
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Subpaths of /otree because GDbusObjectManagerServer is artificially limited to that */
+  for (i = 0; i < count; i++)
+    {
+      path = g_strdup_printf ("/otree/many/%u", i);
+      retval = g_dbus_connection_call_sync (connection, "com.redhat.Cockpit.DBusTests.Test",
+                                            "/otree/frobber", "com.redhat.Cockpit.DBusTests.Frobber",
+                                            "CreateObject", g_variant_new ("(o)", path),
+                                            G_VARIANT_TYPE ("()"), G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                            -1, NULL, &error);
+      g_assert_no_error (error);
+      g_variant_unref (retval);
+      g_free (path);
+    }
+
+  g_object_unref (connection);
+}
+
+static void
+test_many_objects (TestCase *tc,
+                   gconstpointer unused)
+{
+  const gchar *object_paths[] = { "/otree", NULL };
+  GDBusObjectManager *manager;
+  GError *error = NULL;
+  GDBusObject *object;
+  GList *objects;
+
+  /* More than we'll introspect at once */
+  create_objects (100);
+
+  manager = fake_manager_new_sync ("com.redhat.Cockpit.DBusTests.Test",
+                                   object_paths, &error);
+  g_assert_no_error (error);
+
+  /* Everything is there by the time init completes */
+  objects = g_dbus_object_manager_get_objects (manager);
+  g_assert_cmpint (g_list_length (objects), ==, 102);
+  g_list_free_full (objects, g_object_unref);
+
+  object = g_dbus_object_manager_get_object (manager, "/otree/many/99");
+  g_assert (G_IS_DBUS_OBJECT (object));
+  g_object_unref (object);
+
+  g_object_unref (manager);
+}
+
+#define PERF_OBJECTS 2000
+
+static void
+test_perf_introspect (TestCase *tc,
+                      gconstpointer unused)
+{
+  const gchar *object_paths[] = { "/otree", NULL };
+  GDBusObjectManager *manager;
+  GError *error = NULL;
+  GList *objects;
+  gdouble elapsed;
+
+  create_objects (PERF_OBJECTS);
+
+  g_test_timer_start ();
+  manager = fake_manager_new_sync ("com.redhat.Cockpit.DBusTests.Test",
+                                   object_paths, &error);
+  elapsed = g_test_timer_elapsed ();
+  g_assert_no_error (error);
+
+  objects = g_dbus_object_manager_get_objects (manager);
+  g_assert_cmpint (g_list_length (objects), ==, PERF_OBJECTS + 2);
+  g_list_free_full (objects, g_object_unref);
+
+  g_test_maximized_result (PERF_OBJECTS / elapsed, "%.0f objects per second",
+                           PERF_OBJECTS / elapsed);
+
+  g_object_unref (manager);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -868,12 +956,20 @@ main (int argc,
               setup_mock, test_signal_emission, teardown_mock);
   g_test_add ("/fake-manager/properties-changed", TestCase, NULL,
               setup_mock, test_properties_changed, teardown_mock);
+  g_test_add ("/fake-manager/many-objects", TestCase, NULL,
+              setup_mock, test_many_objects, teardown_mock);
 
   g_test_add ("/fake-manager/name-vanished", TestCase, NULL,
               setup_mock, test_name_vanished, teardown_mock);
   g_test_add ("/fake-manager/connection-closed", TestCase, NULL,
               setup_mock, test_connection_closed, teardown_mock);
 
+  if (g_test_perf ())
+    {
+      g_test_add ("/fake-manager/perf/introspect", TestCase, NULL,
+                  setup_mock, test_perf_introspect, teardown_mock);
+    }
+
   /* This isolates us from affecting other processes during tests */
   bus = g_test_dbus_new (G_TEST_DBUS_NONE);
   g_test_dbus_up (bus);
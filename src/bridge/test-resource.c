@@ -24,6 +24,8 @@
 
 #include "common/cockpittest.h"
 
+#include <glib/gstdio.h>
+
 extern const gchar **cockpit_bridge_data_dirs;
 
 typedef struct {
@@ -204,6 +206,113 @@ test_large (TestCase *tc,
   g_free (contents);
 }
 
+static void
+wait_channel (TestCase *tc,
+              CockpitChannel *channel)
+{
+  tc->closed = FALSE;
+  g_signal_connect (channel, "closed", G_CALLBACK (on_channel_close), tc);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  g_object_unref (channel);
+}
+
+static GBytes *
+request_resource (TestCase *tc,
+                  const gchar *package,
+                  const gchar *path)
+{
+  wait_channel (tc, cockpit_resource_open (COCKPIT_TRANSPORT (tc->transport), "444",
+                                           package, path, NULL));
+  return combine_output (tc, NULL);
+}
+
+static gchar *
+write_file (const gchar *directory,
+            const gchar *name,
+            const gchar *contents)
+{
+  GError *error = NULL;
+  gchar *filename;
+
+  filename = g_build_filename (directory, name, NULL);
+  g_file_set_contents (filename, contents, -1, &error);
+  g_assert_no_error (error);
+  return filename;
+}
+
+static void
+test_cached (TestCase *tc,
+             gconstpointer fixture)
+{
+  const gchar *datadirs[] = { NULL, NULL };
+  GError *error = NULL;
+  gchar *directory;
+  gchar *package;
+  gchar *manifest;
+  gchar *filename;
+  GBytes *data;
+
+  g_assert (fixture == &fixture_large);
+
+  while (tc->closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+  g_bytes_unref (combine_output (tc, NULL));
+
+  /* A package of our own, so its file can change underneath */
+  directory = g_dir_make_tmp ("test-resource.XXXXXX", &error);
+  g_assert_no_error (error);
+  package = g_build_filename (directory, "cockpit", "cached", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (package, 0700), ==, 0);
+  manifest = write_file (package, "manifest.json", "{ }");
+  filename = write_file (package, "file.txt", "Original contents\n");
+
+  /* Listing the packages loads them along with their checksums */
+  datadirs[0] = directory;
+  cockpit_bridge_data_dirs = datadirs;
+  wait_channel (tc, cockpit_resource_open (COCKPIT_TRANSPORT (tc->transport), "444",
+                                           NULL, NULL, NULL));
+
+  data = request_resource (tc, "cached", "/file.txt");
+  cockpit_assert_bytes_eq (data, "Original contents\n", -1);
+  g_bytes_unref (data);
+
+  /* The checksum is still the same, so what was cached is served */
+  g_free (write_file (package, "file.txt", "Changed contents\n"));
+  data = request_resource (tc, "cached", "/file.txt");
+  cockpit_assert_bytes_eq (data, "Original contents\n", -1);
+  g_bytes_unref (data);
+
+  /* Turning the cache off drops it, and the file is read again */
+  cockpit_resource_set_cache_size (0);
+  data = request_resource (tc, "cached", "/file.txt");
+  cockpit_assert_bytes_eq (data, "Changed contents\n", -1);
+  g_bytes_unref (data);
+  cockpit_resource_set_cache_size (8 * 1024 * 1024);
+
+  g_assert_cmpint (g_unlink (filename), ==, 0);
+  g_assert_cmpint (g_unlink (manifest), ==, 0);
+  g_assert_cmpint (g_rmdir (package), ==, 0);
+  g_free (package);
+  package = g_build_filename (directory, "cockpit", NULL);
+  g_assert_cmpint (g_rmdir (package), ==, 0);
+  g_assert_cmpint (g_rmdir (directory), ==, 0);
+
+  /* Back to the usual packages for the other tests */
+  cockpit_bridge_data_dirs = NULL;
+  wait_channel (tc, cockpit_resource_open (COCKPIT_TRANSPORT (tc->transport), "444",
+                                           NULL, NULL, NULL));
+
+  g_free (filename);
+  g_free (manifest);
+  g_free (package);
+  g_free (directory);
+}
+
 static const Fixture fixture_listing = {
   .package = NULL,
   .path = NULL,
@@ -421,6 +530,8 @@ main (int argc,
               setup, test_minified, teardown);
   g_test_add ("/resource/large", TestCase, &fixture_large,
               setup, test_large, teardown);
+  g_test_add ("/resource/cached", TestCase, &fixture_large,
+              setup, test_cached, teardown);
   g_test_add ("/resource/listing", TestCase, &fixture_listing,
               setup, test_listing, teardown);
   g_test_add ("/resource/not-found", TestCase, &fixture_not_found,
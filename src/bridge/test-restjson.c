@@ -148,8 +148,10 @@ typedef struct {
   gboolean slowly; /* write one byte at a time */
   gboolean stutter; /* write data, then wait, then close */
   gboolean no_length; /* don't send Content-Length */
+  gboolean hang_up; /* close without answering the request */
   gint connections;
   gint connections_now_open;
+  gint unanswered; /* requests left unread when a connection closed */
 }MockServer;
 
 typedef GThreadedSocketServiceClass MockServerClass;
@@ -300,12 +302,15 @@ mock_server_handle (MockServer *self,
   gboolean keep_alive;
   JsonNode *node;
 
-  /* Read the request */
+  /* Read the request, pipelined requests may already be buffered */
   do
     {
-      if (g_buffered_input_stream_fill (in, 1024, NULL, &error) == 0)
-        return FALSE; /* connection closed */
-      g_assert_no_error (error);
+      if (g_buffered_input_stream_get_available (in) == 0)
+        {
+          if (g_buffered_input_stream_fill (in, 1024, NULL, &error) == 0)
+            return FALSE; /* connection closed */
+          g_assert_no_error (error);
+        }
 
       if (what == NULL)
         {
@@ -329,6 +334,7 @@ mock_server_handle (MockServer *self,
           if (off == 0)
             continue;
           g_assert_cmpint (g_input_stream_skip (G_INPUT_STREAM (in), off, NULL, NULL), ==, off);
+          g_assert (g_hash_table_lookup (headers, "Host") != NULL);
         }
 
       value = g_hash_table_lookup (headers, "Content-Length");
@@ -359,7 +365,9 @@ mock_server_handle (MockServer *self,
     }
   while (0);
 
-  if (g_str_equal (what, "GET /stream"))
+  if (self->hang_up)
+    keep_alive = FALSE;
+  else if (g_str_equal (what, "GET /stream"))
     keep_alive = mock_server_stream (self, out);
   else
     keep_alive = mock_server_respond (self, what, out);
@@ -391,6 +399,9 @@ mock_server_connection (GThreadedSocketService *service,
    }
   while (keep_alive);
 
+  if (g_buffered_input_stream_get_available (G_BUFFERED_INPUT_STREAM (in)) > 0)
+    self->unanswered++;
+
   g_io_stream_close (G_IO_STREAM (connection), NULL, &error);
   g_assert_no_error (error);
   g_object_unref (in);
@@ -577,6 +588,18 @@ send_request (TestCase *tc,
   g_bytes_unref (sent);
 }
 
+static void
+cookie_request (TestCase *tc,
+                const gchar *path,
+                gint cookie)
+{
+  gchar *data;
+
+  data = g_strdup_printf ("{\"method\":\"GET\",\"path\":\"%s\",\"cookie\":%d}", path, cookie);
+  send_request (tc, data);
+  g_free (data);
+}
+
 static gint
 simple_request (TestCase *tc,
                 const gchar *method,
@@ -798,6 +821,191 @@ test_keep_alive (TestCase *tc,
   g_assert_cmpint (tc->server->connections, ==, 1);
 }
 
+static void
+wait_for_replies (TestCase *tc,
+                  guint count)
+{
+  JsonNode *node;
+  gboolean complete;
+  guint i;
+
+  while (g_queue_get_length (tc->sent) < count && tc->channel_problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (g_queue_get_length (tc->sent), ==, count);
+  for (i = 0; i < count; i++)
+    {
+      /* The mock transport owns the parsed replies */
+      node = g_queue_pop_head (tc->sent);
+      g_assert (cockpit_json_get_bool (json_node_get_object (node), "complete", FALSE, &complete));
+      g_assert (complete);
+    }
+}
+
+static void
+test_keep_alive_pool (TestCase *tc,
+                      gconstpointer unused)
+{
+  gint i;
+
+  tc->server->keep_alive = TRUE;
+
+  for (i = 0; i < 7; i++)
+    mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+
+  /* One connection that we know has keep-alive */
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* Concurrent requests each need a connection */
+  for (i = 2; i < 5; i++)
+    cookie_request (tc, "/", i);
+  wait_for_replies (tc, 3);
+  g_assert_cmpint (tc->server->connections, ==, 3);
+
+  /* And then they're all reused */
+  for (i = 5; i < 8; i++)
+    cookie_request (tc, "/", i);
+  wait_for_replies (tc, 3);
+  g_assert_cmpint (tc->server->connections, ==, 3);
+}
+
+static void
+test_pipeline (TestCase *tc,
+               gconstpointer unused)
+{
+  gint i;
+
+  tc->server->keep_alive = TRUE;
+  json_object_set_boolean_member (tc->options, "pipeline", TRUE);
+
+  for (i = 0; i < 5; i++)
+    mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* These all queue up on the one keep-alive connection */
+  for (i = 2; i < 6; i++)
+    cookie_request (tc, "/", i);
+  wait_for_replies (tc, 4);
+
+  g_assert_cmpint (tc->server->connections, ==, 1);
+}
+
+static void
+test_pipeline_cancel (TestCase *tc,
+                      gconstpointer unused)
+{
+  tc->server->keep_alive = TRUE;
+  json_object_set_boolean_member (tc->options, "pipeline", TRUE);
+
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* The cancelled response is still read, but not sent */
+  cookie_request (tc, "/", 2);
+  cookie_request (tc, "/", 3);
+  cancel_request (tc, 2);
+
+  while (all_is_quiet (tc))
+    g_main_context_iteration (NULL, TRUE);
+
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":3,\"status\":200,\"message\":\"OK\","
+                  " \"complete\":true,\"body\":{\"key\":\"value\"}}");
+
+  g_assert_cmpint (tc->server->connections, ==, 1);
+}
+
+static void
+test_pipeline_server_close (TestCase *tc,
+                            gconstpointer unused)
+{
+  gint i;
+
+  tc->server->keep_alive = TRUE;
+  json_object_set_boolean_member (tc->options, "pipeline", TRUE);
+
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+
+  /* The server closes the connection after this one */
+  tc->server->keep_alive = FALSE;
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  tc->server->keep_alive = TRUE;
+
+  for (i = 0; i < 3; i++)
+    mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* The ones pipelined behind the closing response are sent again */
+  for (i = 2; i < 6; i++)
+    cookie_request (tc, "/", i);
+  wait_for_replies (tc, 4);
+
+  g_assert_cmpstr (tc->channel_problem, ==, NULL);
+  g_assert_cmpint (tc->server->connections, ==, 4);
+}
+
+static void
+test_pipeline_post_close (TestCase *tc,
+                          gconstpointer unused)
+{
+  tc->server->keep_alive = TRUE;
+  json_object_set_boolean_member (tc->options, "pipeline", TRUE);
+
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  tc->server->keep_alive = FALSE;
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  mock_server_response (tc->server, "POST", "/", 200, "{ \"key\": \"posted\" }");
+
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* The POST isn't pipelined behind a response that closes the connection */
+  cookie_request (tc, "/", 2);
+  send_request (tc, "{\"method\":\"POST\",\"path\":\"/\",\"cookie\":3,\"body\":[]}");
+  wait_for_replies (tc, 2);
+
+  g_assert_cmpstr (tc->channel_problem, ==, NULL);
+  g_assert_cmpint (tc->server->connections, ==, 2);
+  g_assert_cmpint (tc->server->unanswered, ==, 0);
+}
+
+static void
+test_post_idle_closed (TestCase *tc,
+                       gconstpointer unused)
+{
+  tc->server->keep_alive = TRUE;
+
+  mock_server_response (tc->server, "GET", "/", 200, "{ \"key\": \"value\" }");
+  mock_server_response (tc->server, "POST", "/", 200, "{ \"key\": \"posted\" }");
+
+  cookie_request (tc, "/", 1);
+  wait_for_replies (tc, 1);
+
+  /* The server closes the idle connection when the POST arrives on it */
+  tc->server->hang_up = TRUE;
+  send_request (tc, "{\"method\":\"POST\",\"path\":\"/\",\"cookie\":2,\"body\":[]}");
+
+  while (all_is_quiet (tc))
+    g_main_context_iteration (NULL, TRUE);
+
+  /* It may have been acted on, so it fails rather than being sent again */
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":2,\"status\":502,"
+                  " \"message\":\"Connection closed before response\",\"complete\":true}");
+
+  g_assert_cmpstr (tc->channel_problem, ==, NULL);
+  g_assert_cmpint (tc->server->connections, ==, 1);
+}
+
 static void
 test_bad_json (TestCase *tc,
                gconstpointer unused)
@@ -892,23 +1100,97 @@ test_failure_message (TestCase *tc,
 
 
 static void
-test_skip_body_error_version (TestCase *tc,
-                              gconstpointer unused)
+test_http11 (TestCase *tc,
+             gconstpointer unused)
 {
-  tc->server->slowly = TRUE;
-
   mock_server_push (tc->server, "GET", "/",
-                    g_strdup ("HTTP/1.1 400 Bad\r\nContent-type: application/json\r\n\r\n{ }"));
+                    g_strdup ("HTTP/1.1 400 Bad\r\nContent-type: application/json\r\n"
+                              "Content-Length: 3\r\n\r\n{ }"));
 
   simple_request (tc, "GET", "/");
 
-  /* Even though had json, skipped due to HTTP version, (only works one errors) */
   while (all_is_quiet (tc))
     g_main_context_iteration (NULL, TRUE);
 
   assert_json_eq (g_queue_pop_head (tc->sent),
                   "{\"cookie\":0,\"status\":400,\"message\":\"Bad\","
-                  " \"complete\":true}");
+                  " \"complete\":true,\"body\":{}}");
+}
+
+static void
+test_chunked (TestCase *tc,
+              gconstpointer data)
+{
+  tc->server->slowly = GPOINTER_TO_INT (data);
+
+  /* JSON split across chunks, and a chunk extension */
+  mock_server_push (tc->server, "GET", "/",
+                    g_strdup ("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n"
+                              "5\r\n{\"a\":\r\n"
+                              "3;ext=1\r\n 1}\r\n"
+                              "8\r\n[1,2,3]\n\r\n"
+                              "0\r\nX-Trailer: yes\r\n\r\n"));
+
+  simple_request (tc, "GET", "/");
+
+  while (g_queue_get_length (tc->sent) < 3 && tc->channel_problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\",\"body\":{\"a\":1}}");
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\",\"body\":[1,2,3]}");
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\",\"complete\":true}");
+}
+
+static void
+test_chunked_keep_alive (TestCase *tc,
+                         gconstpointer unused)
+{
+  gint i;
+
+  for (i = 0; i < 2; i++)
+    {
+      mock_server_push (tc->server, "GET", "/",
+                        g_strdup ("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                  "Connection: keep-alive\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                  "7\r\n{\"a\":1}\r\n0\r\n\r\n"));
+    }
+
+  /* The end of the chunked body is known, so the connection is reused */
+  for (i = 0; i < 2; i++)
+    {
+      simple_request (tc, "GET", "/");
+
+      while (g_queue_get_length (tc->sent) < 2 && tc->channel_problem == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      assert_json_eq (g_queue_pop_head (tc->sent),
+                      "{\"cookie\":0,\"status\":200,\"message\":\"OK\",\"body\":{\"a\":1}}");
+      assert_json_eq (g_queue_pop_head (tc->sent),
+                      "{\"cookie\":0,\"status\":200,\"message\":\"OK\",\"complete\":true}");
+    }
+
+  g_assert_cmpint (tc->server->connections, ==, 1);
+}
+
+static void
+test_bad_chunked (TestCase *tc,
+                  gconstpointer unused)
+{
+  cockpit_expect_message ("*received invalid chunk in REST JSON response");
+
+  mock_server_push (tc->server, "GET", "/",
+                    g_strdup ("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nZZ\r\n"));
+
+  simple_request (tc, "GET", "/");
+
+  while (all_is_quiet (tc))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (tc->channel_problem, ==, "protocol-error");
 }
 
 static void
@@ -1054,6 +1336,39 @@ test_poll_interval (TestCase *tc,
   g_assert_cmpint (count, ==, 5 + 1);
 }
 
+static void
+test_poll_patch (TestCase *tc,
+                 gconstpointer unused)
+{
+  mock_server_response (tc->server, "GET", "/poll", 200,
+                        "{ \"key\": 0, \"names\": [ \"one\", \"two\", \"three\", \"four\" ] }");
+  mock_server_response (tc->server, "GET", "/poll", 200,
+                        "{ \"key\": 1, \"names\": [ \"one\", \"two\", \"three\", \"four\" ] }");
+  mock_server_response (tc->server, "GET", "/poll", 200,
+                        "{ \"other\": true }");
+
+  send_request (tc, "{ \"method\": \"GET\", \"path\": \"/poll\", "
+                "\"poll\": { \"interval\": 20, \"patch\": true }}");
+
+  while (g_queue_get_length (tc->sent) < 4 && tc->channel_problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* First the whole thing, then only what changed */
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\","
+                  " \"body\":{\"key\":0,\"names\":[\"one\",\"two\",\"three\",\"four\"]}}");
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\","
+                  " \"patch\":[{\"op\":\"replace\",\"path\":\"/key\",\"value\":1}]}");
+
+  /* When the patch would be bigger, everything is sent again */
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":200,\"message\":\"OK\","
+                  " \"body\":{\"other\":true}}");
+  assert_json_eq (g_queue_pop_head (tc->sent),
+                  "{\"cookie\":0,\"status\":404,\"message\":\"Not Found\",\"complete\":true}");
+}
+
 static void
 test_poll_stutter (TestCase *tc,
                    gconstpointer unused)
@@ -1230,6 +1545,26 @@ main (int argc,
               setup, test_slowly, teardown);
   g_test_add ("/rest-json/keep-alive", TestCase, NULL,
               setup, test_keep_alive, teardown);
+  g_test_add ("/rest-json/keep-alive-pool", TestCase, NULL,
+              setup, test_keep_alive_pool, teardown);
+  g_test_add ("/rest-json/pipeline", TestCase, NULL,
+              setup, test_pipeline, teardown);
+  g_test_add ("/rest-json/pipeline-cancel", TestCase, NULL,
+              setup, test_pipeline_cancel, teardown);
+  g_test_add ("/rest-json/pipeline-server-close", TestCase, NULL,
+              setup, test_pipeline_server_close, teardown);
+  g_test_add ("/rest-json/pipeline-post-close", TestCase, NULL,
+              setup, test_pipeline_post_close, teardown);
+  g_test_add ("/rest-json/post-idle-closed", TestCase, NULL,
+              setup, test_post_idle_closed, teardown);
+  g_test_add ("/rest-json/http11", TestCase, NULL,
+              setup, test_http11, teardown);
+  g_test_add ("/rest-json/chunked", TestCase, GINT_TO_POINTER (FALSE),
+              setup, test_chunked, teardown);
+  g_test_add ("/rest-json/chunked-slowly", TestCase, GINT_TO_POINTER (TRUE),
+              setup, test_chunked, teardown);
+  g_test_add ("/rest-json/chunked-keep-alive", TestCase, NULL,
+              setup, test_chunked_keep_alive, teardown);
 
   g_test_add ("/rest-json/bad-json", TestCase, NULL,
               setup, test_bad_json, teardown);
@@ -1237,6 +1572,8 @@ main (int argc,
               setup, test_bad_status, teardown);
   g_test_add ("/rest-json/bad-truncated", TestCase, NULL,
               setup, test_bad_truncated, teardown);
+  g_test_add ("/rest-json/bad-chunked", TestCase, NULL,
+              setup, test_bad_chunked, teardown);
   g_test_add ("/rest-json/bad-content-length", TestCase, NULL,
               setup, test_bad_content_length, teardown);
   g_test_add ("/rest-json/bad-version", TestCase, NULL,
@@ -1245,8 +1582,6 @@ main (int argc,
 
   g_test_add ("/rest-json/failure-message", TestCase, NULL,
               setup, test_failure_message, teardown);
-  g_test_add ("/rest-json/skip-body-error-version", TestCase, NULL,
-              setup, test_skip_body_error_version, teardown);
   g_test_add ("/rest-json/stream", TestCase, NULL,
               setup, test_stream, teardown);
   g_test_add ("/rest-json/stream-stutter", TestCase, NULL,
@@ -1259,6 +1594,8 @@ main (int argc,
               setup, test_poll_watch, teardown);
   g_test_add ("/rest-json/poll-stutter", TestCase, NULL,
               setup, test_poll_stutter, teardown);
+  g_test_add ("/rest-json/poll-patch", TestCase, NULL,
+              setup, test_poll_patch, teardown);
 
   return g_test_run ();
 }
@@ -0,0 +1,304 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitfairqueue.h"
+
+/**
+ * CockpitFairQueue:
+ *
+ * Holds frames waiting to be sent over a transport, and decides which
+ * goes next. Each channel has its own queue, and the channels take
+ * turns by deficit round robin, so that a channel sending lots of data
+ * doesn't hold up the others.
+ *
+ * Control messages that aren't about a specific channel go out before
+ * everything else. Control messages about a channel, such as "close",
+ * are pushed with cockpit_fair_queue_push_control() and kept in order
+ * with the data of that channel.
+ */
+
+typedef struct {
+  GBytes *prefix;
+  GBytes *payload;
+  gsize size;
+} QueuedFrame;
+
+typedef struct {
+  gchar *channel;
+  GQueue frames;
+  gsize deficit;
+} ChannelFlow;
+
+struct _CockpitFairQueue {
+  gsize quantum;
+
+  /* Channel-less control messages */
+  GQueue control;
+
+  /* ChannelFlow structs with frames, in turn order */
+  GQueue active;
+
+  /* Channel id -> ChannelFlow, owns the flows */
+  GHashTable *flows;
+
+  /* Bytes in all the queued frames */
+  gsize size;
+};
+
+static void
+queued_frame_free (gpointer data)
+{
+  QueuedFrame *frame = data;
+  if (frame->prefix)
+    g_bytes_unref (frame->prefix);
+  g_bytes_unref (frame->payload);
+  g_free (frame);
+}
+
+static void
+channel_flow_free (gpointer data)
+{
+  ChannelFlow *flow = data;
+  while (flow->frames.head)
+    queued_frame_free (g_queue_pop_head (&flow->frames));
+  g_free (flow->channel);
+  g_free (flow);
+}
+
+/**
+ * cockpit_fair_queue_new:
+ * @quantum: bytes a channel may send each turn
+ *
+ * Create a new empty queue.
+ *
+ * Returns: (transfer full): the new queue
+ */
+CockpitFairQueue *
+cockpit_fair_queue_new (gsize quantum)
+{
+  CockpitFairQueue *queue;
+
+  g_return_val_if_fail (quantum > 0, NULL);
+
+  queue = g_new0 (CockpitFairQueue, 1);
+  queue->quantum = quantum;
+  queue->flows = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, channel_flow_free);
+  return queue;
+}
+
+/**
+ * cockpit_fair_queue_free:
+ * @queue: a queue
+ *
+ * Free the queue along with any frames still in it.
+ */
+void
+cockpit_fair_queue_free (CockpitFairQueue *queue)
+{
+  if (queue == NULL)
+    return;
+
+  cockpit_fair_queue_clear (queue);
+  g_hash_table_destroy (queue->flows);
+  g_free (queue);
+}
+
+static void
+push_frame (CockpitFairQueue *queue,
+            const gchar *channel,
+            GBytes *prefix,
+            GBytes *payload)
+{
+  ChannelFlow *flow;
+  QueuedFrame *frame;
+
+  frame = g_new0 (QueuedFrame, 1);
+  frame->prefix = prefix ? g_bytes_ref (prefix) : NULL;
+  frame->payload = g_bytes_ref (payload);
+  frame->size = g_bytes_get_size (payload);
+  if (prefix)
+    frame->size += g_bytes_get_size (prefix);
+  queue->size += frame->size;
+
+  if (!channel)
+    {
+      g_queue_push_tail (&queue->control, frame);
+      return;
+    }
+
+  flow = g_hash_table_lookup (queue->flows, channel);
+  if (!flow)
+    {
+      flow = g_new0 (ChannelFlow, 1);
+      flow->channel = g_strdup (channel);
+      g_hash_table_insert (queue->flows, flow->channel, flow);
+      g_queue_push_tail (&queue->active, flow);
+    }
+
+  g_queue_push_tail (&flow->frames, frame);
+}
+
+/**
+ * cockpit_fair_queue_push:
+ * @queue: a queue
+ * @channel: the channel, or %NULL for a control message
+ * @prefix: (allow-none): framing to send before the payload
+ * @payload: the payload
+ *
+ * Queue a frame. Frames for the same channel are popped in the
+ * order they were pushed. A control message pushed here goes
+ * out before all channel data.
+ */
+void
+cockpit_fair_queue_push (CockpitFairQueue *queue,
+                         const gchar *channel,
+                         GBytes *prefix,
+                         GBytes *payload)
+{
+  g_return_if_fail (queue != NULL);
+  g_return_if_fail (payload != NULL);
+
+  push_frame (queue, channel, prefix, payload);
+}
+
+/**
+ * cockpit_fair_queue_push_control:
+ * @queue: a queue
+ * @channel: (allow-none): the channel the message is about
+ * @prefix: (allow-none): framing to send before the payload
+ * @payload: the control message
+ *
+ * Queue a control message. When it is about a @channel, such as
+ * "close", it's popped in order with the frames of that channel,
+ * so it doesn't overtake that channel's data. Otherwise it goes
+ * out before all channel data.
+ */
+void
+cockpit_fair_queue_push_control (CockpitFairQueue *queue,
+                                 const gchar *channel,
+                                 GBytes *prefix,
+                                 GBytes *payload)
+{
+  g_return_if_fail (queue != NULL);
+  g_return_if_fail (payload != NULL);
+
+  push_frame (queue, channel, prefix, payload);
+}
+
+/**
+ * cockpit_fair_queue_pop:
+ * @queue: a queue
+ * @prefix: (out) (transfer full): location for the framing, or %NULL if none
+ * @payload: (out) (transfer full): location for the payload
+ *
+ * Take the next frame that should be sent off the queue.
+ *
+ * Returns: %FALSE if the queue was empty
+ */
+gboolean
+cockpit_fair_queue_pop (CockpitFairQueue *queue,
+                        GBytes **prefix,
+                        GBytes **payload)
+{
+  ChannelFlow *flow = NULL;
+  QueuedFrame *frame;
+
+  g_return_val_if_fail (queue != NULL, FALSE);
+
+  frame = g_queue_pop_head (&queue->control);
+  while (!frame)
+    {
+      flow = g_queue_peek_head (&queue->active);
+      if (!flow)
+        return FALSE;
+
+      /* This channel has used up its turn, on to the next */
+      frame = g_queue_peek_head (&flow->frames);
+      if (frame->size > flow->deficit)
+        {
+          flow->deficit += queue->quantum;
+          g_queue_push_tail (&queue->active, g_queue_pop_head (&queue->active));
+          frame = NULL;
+          continue;
+        }
+
+      g_queue_pop_head (&flow->frames);
+      flow->deficit -= frame->size;
+
+      /* An idle channel doesn't save up credit */
+      if (g_queue_is_empty (&flow->frames))
+        {
+          g_queue_pop_head (&queue->active);
+          g_hash_table_remove (queue->flows, flow->channel);
+        }
+    }
+
+  queue->size -= frame->size;
+  *prefix = frame->prefix;
+  *payload = frame->payload;
+  frame->prefix = frame->payload = NULL;
+  g_free (frame);
+  return TRUE;
+}
+
+/**
+ * cockpit_fair_queue_is_empty:
+ * @queue: a queue
+ *
+ * Returns: whether there are no frames to pop
+ */
+gboolean
+cockpit_fair_queue_is_empty (CockpitFairQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, TRUE);
+  return g_queue_is_empty (&queue->control) && g_queue_is_empty (&queue->active);
+}
+
+/**
+ * cockpit_fair_queue_get_size:
+ * @queue: a queue
+ *
+ * Returns: the number of bytes in the queued frames, framing included
+ */
+gsize
+cockpit_fair_queue_get_size (CockpitFairQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, 0);
+  return queue->size;
+}
+
+/**
+ * cockpit_fair_queue_clear:
+ * @queue: a queue
+ *
+ * Drop all the frames in the queue.
+ */
+void
+cockpit_fair_queue_clear (CockpitFairQueue *queue)
+{
+  g_return_if_fail (queue != NULL);
+
+  while (queue->control.head)
+    queued_frame_free (g_queue_pop_head (&queue->control));
+  g_queue_clear (&queue->active);
+  g_hash_table_remove_all (queue->flows);
+  queue->size = 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_FAIR_QUEUE_H__
+#define __COCKPIT_FAIR_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _CockpitFairQueue CockpitFairQueue;
+
+CockpitFairQueue * cockpit_fair_queue_new       (gsize quantum);
+
+void               cockpit_fair_queue_free      (CockpitFairQueue *queue);
+
+void               cockpit_fair_queue_push      (CockpitFairQueue *queue,
+                                                 const gchar *channel,
+                                                 GBytes *prefix,
+                                                 GBytes *payload);
+
+void               cockpit_fair_queue_push_control (CockpitFairQueue *queue,
+                                                    const gchar *channel,
+                                                    GBytes *prefix,
+                                                    GBytes *payload);
+
+gboolean           cockpit_fair_queue_pop       (CockpitFairQueue *queue,
+                                                 GBytes **prefix,
+                                                 GBytes **payload);
+
+gboolean           cockpit_fair_queue_is_empty  (CockpitFairQueue *queue);
+
+gsize              cockpit_fair_queue_get_size  (CockpitFairQueue *queue);
+
+void               cockpit_fair_queue_clear     (CockpitFairQueue *queue);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_FAIR_QUEUE_H__ */
@@ -291,6 +291,171 @@ cockpit_json_equal (JsonNode *previous,
     }
 }
 
+static void
+append_pointer_token (GString *path,
+                      const gchar *token)
+{
+  g_string_append_c (path, '/');
+  for (; *token; token++)
+    {
+      if (*token == '~')
+        g_string_append (path, "~0");
+      else if (*token == '/')
+        g_string_append (path, "~1");
+      else
+        g_string_append_c (path, *token);
+    }
+}
+
+static void
+add_diff_op (JsonArray *ops,
+             const gchar *op,
+             const gchar *path,
+             JsonNode *value)
+{
+  JsonObject *object;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "op", op);
+  json_object_set_string_member (object, "path", path);
+  if (value)
+    json_object_set_member (object, "value", json_node_copy (value));
+  json_array_add_object_element (ops, object);
+}
+
+static void
+cockpit_json_diff_node (JsonArray *ops,
+                        GString *path,
+                        JsonNode *previous,
+                        JsonNode *current)
+{
+  JsonObject *prev_object;
+  JsonObject *cur_object;
+  JsonArray *prev_array;
+  JsonArray *cur_array;
+  JsonNodeType type;
+  GList *names;
+  GList *l;
+  gsize len;
+  guint len_previous;
+  guint len_current;
+  gchar index[16];
+  guint i;
+
+  if (cockpit_json_equal (previous, current))
+    return;
+
+  len = path->len;
+  type = json_node_get_node_type (previous);
+
+  if (type == JSON_NODE_OBJECT && json_node_get_node_type (current) == JSON_NODE_OBJECT)
+    {
+      prev_object = json_node_get_object (previous);
+      cur_object = json_node_get_object (current);
+
+      names = json_object_get_members (prev_object);
+      for (l = names; l != NULL; l = g_list_next (l))
+        {
+          if (!json_object_has_member (cur_object, l->data))
+            {
+              append_pointer_token (path, l->data);
+              add_diff_op (ops, "remove", path->str, NULL);
+              g_string_truncate (path, len);
+            }
+        }
+      g_list_free (names);
+
+      names = json_object_get_members (cur_object);
+      for (l = names; l != NULL; l = g_list_next (l))
+        {
+          append_pointer_token (path, l->data);
+          if (json_object_has_member (prev_object, l->data))
+            {
+              cockpit_json_diff_node (ops, path,
+                                      json_object_get_member (prev_object, l->data),
+                                      json_object_get_member (cur_object, l->data));
+            }
+          else
+            {
+              add_diff_op (ops, "add", path->str, json_object_get_member (cur_object, l->data));
+            }
+          g_string_truncate (path, len);
+        }
+      g_list_free (names);
+    }
+  else if (type == JSON_NODE_ARRAY && json_node_get_node_type (current) == JSON_NODE_ARRAY)
+    {
+      prev_array = json_node_get_array (previous);
+      cur_array = json_node_get_array (current);
+      len_previous = json_array_get_length (prev_array);
+      len_current = json_array_get_length (cur_array);
+
+      /* Elements at the same index are compared */
+      for (i = 0; i < MIN (len_previous, len_current); i++)
+        {
+          g_snprintf (index, sizeof (index), "%u", i);
+          append_pointer_token (path, index);
+          cockpit_json_diff_node (ops, path,
+                                  json_array_get_element (prev_array, i),
+                                  json_array_get_element (cur_array, i));
+          g_string_truncate (path, len);
+        }
+
+      /* Removed from the end backwards, so indexes stay valid */
+      for (i = len_previous; i > len_current; i--)
+        {
+          g_snprintf (index, sizeof (index), "%u", i - 1);
+          append_pointer_token (path, index);
+          add_diff_op (ops, "remove", path->str, NULL);
+          g_string_truncate (path, len);
+        }
+
+      for (i = len_previous; i < len_current; i++)
+        {
+          g_snprintf (index, sizeof (index), "%u", i);
+          append_pointer_token (path, index);
+          add_diff_op (ops, "add", path->str, json_array_get_element (cur_array, i));
+          g_string_truncate (path, len);
+        }
+    }
+  else
+    {
+      add_diff_op (ops, "replace", path->str, current);
+    }
+}
+
+/**
+ * cockpit_json_diff:
+ * @previous: the old JSON
+ * @current: the new JSON
+ *
+ * Calculate a JSON patch as described in RFC 6902 which turns
+ * @previous into @current. Only "add", "remove" and "replace"
+ * operations are used.
+ *
+ * Elements of arrays are compared by their index, so inserting
+ * at the start of an array results in a long patch.
+ *
+ * Returns: (transfer full): the patch operations, empty if equal
+ */
+JsonArray *
+cockpit_json_diff (JsonNode *previous,
+                   JsonNode *current)
+{
+  JsonArray *ops;
+  GString *path;
+
+  g_return_val_if_fail (previous != NULL, NULL);
+  g_return_val_if_fail (current != NULL, NULL);
+
+  ops = json_array_new ();
+  path = g_string_new ("");
+  cockpit_json_diff_node (ops, path, previous, current);
+  g_string_free (path, TRUE);
+
+  return ops;
+}
+
 /**
  * cockpit_json_int_hash:
  * @v: pointer to a gint64
@@ -351,98 +516,154 @@ cockpit_json_skip (const gchar *data,
                    gsize length,
                    gsize *spaces)
 {
-  gint depth = 0;
-  gboolean instr = FALSE;
-  gboolean inword = FALSE;
-  gboolean any = FALSE;
+  CockpitJsonSkip skip;
+
+  cockpit_json_skip_init (&skip);
+  return cockpit_json_skip_next (&skip, data, length, spaces);
+}
+
+/**
+ * cockpit_json_skip_init:
+ * @skip: the state to initialize
+ *
+ * Prepare to skip over a block of JSON with cockpit_json_skip_next().
+ */
+void
+cockpit_json_skip_init (CockpitJsonSkip *skip)
+{
+  memset (skip, 0, sizeof (CockpitJsonSkip));
+}
+
+/**
+ * cockpit_json_skip_next:
+ * @skip: state from a previous call, or cockpit_json_skip_init()
+ * @data: the data to parse
+ * @length: length of data
+ * @spaces: location to return number of prefix spaces, or %NULL
+ *
+ * Like cockpit_json_skip() but resumes where the previous call on
+ * @skip stopped when that didn't find a complete block. The @data
+ * must start at the same place as in that call, with more data
+ * appended, so that data which arrives bit by bit is only scanned
+ * once.
+ *
+ * Once a block is found, @skip is ready to look for the next one,
+ * starting at the returned offset.
+ *
+ * Returns: the number of bytes in the JSON block, or zero
+ */
+gsize
+cockpit_json_skip_next (CockpitJsonSkip *skip,
+                        const gchar *data,
+                        gsize length,
+                        gsize *spaces)
+{
   const gchar *p;
   const gchar *end;
+  gsize ret;
 
-  for (p = data, end = data + length; p != end; p++)
+  g_return_val_if_fail (skip->offset <= length, 0);
+
+  for (p = data + skip->offset, end = data + length; p != end; p++)
     {
-      if (any && depth <= 0)
+      if (skip->any && skip->depth <= 0)
         break; /* skipped over one thing */
 
 #if 0
       g_printerr ("%d:  %c  %s%d%s%s\n", (gint)(p - data), (gint)*p,
-                  depth > 0 ? "+" : "", depth,
-                  instr ? " instr" : "", inword ? " inword" : "");
+                  skip->depth > 0 ? "+" : "", skip->depth,
+                  skip->instr ? " instr" : "", skip->inword ? " inword" : "");
 #endif
 
-      if (inword)
+      if (skip->escape)
         {
-          if (g_ascii_isspace (*p) || strchr ("[{}]\"", *p))
+          skip->escape = FALSE; /* skip char after bs */
+          continue;
+        }
+
+      if (skip->instr)
+        {
+          /* Most of the data is in strings, only look for their ends */
+          while (p != end && *p != '"' && *p != '\\')
+            p++;
+          if (p == end)
+            break;
+          if (*p == '\\')
             {
-              inword = FALSE;
-              depth--;
-              p--;
+              skip->escape = TRUE;
+            }
+          else
+            {
+              skip->instr = FALSE;
+              skip->depth--;
             }
           continue;
         }
 
-      if (g_ascii_isspace (*p))
-        continue;
-
-      if (instr)
+      if (skip->inword)
         {
-          switch (*p)
+          if (g_ascii_isspace (*p) || strchr ("[{}]\"", *p))
             {
-            case '\\':
-              if (p + 1 == end)
-                continue;
-              p++; /* skip char after bs */
-              break;
-            case '"':
-              instr = FALSE;
-              depth--;
-              break;
+              skip->inword = FALSE;
+              skip->depth--;
+              p--;
             }
           continue;
         }
 
-      if (spaces)
+      if (g_ascii_isspace (*p))
+        continue;
+
+      if (!skip->any)
         {
-          *spaces = p - data;
-          spaces = NULL;
+          skip->spaces = p - data;
+          skip->any = TRUE;
         }
 
-      any = TRUE;
       switch (*p)
         {
         case '[': case '{':
-          depth++;
+          skip->depth++;
           break;
         case ']': case '}':
-          depth--;
+          skip->depth--;
           break;
         case '"':
-          instr = TRUE;
-          depth++;
+          skip->instr = TRUE;
+          skip->depth++;
           break;
         default:
-          inword = TRUE;
-          depth++;
+          skip->inword = TRUE;
+          skip->depth++;
           break;
         }
     }
 
+  /* End of data can be end of word */
+  if (skip->inword && skip->depth == 1)
+    {
+      skip->inword = FALSE;
+      skip->depth = 0;
+    }
+
+  /* No complete JSON blocks found, continue from here next time */
+  if (skip->depth > 0)
+    {
+      skip->offset = length;
+      return 0;
+    }
+
   /* Consume any trailing whitespace */
   while (p != end && g_ascii_isspace (*p))
     p++;
 
-  if (!any && spaces)
-    *spaces = p - data;
-
-  /* End of data can be end of word */
-  if (inword && depth == 1)
-    depth = 0;
-
-  /* No complete JSON blocks found */
-  if (depth > 0)
-    return 0;
-
   /* The position at which we found the end */
-  return p - data;
+  ret = p - data;
+  if (spaces)
+    *spaces = skip->any ? skip->spaces : ret;
+
+  cockpit_json_skip_init (skip);
+  return ret;
 }
 
 /**
@@ -636,58 +857,87 @@ static gchar *dump_object (const gchar   *name,
                            JsonObject    *object,
                            gsize         *length);
 
-static gchar *
-json_strescape (const gchar *str)
+static void
+append_escaped (GString *output,
+                const gchar *str)
 {
   const gchar *p;
-  const gchar *end;
-  GString *output;
-  gsize len;
-
-  len = strlen (str);
-  end = str + len;
-  output = g_string_sized_new (len);
+  const gchar *run;
+  guchar c;
 
-  for (p = str; p < end; p++)
+  /* Copy unescaped runs in one go */
+  for (p = run = str; *p; p++)
     {
-      if (*p == '\\' || *p == '"')
+      c = *p;
+      if (c != '\\' && c != '"' && c >= 0x20 && c != 0x7f)
+        continue;
+
+      g_string_append_len (output, run, p - run);
+      run = p + 1;
+
+      switch (c)
         {
+        case '\\':
+        case '"':
           g_string_append_c (output, '\\');
-          g_string_append_c (output, *p);
-        }
-      else if ((*p > 0 && *p < 0x1f) || *p == 0x7f)
-        {
-          switch (*p)
-            {
-            case '\b':
-              g_string_append (output, "\\b");
-              break;
-            case '\f':
-              g_string_append (output, "\\f");
-              break;
-            case '\n':
-              g_string_append (output, "\\n");
-              break;
-            case '\r':
-              g_string_append (output, "\\r");
-              break;
-            case '\t':
-              g_string_append (output, "\\t");
-              break;
-            default:
-              g_string_append_printf (output, "\\u00%02x", (guint)*p);
-              break;
-            }
-        }
-      else
-        {
-          g_string_append_c (output, *p);
+          g_string_append_c (output, c);
+          break;
+        case '\b':
+          g_string_append (output, "\\b");
+          break;
+        case '\f':
+          g_string_append (output, "\\f");
+          break;
+        case '\n':
+          g_string_append (output, "\\n");
+          break;
+        case '\r':
+          g_string_append (output, "\\r");
+          break;
+        case '\t':
+          g_string_append (output, "\\t");
+          break;
+        default:
+          {
+            static const gchar hex[] = "0123456789abcdef";
+            g_string_append (output, "\\u00");
+            g_string_append_c (output, hex[c >> 4]);
+            g_string_append_c (output, hex[c & 0xf]);
+          }
+          break;
         }
     }
 
+  g_string_append_len (output, run, p - run);
+}
+
+static gchar *
+json_strescape (const gchar *str)
+{
+  GString *output;
+
+  output = g_string_sized_new (strlen (str));
+  append_escaped (output, str);
   return g_string_free (output, FALSE);
 }
 
+/**
+ * cockpit_json_append_string:
+ * @buffer: the buffer to append to
+ * @str: a nul terminated UTF-8 string
+ *
+ * Append @str to @buffer as a quoted and escaped JSON string. This is
+ * for code that writes JSON directly, without building a JsonNode tree.
+ */
+void
+cockpit_json_append_string (GString *buffer,
+                            const gchar *str)
+{
+  g_string_append_c (buffer, '"');
+  append_escaped (buffer, str);
+  g_string_append_c (buffer, '"');
+}
+
 static gchar *
 dump_value (const gchar   *name,
             JsonNode      *node,
@@ -50,13 +50,37 @@ gchar *        cockpit_json_write_object      (JsonObject *object,
 
 GBytes *       cockpit_json_write_bytes       (JsonObject *object);
 
+void           cockpit_json_append_string     (GString *buffer,
+                                               const gchar *str);
+
 gsize          cockpit_json_skip              (const gchar *data,
                                                gsize length,
                                                gsize *spaces);
 
+typedef struct {
+  /*< private >*/
+  gsize offset;
+  gsize spaces;
+  gint depth;
+  guint any : 1;
+  guint instr : 1;
+  guint inword : 1;
+  guint escape : 1;
+} CockpitJsonSkip;
+
+void           cockpit_json_skip_init         (CockpitJsonSkip *skip);
+
+gsize          cockpit_json_skip_next         (CockpitJsonSkip *skip,
+                                               const gchar *data,
+                                               gsize length,
+                                               gsize *spaces);
+
 gboolean       cockpit_json_equal             (JsonNode *previous,
                                                JsonNode *current);
 
+JsonArray *    cockpit_json_diff              (JsonNode *previous,
+                                               JsonNode *current);
+
 gboolean       cockpit_json_get_int           (JsonObject *object,
                                                const gchar *member,
                                                gint64 defawlt,
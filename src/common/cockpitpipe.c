@@ -24,6 +24,7 @@
 
 #include <glib-unix.h>
 
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
@@ -76,19 +77,49 @@ struct _CockpitPipePrivate {
   GSource *in_source;
   GQueue *out_queue;
   gsize out_partial;
+  gsize out_queued;
 
   int in_fd;
   GSource *out_source;
-  GByteArray *in_buffer;
+  gboolean draining;
+  CockpitPipeBuffer *in_buffer;
+  gboolean in_paused;
+  gsize in_window;
 };
 
+/* Reads start at this size and grow while the other end keeps filling them */
+#define MIN_READ_WINDOW   1024
+#define MAX_READ_WINDOW   (256 * 1024)
+
 typedef struct {
   GSource source;
   CockpitPipe *pipe;
 } CockpitPipeSource;
 
+/*
+ * Storage for a CockpitPipeBuffer. Consumed data is handed out as
+ * GBytes that reference the block, so it is only ever moved or reused
+ * when nothing else holds a reference.
+ */
+typedef struct {
+  volatile gint refs;
+  gsize size;
+  guint8 data[1];
+} BufferBlock;
+
+typedef struct {
+  CockpitPipeBuffer pub;
+  BufferBlock *block;
+} RealPipeBuffer;
+
+#define MIN_BLOCK_SIZE    4096
+
+/* Consumed data smaller than this fraction of its block is copied */
+#define COPY_FRACTION     8
+
 static guint cockpit_pipe_sig_read;
 static guint cockpit_pipe_sig_close;
+static guint cockpit_pipe_sig_drain;
 
 static void  cockpit_close_later (CockpitPipe *self);
 
@@ -98,8 +129,9 @@ static void
 cockpit_pipe_init (CockpitPipe *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, COCKPIT_TYPE_PIPE, CockpitPipePrivate);
-  self->priv->in_buffer = g_byte_array_new ();
+  self->priv->in_buffer = cockpit_pipe_buffer_new ();
   self->priv->in_fd = -1;
+  self->priv->in_window = MIN_READ_WINDOW;
   self->priv->out_queue = g_queue_new ();
   self->priv->out_fd = -1;
   self->priv->status = -1;
@@ -148,6 +180,7 @@ close_immediately (CockpitPipe *self,
     stop_input (self);
   if (self->priv->out_source)
     stop_output (self);
+  self->priv->in_paused = FALSE;
 
   if (self->priv->in_fd != -1)
     {
@@ -179,7 +212,7 @@ close_maybe (CockpitPipe *self)
 {
   if (!self->priv->closed)
     {
-      if (!self->priv->in_source && !self->priv->out_source)
+      if (!self->priv->in_source && !self->priv->in_paused && !self->priv->out_source)
         {
           g_debug ("%s: input and output done", self->priv->name);
           close_immediately (self, NULL);
@@ -218,6 +251,118 @@ on_child_reap (GPid pid,
     g_signal_emit (self, cockpit_pipe_sig_close, 0, self->priv->problem);
 }
 
+static BufferBlock *
+buffer_block_new (gsize size)
+{
+  BufferBlock *block = g_malloc (G_STRUCT_OFFSET (BufferBlock, data) + size);
+  block->refs = 1;
+  block->size = size;
+  return block;
+}
+
+static gpointer
+buffer_block_ref (BufferBlock *block)
+{
+  g_atomic_int_inc (&block->refs);
+  return block;
+}
+
+static void
+buffer_block_unref (gpointer data)
+{
+  BufferBlock *block = data;
+  if (g_atomic_int_dec_and_test (&block->refs))
+    g_free (block);
+}
+
+/*
+ * Make room for @want bytes after the unread data, and return where
+ * they should be written. Callers then add to buffer->len.
+ */
+static guint8 *
+buffer_reserve (CockpitPipeBuffer *buffer,
+                gsize want)
+{
+  RealPipeBuffer *real = (RealPipeBuffer *)buffer;
+  BufferBlock *block = real->block;
+  gsize offset = 0;
+  gsize size;
+
+  if (block)
+    {
+      offset = buffer->data - block->data;
+
+      /* Enough room at the end already */
+      if (offset + buffer->len + want <= block->size)
+        return buffer->data + buffer->len;
+
+      /* Nobody else is looking at this block, compact it in place */
+      if (g_atomic_int_get (&block->refs) == 1 && buffer->len + want <= block->size)
+        {
+          memmove (block->data, buffer->data, buffer->len);
+          buffer->data = block->data;
+          return buffer->data + buffer->len;
+        }
+    }
+
+  /* Otherwise move the unread data to a new block */
+  size = MIN_BLOCK_SIZE;
+  while (size < buffer->len + want)
+    size *= 2;
+
+  real->block = buffer_block_new (size);
+  if (buffer->len)
+    memcpy (real->block->data, buffer->data, buffer->len);
+  buffer->data = real->block->data;
+
+  if (block)
+    buffer_block_unref (block);
+
+  return buffer->data + buffer->len;
+}
+
+static void
+buffer_advance (CockpitPipeBuffer *buffer,
+                gsize length)
+{
+  RealPipeBuffer *real = (RealPipeBuffer *)buffer;
+
+  g_assert (length <= buffer->len);
+  buffer->data += length;
+  buffer->len -= length;
+
+  /* Start at the front again if this is cheap */
+  if (buffer->len == 0 && real->block && g_atomic_int_get (&real->block->refs) == 1)
+    buffer->data = real->block->data;
+}
+
+static gsize
+input_read_size (CockpitPipe *self)
+{
+  int avail = 0;
+
+  /* When we can tell how much is waiting, read all of it at once */
+  if (ioctl (self->priv->in_fd, FIONREAD, &avail) == 0 &&
+      avail > 0 && (gsize)avail > self->priv->in_window)
+    return MIN (avail, MAX_READ_WINDOW);
+
+  return self->priv->in_window;
+}
+
+static void
+input_adjust_window (CockpitPipe *self,
+                     gsize size,
+                     gssize ret)
+{
+  if (ret <= 0)
+    return;
+
+  if ((gsize)ret == size)
+    self->priv->in_window = MIN (self->priv->in_window * 2, MAX_READ_WINDOW);
+  else if ((gsize)ret < self->priv->in_window / 4)
+    self->priv->in_window = MAX (self->priv->in_window / 2, MIN_READ_WINDOW);
+}
+
 static gboolean
 dispatch_input (gint fd,
                 GIOCondition cond,
@@ -225,11 +370,11 @@ dispatch_input (gint fd,
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
   gssize ret = 0;
-  gsize len;
+  guint8 *data;
+  gsize size;
   gboolean eof;
 
   g_return_val_if_fail (self->priv->in_source, FALSE);
-  len = self->priv->in_buffer->len;
 
   /*
    * Enable clean shutdown by not reading when we just get
@@ -240,11 +385,12 @@ dispatch_input (gint fd,
     {
       g_debug ("%s: reading input", self->priv->name);
 
-      g_byte_array_set_size (self->priv->in_buffer, len + 1024);
-      ret = read (self->priv->in_fd, self->priv->in_buffer->data + len, 1024);
+      size = input_read_size (self);
+      data = buffer_reserve (self->priv->in_buffer, size);
+      ret = read (self->priv->in_fd, data, size);
+      input_adjust_window (self, size, ret);
       if (ret < 0)
         {
-          g_byte_array_set_size (self->priv->in_buffer, len);
           if (errno != EAGAIN && errno != EINTR)
             {
               g_warning ("%s: couldn't read: %s", self->priv->name, g_strerror (errno));
@@ -263,7 +409,7 @@ dispatch_input (gint fd,
 
   g_object_ref (self);
 
-  g_byte_array_set_size (self->priv->in_buffer, len + ret);
+  self->priv->in_buffer->len += ret;
 
   eof = (self->priv->in_source == NULL);
   g_signal_emit (self, cockpit_pipe_sig_read, 0, self->priv->in_buffer, eof);
@@ -293,6 +439,7 @@ close_output (CockpitPipe *self)
               if (self->priv->in_fd == self->priv->out_fd)
                 {
                   self->priv->in_fd = -1;
+                  self->priv->in_paused = FALSE;
                   if (self->priv->in_source)
                     {
                       g_debug ("%s: and closing input because same fd", self->priv->name);
@@ -431,6 +578,7 @@ dispatch_output (gint fd,
           g_debug ("%s: wrote %d bytes", self->priv->name, (int)iov[i].iov_len);
           g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
           self->priv->out_partial = 0;
+          self->priv->out_queued -= iov[i].iov_len;
           ret -= iov[i].iov_len;
         }
       else
@@ -438,6 +586,7 @@ dispatch_output (gint fd,
           g_debug ("%s: partial write %d of %d bytes", self->priv->name,
                    (int)ret, (int)iov[i].iov_len);
           self->priv->out_partial += ret;
+          self->priv->out_queued -= ret;
           ret = 0;
         }
     }
@@ -445,6 +594,21 @@ dispatch_output (gint fd,
   if (self->priv->out_queue->head)
     return TRUE;
 
+  /* Give the caller a chance to queue more before we stop polling */
+  if (!self->priv->closing)
+    {
+      g_object_ref (self);
+      self->priv->draining = TRUE;
+      g_signal_emit (self, cockpit_pipe_sig_drain, 0);
+      self->priv->draining = FALSE;
+      if (self->priv->closed || self->priv->out_queue->head)
+        {
+          g_object_unref (self);
+          return TRUE;
+        }
+      g_object_unref (self);
+    }
+
   g_debug ("%s: output queue empty", self->priv->name);
 
   /* If all messages are done, then stop polling out fd */
@@ -458,6 +622,16 @@ dispatch_output (gint fd,
   return TRUE;
 }
 
+static void
+start_input (CockpitPipe *self)
+{
+  g_assert (self->priv->in_source == NULL);
+  self->priv->in_source = cockpit_unix_fd_source_new (self->priv->in_fd, G_IO_IN);
+  g_source_set_name (self->priv->in_source, "pipe-input");
+  g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
+  g_source_attach (self->priv->in_source, self->priv->context);
+}
+
 static void
 start_output (CockpitPipe *self)
 {
@@ -485,10 +659,7 @@ cockpit_pipe_constructed (GObject *object)
           g_clear_error (&error);
         }
 
-      self->priv->in_source = cockpit_unix_fd_source_new (self->priv->in_fd, G_IO_IN);
-      g_source_set_name (self->priv->in_source, "pipe-input");
-      g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
-      g_source_attach (self->priv->in_source, self->priv->context);
+      start_input (self);
     }
 
   if (self->priv->out_fd >= 0)
@@ -597,6 +768,7 @@ cockpit_pipe_dispose (GObject *object)
 
   while (self->priv->out_queue->head)
     g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
+  self->priv->out_queued = 0;
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->dispose (object);
 }
@@ -621,7 +793,7 @@ cockpit_pipe_finalize (GObject *object)
   if (self->priv->watch_arg)
     *(self->priv->watch_arg) = NULL;
 
-  g_byte_array_unref (self->priv->in_buffer);
+  cockpit_pipe_buffer_free (self->priv->in_buffer);
   g_queue_free (self->priv->out_queue);
   g_free (self->priv->problem);
   g_free (self->priv->name);
@@ -697,15 +869,15 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
 
   /**
    * CockpitPipe::read:
-   * @buffer: a GByteArray of the read data
+   * @buffer: a CockpitPipeBuffer of the read data
    * @eof: whether the pipe is done reading
    *
    * Emitted when data is read from the input file descriptor of the
    * pipe.
    *
    * Data consumed from @buffer by the handler should be removed from
-   * the GByteArray. This can be done with the cockpit_pipe_consume()
-   * function.
+   * the buffer. This can be done with the cockpit_pipe_consume()
+   * or cockpit_pipe_skip() functions.
    *
    * This handler will only be called once with @eof set to TRUE. But
    * in error conditions it may not be called with @eof set to TRUE
@@ -714,7 +886,7 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
   cockpit_pipe_sig_read = g_signal_new ("read", COCKPIT_TYPE_PIPE, G_SIGNAL_RUN_LAST,
                                         G_STRUCT_OFFSET (CockpitPipeClass, read),
                                         NULL, NULL, NULL,
-                                        G_TYPE_NONE, 2, G_TYPE_BYTE_ARRAY, G_TYPE_BOOLEAN);
+                                        G_TYPE_NONE, 2, G_TYPE_POINTER, G_TYPE_BOOLEAN);
 
   /**
    * CockpitPipe::close:
@@ -730,6 +902,19 @@ cockpit_pipe_class_init (CockpitPipeClass *klass)
                                          NULL, NULL, NULL,
                                          G_TYPE_NONE, 1, G_TYPE_STRING);
 
+  /**
+   * CockpitPipe::drain:
+   *
+   * Emitted when all data queued with cockpit_pipe_write() has been
+   * written to the output file descriptor. Handlers can write more
+   * data, which is then sent without waiting for another main loop
+   * iteration.
+   */
+  cockpit_pipe_sig_drain = g_signal_new ("drain", COCKPIT_TYPE_PIPE, G_SIGNAL_RUN_LAST,
+                                         G_STRUCT_OFFSET (CockpitPipeClass, drain),
+                                         NULL, NULL, NULL,
+                                         G_TYPE_NONE, 0);
+
   g_type_class_add_private (klass, sizeof (CockpitPipePrivate));
 }
 
@@ -777,6 +962,7 @@ cockpit_pipe_write (CockpitPipe *self,
     }
 
   g_queue_push_tail (self->priv->out_queue, g_bytes_ref (data));
+  self->priv->out_queued += g_bytes_get_size (data);
 
   if (!self->priv->out_source && self->priv->out_fd >= 0)
     {
@@ -810,9 +996,10 @@ cockpit_pipe_close (CockpitPipe *self,
 
   self->priv->closing = TRUE;
 
+  /* When draining, output is closed once the drain handlers return */
   if (problem)
       close_immediately (self, problem);
-  else if (g_queue_is_empty (self->priv->out_queue))
+  else if (g_queue_is_empty (self->priv->out_queue) && !self->priv->draining)
     close_output (self);
 }
 
@@ -1176,6 +1363,55 @@ cockpit_pipe_get_pid (CockpitPipe *self,
   return TRUE;
 }
 
+/**
+ * cockpit_pipe_pause_input:
+ * @self: a pipe
+ * @paused: whether to stop or continue reading
+ *
+ * Stop reading from the input file descriptor, so that data backs
+ * up in the other process rather than in memory here. Reading
+ * continues when called again with @paused set to %FALSE.
+ *
+ * End of input isn't noticed while paused, so an orderly close
+ * waits until input is resumed. Closing with a problem happens
+ * right away.
+ */
+void
+cockpit_pipe_pause_input (CockpitPipe *self,
+                          gboolean paused)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+
+  if (paused && self->priv->in_source)
+    {
+      g_debug ("%s: pausing input", self->priv->name);
+      stop_input (self);
+      self->priv->in_paused = TRUE;
+    }
+  else if (!paused && self->priv->in_paused)
+    {
+      g_debug ("%s: resuming input", self->priv->name);
+      self->priv->in_paused = FALSE;
+      start_input (self);
+    }
+}
+
+/**
+ * cockpit_pipe_get_queued:
+ * @self: a pipe
+ *
+ * Get the amount of data passed to cockpit_pipe_write() that
+ * hasn't yet been written to the output file descriptor.
+ *
+ * Returns: the number of bytes queued
+ */
+gsize
+cockpit_pipe_get_queued (CockpitPipe *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), 0);
+  return self->priv->out_queued;
+}
+
 /**
  * cockpit_pipe_get_buffer:
  * @self: a pipe
@@ -1187,7 +1423,7 @@ cockpit_pipe_get_pid (CockpitPipe *self,
  *
  * Returns: (transfer none): the buffer
  */
-GByteArray *
+CockpitPipeBuffer *
 cockpit_pipe_get_buffer (CockpitPipe *self)
 {
   g_return_val_if_fail (COCKPIT_IS_PIPE (self), NULL);
@@ -1215,6 +1451,61 @@ cockpit_pipe_exit_status (CockpitPipe *self)
   return self->priv->status;
 }
 
+/**
+ * cockpit_pipe_buffer_new:
+ *
+ * Create a new empty buffer, for use with cockpit_pipe_consume()
+ * and friends outside of a pipe.
+ *
+ * Returns: (transfer full): the new buffer
+ */
+CockpitPipeBuffer *
+cockpit_pipe_buffer_new (void)
+{
+  return (CockpitPipeBuffer *)g_new0 (RealPipeBuffer, 1);
+}
+
+/**
+ * cockpit_pipe_buffer_free:
+ * @buffer: a data buffer
+ *
+ * Free the buffer. Bytes previously consumed from it stay valid.
+ */
+void
+cockpit_pipe_buffer_free (CockpitPipeBuffer *buffer)
+{
+  RealPipeBuffer *real = (RealPipeBuffer *)buffer;
+
+  if (buffer == NULL)
+    return;
+
+  if (real->block)
+    buffer_block_unref (real->block);
+  g_free (real);
+}
+
+/**
+ * cockpit_pipe_buffer_append:
+ * @buffer: a data buffer
+ * @data: the data to add
+ * @length: length of the data
+ *
+ * Add data to the end of the buffer.
+ */
+void
+cockpit_pipe_buffer_append (CockpitPipeBuffer *buffer,
+                            gconstpointer data,
+                            gsize length)
+{
+  g_return_if_fail (buffer != NULL);
+
+  if (length > 0)
+    {
+      memcpy (buffer_reserve (buffer, length), data, length);
+      buffer->len += length;
+    }
+}
+
 /**
  * cockpit_pipe_consume:
  * @buffer: a data buffer
@@ -1227,37 +1518,32 @@ cockpit_pipe_exit_status (CockpitPipe *self)
  * @skip + @length bytes will be removed from the @buffer,
  * and @length bytes will be returned.
  *
- * As an omptimization of @skip + @length is equal to the
- * entire length of the buffer, then the data will not
- * be copied but ownership will be transferred to the returned
- * bytes.
+ * Large amounts of data are not copied. The returned bytes refer
+ * to the memory of the buffer, which is kept around while they do.
+ * Small amounts are copied, so they don't hold on to a whole block.
  *
  * Returns: (transfer full): the read bytes
  */
 GBytes *
-cockpit_pipe_consume (GByteArray *buffer,
+cockpit_pipe_consume (CockpitPipeBuffer *buffer,
                       gsize skip,
                       gsize length)
 {
+  RealPipeBuffer *real = (RealPipeBuffer *)buffer;
   GBytes *bytes;
-  guint8 *buf;
 
   g_return_val_if_fail (buffer != NULL, NULL);
+  g_return_val_if_fail (skip + length <= buffer->len, NULL);
 
-  /* Optimize when we match full buffer length */
-  if (buffer->len == skip + length)
-    {
-      /* When array is reffed, this just clears byte array */
-      g_byte_array_ref (buffer);
-      buf = g_byte_array_free (buffer, FALSE);
-      bytes = g_bytes_new_with_free_func (buf + skip, length, g_free, buf);
-    }
+  if (length == 0)
+    bytes = g_bytes_new_static ("", 0);
+  else if (length < real->block->size / COPY_FRACTION)
+    bytes = g_bytes_new (buffer->data + skip, length);
   else
-    {
-      bytes = g_bytes_new (buffer->data + skip, length);
-      g_byte_array_remove_range (buffer, 0, skip + length);
-    }
+    bytes = g_bytes_new_with_free_func (buffer->data + skip, length,
+                                        buffer_block_unref, buffer_block_ref (real->block));
 
+  buffer_advance (buffer, skip + length);
   return bytes;
 }
 
@@ -1271,11 +1557,12 @@ cockpit_pipe_consume (GByteArray *buffer,
  * the buffer.
  */
 void
-cockpit_pipe_skip (GByteArray *buffer,
+cockpit_pipe_skip (CockpitPipeBuffer *buffer,
                    gsize skip)
 {
   g_return_if_fail (buffer != NULL);
-  g_byte_array_remove_range (buffer, 0, skip);
+  g_return_if_fail (skip <= buffer->len);
+  buffer_advance (buffer, skip);
 }
 
 /**
@@ -33,23 +33,35 @@ G_BEGIN_DECLS
 typedef struct _CockpitPipe        CockpitPipe;
 typedef struct _CockpitPipeClass   CockpitPipeClass;
 typedef struct _CockpitPipePrivate CockpitPipePrivate;
+typedef struct _CockpitPipeBuffer  CockpitPipeBuffer;
 
 struct _CockpitPipe {
   GObject parent_instance;
   CockpitPipePrivate *priv;
 };
 
+/*
+ * Unread data, starting at the read cursor. Consuming data moves the
+ * cursor, rather than moving the remaining data.
+ */
+struct _CockpitPipeBuffer {
+  guint8 *data;
+  guint len;
+};
+
 struct _CockpitPipeClass {
   GObjectClass parent_class;
 
   /* signals */
 
   void        (* read)        (CockpitPipe *pipe,
-                               GByteArray *buffer,
+                               CockpitPipeBuffer *buffer,
                                gboolean eof);
 
   void        (* close)       (CockpitPipe *pipe,
                                const gchar *problem);
+
+  void        (* drain)       (CockpitPipe *pipe);
 };
 
 GType              cockpit_pipe_get_type     (void) G_GNUC_CONST;
@@ -75,20 +87,33 @@ void               cockpit_pipe_write        (CockpitPipe *self,
 void               cockpit_pipe_close        (CockpitPipe *self,
                                               const gchar *problem);
 
+void               cockpit_pipe_pause_input  (CockpitPipe *self,
+                                              gboolean paused);
+
+gsize              cockpit_pipe_get_queued   (CockpitPipe *self);
+
 gint               cockpit_pipe_exit_status  (CockpitPipe *self);
 
-GByteArray *       cockpit_pipe_get_buffer   (CockpitPipe *self);
+CockpitPipeBuffer * cockpit_pipe_get_buffer  (CockpitPipe *self);
 
 gboolean           cockpit_pipe_get_pid      (CockpitPipe *self,
                                               GPid *pid);
 
-void               cockpit_pipe_skip         (GByteArray *buffer,
+void               cockpit_pipe_skip         (CockpitPipeBuffer *buffer,
                                               gsize skip);
 
-GBytes *           cockpit_pipe_consume      (GByteArray *buffer,
+GBytes *           cockpit_pipe_consume      (CockpitPipeBuffer *buffer,
                                               gsize skip,
                                               gsize length);
 
+CockpitPipeBuffer * cockpit_pipe_buffer_new  (void);
+
+void               cockpit_pipe_buffer_append (CockpitPipeBuffer *buffer,
+                                               gconstpointer data,
+                                               gsize length);
+
+void               cockpit_pipe_buffer_free  (CockpitPipeBuffer *buffer);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_H__ */
@@ -21,6 +21,7 @@
 
 #include "cockpitpipetransport.h"
 
+#include "cockpitfairqueue.h"
 #include "cockpitpipe.h"
 
 #include <glib-unix.h>
@@ -48,8 +49,18 @@ struct _CockpitPipeTransport {
   CockpitPipe *pipe;
   gulong read_sig;
   gulong close_sig;
+  gulong drain_sig;
+
+  /* Frames not yet handed to the pipe */
+  CockpitFairQueue *queue;
+  gboolean feeding;
+  gboolean closing;
 };
 
+/* How much the pipe gets at a time, and each channel per turn */
+#define FEED_SIZE  (64 * 1024)
+#define QUANTUM    (16 * 1024)
+
 struct _CockpitPipeTransportClass {
   CockpitTransportClass parent_class;
 };
@@ -58,6 +69,7 @@ enum {
     PROP_0,
     PROP_NAME,
     PROP_PIPE,
+    PROP_QUEUED,
 };
 
 G_DEFINE_TYPE (CockpitPipeTransport, cockpit_pipe_transport, COCKPIT_TYPE_TRANSPORT);
@@ -65,19 +77,59 @@ G_DEFINE_TYPE (CockpitPipeTransport, cockpit_pipe_transport, COCKPIT_TYPE_TRANSP
 static void
 cockpit_pipe_transport_init (CockpitPipeTransport *self)
 {
+  self->queue = cockpit_fair_queue_new (QUANTUM);
+}
 
+/*
+ * Only a little is handed to the pipe at a time, so the fair queue
+ * gets to decide what is sent next, rather than the pipe's FIFO.
+ */
+static void
+feed_pipe (CockpitPipeTransport *self)
+{
+  GBytes *prefix;
+  GBytes *payload;
+  gsize fed = 0;
+
+  while (fed < FEED_SIZE && cockpit_fair_queue_pop (self->queue, &prefix, &payload))
+    {
+      cockpit_transport_deflate_frame ((CockpitTransport *)self, &prefix, &payload);
+      cockpit_pipe_write (self->pipe, prefix);
+      cockpit_pipe_write (self->pipe, payload);
+      fed += g_bytes_get_size (prefix) + g_bytes_get_size (payload);
+      g_bytes_unref (prefix);
+      g_bytes_unref (payload);
+    }
+
+  self->feeding = (fed > 0);
+
+  /* Everything was fed, the pipe closes after writing it */
+  if (self->closing && cockpit_fair_queue_is_empty (self->queue))
+    cockpit_pipe_close (self->pipe, NULL);
+}
+
+static void
+on_pipe_drain (CockpitPipe *pipe,
+               gpointer user_data)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (user_data);
+  if (!self->closing || !cockpit_fair_queue_is_empty (self->queue))
+    feed_pipe (self);
+  g_object_notify (G_OBJECT (self), "queued");
 }
 
 static void
 on_pipe_read (CockpitPipe *pipe,
-              GByteArray *input,
+              CockpitPipeBuffer *input,
               gboolean end_of_data,
               gpointer user_data)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (user_data);
   GBytes *message;
   GBytes *payload;
-  gchar *channel;
+  GBytes *inflated;
+  const gchar *channel;
+  gboolean compressed;
   guint32 size;
 
   for (;;)
@@ -91,6 +143,8 @@ on_pipe_read (CockpitPipe *pipe,
 
       memcpy (&size, input->data, sizeof (size));
       size = GUINT32_FROM_BE (size);
+      compressed = (size & COCKPIT_TRANSPORT_COMPRESSED) ? TRUE : FALSE;
+      size &= ~COCKPIT_TRANSPORT_COMPRESSED;
       if (input->len < size + sizeof (size))
         {
           g_debug ("%s: want more data", self->name);
@@ -98,13 +152,27 @@ on_pipe_read (CockpitPipe *pipe,
         }
 
       message = cockpit_pipe_consume (input, sizeof (size), size);
-      payload = cockpit_transport_parse_frame (message, &channel);
+      if (compressed)
+        {
+          inflated = cockpit_transport_inflate_frame ((CockpitTransport *)self, message);
+          g_bytes_unref (message);
+          if (!inflated)
+            {
+              g_warning ("%s: received invalid compressed frame", self->name);
+              cockpit_pipe_close (pipe, "protocol-error");
+              break;
+            }
+          message = inflated;
+        }
+
+      payload = cockpit_transport_parse_frame_interned (message, &channel);
       if (payload)
         {
           g_debug ("%s: received a %d byte payload", self->name, (int)size);
-          cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
+          cockpit_transport_emit_recv_interned ((CockpitTransport *)self, channel, payload);
           g_bytes_unref (payload);
-          g_free (channel);
+          if (channel)
+            cockpit_transport_release_channel (channel);
         }
       g_bytes_unref (message);
     }
@@ -164,6 +232,9 @@ on_pipe_close (CockpitPipe *pipe,
   g_debug ("%s: closed%s%s", self->name,
            problem ? ": " : "", problem ? problem : "");
 
+  cockpit_fair_queue_clear (self->queue);
+  g_object_notify (G_OBJECT (self), "queued");
+
   cockpit_transport_emit_closed (COCKPIT_TRANSPORT (self), problem);
 }
 
@@ -178,6 +249,7 @@ cockpit_pipe_transport_constructed (GObject *object)
   g_object_get (self->pipe, "name", &self->name, NULL);
   self->read_sig = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
   self->close_sig = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
+  self->drain_sig = g_signal_connect (self->pipe, "drain", G_CALLBACK (on_pipe_drain), self);
 }
 
 static void
@@ -196,6 +268,9 @@ cockpit_pipe_transport_get_property (GObject *object,
     case PROP_PIPE:
       g_value_set_object (value, self->pipe);
       break;
+    case PROP_QUEUED:
+      g_value_set_ulong (value, cockpit_pipe_transport_get_queued (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -230,19 +305,27 @@ cockpit_pipe_transport_finalize (GObject *object)
     g_signal_handler_disconnect (self->pipe, self->read_sig);
   if (self->close_sig)
     g_signal_handler_disconnect (self->pipe, self->close_sig);
+  if (self->drain_sig)
+    g_signal_handler_disconnect (self->pipe, self->drain_sig);
 
+  cockpit_fair_queue_free (self->queue);
   g_free (self->name);
   g_clear_object (&self->pipe);
 
   G_OBJECT_CLASS (cockpit_pipe_transport_parent_class)->finalize (object);
 }
 
+/*
+ * Data goes out on @channel_id, control messages on the control
+ * channel. A control message about a channel is queued with that
+ * channel's data, given as @control_channel.
+ */
 static void
-cockpit_pipe_transport_send (CockpitTransport *transport,
-                             const gchar *channel_id,
-                             GBytes *payload)
+queue_frame (CockpitPipeTransport *self,
+             const gchar *channel_id,
+             const gchar *control_channel,
+             GBytes *payload)
 {
-  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
   GBytes *prefix;
   gchar *prefix_str;
   gsize prefix_len;
@@ -257,11 +340,33 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
 
   prefix = g_bytes_new_take (prefix_str, prefix_len);
 
-  cockpit_pipe_write (self->pipe, prefix);
-  cockpit_pipe_write (self->pipe, payload);
+  if (channel_id)
+    cockpit_fair_queue_push (self->queue, channel_id, prefix, payload);
+  else
+    cockpit_fair_queue_push_control (self->queue, control_channel, prefix, payload);
   g_bytes_unref (prefix);
 
+  if (!self->feeding)
+    feed_pipe (self);
+
   g_debug ("%s: queued %d byte payload", self->name, (int)g_bytes_get_size (payload));
+  g_object_notify (G_OBJECT (self), "queued");
+}
+
+static void
+cockpit_pipe_transport_send (CockpitTransport *transport,
+                             const gchar *channel_id,
+                             GBytes *payload)
+{
+  queue_frame (COCKPIT_PIPE_TRANSPORT (transport), channel_id, NULL, payload);
+}
+
+static void
+cockpit_pipe_transport_send_control (CockpitTransport *transport,
+                                     const gchar *channel_id,
+                                     GBytes *payload)
+{
+  queue_frame (COCKPIT_PIPE_TRANSPORT (transport), NULL, channel_id, payload);
 }
 
 static void
@@ -269,7 +374,32 @@ cockpit_pipe_transport_close (CockpitTransport *transport,
                               const gchar *problem)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
-  cockpit_pipe_close (self->pipe, problem);
+
+  self->closing = TRUE;
+
+  /* Otherwise the pipe is closed once the queue is fed to it */
+  if (problem || cockpit_fair_queue_is_empty (self->queue))
+    {
+      cockpit_fair_queue_clear (self->queue);
+      cockpit_pipe_close (self->pipe, problem);
+    }
+}
+
+/**
+ * cockpit_pipe_transport_get_queued:
+ * @self: a pipe transport
+ *
+ * Get the amount of output not yet written. This includes the frames
+ * waiting for their turn as well as what was handed to the pipe.
+ * The CockpitPipeTransport:queued property is notified when it changes.
+ *
+ * Returns: the number of bytes queued
+ */
+gsize
+cockpit_pipe_transport_get_queued (CockpitPipeTransport *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self), 0);
+  return cockpit_fair_queue_get_size (self->queue) + cockpit_pipe_get_queued (self->pipe);
 }
 
 static void
@@ -279,6 +409,7 @@ cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
   CockpitTransportClass *transport_class = COCKPIT_TRANSPORT_CLASS (klass);
 
   transport_class->send = cockpit_pipe_transport_send;
+  transport_class->send_control = cockpit_pipe_transport_send_control;
   transport_class->close = cockpit_pipe_transport_close;
 
   gobject_class->constructed = cockpit_pipe_transport_constructed;
@@ -292,6 +423,15 @@ cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
               g_param_spec_object ("pipe", NULL, NULL,
                                    COCKPIT_TYPE_PIPE,
                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * CockpitPipeTransport:queued:
+   *
+   * Amount of output not yet written, see cockpit_pipe_transport_get_queued().
+   */
+  g_object_class_install_property (gobject_class, PROP_QUEUED,
+              g_param_spec_ulong ("queued", NULL, NULL, 0, G_MAXULONG, 0,
+                                  G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 }
 
 /**
@@ -31,6 +31,7 @@ G_BEGIN_DECLS
 #define COCKPIT_PIPE_TRANSPORT(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_PIPE_TRANSPORT, CockpitPipeTransport))
 #define COCKPIT_PIPE_TRANSPORT_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS ((o), COCKPIT_TYPE_PIPE_TRANSPORT, CockpitPipeTransportClass))
 #define COCKPIT_IS_PIPE_TRANSPORT_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE ((k), COCKPIT_TYPE_PIPE_TRANSPORT))
+#define COCKPIT_IS_PIPE_TRANSPORT(k)        (G_TYPE_CHECK_INSTANCE_TYPE ((k), COCKPIT_TYPE_PIPE_TRANSPORT))
 
 typedef struct _CockpitPipeTransport        CockpitPipeTransport;
 typedef struct _CockpitPipeTransportClass   CockpitPipeTransportClass;
@@ -43,6 +44,8 @@ CockpitTransport * cockpit_pipe_transport_new_fds    (const gchar *name,
                                                       gint in_fd,
                                                       gint out_fd);
 
+gsize              cockpit_pipe_transport_get_queued (CockpitPipeTransport *self);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_TRANSPORT_H__ */
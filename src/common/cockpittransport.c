@@ -23,6 +23,8 @@
 
 #include "common/cockpitjson.h"
 
+#include <gio/gio.h>
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,12 +37,53 @@ enum {
 
 static guint signals[NUM_SIGNALS];
 
+struct _CockpitTransportPrivate {
+  /* Compresses frames we send, once the peer can take them */
+  GConverter *deflater;
+  gsize threshold;
+
+  /* Created when the first compressed frame arrives */
+  GConverter *inflater;
+};
+
+/*
+ * Interned channel ids. The ChannelKey is first so that an entry can
+ * be looked up with a key that points into a frame being parsed.
+ */
+
+typedef struct {
+  const gchar *data;
+  gsize length;
+  guint hash;
+} ChannelKey;
+
+typedef struct {
+  ChannelKey key;
+  gint refs;
+  GBytes *prefix;
+  gchar id[1];
+} ChannelEntry;
+
+G_LOCK_DEFINE_STATIC (interned);
+static GHashTable *interned = NULL;
+
 G_DEFINE_ABSTRACT_TYPE (CockpitTransport, cockpit_transport, G_TYPE_OBJECT);
 
 static void
 cockpit_transport_init (CockpitTransport *self)
 {
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, COCKPIT_TYPE_TRANSPORT, CockpitTransportPrivate);
+}
 
+static void
+cockpit_transport_finalize (GObject *object)
+{
+  CockpitTransport *self = COCKPIT_TRANSPORT (object);
+
+  g_clear_object (&self->priv->deflater);
+  g_clear_object (&self->priv->inflater);
+
+  G_OBJECT_CLASS (cockpit_transport_parent_class)->finalize (object);
 }
 
 static void
@@ -60,6 +103,7 @@ cockpit_transport_default_recv (CockpitTransport *transport,
 {
   gboolean ret = FALSE;
   const gchar *inner_channel;
+  const gchar *interned_channel = NULL;
   JsonObject *options;
   const gchar *command;
 
@@ -75,7 +119,14 @@ cockpit_transport_default_recv (CockpitTransport *transport,
       return TRUE;
     }
 
-  g_signal_emit (transport, signals[CONTROL], 0, command, inner_channel, options, &ret);
+  /* Handlers get the same channel pointer as for the channel's payloads */
+  if (inner_channel)
+    interned_channel = cockpit_transport_intern_channel (inner_channel, -1);
+
+  g_signal_emit (transport, signals[CONTROL], 0, command, interned_channel, options, &ret);
+
+  if (interned_channel)
+    cockpit_transport_release_channel (interned_channel);
   json_object_unref (options);
 
   if (!ret)
@@ -93,6 +144,7 @@ cockpit_transport_class_init (CockpitTransportClass *klass)
   klass->recv = cockpit_transport_default_recv;
 
   object_class->get_property = cockpit_transport_get_property;
+  object_class->finalize = cockpit_transport_finalize;
 
   g_object_class_install_property (object_class, 1,
               g_param_spec_string ("name", "name", "name", NULL,
@@ -102,18 +154,24 @@ cockpit_transport_class_init (CockpitTransportClass *klass)
                                 G_STRUCT_OFFSET (CockpitTransportClass, recv),
                                 g_signal_accumulator_true_handled, NULL,
                                 g_cclosure_marshal_generic,
-                                G_TYPE_BOOLEAN, 2, G_TYPE_STRING, G_TYPE_BYTES);
+                                G_TYPE_BOOLEAN, 2,
+                                G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE,
+                                G_TYPE_BYTES);
 
   signals[CONTROL] = g_signal_new ("control", COCKPIT_TYPE_TRANSPORT, G_SIGNAL_RUN_LAST,
                                    G_STRUCT_OFFSET (CockpitTransportClass, control),
                                    g_signal_accumulator_true_handled, NULL,
                                    g_cclosure_marshal_generic,
-                                   G_TYPE_BOOLEAN, 3, G_TYPE_STRING, G_TYPE_STRING, JSON_TYPE_OBJECT);
+                                   G_TYPE_BOOLEAN, 3, G_TYPE_STRING,
+                                   G_TYPE_STRING | G_SIGNAL_TYPE_STATIC_SCOPE,
+                                   JSON_TYPE_OBJECT);
 
   signals[CLOSED] = g_signal_new ("closed", COCKPIT_TYPE_TRANSPORT, G_SIGNAL_RUN_FIRST,
                                   G_STRUCT_OFFSET (CockpitTransportClass, closed),
                                   NULL, NULL, g_cclosure_marshal_generic,
                                   G_TYPE_NONE, 1, G_TYPE_STRING);
+
+  g_type_class_add_private (klass, sizeof (CockpitTransportPrivate));
 }
 
 void
@@ -130,6 +188,33 @@ cockpit_transport_send (CockpitTransport *transport,
   klass->send (transport, channel, data);
 }
 
+/**
+ * cockpit_transport_send_control:
+ * @transport: a transport
+ * @channel: (allow-none): the channel the message is about
+ * @data: the control message
+ *
+ * Send a control message. The message itself goes on the control
+ * channel. When it's about a @channel, such as "close", it's kept in
+ * order with the data already queued for that channel.
+ */
+void
+cockpit_transport_send_control (CockpitTransport *transport,
+                                const gchar *channel,
+                                GBytes *data)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
+  g_return_if_fail (klass && klass->send);
+  if (channel && klass->send_control)
+    klass->send_control (transport, channel, data);
+  else
+    klass->send (transport, NULL, data);
+}
+
 void
 cockpit_transport_close (CockpitTransport *transport,
                          const gchar *problem)
@@ -143,10 +228,240 @@ cockpit_transport_close (CockpitTransport *transport,
   klass->close (transport, problem);
 }
 
+/**
+ * cockpit_transport_set_compress:
+ * @transport: a transport
+ * @scheme: compression scheme or %NULL
+ * @threshold: frames smaller than this are sent uncompressed
+ *
+ * Start compressing frames sent over the transport. Only do this
+ * once the other end has said it can handle the compression @scheme,
+ * usually in its "init" message. Currently the only supported scheme
+ * is "zlib". Frames are compressed as a single stream, flushed at the
+ * end of each frame.
+ *
+ * Compressed frames are always understood when received.
+ *
+ * Returns: %FALSE if the @scheme is not supported
+ */
+gboolean
+cockpit_transport_set_compress (CockpitTransport *transport,
+                                const gchar *scheme,
+                                gsize threshold)
+{
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), FALSE);
+
+  if (scheme && !g_str_equal (scheme, "zlib"))
+    return FALSE;
+
+  transport->priv->threshold = threshold;
+
+  /* Keep the same stream if already compressing */
+  if (!scheme)
+    g_clear_object (&transport->priv->deflater);
+  else if (!transport->priv->deflater)
+    transport->priv->deflater = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+
+  return TRUE;
+}
+
+static gboolean
+convert_into (GConverter *converter,
+              GByteArray *output,
+              const guint8 *data,
+              gsize length,
+              GConverterFlags flags,
+              gsize limit)
+{
+  GConverterResult result;
+  GError *error = NULL;
+  gsize bytes_read;
+  gsize bytes_written;
+  gsize offset;
+  gsize space;
+
+  /* zlib complains when asked to do nothing */
+  if (length == 0 && !(flags & G_CONVERTER_FLUSH))
+    return TRUE;
+
+  for (;;)
+    {
+      offset = output->len;
+      space = MAX (length * 2, 4096);
+      g_byte_array_set_size (output, offset + space);
+
+      bytes_read = bytes_written = 0;
+      result = g_converter_convert (converter, data, length, output->data + offset, space,
+                                    flags, &bytes_read, &bytes_written, &error);
+      if (result == G_CONVERTER_ERROR)
+        {
+          g_byte_array_set_size (output, offset);
+          g_warning ("Couldn't %s frame: %s",
+                     G_IS_ZLIB_COMPRESSOR (converter) ? "compress" : "decompress",
+                     error->message);
+          g_error_free (error);
+          return FALSE;
+        }
+
+      g_byte_array_set_size (output, offset + bytes_written);
+      data += bytes_read;
+      length -= bytes_read;
+
+      /* A small compressed frame can expand into something huge */
+      if (limit && output->len > limit)
+        {
+          g_warning ("Decompressed frame is larger than %" G_GSIZE_FORMAT " bytes", limit);
+          return FALSE;
+        }
+
+      /* With a flush, we're done when zlib has nothing more to give */
+      if (length == 0 && (!(flags & G_CONVERTER_FLUSH) ||
+                          result == G_CONVERTER_FLUSHED ||
+                          result == G_CONVERTER_FINISHED))
+        return TRUE;
+    }
+}
+
+/**
+ * cockpit_transport_deflate_frame:
+ * @transport: a transport
+ * @prefix: (inout): the length and channel prefix of a frame
+ * @payload: (inout): the payload of the frame
+ *
+ * Compress a frame if cockpit_transport_set_compress() was called, and
+ * the frame is large enough. The @prefix is replaced with just the length,
+ * with #COCKPIT_TRANSPORT_COMPRESSED set, and the @payload with the
+ * compressed channel and payload.
+ *
+ * Frames must be compressed in the order they are written, as they
+ * form a single compressed stream.
+ */
+void
+cockpit_transport_deflate_frame (CockpitTransport *transport,
+                                 GBytes **prefix,
+                                 GBytes **payload)
+{
+  GConverter *deflater;
+  GByteArray *output;
+  const guint8 *data;
+  gsize prefix_len;
+  gsize payload_len;
+  guint32 size;
+  gboolean ret;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  deflater = transport->priv->deflater;
+  if (!deflater)
+    return;
+
+  payload_len = g_bytes_get_size (*payload);
+  if (payload_len < transport->priv->threshold)
+    return;
+
+  /* The four byte length isn't compressed */
+  data = g_bytes_get_data (*prefix, &prefix_len);
+  g_return_if_fail (prefix_len >= sizeof (size));
+
+  output = g_byte_array_sized_new (payload_len / 2);
+
+  ret = convert_into (deflater, output, data + sizeof (size), prefix_len - sizeof (size),
+                      G_CONVERTER_NO_FLAGS, 0) &&
+        convert_into (deflater, output, g_bytes_get_data (*payload, NULL), payload_len,
+                      G_CONVERTER_FLUSH, 0);
+
+  /*
+   * The other end never sees the half compressed frame, but our
+   * compressor state no longer matches its decompressor. So send
+   * this and all further frames uncompressed.
+   */
+  if (!ret)
+    {
+      g_byte_array_unref (output);
+      g_clear_object (&transport->priv->deflater);
+      return;
+    }
+
+  size = GUINT32_TO_BE (output->len | COCKPIT_TRANSPORT_COMPRESSED);
+
+  g_bytes_unref (*prefix);
+  g_bytes_unref (*payload);
+  *prefix = g_bytes_new (&size, sizeof (size));
+  *payload = g_byte_array_free_to_bytes (output);
+}
+
+/**
+ * cockpit_transport_inflate_frame:
+ * @transport: a transport
+ * @body: the frame contents after the length
+ *
+ * Decompress a frame that had #COCKPIT_TRANSPORT_COMPRESSED set
+ * in its length. The frames must be decompressed in the order they
+ * were received. A frame that decompresses to more than
+ * #COCKPIT_TRANSPORT_MAX_INFLATED bytes is invalid.
+ *
+ * Returns: (transfer full): the decompressed frame or %NULL if invalid
+ */
+GBytes *
+cockpit_transport_inflate_frame (CockpitTransport *transport,
+                                 GBytes *body)
+{
+  GByteArray *output;
+  gconstpointer data;
+  gsize length;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), NULL);
+
+  if (!transport->priv->inflater)
+    transport->priv->inflater = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+
+  data = g_bytes_get_data (body, &length);
+  output = g_byte_array_sized_new (length * 4);
+
+  if (!convert_into (transport->priv->inflater, output, data, length,
+                     G_CONVERTER_FLUSH, COCKPIT_TRANSPORT_MAX_INFLATED))
+    {
+      g_byte_array_unref (output);
+      return NULL;
+    }
+
+  return g_byte_array_free_to_bytes (output);
+}
+
 void
 cockpit_transport_emit_recv (CockpitTransport *transport,
                              const gchar *channel,
                              GBytes *data)
+{
+  const gchar *interned_channel = NULL;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  /* So that handlers can compare channel pointers */
+  if (channel)
+    interned_channel = cockpit_transport_intern_channel (channel, -1);
+
+  cockpit_transport_emit_recv_interned (transport, interned_channel, data);
+
+  if (interned_channel)
+    cockpit_transport_release_channel (interned_channel);
+}
+
+/**
+ * cockpit_transport_emit_recv_interned:
+ * @transport: a transport
+ * @channel: an interned channel id, or NULL
+ * @data: the payload
+ *
+ * Like cockpit_transport_emit_recv() but @channel must already be
+ * interned, such as one returned by
+ * cockpit_transport_parse_frame_interned(). The caller keeps its
+ * reference to the channel id.
+ */
+void
+cockpit_transport_emit_recv_interned (CockpitTransport *transport,
+                                      const gchar *channel,
+                                      GBytes *data)
 {
   gboolean result = FALSE;
   gchar *name = NULL;
@@ -219,6 +534,216 @@ cockpit_transport_parse_frame (GBytes *message,
   return g_bytes_new_from_bytes (message, channel_len, length - channel_len);
 }
 
+static guint
+channel_key_hash (gconstpointer v)
+{
+  return ((const ChannelKey *)v)->hash;
+}
+
+static gboolean
+channel_key_equal (gconstpointer v1,
+                   gconstpointer v2)
+{
+  const ChannelKey *k1 = v1;
+  const ChannelKey *k2 = v2;
+  return k1->hash == k2->hash && k1->length == k2->length &&
+         memcmp (k1->data, k2->data, k1->length) == 0;
+}
+
+static void
+channel_key_init (ChannelKey *key,
+                  const gchar *data,
+                  gsize length)
+{
+  guint32 hash = 5381;
+  gsize i;
+
+  /* Same as g_str_hash(), but doesn't need a terminated string */
+  for (i = 0; i < length; i++)
+    hash = (hash << 5) + hash + (signed char)data[i];
+
+  key->data = data;
+  key->length = length;
+  key->hash = hash;
+}
+
+static inline ChannelEntry *
+channel_entry_for_id (const gchar *channel)
+{
+  return (ChannelEntry *)(channel - G_STRUCT_OFFSET (ChannelEntry, id));
+}
+
+static const gchar *
+intern_channel_key (ChannelKey *key)
+{
+  ChannelEntry *entry;
+  gchar *prefix;
+
+  G_LOCK (interned);
+
+  if (!interned)
+    interned = g_hash_table_new (channel_key_hash, channel_key_equal);
+
+  entry = g_hash_table_lookup (interned, key);
+  if (entry)
+    {
+      entry->refs++;
+    }
+  else
+    {
+      entry = g_malloc (sizeof (ChannelEntry) + key->length);
+      memcpy (entry->id, key->data, key->length);
+      entry->id[key->length] = '\0';
+      channel_key_init (&entry->key, entry->id, key->length);
+      entry->refs = 1;
+
+      prefix = g_malloc (key->length + 1);
+      memcpy (prefix, key->data, key->length);
+      prefix[key->length] = '\n';
+      entry->prefix = g_bytes_new_take (prefix, key->length + 1);
+
+      g_hash_table_add (interned, entry);
+    }
+
+  G_UNLOCK (interned);
+
+  return entry->id;
+}
+
+/**
+ * cockpit_transport_intern_channel:
+ * @channel: a channel id
+ * @length: length of @channel or -1 if null terminated
+ *
+ * Get the interned copy of a channel id. All interned copies of
+ * the same channel id are the same pointer, so they can be compared
+ * and used as hash table keys with g_direct_hash().
+ *
+ * The channel ids passed to handlers of the CockpitTransport::recv
+ * and CockpitTransport::control signals are interned.
+ *
+ * Only allocates memory the first time a channel id is interned.
+ *
+ * Returns: (transfer full): the interned channel id, release
+ *          with cockpit_transport_release_channel()
+ */
+const gchar *
+cockpit_transport_intern_channel (const gchar *channel,
+                                  gssize length)
+{
+  ChannelKey key;
+
+  g_return_val_if_fail (channel != NULL, NULL);
+
+  if (length < 0)
+    length = strlen (channel);
+
+  channel_key_init (&key, channel, length);
+  return intern_channel_key (&key);
+}
+
+/**
+ * cockpit_transport_release_channel:
+ * @channel: an interned channel id
+ *
+ * Release a reference to a channel id returned by
+ * cockpit_transport_intern_channel() or
+ * cockpit_transport_parse_frame_interned().
+ */
+void
+cockpit_transport_release_channel (const gchar *channel)
+{
+  ChannelEntry *entry;
+  gboolean last;
+
+  g_return_if_fail (channel != NULL);
+
+  entry = channel_entry_for_id (channel);
+
+  G_LOCK (interned);
+  g_assert (entry->refs > 0);
+  last = (--entry->refs == 0);
+  if (last)
+    g_hash_table_remove (interned, entry);
+  G_UNLOCK (interned);
+
+  if (last)
+    {
+      g_bytes_unref (entry->prefix);
+      g_free (entry);
+    }
+}
+
+/**
+ * cockpit_transport_get_channel_prefix:
+ * @channel: an interned channel id
+ *
+ * Get the channel id followed by a new line, which is how it
+ * prefixes payloads on the wire.
+ *
+ * Returns: (transfer none): the prefix, valid as long as @channel
+ */
+GBytes *
+cockpit_transport_get_channel_prefix (const gchar *channel)
+{
+  g_return_val_if_fail (channel != NULL, NULL);
+  return channel_entry_for_id (channel)->prefix;
+}
+
+/**
+ * cockpit_transport_parse_frame_interned:
+ * @message: message to parse
+ * @channel: location to return the channel
+ *
+ * Like cockpit_transport_parse_frame() but @channel is set to an
+ * interned channel id, which should be released with
+ * cockpit_transport_release_channel(). This doesn't allocate
+ * a copy of the channel id when it is already interned, which
+ * it is for any open channel.
+ *
+ * Returns: (transfer full): the payload or NULL.
+ */
+GBytes *
+cockpit_transport_parse_frame_interned (GBytes *message,
+                                        const gchar **channel)
+{
+  const gchar *data;
+  gsize length;
+  const gchar *line;
+  gsize channel_len;
+  ChannelKey key;
+
+  g_return_val_if_fail (message != NULL, NULL);
+
+  data = g_bytes_get_data (message, &length);
+  line = memchr (data, '\n', length);
+  if (!line)
+    {
+      g_warning ("Received invalid message without channel prefix");
+      return NULL;
+    }
+
+  channel_len = line - data;
+  if (memchr (data, '\0', channel_len) != NULL)
+    {
+      g_warning ("Received massage with invalid channel prefix");
+      return NULL;
+    }
+
+  if (channel_len)
+    {
+      channel_key_init (&key, data, channel_len);
+      *channel = intern_channel_key (&key);
+    }
+  else
+    {
+      *channel = NULL;
+    }
+
+  channel_len++;
+  return g_bytes_new_from_bytes (message, channel_len, length - channel_len);
+}
+
 /**
  * cockpit_transport_parse_command:
  * @payload: command JSON payload to parse
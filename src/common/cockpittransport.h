@@ -33,10 +33,18 @@ G_BEGIN_DECLS
 
 typedef struct _CockpitTransport        CockpitTransport;
 typedef struct _CockpitTransportClass   CockpitTransportClass;
+typedef struct _CockpitTransportPrivate CockpitTransportPrivate;
+
+/* Set in the frame length when the rest of the frame is compressed */
+#define COCKPIT_TRANSPORT_COMPRESSED  0x80000000U
+
+/* The most a compressed frame may decompress to */
+#define COCKPIT_TRANSPORT_MAX_INFLATED  (32 * 1024 * 1024)
 
 struct _CockpitTransport
 {
   GObject parent;
+  CockpitTransportPrivate *priv;
 };
 
 struct _CockpitTransportClass
@@ -69,6 +77,14 @@ struct _CockpitTransportClass
                                const gchar *channel,
                                GBytes *data);
 
+  /*
+   * Called to queue a control message about a channel. Optional,
+   * it's sent as any other control message when not implemented.
+   */
+  void        (* send_control) (CockpitTransport *transport,
+                                const gchar *channel,
+                                GBytes *data);
+
   void        (* close)       (CockpitTransport *transport,
                                const gchar *problem);
 };
@@ -79,19 +95,50 @@ void        cockpit_transport_send           (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
 
+void        cockpit_transport_send_control   (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              GBytes *data);
+
 void        cockpit_transport_close          (CockpitTransport *transport,
                                               const gchar *problem);
 
+gboolean    cockpit_transport_set_compress   (CockpitTransport *transport,
+                                              const gchar *scheme,
+                                              gsize threshold);
+
+/* Used by implementations */
+
+void        cockpit_transport_deflate_frame  (CockpitTransport *transport,
+                                              GBytes **prefix,
+                                              GBytes **payload);
+
+GBytes *    cockpit_transport_inflate_frame  (CockpitTransport *transport,
+                                              GBytes *body);
+
 void        cockpit_transport_emit_recv      (CockpitTransport *transport,
                                               const gchar *channel,
                                               GBytes *data);
 
+void        cockpit_transport_emit_recv_interned (CockpitTransport *transport,
+                                                  const gchar *channel,
+                                                  GBytes *data);
+
 void        cockpit_transport_emit_closed    (CockpitTransport *transport,
                                               const gchar *problem);
 
 GBytes *    cockpit_transport_parse_frame    (GBytes *message,
                                               gchar **channel);
 
+GBytes *    cockpit_transport_parse_frame_interned (GBytes *message,
+                                                    const gchar **channel);
+
+const gchar * cockpit_transport_intern_channel (const gchar *channel,
+                                                gssize length);
+
+void        cockpit_transport_release_channel (const gchar *channel);
+
+GBytes *    cockpit_transport_get_channel_prefix (const gchar *channel);
+
 gboolean    cockpit_transport_parse_command  (GBytes *payload,
                                               const gchar **command,
                                               const gchar **channel,
@@ -274,6 +274,69 @@ test_skip_whitespace (void)
   g_assert_cmpuint (spaces, ==, 7);
 }
 
+static void
+test_skip_resume (void)
+{
+  const gchar *first = "{\"a\": \"b\\\\\\\"}\", \"c\": [1, 2, {\"d\": true}]}";
+  const gchar *second = "[\"x\\\"y\", 22]";
+  CockpitJsonSkip skip;
+  gchar *data;
+  gsize spaces;
+  gsize off;
+  gsize i;
+
+  data = g_strconcat (first, second, NULL);
+
+  /* Feed one byte more each time, as if reading slowly */
+  cockpit_json_skip_init (&skip);
+  for (i = 1; i < strlen (first); i++)
+    g_assert_cmpuint (cockpit_json_skip_next (&skip, data, i, &spaces), ==, 0);
+  off = cockpit_json_skip_next (&skip, data, i, &spaces);
+  g_assert_cmpuint (off, ==, strlen (first));
+  g_assert_cmpuint (spaces, ==, 0);
+
+  for (i = 1; i < strlen (second); i++)
+    g_assert_cmpuint (cockpit_json_skip_next (&skip, data + off, i, &spaces), ==, 0);
+  g_assert_cmpuint (cockpit_json_skip_next (&skip, data + off, i, &spaces), ==, strlen (second));
+
+  g_free (data);
+}
+
+#define PERF_SKIP_OBJECTS 20000
+#define PERF_SKIP_READ 1024
+
+static void
+test_perf_skip (void)
+{
+  CockpitJsonSkip skip;
+  GString *string;
+  gdouble rate;
+  gsize length;
+  gsize off = 0;
+  gint i;
+
+  string = g_string_new ("[");
+  for (i = 0; i < PERF_SKIP_OBJECTS; i++)
+    {
+      g_string_append_printf (string, "%s{\"Id\":\"%08x%08x\",\"Names\":[\"/name-%d\"],"
+                              "\"Status\":\"Up 5 days\",\"Ports\":[]}\n",
+                              i == 0 ? "" : ",", i, i, i);
+    }
+  g_string_append (string, "]");
+
+  /* A large document arriving a bit at a time */
+  cockpit_json_skip_init (&skip);
+  g_test_timer_start ();
+  for (length = PERF_SKIP_READ; off == 0; length += PERF_SKIP_READ)
+    off = cockpit_json_skip_next (&skip, string->str, MIN (length, string->len), NULL);
+  rate = string->len / g_test_timer_elapsed () / (1024 * 1024);
+  g_test_maximized_result (rate, "skipped %.1f MB/s of JSON in %d byte reads",
+                           rate, PERF_SKIP_READ);
+
+  g_assert_cmpuint (off, ==, string->len);
+  g_string_free (string, TRUE);
+}
+
 static void
 test_parser_trims (void)
 {
@@ -404,6 +467,60 @@ test_equal (gconstpointer data)
   json_node_free (b);
 }
 
+typedef struct {
+    const gchar *name;
+    const gchar *a;
+    const gchar *b;
+    const gchar *patch;
+} FixtureDiff;
+
+static const FixtureDiff diff_fixtures[] = {
+  { "equal", "{\"a\":1}", "{\"a\":1}", "[]" },
+  { "replace-root", "1", "\"x\"",
+    "[{\"op\":\"replace\",\"path\":\"\",\"value\":\"x\"}]" },
+  { "replace-type", "{\"a\":[1]}", "{\"a\":{\"b\":1}}",
+    "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":{\"b\":1}}]" },
+  { "object-add", "{\"a\":1}", "{\"a\":1,\"b\":2}",
+    "[{\"op\":\"add\",\"path\":\"/b\",\"value\":2}]" },
+  { "object-remove", "{\"a\":1,\"b\":2}", "{\"a\":1}",
+    "[{\"op\":\"remove\",\"path\":\"/b\"}]" },
+  { "nested", "{\"a\":{\"b\":[1,2]}}", "{\"a\":{\"b\":[1,3]}}",
+    "[{\"op\":\"replace\",\"path\":\"/a/b/1\",\"value\":3}]" },
+  { "array-shrink", "[1,2,3]", "[1]",
+    "[{\"op\":\"remove\",\"path\":\"/2\"},{\"op\":\"remove\",\"path\":\"/1\"}]" },
+  { "array-grow", "[1]", "[1,2,3]",
+    "[{\"op\":\"add\",\"path\":\"/1\",\"value\":2},{\"op\":\"add\",\"path\":\"/2\",\"value\":3}]" },
+  { "escaped", "{\"a/b~c\":1}", "{\"a/b~c\":2}",
+    "[{\"op\":\"replace\",\"path\":\"/a~1b~0c\",\"value\":2}]" },
+};
+
+static void
+test_diff (gconstpointer data)
+{
+  const FixtureDiff *fixture = data;
+  GError *error = NULL;
+  JsonNode *a;
+  JsonNode *b;
+  JsonNode *expected;
+  JsonNode *patch;
+
+  a = cockpit_json_parse (fixture->a, -1, &error);
+  g_assert_no_error (error);
+  b = cockpit_json_parse (fixture->b, -1, &error);
+  g_assert_no_error (error);
+  expected = cockpit_json_parse (fixture->patch, -1, &error);
+  g_assert_no_error (error);
+
+  patch = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (patch, cockpit_json_diff (a, b));
+  g_assert (cockpit_json_equal (patch, expected));
+
+  json_node_free (a);
+  json_node_free (b);
+  json_node_free (expected);
+  json_node_free (patch);
+}
+
 static void
 test_utf8_invalid (void)
 {
@@ -426,6 +543,8 @@ static const FixtureString string_fixtures[] = {
   { "abc", "\"abc\"" },
   { "a\x7fxc", "\"a\\u007fxc\"" },
   { "a\033xc", "\"a\\u001bxc\"" },
+  { "a\037xc", "\"a\\u001fxc\"" },
+  { "a\"b\tc", "\"a\\\"b\\tc\"" },
   { "a\nxc", "\"a\\nxc\"" },
   { "a\\xc", "\"a\\\\xc\"" },
   { "Barney B\303\244r", "\"Barney B\303\244r\"" },
@@ -435,6 +554,7 @@ static void
 test_string_encode (gconstpointer data)
 {
   const FixtureString *fixture = data;
+  GString *buffer;
   JsonNode *node;
   gsize length;
   gchar *output;
@@ -445,6 +565,11 @@ test_string_encode (gconstpointer data)
   g_assert_cmpuint (length, ==, strlen (fixture->expect));
   g_free (output);
   json_node_free (node);
+
+  buffer = g_string_new ("x");
+  cockpit_json_append_string (buffer, fixture->str);
+  g_assert_cmpstr (buffer->str + 1, ==, fixture->expect);
+  g_string_free (buffer, TRUE);
 }
 
 static void
@@ -540,6 +665,10 @@ main (int argc,
     }
   g_test_add_func ("/json/skip/return-spaces", test_skip_whitespace);
   g_test_add_func ("/json/skip/truncated-in-escape", test_skip_truncated_in_escape);
+  g_test_add_func ("/json/skip/resume", test_skip_resume);
+
+  if (g_test_perf ())
+    g_test_add_func ("/json/perf/skip", test_perf_skip);
 
   for (i = 0; i < G_N_ELEMENTS (equal_fixtures); i++)
     {
@@ -548,6 +677,13 @@ main (int argc,
       g_free (name);
     }
 
+  for (i = 0; i < G_N_ELEMENTS (diff_fixtures); i++)
+    {
+      name = g_strdup_printf ("/json/diff/%s", diff_fixtures[i].name);
+      g_test_add_data_func (name, diff_fixtures + i, test_diff);
+      g_free (name);
+    }
+
   for (i = 0; i < G_N_ELEMENTS (string_fixtures); i++)
     {
       escaped = g_strescape (string_fixtures[i].str, NULL);
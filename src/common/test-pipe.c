@@ -40,6 +40,7 @@ static GType mock_echo_pipe_get_type (void) G_GNUC_CONST;
 typedef struct {
   CockpitPipe parent;
   GByteArray *received;
+  guint reads;
   gboolean closed;
   gchar *problem;
 } MockEchoPipe;
@@ -50,12 +51,13 @@ G_DEFINE_TYPE (MockEchoPipe, mock_echo_pipe, COCKPIT_TYPE_PIPE);
 
 static void
 mock_echo_pipe_read (CockpitPipe *pipe,
-                     GByteArray *buffer,
+                     CockpitPipeBuffer *buffer,
                      gboolean end_of_data)
 {
   MockEchoPipe *self = (MockEchoPipe *)pipe;
+  self->reads++;
   g_byte_array_append (self->received, buffer->data, buffer->len);
-  g_byte_array_set_size (buffer, 0);
+  cockpit_pipe_skip (buffer, buffer->len);
 }
 
 static void
@@ -280,6 +282,83 @@ test_echo_large (TestCase *tc,
   g_bytes_unref (sent);
 }
 
+static const TestFixture fixture_perf_echo = {
+    .command = "cat",
+    .no_timeout = TRUE
+};
+
+#define PERF_ECHO_SIZE (10 * 1000 * 1000)
+
+static void
+test_perf_echo (TestCase *tc,
+                gconstpointer data)
+{
+  MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
+  gdouble elapsed;
+  GBytes *sent;
+
+  sent = g_bytes_new_take (g_strnfill (PERF_ECHO_SIZE, '?'), PERF_ECHO_SIZE);
+
+  g_test_timer_start ();
+  cockpit_pipe_write (tc->pipe, sent);
+  while (echo_pipe->received->len < PERF_ECHO_SIZE)
+    g_main_context_iteration (NULL, TRUE);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpint (echo_pipe->received->len, ==, PERF_ECHO_SIZE);
+  g_test_maximized_result (PERF_ECHO_SIZE / elapsed / 1024,
+                           "echo throughput: %.1f KiB/s", PERF_ECHO_SIZE / elapsed / 1024);
+  g_test_minimized_result (echo_pipe->reads, "reads: %u", echo_pipe->reads);
+  g_bytes_unref (sent);
+
+  cockpit_pipe_close (tc->pipe, NULL);
+  while (!echo_pipe->closed)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_pause_input (TestCase *tc,
+                  gconstpointer data)
+{
+  MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
+  gboolean timeout = FALSE;
+  GBytes *sent;
+
+  cockpit_pipe_pause_input (tc->pipe, TRUE);
+
+  sent = g_bytes_new_static ("paused", 6);
+  cockpit_pipe_write (tc->pipe, sent);
+  g_bytes_unref (sent);
+  g_assert_cmpuint (cockpit_pipe_get_queued (tc->pipe), ==, 6);
+
+  /* Nothing should be read while paused, but output still goes out */
+  g_timeout_add (100, on_timeout_set_flag, &timeout);
+  while (!timeout)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (echo_pipe->received->len, ==, 0);
+  g_assert_cmpuint (cockpit_pipe_get_queued (tc->pipe), ==, 0);
+
+  cockpit_pipe_pause_input (tc->pipe, FALSE);
+  while (echo_pipe->received->len < 6)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (memcmp (echo_pipe->received->data, "paused", 6) == 0);
+
+  /* Closing with a problem works while paused */
+  cockpit_pipe_pause_input (tc->pipe, TRUE);
+  cockpit_pipe_close (tc->pipe, "bye");
+  while (!echo_pipe->closed)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (echo_pipe->problem, ==, "bye");
+}
+
 static void
 test_close_problem (TestCase *tc,
                     gconstpointer data)
@@ -328,7 +407,7 @@ static void
 test_buffer (TestCase *tc,
              gconstpointer data)
 {
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GBytes *sent;
 
   buffer = cockpit_pipe_get_buffer (tc->pipe);
@@ -551,15 +630,15 @@ test_read_combined (void)
 static void
 test_consume_entire (void)
 {
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GBytes *bytes;
 
-  buffer = g_byte_array_new ();
-  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+  buffer = cockpit_pipe_buffer_new ();
+  cockpit_pipe_buffer_append (buffer, "Marmaalaaaade!", 15);
 
   bytes = cockpit_pipe_consume (buffer, 0, 15);
   g_assert_cmpuint (buffer->len, ==, 0);
-  g_byte_array_free (buffer, TRUE);
+  cockpit_pipe_buffer_free (buffer);
 
   g_assert_cmpuint (g_bytes_get_size (bytes), ==, 15);
   g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==, "Marmaalaaaade!");
@@ -569,16 +648,16 @@ test_consume_entire (void)
 static void
 test_consume_partial (void)
 {
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GBytes *bytes;
 
-  buffer = g_byte_array_new ();
-  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+  buffer = cockpit_pipe_buffer_new ();
+  cockpit_pipe_buffer_append (buffer, "Marmaalaaaade!", 15);
 
   bytes = cockpit_pipe_consume (buffer, 0, 7);
   g_assert_cmpuint (buffer->len, ==, 8);
   g_assert_cmpstr ((gchar *)buffer->data, ==, "aaaade!");
-  g_byte_array_free (buffer, TRUE);
+  cockpit_pipe_buffer_free (buffer);
 
   g_assert_cmpuint (g_bytes_get_size (bytes), ==, 7);
   g_assert (memcmp (g_bytes_get_data (bytes, NULL), "Marmaal", 7) == 0);
@@ -588,15 +667,15 @@ test_consume_partial (void)
 static void
 test_consume_skip (void)
 {
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GBytes *bytes;
 
-  buffer = g_byte_array_new ();
-  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+  buffer = cockpit_pipe_buffer_new ();
+  cockpit_pipe_buffer_append (buffer, "Marmaalaaaade!", 15);
 
   bytes = cockpit_pipe_consume (buffer, 7, 8);
   g_assert_cmpuint (buffer->len, ==, 0);
-  g_byte_array_free (buffer, TRUE);
+  cockpit_pipe_buffer_free (buffer);
 
   g_assert_cmpuint (g_bytes_get_size (bytes), ==, 8);
   g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==,  "aaaade!");
@@ -606,16 +685,98 @@ test_consume_skip (void)
 static void
 test_buffer_skip (void)
 {
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
 
-  buffer = g_byte_array_new ();
-  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+  buffer = cockpit_pipe_buffer_new ();
+  cockpit_pipe_buffer_append (buffer, "Marmaalaaaade!", 15);
 
   cockpit_pipe_skip (buffer, 7);
   g_assert_cmpuint (buffer->len, ==, 8);
 
   g_assert_cmpstr ((char *)buffer->data, ==,  "aaaade!");
-  g_byte_array_free (buffer, TRUE);
+  cockpit_pipe_buffer_free (buffer);
+}
+
+static void
+test_buffer_many_frames (void)
+{
+  CockpitPipeBuffer *buffer;
+  GPtrArray *consumed;
+  const guint8 *data;
+  gchar frame[16];
+  gint i;
+
+  buffer = cockpit_pipe_buffer_new ();
+  consumed = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (frame, sizeof (frame), "%08d", i);
+      cockpit_pipe_buffer_append (buffer, frame, 8);
+    }
+
+  /* Small consumed bytes are copied, and don't keep the buffer around */
+  data = buffer->data;
+  for (i = 0; i < 1000; i++)
+    g_ptr_array_add (consumed, cockpit_pipe_consume (buffer, 0, 8));
+
+  g_assert_cmpuint (buffer->len, ==, 0);
+  g_assert (g_bytes_get_data (consumed->pdata[0], NULL) != data);
+
+  /* More data must not overwrite what was consumed */
+  cockpit_pipe_buffer_append (buffer, "overwrite", 9);
+  cockpit_pipe_buffer_free (buffer);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (frame, sizeof (frame), "%08d", i);
+      g_assert_cmpuint (g_bytes_get_size (consumed->pdata[i]), ==, 8);
+      g_assert (memcmp (g_bytes_get_data (consumed->pdata[i], NULL), frame, 8) == 0);
+    }
+
+  g_ptr_array_free (consumed, TRUE);
+}
+
+static void
+test_buffer_large_frames (void)
+{
+  CockpitPipeBuffer *buffer;
+  GPtrArray *consumed;
+  const guint8 *data;
+  gchar *frame;
+  gint i;
+
+  buffer = cockpit_pipe_buffer_new ();
+  consumed = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  frame = g_malloc (65536);
+  for (i = 0; i < 4; i++)
+    {
+      memset (frame, 'a' + i, 65536);
+      cockpit_pipe_buffer_append (buffer, frame, 65536);
+    }
+
+  /* Large consumed bytes point into the buffer, and keep it around */
+  data = buffer->data;
+  for (i = 0; i < 4; i++)
+    g_ptr_array_add (consumed, cockpit_pipe_consume (buffer, 0, 65536));
+
+  g_assert_cmpuint (buffer->len, ==, 0);
+  g_assert (g_bytes_get_data (consumed->pdata[0], NULL) == data);
+
+  /* More data must not overwrite what was consumed */
+  cockpit_pipe_buffer_append (buffer, "overwrite", 9);
+  cockpit_pipe_buffer_free (buffer);
+
+  for (i = 0; i < 4; i++)
+    {
+      memset (frame, 'a' + i, 65536);
+      g_assert_cmpuint (g_bytes_get_size (consumed->pdata[i]), ==, 65536);
+      g_assert (memcmp (g_bytes_get_data (consumed->pdata[i], NULL), frame, 65536) == 0);
+    }
+
+  g_free (frame);
+  g_ptr_array_free (consumed, TRUE);
 }
 
 static void
@@ -669,7 +830,7 @@ static void
 test_spawn_and_read (void)
 {
   gboolean closed = FALSE;
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   CockpitPipe *pipe;
 
   const gchar *argv[] = { "/bin/sh", "-c", "set", NULL };
@@ -683,7 +844,7 @@ test_spawn_and_read (void)
     g_main_context_iteration (NULL, TRUE);
 
   buffer = cockpit_pipe_get_buffer (pipe);
-  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  cockpit_pipe_buffer_append (buffer, "\0", 1);
 
   cockpit_assert_strmatch ((gchar *)buffer->data, "*ENVIRON*Marmalaaade*");
   g_object_unref (pipe);
@@ -693,7 +854,7 @@ static void
 test_spawn_and_write (void)
 {
   CockpitPipe *pipe;
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GBytes *sent;
 
   const gchar *argv[] = { "/bin/cat", NULL };
@@ -846,7 +1007,7 @@ static void
 test_pty_shell (void)
 {
   gboolean closed = FALSE;
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   CockpitPipe *pipe;
   GBytes *sent;
 
@@ -865,7 +1026,7 @@ test_pty_shell (void)
     g_main_context_iteration (NULL, TRUE);
 
   buffer = cockpit_pipe_get_buffer (pipe);
-  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  cockpit_pipe_buffer_append (buffer, "\0", 1);
 
   cockpit_assert_strmatch ((gchar *)buffer->data, "*booyah*");
   g_object_unref (pipe);
@@ -981,7 +1142,7 @@ test_connect_and_read (TestConnect *tc,
 {
   CockpitPipe *pipe;
   GError *error = NULL;
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
 
   pipe = cockpit_pipe_connect ("broooo", tc->address);
   g_assert (pipe != NULL);
@@ -1145,6 +1306,8 @@ main (int argc,
   g_test_add_func ("/pipe/buffer/consume-partial", test_consume_partial);
   g_test_add_func ("/pipe/buffer/consume-skip", test_consume_skip);
   g_test_add_func ("/pipe/buffer/skip", test_buffer_skip);
+  g_test_add_func ("/pipe/buffer/many-frames", test_buffer_many_frames);
+  g_test_add_func ("/pipe/buffer/large-frames", test_buffer_large_frames);
 
   g_test_add_func ("/pipe/properties", test_properties);
 
@@ -1161,6 +1324,8 @@ main (int argc,
               setup_simple, test_echo_queue, teardown);
   g_test_add ("/pipe/echo-large", TestCase, &fixture_no_timeout,
               setup_simple, test_echo_large, teardown);
+  g_test_add ("/pipe/pause-input", TestCase, NULL,
+              setup_simple, test_pause_input, teardown);
   g_test_add ("/pipe/close-problem", TestCase, NULL,
               setup_simple, test_close_problem, teardown);
   g_test_add ("/pipe/buffer", TestCase, &fixture_buffer,
@@ -1193,6 +1358,12 @@ main (int argc,
 
   g_test_add_func ("/pipe/pty/shell", test_pty_shell);
 
+  if (g_test_perf ())
+    {
+      g_test_add ("/pipe/perf/echo", TestCase, &fixture_perf_echo,
+                  setup_simple, test_perf_echo, teardown);
+    }
+
   g_test_add ("/pipe/connect/and-read", TestConnect, NULL,
               setup_connect, test_connect_and_read, teardown_connect);
   g_test_add ("/pipe/connect/and-write", TestConnect, NULL,
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpittransport.h"
+#include "cockpitfairqueue.h"
 #include "cockpitpipe.h"
 #include "cockpitpipetransport.h"
 
@@ -425,6 +426,376 @@ test_read_truncated (void)
   cockpit_assert_expected ();
 }
 
+static void
+test_echo_compress (TestCase *tc,
+                    gconstpointer data)
+{
+  GBytes *received = NULL;
+  GBytes *sent;
+  GString *json;
+  gint i;
+
+  g_assert (!cockpit_transport_set_compress (tc->transport, "unknown", 16));
+  g_assert (cockpit_transport_set_compress (tc->transport, "zlib", 16));
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_get_payload), &received);
+
+  /* Below the threshold, not compressed */
+  sent = g_bytes_new_static ("small", 5);
+  cockpit_transport_send (tc->transport, "546", sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  /* Each of these is compressed, as part of the same stream */
+  json = g_string_new ("");
+  for (i = 0; i < 3; i++)
+    {
+      g_string_append_printf (json, "{ \"notify\": { \"/path/%d\": { \"iface\": { \"Prop\": %d } } } }", i, i);
+      sent = g_bytes_new (json->str, json->len);
+      cockpit_transport_send (tc->transport, "546", sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (received, sent));
+      g_bytes_unref (sent);
+      g_bytes_unref (received);
+      received = NULL;
+    }
+  g_string_free (json, TRUE);
+
+  /* Large enough to take more than one pass through zlib */
+  sent = g_bytes_new_take (g_strnfill (1000 * 1000, '?'), 1000 * 1000);
+  cockpit_transport_send (tc->transport, "546", sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  /* And turned off again */
+  g_assert (cockpit_transport_set_compress (tc->transport, NULL, 0));
+  sent = g_bytes_new_static ("yello yello yello yello", 23);
+  cockpit_transport_send (tc->transport, "546", sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+}
+
+static void
+test_read_bad_compressed (void)
+{
+  CockpitTransport *transport;
+  gchar *problem = NULL;
+  guint32 size;
+  gint fds[2];
+  gint out;
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  cockpit_expect_warning ("*Couldn't decompress frame*");
+  cockpit_expect_warning ("*received invalid compressed frame");
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+
+  /* Marked as compressed, but isn't valid deflate data */
+  size = GUINT32_TO_BE (4 | COCKPIT_TRANSPORT_COMPRESSED);
+  g_assert_cmpint (write (fds[1], &size, sizeof (size)), ==, sizeof (size));
+  g_assert_cmpint (write (fds[1], "\xff\xff\xff\xff", 4), ==, 4);
+
+  WAIT_UNTIL (problem != NULL);
+
+  g_assert_cmpstr (problem, ==, "protocol-error");
+  g_free (problem);
+
+  close (fds[1]);
+  g_object_unref (transport);
+
+  cockpit_assert_expected ();
+}
+
+static void
+test_read_compressed_too_large (void)
+{
+  CockpitTransport *transport;
+  GConverter *compressor;
+  GError *error = NULL;
+  gchar *problem = NULL;
+  gsize bytes_read;
+  gsize bytes_written;
+  gsize length;
+  guint8 *input;
+  guint8 *output;
+  guint32 size;
+  gint fds[2];
+  gint out;
+
+  if (pipe(fds) < 0)
+    g_assert_not_reached ();
+
+  out = dup (2);
+  g_assert (out >= 0);
+
+  /* Zeros compress so well that this is still a small frame */
+  length = COCKPIT_TRANSPORT_MAX_INFLATED + 1024;
+  input = g_malloc0 (length);
+  output = g_malloc (length / 512);
+
+  compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+  g_assert_cmpint (g_converter_convert (compressor, input, length, output, length / 512,
+                                        G_CONVERTER_INPUT_AT_END | G_CONVERTER_FLUSH,
+                                        &bytes_read, &bytes_written, &error), ==, G_CONVERTER_FINISHED);
+  g_assert_no_error (error);
+  g_assert_cmpuint (bytes_read, ==, length);
+  g_object_unref (compressor);
+  g_free (input);
+
+  cockpit_expect_warning ("*Decompressed frame is larger than*");
+  cockpit_expect_warning ("*received invalid compressed frame");
+
+  transport = cockpit_pipe_transport_new_fds ("test", fds[0], out);
+  g_signal_connect (transport, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+
+  size = GUINT32_TO_BE (bytes_written | COCKPIT_TRANSPORT_COMPRESSED);
+  g_assert_cmpint (write (fds[1], &size, sizeof (size)), ==, sizeof (size));
+  g_assert_cmpint (write (fds[1], output, bytes_written), ==, bytes_written);
+  g_free (output);
+
+  WAIT_UNTIL (problem != NULL);
+
+  g_assert_cmpstr (problem, ==, "protocol-error");
+  g_free (problem);
+
+  close (fds[1]);
+  g_object_unref (transport);
+
+  cockpit_assert_expected ();
+}
+
+static void
+assert_pops (CockpitFairQueue *queue,
+             const gchar *expected)
+{
+  GBytes *prefix = NULL;
+  GBytes *payload = NULL;
+  gchar *str;
+
+  g_assert (cockpit_fair_queue_pop (queue, &prefix, &payload));
+  g_assert (prefix == NULL);
+  str = g_strndup (g_bytes_get_data (payload, NULL), g_bytes_get_size (payload));
+  g_assert_cmpstr (str, ==, expected);
+  g_bytes_unref (payload);
+  g_free (str);
+}
+
+static void
+push_static (CockpitFairQueue *queue,
+             const gchar *channel,
+             const gchar *data)
+{
+  GBytes *payload = g_bytes_new_static (data, strlen (data));
+  cockpit_fair_queue_push (queue, channel, NULL, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+test_fair_queue (void)
+{
+  CockpitFairQueue *queue;
+  GBytes *prefix;
+  GBytes *payload;
+
+  queue = cockpit_fair_queue_new (8);
+  g_assert (cockpit_fair_queue_is_empty (queue));
+
+  /* A bulk channel gets in first */
+  push_static (queue, "bulk", "aaaaaaaa");
+  push_static (queue, "bulk", "bbbbbbbb");
+  push_static (queue, "bulk", "cccccccc");
+  push_static (queue, "bulk", "dddddddd");
+
+  /* Then a small message, its close, and a control message */
+  push_static (queue, "small", "1");
+  payload = g_bytes_new_static ("{\"command\": \"close\", \"channel\": \"small\"}", 40);
+  cockpit_fair_queue_push_control (queue, "small", NULL, payload);
+  g_bytes_unref (payload);
+  push_static (queue, NULL, "{\"command\": \"ping\"}");
+
+  g_assert (!cockpit_fair_queue_is_empty (queue));
+  g_assert_cmpuint (cockpit_fair_queue_get_size (queue), ==, 32 + 1 + 40 + 19);
+
+  /* Control messages first, then the channels take turns */
+  assert_pops (queue, "{\"command\": \"ping\"}");
+  assert_pops (queue, "aaaaaaaa");
+  g_assert_cmpuint (cockpit_fair_queue_get_size (queue), ==, 24 + 1 + 40);
+  assert_pops (queue, "1");
+  assert_pops (queue, "bbbbbbbb");
+  assert_pops (queue, "cccccccc");
+  assert_pops (queue, "dddddddd");
+
+  /* The close for a channel stays behind its data */
+  assert_pops (queue, "{\"command\": \"close\", \"channel\": \"small\"}");
+
+  g_assert (cockpit_fair_queue_is_empty (queue));
+  g_assert (!cockpit_fair_queue_pop (queue, &prefix, &payload));
+
+  /* Clearing drops everything */
+  push_static (queue, "bulk", "aaaaaaaa");
+  push_static (queue, NULL, "{\"command\": \"ping\"}");
+  cockpit_fair_queue_clear (queue);
+  g_assert (cockpit_fair_queue_is_empty (queue));
+  g_assert_cmpuint (cockpit_fair_queue_get_size (queue), ==, 0);
+
+  push_static (queue, "bulk", "left over");
+  cockpit_fair_queue_free (queue);
+}
+
+typedef struct {
+  gsize bulk;
+  gboolean call;
+} PerfLatency;
+
+static gboolean
+on_recv_perf_latency (CockpitTransport *transport,
+                      const gchar *channel,
+                      GBytes *message,
+                      gpointer user_data)
+{
+  PerfLatency *perf = user_data;
+
+  if (g_str_equal (channel, "bulk"))
+    perf->bulk += g_bytes_get_size (message);
+  else if (g_str_equal (channel, "call"))
+    perf->call = TRUE;
+  else
+    g_assert_not_reached ();
+  return TRUE;
+}
+
+#define PERF_BULK_BLOCK (32 * 1024)
+#define PERF_BULK_BLOCKS 64
+#define PERF_CALLS 20
+
+static void
+test_perf_latency (TestCase *tc,
+                   gconstpointer data)
+{
+  PerfLatency perf = { 0, FALSE };
+  gdouble elapsed;
+  gdouble total = 0;
+  gdouble worst = 0;
+  GBytes *block;
+  GBytes *call;
+  gsize sent = 0;
+  gint i, j;
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_perf_latency), &perf);
+
+  block = g_bytes_new_take (g_strnfill (PERF_BULK_BLOCK, 'x'), PERF_BULK_BLOCK);
+  data = "{ \"call\": [ \"/path\", \"iface\", \"Method\", [ ] ] }";
+  call = g_bytes_new_static (data, strlen (data));
+
+  for (i = 0; i < PERF_CALLS; i++)
+    {
+      /* Keep megabytes of bulk data queued ahead of each call */
+      for (j = 0; j < PERF_BULK_BLOCKS; j++)
+        cockpit_transport_send (tc->transport, "bulk", block);
+      sent += PERF_BULK_BLOCK * PERF_BULK_BLOCKS;
+
+      perf.call = FALSE;
+      g_test_timer_start ();
+      cockpit_transport_send (tc->transport, "call", call);
+      WAIT_UNTIL (perf.call);
+      elapsed = g_test_timer_elapsed ();
+
+      total += elapsed;
+      worst = MAX (worst, elapsed);
+    }
+
+  g_test_minimized_result (total / PERF_CALLS, "mean call round trip behind bulk: %.6f s",
+                           total / PERF_CALLS);
+  g_test_minimized_result (worst, "worst call round trip behind bulk: %.6f s", worst);
+
+  WAIT_UNTIL (perf.bulk == sent);
+
+  g_bytes_unref (block);
+  g_bytes_unref (call);
+}
+
+#define PERF_COMPRESS_FRAMES 5000
+
+static void
+test_perf_compress (TestCase *tc,
+                    gconstpointer data)
+{
+  GBytes **frames;
+  GBytes *prefix;
+  GBytes *payload;
+  GBytes *inflated;
+  gchar *frame;
+  gsize plain = 0;
+  gsize compressed = 0;
+  gdouble deflating;
+  gdouble inflating;
+  guint32 size;
+  gint i;
+
+  /* Looks like a stream of dbus-json property notifications */
+  frames = g_new0 (GBytes *, PERF_COMPRESS_FRAMES);
+  for (i = 0; i < PERF_COMPRESS_FRAMES; i++)
+    {
+      frame = g_strdup_printf ("....44\n{ \"notify\": { \"/org/freedesktop/systemd1/unit/unit_%d_2eservice\": "
+                               "{ \"org.freedesktop.systemd1.Unit\": { \"ActiveState\": \"%s\", "
+                               "\"SubState\": \"%s\", \"ActiveEnterTimestamp\": %d, "
+                               "\"Description\": \"Service number %d\" } } } }",
+                               i, i % 3 ? "active" : "inactive", i % 3 ? "running" : "dead",
+                               i * 1013, i);
+      size = GUINT32_TO_BE (strlen (frame) - sizeof (size));
+      memcpy (frame, &size, sizeof (size));
+      frames[i] = g_bytes_new_take (frame, strlen (frame));
+      plain += g_bytes_get_size (frames[i]);
+    }
+
+  g_assert (cockpit_transport_set_compress (tc->transport, "zlib", 0));
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_COMPRESS_FRAMES; i++)
+    {
+      prefix = g_bytes_new_from_bytes (frames[i], 0, 7);
+      payload = g_bytes_new_from_bytes (frames[i], 7, g_bytes_get_size (frames[i]) - 7);
+      cockpit_transport_deflate_frame (tc->transport, &prefix, &payload);
+      g_assert_cmpuint (g_bytes_get_size (prefix), ==, 4);
+      compressed += g_bytes_get_size (prefix) + g_bytes_get_size (payload);
+      g_bytes_unref (prefix);
+      g_bytes_unref (frames[i]);
+      frames[i] = payload;
+    }
+  deflating = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_COMPRESS_FRAMES; i++)
+    {
+      inflated = cockpit_transport_inflate_frame (tc->transport, frames[i]);
+      g_assert (inflated != NULL);
+      g_bytes_unref (inflated);
+      g_bytes_unref (frames[i]);
+    }
+  inflating = g_test_timer_elapsed ();
+
+  g_test_maximized_result ((gdouble)plain / compressed, "compression ratio: %.2f",
+                           (gdouble)plain / compressed);
+  g_test_maximized_result (plain / deflating, "deflate: %.1f MB/s", plain / deflating / 1000000);
+  g_test_maximized_result (plain / inflating, "inflate: %.1f MB/s", plain / inflating / 1000000);
+
+  g_free (frames);
+}
+
 static void
 test_parse_frame (void)
 {
@@ -444,6 +815,45 @@ test_parse_frame (void)
   g_free (channel);
 }
 
+static void
+test_parse_frame_interned (void)
+{
+  const gchar *interned;
+  const gchar *channel;
+  GBytes *message;
+  GBytes *payload;
+  GBytes *prefix;
+
+  interned = cockpit_transport_intern_channel ("134xxx", 3);
+  g_assert_cmpstr (interned, ==, "134");
+  g_assert (cockpit_transport_intern_channel ("134", -1) == interned);
+  cockpit_transport_release_channel (interned);
+
+  prefix = cockpit_transport_get_channel_prefix (interned);
+  g_assert_cmpuint (g_bytes_get_size (prefix), ==, 4);
+  g_assert (memcmp (g_bytes_get_data (prefix, NULL), "134\n", 4) == 0);
+
+  /* Parsing returns the same pointer */
+  message = g_bytes_new_static ("134\ntest", 8);
+  payload = cockpit_transport_parse_frame_interned (message, &channel);
+  g_assert (payload != NULL);
+  g_assert (channel == interned);
+  g_assert_cmpstr (g_bytes_get_data (payload, NULL), ==, "test");
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+  cockpit_transport_release_channel (channel);
+
+  /* Control messages have no channel */
+  message = g_bytes_new_static ("\n{}", 3);
+  payload = cockpit_transport_parse_frame_interned (message, &channel);
+  g_assert (payload != NULL);
+  g_assert (channel == NULL);
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+
+  cockpit_transport_release_channel (interned);
+}
+
 static void
 test_parse_frame_bad (void)
 {
@@ -561,8 +971,11 @@ main (int argc,
 
   cockpit_test_init (&argc, &argv);
 
+  g_test_add_func ("/transport/fair-queue", test_fair_queue);
+
   g_test_add_func ("/transport/parse-frame", test_parse_frame);
   g_test_add_func ("/transport/parse-frame-bad", test_parse_frame_bad);
+  g_test_add_func ("/transport/parse-frame-interned", test_parse_frame_interned);
 
   g_test_add_func ("/transport/parse-command/normal", test_parse_command);
   g_test_add_func ("/transport/parse-command/no-channel", test_parse_command_no_channel);
@@ -609,5 +1022,24 @@ main (int argc,
   g_test_add_func ("/transport/read-combined", test_read_combined);
   g_test_add_func ("/transport/read-truncated", test_read_truncated);
 
+  g_test_add ("/transport/echo-compress/child", TestCase,
+              "cat", setup_with_child,
+              test_echo_compress, teardown_transport);
+  g_test_add ("/transport/echo-compress/no-child", TestCase,
+              NULL, setup_no_child,
+              test_echo_compress, teardown_transport);
+  g_test_add_func ("/transport/read-bad-compressed", test_read_bad_compressed);
+  g_test_add_func ("/transport/read-compressed-too-large", test_read_compressed_too_large);
+
+  if (g_test_perf ())
+    {
+      g_test_add ("/transport/perf/latency", TestCase,
+                  "cat", setup_with_child,
+                  test_perf_latency, teardown_transport);
+      g_test_add ("/transport/perf/compress", TestCase,
+                  NULL, setup_no_child,
+                  test_perf_compress, teardown_transport);
+    }
+
   return g_test_run ();
 }
@@ -35,6 +35,7 @@ typedef struct {
 typedef struct {
   WebSocketFlavor flavor;
   const gchar *flavor_name;
+  gboolean deflate;
 } FlavorFixture;
 
 static void
@@ -477,6 +478,14 @@ setup_pair (Test *test,
   test->server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, ios, NULL, NULL);
   test->client = client_new_for_stream_and_flavor (ioc, fixture->flavor);
 
+  /* Compress everything, and the server with a smaller window */
+  if (fixture->deflate)
+    {
+      g_object_set (test->server, "deflate", TRUE, "deflate-threshold", (gulong)0,
+                    "deflate-window-bits", 10, NULL);
+      g_object_set (test->client, "deflate", TRUE, "deflate-threshold", (gulong)0, NULL);
+    }
+
   g_signal_connect (test->client, "error", G_CALLBACK (on_error_not_reached), NULL);
   g_signal_connect (test->server, "error", G_CALLBACK (on_error_not_reached), NULL);
 
@@ -629,6 +638,65 @@ test_send_big_packets (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_text_message_append (WebSocketConnection *ws,
+                        WebSocketDataType type,
+                        GBytes *message,
+                        gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  g_assert_cmpint (type, ==, WEB_SOCKET_DATA_TEXT);
+  g_ptr_array_add (received, g_bytes_ref (message));
+}
+
+static void
+test_send_coalesced (Test *test,
+                     gconstpointer data)
+{
+  GPtrArray *received;
+  GBytes *sent;
+  gchar *string;
+  gint i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->client, "message", G_CALLBACK (on_text_message_append), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Small budget so that frames are split across several batches */
+  g_object_set (test->server, "output-budget", (gulong)100, NULL);
+
+  for (i = 0; i < 200; i++)
+    {
+      string = g_strdup_printf ("message %d", i);
+      sent = g_bytes_new_take (string, strlen (string));
+      web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      g_bytes_unref (sent);
+    }
+
+  /* And one larger than the budget */
+  sent = g_bytes_new_take (g_strnfill (1000, '!'), 1000);
+  web_socket_connection_send (test->server, WEB_SOCKET_DATA_TEXT, NULL, sent);
+
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), >, 0);
+
+  WAIT_UNTIL (received->len == 201);
+
+  for (i = 0; i < 200; i++)
+    {
+      string = g_strdup_printf ("message %d", i);
+      g_assert_cmpstr (g_bytes_get_data (received->pdata[i], NULL), ==, string);
+      g_free (string);
+    }
+
+  g_assert (g_bytes_equal (received->pdata[200], sent));
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (test->server), ==, 0);
+
+  g_bytes_unref (sent);
+  g_ptr_array_free (received, TRUE);
+}
+
 static void
 test_send_prefixed (Test *test,
                     gconstpointer data)
@@ -654,6 +722,57 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+test_send_prefixed_big (Test *test,
+                        gconstpointer data)
+{
+  WebSocketConnection *senders[] = { test->server, test->client };
+  WebSocketConnection *receivers[] = { test->client, test->server };
+  GPtrArray *received;
+  GBytes *prefix;
+  GBytes *payload;
+  GBytes *small;
+  GBytes *expect;
+  GByteArray *buffer;
+  gint i;
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (test->server), ==, WEB_SOCKET_STATE_OPEN);
+
+  prefix = g_bytes_new_static ("channel\n", 8);
+  payload = g_bytes_new_take (g_strnfill (100 * 1000, 'x'), 100 * 1000);
+  small = g_bytes_new_static ("small", 5);
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (guint8 *)"channel\n", 8);
+  g_byte_array_append (buffer, g_bytes_get_data (payload, NULL), g_bytes_get_size (payload));
+  expect = g_byte_array_free_to_bytes (buffer);
+
+  /* Both directions, the client side has to mask */
+  for (i = 0; i < G_N_ELEMENTS (senders); i++)
+    {
+      received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+      g_signal_connect (receivers[i], "message", G_CALLBACK (on_text_message_append), received);
+
+      web_socket_connection_send (senders[i], WEB_SOCKET_DATA_TEXT, NULL, small);
+      web_socket_connection_send (senders[i], WEB_SOCKET_DATA_TEXT, prefix, payload);
+      web_socket_connection_send (senders[i], WEB_SOCKET_DATA_TEXT, prefix, small);
+
+      WAIT_UNTIL (received->len == 3);
+      g_assert (g_bytes_equal (received->pdata[0], small));
+      g_assert (g_bytes_equal (received->pdata[1], expect));
+      g_assert_cmpstr (g_bytes_get_data (received->pdata[2], NULL), ==, "channel\nsmall");
+
+      g_signal_handlers_disconnect_by_func (receivers[i], on_text_message_append, received);
+      g_ptr_array_free (received, TRUE);
+    }
+
+  g_bytes_unref (expect);
+  g_bytes_unref (small);
+  g_bytes_unref (payload);
+  g_bytes_unref (prefix);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -921,7 +1040,8 @@ test_message_after_closing (Test *test,
 }
 
 static void
-mock_perform_handshake (GIOStream *io)
+mock_perform_handshake_full (GIOStream *io,
+                             const gchar *extensions)
 {
   GHashTable *headers;
   gchar buffer[1024];
@@ -950,7 +1070,11 @@ mock_perform_handshake (GIOStream *io)
                       "Upgrade: websocket\r\n"
                       "Connection: Upgrade\r\n"
                       "Sec-WebSocket-Accept: %s\r\n"
-                      "\r\n", accept);
+                      "%s%s%s"
+                      "\r\n", accept,
+                      extensions ? "Sec-WebSocket-Extensions: " : "",
+                      extensions ? extensions : "",
+                      extensions ? "\r\n" : "");
   g_free (accept);
 
   if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
@@ -961,6 +1085,12 @@ mock_perform_handshake (GIOStream *io)
   g_hash_table_unref (headers);
 }
 
+static void
+mock_perform_handshake (GIOStream *io)
+{
+  mock_perform_handshake_full (io, NULL);
+}
+
 static gpointer
 handshake_then_timeout_server_thread (gpointer user_data)
 {
@@ -1363,6 +1493,357 @@ test_hixie76_rough_close (void)
   g_object_unref (ios);
 }
 
+static void
+test_parse_deflate (void)
+{
+  WebSocketDeflateParams params;
+
+  g_assert (_web_socket_util_parse_deflate ("permessage-deflate", &params));
+  g_assert (!params.server_no_context_takeover);
+  g_assert (!params.client_no_context_takeover);
+  g_assert_cmpint (params.server_max_window_bits, ==, 0);
+  g_assert_cmpint (params.client_max_window_bits, ==, 0);
+
+  g_assert (_web_socket_util_parse_deflate (" permessage-deflate; client_max_window_bits ", &params));
+  g_assert_cmpint (params.client_max_window_bits, ==, -1);
+
+  g_assert (_web_socket_util_parse_deflate ("permessage-deflate; server_no_context_takeover;"
+                                            "client_no_context_takeover; server_max_window_bits=10; "
+                                            "client_max_window_bits=\"12\"", &params));
+  g_assert (params.server_no_context_takeover);
+  g_assert (params.client_no_context_takeover);
+  g_assert_cmpint (params.server_max_window_bits, ==, 10);
+  g_assert_cmpint (params.client_max_window_bits, ==, 12);
+
+  /* Other extensions, and invalid parameters */
+  g_assert (!_web_socket_util_parse_deflate ("x-webkit-deflate-frame", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; unknown", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; server_max_window_bits", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; server_max_window_bits=16", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; client_max_window_bits=7", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; client_max_window_bits=ten", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; server_no_context_takeover=1", &params));
+  g_assert (!_web_socket_util_parse_deflate ("permessage-deflate; server_no_context_takeover; "
+                                             "server_no_context_takeover", &params));
+}
+
+static gpointer
+send_compressed_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  /* The examples from RFC 7692 section 7.2.3.2, with context takeover */
+  const gchar frames[] = "\xc1\x07\xf2\x48\xcd\xc9\xc9\x07\x00"
+                         "\xc1\x05\xf2\x00\x11\x00\x00";
+
+  mock_perform_handshake_full (io, "permessage-deflate");
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frames, sizeof (frames) -1, &written, NULL, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (written, ==, sizeof (frames) - 1);
+
+  return NULL;
+}
+
+static void
+test_deflate_receive (void)
+{
+  WebSocketConnection *client;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  GPtrArray *received;
+
+  create_iostream_pair (&io_a, &io_b);
+  thread = g_thread_new ("compressed-thread", send_compressed_server_thread, io_a);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "deflate", TRUE, NULL);
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (client, "message", G_CALLBACK (on_text_message_append), received);
+
+  WAIT_UNTIL (received->len == 2);
+  g_assert_cmpstr (g_bytes_get_data (received->pdata[0], NULL), ==, "Hello");
+  g_assert_cmpstr (g_bytes_get_data (received->pdata[1], NULL), ==, "Hello");
+  g_ptr_array_free (received, TRUE);
+
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_unexpected_compressed_server_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  gsize written;
+
+  /* Compressed, but the extension was not negotiated */
+  const gchar frame[] = "\xc1\x07\xf2\x48\xcd\xc9\xc9\x07\x00";
+
+  mock_perform_handshake (io);
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frame, sizeof (frame) -1, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  return NULL;
+}
+
+static void
+test_deflate_unexpected (void)
+{
+  WebSocketConnection *client;
+  GError *error = NULL;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  guint logid;
+
+  create_iostream_pair (&io_a, &io_b);
+  thread = g_thread_new ("compressed-thread", send_unexpected_compressed_server_thread, io_a);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "deflate", TRUE, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_PROTOCOL);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static gpointer
+send_compressed_too_big_thread (gpointer user_data)
+{
+  GIOStream *io = user_data;
+  GConverter *compressor;
+  guint8 frame[4096];
+  gchar *input;
+  gsize length = 200 * 1024;
+  gsize bytes_read;
+  gsize bytes_written;
+  gsize written;
+
+  mock_perform_handshake_full (io, "permessage-deflate");
+
+  /* Compresses to far less than the payload limit, but inflates past it */
+  input = g_strnfill (length, 'a');
+  compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+  if (g_converter_convert (compressor, input, length, frame + 4, sizeof (frame) - 4,
+                           G_CONVERTER_FLUSH, &bytes_read, &bytes_written, NULL) != G_CONVERTER_FLUSHED)
+    g_assert_not_reached ();
+  g_assert_cmpuint (bytes_read, ==, length);
+  g_object_unref (compressor);
+  g_free (input);
+
+  /* The flush adds a tail that is left off on the wire */
+  bytes_written -= 4;
+  g_assert_cmpuint (bytes_written, <, 65536);
+  frame[0] = 0xc1;
+  frame[1] = 126;
+  frame[2] = (bytes_written >> 8) & 0xFF;
+  frame[3] = (bytes_written >> 0) & 0xFF;
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (io),
+                                  frame, bytes_written + 4, &written, NULL, NULL))
+    g_assert_not_reached ();
+
+  return NULL;
+}
+
+static void
+test_deflate_too_big (void)
+{
+  WebSocketConnection *client;
+  GError *error = NULL;
+  GIOStream *io_a;
+  GIOStream *io_b;
+  GThread *thread;
+  guint logid;
+
+  create_iostream_pair (&io_a, &io_b);
+  thread = g_thread_new ("compressed-thread", send_compressed_too_big_thread, io_a);
+
+  logid = g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, null_log_handler, NULL);
+
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "deflate", TRUE, NULL);
+  g_signal_connect (client, "error", G_CALLBACK (on_error_copy), &error);
+
+  WAIT_UNTIL (error != NULL);
+  g_assert_error (error, WEB_SOCKET_ERROR, WEB_SOCKET_CLOSE_TOO_BIG);
+  g_error_free (error);
+
+  g_log_remove_handler (G_LOG_DOMAIN, logid);
+
+  g_thread_join (thread);
+  g_object_unref (client);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static void
+test_deflate_declined (void)
+{
+  WebSocketConnection *client;
+  WebSocketConnection *server;
+  GBytes *received = NULL;
+  GBytes *sent;
+  GIOStream *io_a;
+  GIOStream *io_b;
+
+  create_iostream_pair (&io_a, &io_b);
+
+  /* The client offers, but the server hasn't been told to accept */
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, io_a, NULL, NULL);
+  client = web_socket_client_new_for_stream ("ws://localhost/unix", NULL, NULL, io_b);
+  g_object_set (client, "deflate", TRUE, "deflate-threshold", (gulong)0, NULL);
+
+  g_signal_connect (client, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (server, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_signal_connect (server, "message", G_CALLBACK (on_text_message), &received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (client) == WEB_SOCKET_STATE_OPEN);
+
+  /* So this is sent uncompressed */
+  sent = g_bytes_new_static ("uncompressed", 12);
+  web_socket_connection_send (client, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (sent, received));
+  g_bytes_unref (received);
+  g_bytes_unref (sent);
+
+  g_object_unref (client);
+  g_object_unref (server);
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+typedef struct {
+  GIOStream *io;
+  const gchar *extensions;
+  gsize total;
+} PerfReader;
+
+static gpointer
+perf_reader_thread (gpointer user_data)
+{
+  PerfReader *reader = user_data;
+  GInputStream *input;
+  gchar *request;
+  gchar buffer[64 * 1024];
+  gssize count;
+
+  request = g_strdup_printf ("GET /unix HTTP/1.1\r\n"
+                             "Host: localhost\r\n"
+                             "Upgrade: websocket\r\n"
+                             "Connection: Upgrade\r\n"
+                             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                             "Sec-WebSocket-Version: 13\r\n"
+                             "%s%s%s"
+                             "\r\n",
+                             reader->extensions ? "Sec-WebSocket-Extensions: " : "",
+                             reader->extensions ? reader->extensions : "",
+                             reader->extensions ? "\r\n" : "");
+
+  if (!g_output_stream_write_all (g_io_stream_get_output_stream (reader->io),
+                                  request, strlen (request), NULL, NULL, NULL))
+    g_assert_not_reached ();
+  g_free (request);
+
+  /* Count everything the server sends, until it goes away */
+  input = g_io_stream_get_input_stream (reader->io);
+  for (;;)
+    {
+      count = g_input_stream_read (input, buffer, sizeof (buffer), NULL, NULL);
+      if (count <= 0)
+        break;
+      reader->total += count;
+    }
+
+  return NULL;
+}
+
+#define PERF_MESSAGES 10000
+
+static void
+perf_bandwidth (const gchar *extensions,
+                gsize *total,
+                gdouble *elapsed)
+{
+  WebSocketConnection *server;
+  PerfReader reader = { NULL, extensions, 0 };
+  GIOStream *io;
+  GThread *thread;
+  GBytes *message;
+  gchar *string;
+  gint i;
+
+  create_iostream_pair (&io, &reader.io);
+  thread = g_thread_new ("perf-reader", perf_reader_thread, &reader);
+
+  server = web_socket_server_new_for_stream ("ws://localhost/unix", NULL, NULL, io, NULL, NULL);
+  g_object_set (server, "deflate", TRUE, NULL);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (server) == WEB_SOCKET_STATE_OPEN);
+
+  g_test_timer_start ();
+
+  /* Looks like a flood of property changes */
+  for (i = 0; i < PERF_MESSAGES; i++)
+    {
+      string = g_strdup_printf ("4:1\n{\"notify\":{\"/org/freedesktop/systemd1/unit/unit_%d_2eservice\":"
+                                "{\"org.freedesktop.systemd1.Unit\":{\"ActiveState\":\"%s\","
+                                "\"SubState\":\"%s\",\"ActiveEnterTimestamp\":%d}}}}",
+                                i, i % 3 ? "active" : "inactive", i % 3 ? "running" : "dead", i * 1013);
+      message = g_bytes_new_take (string, strlen (string));
+      web_socket_connection_send (server, WEB_SOCKET_DATA_TEXT, NULL, message);
+      g_bytes_unref (message);
+    }
+
+  WAIT_UNTIL (web_socket_connection_get_buffered_amount (server) == 0);
+  *elapsed = g_test_timer_elapsed ();
+
+  /* A rough close, so the reader sees the end */
+  g_object_unref (server);
+  WAIT_UNTIL (g_io_stream_is_closed (io));
+  g_thread_join (thread);
+
+  *total = reader.total;
+  g_object_unref (reader.io);
+  g_object_unref (io);
+}
+
+static void
+test_perf_deflate_bandwidth (void)
+{
+  gsize plain, compressed;
+  gdouble plain_time, compressed_time;
+
+  perf_bandwidth (NULL, &plain, &plain_time);
+  perf_bandwidth ("permessage-deflate", &compressed, &compressed_time);
+
+  g_test_minimized_result (plain, "uncompressed: %" G_GSIZE_FORMAT " bytes in %.3f s",
+                           plain, plain_time);
+  g_test_minimized_result (compressed, "permessage-deflate: %" G_GSIZE_FORMAT " bytes in %.3f s",
+                           compressed, compressed_time);
+  g_test_maximized_result ((gdouble)plain / compressed, "bandwidth saved: %.1fx",
+                           (gdouble)plain / compressed);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1371,8 +1852,9 @@ main (int argc,
   gint i, j;
 
   FlavorFixture fixtures[] = {
-      { WEB_SOCKET_FLAVOR_RFC6455, "rfc6455" },
-      { WEB_SOCKET_FLAVOR_HIXIE76, "hixie76" },
+      { WEB_SOCKET_FLAVOR_RFC6455, "rfc6455", FALSE },
+      { WEB_SOCKET_FLAVOR_HIXIE76, "hixie76", FALSE },
+      { WEB_SOCKET_FLAVOR_RFC6455, "rfc6455-deflate", TRUE },
   };
 
   struct {
@@ -1383,7 +1865,9 @@ main (int argc,
       { test_send_client_to_server, "send-client-to-server" },
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
+      { test_send_coalesced, "send-coalesced" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_prefixed_big, "send-prefixed-big" },
       { test_send_bad_data, "send-bad-data" },
       { test_protocol_negotiate, "protocol-negotiate" },
       { test_protocol_mismatch, "protocol-mismatch" },
@@ -1455,5 +1939,14 @@ main (int argc,
   g_test_add_func ("/web-socket/hixie76/response-headers", test_hixie76_response_headers);
   g_test_add_func ("/web-socket/hixie76/rough-close", test_hixie76_rough_close);
 
+  g_test_add_func ("/web-socket/deflate/parse", test_parse_deflate);
+  g_test_add_func ("/web-socket/deflate/receive", test_deflate_receive);
+  g_test_add_func ("/web-socket/deflate/unexpected", test_deflate_unexpected);
+  g_test_add_func ("/web-socket/deflate/too-big", test_deflate_too_big);
+  g_test_add_func ("/web-socket/deflate/declined", test_deflate_declined);
+
+  if (g_test_perf ())
+    g_test_add_func ("/web-socket/perf/deflate-bandwidth", test_perf_deflate_bandwidth);
+
   return g_test_run ();
 }
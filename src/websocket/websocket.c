@@ -407,6 +407,101 @@ _web_socket_util_header_empty (GHashTable *headers,
   return FALSE;
 }
 
+static gboolean
+parse_window_bits (const gchar *value,
+                   gint *bits)
+{
+  gchar *end = NULL;
+  gint64 num;
+
+  /* Quoted values are allowed */
+  if (value[0] == '"')
+    value++;
+
+  num = g_ascii_strtoll (value, &end, 10);
+  if (end == value || (end[0] != '\0' && !g_str_equal (end, "\"")))
+    return FALSE;
+  if (num < 8 || num > 15)
+    return FALSE;
+
+  *bits = num;
+  return TRUE;
+}
+
+/*
+ * Parse one permessage-deflate extension from a Sec-WebSocket-Extensions
+ * header, ie: the part between commas. See RFC 7692. Returns FALSE if it's
+ * a different extension, or the parameters are invalid.
+ */
+gboolean
+_web_socket_util_parse_deflate (const gchar *extension,
+                                WebSocketDeflateParams *params)
+{
+  gboolean ret = FALSE;
+  gchar **parts;
+  gchar *name;
+  gchar *value;
+  guint i;
+
+  memset (params, 0, sizeof (WebSocketDeflateParams));
+
+  parts = g_strsplit (extension, ";", -1);
+  if (!parts[0] || !g_str_equal (g_strstrip (parts[0]), "permessage-deflate"))
+    goto out;
+
+  for (i = 1; parts[i] != NULL; i++)
+    {
+      name = g_strstrip (parts[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *(value++) = '\0';
+          g_strchomp (name);
+          value = g_strchug (value);
+        }
+
+      /* Each parameter may only appear once */
+      if (g_str_equal (name, "server_no_context_takeover"))
+        {
+          if (value || params->server_no_context_takeover)
+            goto out;
+          params->server_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "client_no_context_takeover"))
+        {
+          if (value || params->client_no_context_takeover)
+            goto out;
+          params->client_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "server_max_window_bits"))
+        {
+          if (!value || params->server_max_window_bits ||
+              !parse_window_bits (value, &params->server_max_window_bits))
+            goto out;
+        }
+      else if (g_str_equal (name, "client_max_window_bits"))
+        {
+          if (params->client_max_window_bits)
+            goto out;
+          if (!value)
+            params->client_max_window_bits = -1;
+          else if (!parse_window_bits (value, &params->client_max_window_bits))
+            goto out;
+        }
+      else
+        {
+          g_message ("received unknown permessage-deflate parameter: %s", name);
+          goto out;
+        }
+    }
+
+  ret = TRUE;
+
+out:
+  g_strfreev (parts);
+  return ret;
+}
+
 /**
  * web_socket_util_parse_status_line:
  * @data: (array length=length): the input data
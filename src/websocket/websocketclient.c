@@ -63,6 +63,42 @@ protocol_error_and_close (WebSocketConnection *conn)
   _web_socket_connection_error_and_close (conn, error, TRUE);
 }
 
+/*
+ * The server may only accept the permessage-deflate extension,
+ * and only if we offered it.
+ */
+static gboolean
+verify_deflate (WebSocketConnection *conn,
+                const gchar *value)
+{
+  WebSocketDeflateParams params;
+  gint window_bits;
+
+  if (value == NULL || value[0] == '\0')
+    return TRUE;
+
+  if (!_web_socket_connection_get_deflate (conn, &window_bits) ||
+      strchr (value, ',') || !_web_socket_util_parse_deflate (value, &params))
+    {
+      g_message ("received unsupported Sec-WebSocket-Extensions header: %s", value);
+      return FALSE;
+    }
+
+  if (params.client_max_window_bits)
+    {
+      if (params.client_max_window_bits < 9)
+        {
+          g_message ("received unsupported client_max_window_bits: %d", params.client_max_window_bits);
+          return FALSE;
+        }
+      window_bits = MIN (window_bits, params.client_max_window_bits);
+    }
+
+  return _web_socket_connection_start_deflate (conn, window_bits,
+                                               params.client_no_context_takeover,
+                                               params.server_no_context_takeover);
+}
+
 static gboolean
 verify_handshake_rfc6455 (WebSocketClient *self,
                           WebSocketConnection *conn,
@@ -79,7 +115,7 @@ verify_handshake_rfc6455 (WebSocketClient *self,
       !_web_socket_util_header_contains (headers, "Connection", "upgrade") ||
       !_web_socket_connection_choose_protocol (conn, (const gchar **)self->possible_protocols,
                                                g_hash_table_lookup (headers, "Sec-Websocket-Protocol")) ||
-      !_web_socket_util_header_empty (headers, "Sec-WebSocket-Extensions"))
+      !verify_deflate (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions")))
     {
       protocol_error_and_close (conn);
       return FALSE;
@@ -310,6 +346,9 @@ request_handshake_rfc6455 (WebSocketClient *self,
       g_free (protocols);
     }
 
+  if (_web_socket_connection_get_deflate (conn, NULL))
+    g_string_append (handshake, "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n");
+
   include_custom_headers (self, handshake);
   g_string_append (handshake, "\r\n");
 
@@ -22,8 +22,15 @@
 #include "websocket.h"
 #include "websocketprivate.h"
 
+#include <errno.h>
 #include <string.h>
 
+#include <zlib.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 /*
  * SECTION:websocketconnection
  * @title: WebSocketConnection
@@ -85,6 +92,10 @@ enum {
   PROP_BUFFERED_AMOUNT,
   PROP_IO_STREAM,
   PROP_FLAVOR,
+  PROP_OUTPUT_BUDGET,
+  PROP_DEFLATE,
+  PROP_DEFLATE_THRESHOLD,
+  PROP_DEFLATE_WINDOW_BITS,
 };
 
 enum {
@@ -98,13 +109,27 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * A frame is a small header plus references to the caller's data, which
+ * are written out together without being copied into one buffer.
+ */
 typedef struct {
-  GBytes *data;
+  guint8 header[14];
+  gsize header_len;
+  GBytes *parts[3];
+  gsize length;
   gboolean last;
   gsize sent;
   gsize amount;
 } Frame;
 
+/* Header plus each part */
+#define FRAME_VECTORS  4
+
+static void        queue_frame           (WebSocketConnection *self,
+                                          WebSocketQueueFlags flags,
+                                          Frame *frame);
+
 struct _WebSocketConnectionPrivate
 {
   /* FALSE if client, TRUE if server */
@@ -140,31 +165,148 @@ struct _WebSocketConnectionPrivate
   GPollableInputStream *input;
   GSource *input_source;
   GByteArray *incoming;
+  gsize input_window;
 
   GPollableOutputStream *output;
   GSource *output_source;
   GQueue outgoing;
+  gsize buffered_amount;
+
+  /* Plain socket underneath the streams, or -1 */
+  gint socket_fd;
+
+  /* Small frames coalesced into a single write */
+  GByteArray *batch;
+  gsize output_budget;
 
   /* Current message being assembled */
   guint8 message_opcode;
   GByteArray *message_data;
+  gboolean message_compressed;
+
+  /* Whether to offer or accept permessage-deflate, see RFC 7692 */
+  gboolean deflate;
+  gsize deflate_threshold;
+  gint deflate_window_bits;
+
+  /* Once permessage-deflate has been negotiated */
+  z_stream *deflater;
+  z_stream *inflater;
+  gboolean deflate_no_context_takeover;
+  gboolean inflate_no_context_takeover;
 };
 
 #define MAX_PAYLOAD   128 * 1024
 
+/* Don't compress messages smaller than this */
+#define DEFAULT_DEFLATE_THRESHOLD  128
+
+/* Sent at the end of each compressed message, but stripped off */
+static const guint8 deflate_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+/* The largest TLS record, so a coalesced write fits in one */
+#define DEFAULT_OUTPUT_BUDGET  16 * 1024
+
+#define MAX_OUTPUT_VECTORS  64
+
+/* Reads start at this size and grow while the peer keeps filling them */
+#define MIN_INPUT_WINDOW  1024
+#define MAX_INPUT_WINDOW  MAX_PAYLOAD
+
 G_DEFINE_ABSTRACT_TYPE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT);
 
 static void
 frame_free (gpointer data)
 {
   Frame *frame = data;
+  guint i;
+
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      for (i = 0; i < G_N_ELEMENTS (frame->parts); i++)
+        {
+          if (frame->parts[i])
+            g_bytes_unref (frame->parts[i]);
+        }
       g_slice_free (Frame, frame);
     }
 }
 
+static Frame *
+frame_new (gsize amount)
+{
+  Frame *frame = g_slice_new0 (Frame);
+  frame->amount = amount;
+  return frame;
+}
+
+static void
+frame_add_part (Frame *frame,
+                GBytes *bytes)
+{
+  guint i;
+
+  if (bytes == NULL || g_bytes_get_size (bytes) == 0)
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (frame->parts); i++)
+    {
+      if (frame->parts[i] == NULL)
+        {
+          frame->parts[i] = g_bytes_ref (bytes);
+          frame->length += g_bytes_get_size (bytes);
+          return;
+        }
+    }
+
+  g_assert_not_reached ();
+}
+
+/*
+ * Fill in @vectors with the not yet sent remainder of the frame.
+ * There must be room for FRAME_VECTORS of them.
+ */
+static guint
+frame_get_vectors (Frame *frame,
+                   struct iovec *vectors)
+{
+  gsize skip = frame->sent;
+  gconstpointer data;
+  guint n = 0;
+  gsize len;
+  guint i;
+
+  for (i = 0; i < FRAME_VECTORS; i++)
+    {
+      if (i == 0)
+        {
+          data = frame->header;
+          len = frame->header_len;
+        }
+      else if (frame->parts[i - 1])
+        {
+          data = g_bytes_get_data (frame->parts[i - 1], &len);
+        }
+      else
+        {
+          continue;
+        }
+
+      if (skip >= len)
+        {
+          skip -= len;
+          continue;
+        }
+
+      vectors[n].iov_base = (guint8 *)data + skip;
+      vectors[n].iov_len = len - skip;
+      skip = 0;
+      n++;
+    }
+
+  return n;
+}
+
 static void
 web_socket_connection_init (WebSocketConnection *self)
 {
@@ -174,6 +316,12 @@ web_socket_connection_init (WebSocketConnection *self)
                                                WebSocketConnectionPrivate);
 
   g_queue_init (&pv->outgoing);
+  pv->batch = g_byte_array_new ();
+  pv->socket_fd = -1;
+  pv->input_window = MIN_INPUT_WINDOW;
+  pv->output_budget = DEFAULT_OUTPUT_BUDGET;
+  pv->deflate_threshold = DEFAULT_DEFLATE_THRESHOLD;
+  pv->deflate_window_bits = MAX_WBITS;
   pv->main_context = g_main_context_ref_thread_default ();
 }
 
@@ -353,53 +501,154 @@ xor_with_mask_rfc6455 (const guint8 *mask,
 
 static void
 send_text_hixie76 (WebSocketConnection *self,
-                   const guint8 *prefix,
-                   gsize prefix_len,
-                   const guint8 *payload,
-                   gsize payload_len)
+                   GBytes *prefix,
+                   GBytes *payload)
+{
+  static const guchar bff = 0xff;
+  GBytes *trailer;
+  Frame *frame;
+
+  frame = frame_new (g_bytes_get_size (payload));
+  frame->header[0] = 0x00;
+  frame->header_len = 1;
+  frame->length = 1;
+
+  trailer = g_bytes_new_static (&bff, 1);
+  frame_add_part (frame, prefix);
+  frame_add_part (frame, payload);
+  frame_add_part (frame, trailer);
+  g_bytes_unref (trailer);
+
+  g_debug ("queueing hixie76 text frame of len %u", (guint) frame->length);
+  queue_frame (self, WEB_SOCKET_QUEUE_NORMAL, frame);
+}
+
+static gboolean
+deflate_into (z_stream *zs,
+              GByteArray *output,
+              gconstpointer data,
+              gsize length,
+              int flush)
+{
+  gsize offset;
+  int rc;
+
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = length;
+
+  /* Done once zlib has consumed everything and has space left over */
+  do
+    {
+      offset = output->len;
+      g_byte_array_set_size (output, offset + MAX (length, 1024));
+      zs->next_out = output->data + offset;
+      zs->avail_out = output->len - offset;
+
+      rc = deflate (zs, flush);
+      g_byte_array_set_size (output, output->len - zs->avail_out);
+
+      if (rc != Z_OK && rc != Z_BUF_ERROR)
+        {
+          g_warning ("couldn't compress WebSocket message: %s", zs->msg ? zs->msg : "unknown error");
+          return FALSE;
+        }
+    }
+  while (zs->avail_in > 0 || zs->avail_out == 0);
+
+  return TRUE;
+}
+
+/*
+ * Compress a message with the permessage-deflate extension. The
+ * prefix and payload are compressed together as one message.
+ */
+static GBytes *
+deflate_message (WebSocketConnection *self,
+                 GBytes *prefix,
+                 GBytes *payload)
 {
-  guchar b00 = 0x00;
-  guchar bff = 0xff;
-  GByteArray *bytes;
-  gsize frame_len;
+  WebSocketConnectionPrivate *pv = self->pv;
+  GByteArray *output;
+  gsize length;
+  gboolean ret;
+
+  length = g_bytes_get_size (payload);
+  output = g_byte_array_sized_new (length / 2 + 16);
+
+  ret = (!prefix || deflate_into (pv->deflater, output, g_bytes_get_data (prefix, NULL),
+                                  g_bytes_get_size (prefix), Z_NO_FLUSH)) &&
+        deflate_into (pv->deflater, output, g_bytes_get_data (payload, NULL), length, Z_SYNC_FLUSH);
+
+  /*
+   * Our compressor no longer matches what the peer has seen, so
+   * stop compressing, uncompressed messages are always allowed.
+   */
+  if (!ret)
+    {
+      deflateEnd (pv->deflater);
+      g_free (pv->deflater);
+      pv->deflater = NULL;
+      g_byte_array_unref (output);
+      return NULL;
+    }
 
-  bytes = g_byte_array_sized_new (2 + prefix_len + payload_len);
+  /* The empty block at the end of the flush is implied */
+  g_assert (output->len >= sizeof (deflate_tail));
+  g_byte_array_set_size (output, output->len - sizeof (deflate_tail));
 
-  g_byte_array_append (bytes, &b00, 1);
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
-  g_byte_array_append (bytes, &bff, 1);
+  if (pv->deflate_no_context_takeover)
+    deflateReset (pv->deflater);
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, WEB_SOCKET_QUEUE_NORMAL,
-                                g_byte_array_free (bytes, FALSE), frame_len, payload_len);
-  g_debug ("queued hixie76 text frame of len %u", (guint) frame_len);
+  return g_byte_array_free_to_bytes (output);
 }
 
 static void
 send_prefixed_message_rfc6455 (WebSocketConnection *self,
                                WebSocketQueueFlags flags,
                                guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
-{
-  gsize amount = payload_len + prefix_len;
-  GByteArray *bytes;
-  gsize frame_len;
+                               GBytes *prefix,
+                               GBytes *payload)
+{
+  gsize prefix_len = 0;
+  gsize payload_len;
+  GBytes *bytes;
+  Frame *frame;
   guint8 *outer;
   guint8 *mask = 0;
-  guint8 *at;
+  guint8 *data;
   gsize len;
 
+  if (prefix)
+    prefix = g_bytes_ref (prefix);
+  payload = g_bytes_ref (payload);
+
+  if (prefix)
+    prefix_len = g_bytes_get_size (prefix);
+  payload_len = g_bytes_get_size (payload);
   len = prefix_len + payload_len;
-  amount = len;
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
+  frame = frame_new (len);
+  outer = frame->header;
   outer[0] = 0x80 | opcode;
 
+  /* Data messages may be compressed, and are marked with RSV1 */
+  if (self->pv->deflater && !(opcode & 0x08) && len >= self->pv->deflate_threshold)
+    {
+      bytes = deflate_message (self, prefix, payload);
+      if (bytes)
+        {
+          if (prefix)
+            g_bytes_unref (prefix);
+          g_bytes_unref (payload);
+          prefix = NULL;
+          prefix_len = 0;
+          payload = bytes;
+          payload_len = len = g_bytes_get_size (bytes);
+          frame->amount = len;
+          outer[0] |= 0x40;
+        }
+    }
+
   /* If control message, truncate payload */
   if (opcode & 0x08)
     {
@@ -407,25 +656,34 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
         {
           g_warning ("Truncating WebSocket control message payload");
           if (prefix_len > 125)
+            {
+              bytes = g_bytes_new_from_bytes (prefix, 0, 125);
+              g_bytes_unref (prefix);
+              prefix = bytes;
               prefix_len = 125;
+            }
           payload_len = 125 - prefix_len;
+          bytes = g_bytes_new_from_bytes (payload, 0, payload_len);
+          g_bytes_unref (payload);
+          payload = bytes;
+          len = 125;
         }
 
       /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
+      frame->amount = 0;
     }
 
   if (len < 126)
     {
       outer[1] = (0xFF & len); /* mask | 7-bit-len */
-      bytes->len = 2;
+      frame->header_len = 2;
     }
   else if (len < 65536)
     {
       outer[1] = 126; /* mask | 16-bit-len */
       outer[2] = (len >> 8) & 0xFF;
       outer[3] = (len >> 0) & 0xFF;
-      bytes->len = 4;
+      frame->header_len = 4;
     }
   else
     {
@@ -438,7 +696,7 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
       outer[7] = (len >> 16) & 0xFF;
       outer[8] = (len >> 8) & 0xFF;
       outer[9] = (len >> 0) & 0xFF;
-      bytes->len = 10;
+      frame->header_len = 10;
     }
 
   /*
@@ -448,22 +706,38 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
   if (!self->pv->server_side)
     {
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
+      mask = outer + frame->header_len;
       * ((guint32 *)mask) = g_random_int ();
-      bytes->len += 4;
+      frame->header_len += 4;
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
+  frame->length = frame->header_len;
 
-  if (!self->pv->server_side)
-    xor_with_mask_rfc6455 (mask, at, len);
+  /* Masking needs a copy of the data, otherwise reference it as is */
+  if (mask)
+    {
+      data = g_malloc (len);
+      if (prefix_len)
+        memcpy (data, g_bytes_get_data (prefix, NULL), prefix_len);
+      if (payload_len)
+        memcpy (data + prefix_len, g_bytes_get_data (payload, NULL), payload_len);
+      xor_with_mask_rfc6455 (mask, data, len);
+      bytes = g_bytes_new_take (data, len);
+      frame_add_part (frame, bytes);
+      g_bytes_unref (bytes);
+    }
+  else
+    {
+      frame_add_part (frame, prefix);
+      frame_add_part (frame, payload);
+    }
+
+  if (prefix)
+    g_bytes_unref (prefix);
+  g_bytes_unref (payload);
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+  g_debug ("queueing rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->length);
+  queue_frame (self, flags, frame);
 }
 
 static void
@@ -473,7 +747,9 @@ send_message_rfc6455 (WebSocketConnection *self,
                       const guint8 *payload,
                       gsize payload_len)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  GBytes *bytes = g_bytes_new (payload, payload_len);
+  send_prefixed_message_rfc6455 (self, flags, opcode, NULL, bytes);
+  g_bytes_unref (bytes);
 }
 
 static void
@@ -718,17 +994,105 @@ receive_ping_rfc6455 (WebSocketConnection *self,
   send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
 }
 
+/*
+ * Decompress the message that has been assembled in message_data. On
+ * failure the connection is closed and the message discarded.
+ */
+static gboolean
+inflate_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  z_stream *zs = pv->inflater;
+  GByteArray *input = pv->message_data;
+  GByteArray *output;
+  gboolean ret = TRUE;
+  gsize offset;
+  int rc;
+
+  g_byte_array_append (input, deflate_tail, sizeof (deflate_tail));
+  output = g_byte_array_sized_new (MIN (input->len * 4, MAX_PAYLOAD));
+
+  zs->next_in = input->data;
+  zs->avail_in = input->len;
+
+  do
+    {
+      /* Compressed frames can be tiny, the same limit applies once inflated */
+      if (output->len >= MAX_PAYLOAD)
+        {
+          g_message ("received compressed message that's too large");
+          too_big_error_and_close (self, output->len);
+          ret = FALSE;
+          break;
+        }
+
+      offset = output->len;
+      g_byte_array_set_size (output, offset + MIN (MAX (input->len * 2, 4096), MAX_PAYLOAD - offset));
+      zs->next_out = output->data + offset;
+      zs->avail_out = output->len - offset;
+
+      rc = inflate (zs, Z_SYNC_FLUSH);
+      g_byte_array_set_size (output, output->len - zs->avail_out);
+
+      /* The peer finished its stream, a new one may follow */
+      if (rc == Z_STREAM_END)
+        inflateReset (zs);
+      else if (rc != Z_OK && rc != Z_BUF_ERROR)
+        {
+          g_message ("received invalid compressed data: %s", zs->msg ? zs->msg : "unknown error");
+          bad_data_error_and_close (self);
+          ret = FALSE;
+          break;
+        }
+    }
+  while (zs->avail_in > 0 || zs->avail_out == 0);
+
+  if (ret && pv->message_opcode == 0x01 &&
+      !g_utf8_validate ((gchar *)output->data, output->len, NULL))
+    {
+      g_message ("received invalid non-UTF8 text data");
+      bad_data_error_and_close (self);
+      ret = FALSE;
+    }
+
+  if (pv->inflate_no_context_takeover)
+    inflateReset (zs);
+
+  g_byte_array_unref (pv->message_data);
+  if (ret)
+    {
+      pv->message_data = output;
+    }
+  else
+    {
+      g_byte_array_unref (output);
+      pv->message_data = NULL;
+      pv->message_opcode = 0;
+    }
+
+  return ret;
+}
+
 static void
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
                           guint8 opcode,
+                          gboolean compressed,
                           gconstpointer payload,
                           gsize payload_len)
 {
   WebSocketConnectionPrivate *pv = self->pv;
   GBytes *message;
 
+  /* Only the first frame of a data message may be marked compressed */
+  if (compressed && (control || !opcode || !pv->inflater))
+    {
+      g_message ("received unexpected compressed frame");
+      protocol_error_and_close (self);
+      return;
+    }
+
   if (control)
     {
       /* Control frames must never be fragmented */
@@ -818,12 +1182,15 @@ process_contents_rfc6455 (WebSocketConnection *self,
         {
           pv->message_opcode = opcode;
           pv->message_data = g_byte_array_sized_new (payload_len);
+          pv->message_compressed = compressed;
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text is validated once decompressed */
+          if (!pv->message_compressed &&
+              !g_utf8_validate ((gchar *)payload, payload_len, NULL))
             {
               g_message ("received invalid non-UTF8 text data");
 
@@ -847,6 +1214,9 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Actually deliver the message? */
       if (fin)
         {
+          if (pv->message_compressed && !inflate_message (self))
+            return;
+
           /* Always null terminate, as a convenience */
           g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
@@ -875,6 +1245,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   gboolean fin;
   gboolean control;
   gboolean masked;
+  gboolean compressed;
   guint8 opcode;
   gsize len;
   gsize at;
@@ -886,6 +1257,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   header = self->pv->incoming->data;
   fin = ((header[0] & 0x80) != 0);
   control = header[0] & 0x08;
+  compressed = ((header[0] & 0x40) != 0);
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
 
@@ -945,7 +1317,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
+  process_contents_rfc6455 (self, control, fin, opcode, compressed, payload, payload_len);
 
   /* Move past the parsed frame */
   g_byte_array_remove_range (self->pv->incoming, 0, at + payload_len);
@@ -1063,6 +1435,36 @@ process_incoming (WebSocketConnection *self)
     }
 }
 
+static gsize
+input_read_size (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  int avail = 0;
+
+  /* When the socket tells us how much is waiting, read all of it at once */
+  if (pv->socket_fd >= 0 && ioctl (pv->socket_fd, FIONREAD, &avail) == 0 &&
+      avail > 0 && (gsize)avail > pv->input_window)
+    return MIN (avail, MAX_INPUT_WINDOW);
+
+  return pv->input_window;
+}
+
+static void
+input_adjust_window (WebSocketConnection *self,
+                     gsize size,
+                     gssize count)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+
+  if (count <= 0)
+    return;
+
+  if ((gsize)count == size)
+    pv->input_window = MIN (pv->input_window * 2, MAX_INPUT_WINDOW);
+  else if ((gsize)count < pv->input_window / 4)
+    pv->input_window = MAX (pv->input_window / 2, MIN_INPUT_WINDOW);
+}
+
 static gboolean
 on_web_socket_input (GObject *pollable_stream,
                      gpointer user_data)
@@ -1072,16 +1474,23 @@ on_web_socket_input (GObject *pollable_stream,
   GError *error = NULL;
   gboolean end = FALSE;
   gssize count;
+  gsize size;
   gsize len;
 
   do
     {
+      /*
+       * The array keeps its allocation when its length is set back down,
+       * so this only reallocates when the window or backlog grows.
+       */
       len = pv->incoming->len;
-      g_byte_array_set_size (pv->incoming, len + 1024);
+      size = input_read_size (self);
+      g_byte_array_set_size (pv->incoming, len + size);
 
       count = g_pollable_input_stream_read_nonblocking (pv->input,
                                                         pv->incoming->data + len,
-                                                        1024, NULL, &error);
+                                                        size, NULL, &error);
+      input_adjust_window (self, size, count);
 
       if (count < 0)
         {
@@ -1092,6 +1501,7 @@ on_web_socket_input (GObject *pollable_stream,
             }
           else
             {
+              pv->incoming->len = len;
               _web_socket_connection_error_and_close (self, error, TRUE);
               return TRUE;
             }
@@ -1147,35 +1557,123 @@ start_input (WebSocketConnection *self)
   g_source_attach (pv->input_source, pv->main_context);
 }
 
+static void
+sent_last_frame (WebSocketConnection *self)
+{
+  if (self->pv->server_side)
+    {
+      close_io_stream (self);
+    }
+  else
+    {
+      shutdown_wr_io_stream (self);
+      close_io_after_timeout (self);
+    }
+}
+
+static gssize
+write_vectors (WebSocketConnection *self,
+               struct iovec *vectors,
+               guint n_vectors,
+               GError **error)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  struct msghdr msg = { 0, };
+  gssize count;
+  gsize len;
+  guint i;
+  int errn;
+
+  /* A plain socket, write everything at once */
+  if (pv->socket_fd >= 0)
+    {
+      msg.msg_iov = vectors;
+      msg.msg_iovlen = n_vectors;
+      count = sendmsg (pv->socket_fd, &msg, MSG_NOSIGNAL);
+      if (count < 0)
+        {
+          errn = errno;
+          if (errn == EAGAIN || errn == EWOULDBLOCK || errn == EINTR)
+            errn = EAGAIN;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errn),
+                       "Error sending data: %s", g_strerror (errn));
+        }
+      return count;
+    }
+
+  /*
+   * Otherwise the stream (ie: TLS) only does one buffer at a time. A
+   * large piece is written directly, small ones are copied together.
+   * The batch is filled right up to the budget with the start of the
+   * piece that doesn't fit, so that a frame header never goes out in
+   * a record of its own. The caller retires by byte count, so a partly
+   * written piece is picked up where it left off next time around.
+   */
+  if (vectors[0].iov_len >= pv->output_budget)
+    {
+      return g_pollable_output_stream_write_nonblocking (pv->output, vectors[0].iov_base,
+                                                         vectors[0].iov_len, NULL, error);
+    }
+
+  g_byte_array_set_size (pv->batch, 0);
+  for (i = 0; i < n_vectors; i++)
+    {
+      len = MIN (vectors[i].iov_len, pv->output_budget - pv->batch->len);
+      g_byte_array_append (pv->batch, vectors[i].iov_base, len);
+      if (pv->batch->len >= pv->output_budget)
+        break;
+    }
+
+  return g_pollable_output_stream_write_nonblocking (pv->output, pv->batch->data,
+                                                     pv->batch->len, NULL, error);
+}
+
 static gboolean
 on_web_socket_output (GObject *pollable_stream,
                       gpointer user_data)
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = self->pv;
-  const guint8 *data;
+  struct iovec vectors[MAX_OUTPUT_VECTORS];
   GError *error = NULL;
+  guint n_vectors = 0;
+  gsize total = 0;
+  gboolean retired = FALSE;
+  gboolean last;
   Frame *frame;
   gssize count;
-  gsize len;
-
-  frame = g_queue_peek_head (&pv->outgoing);
+  GList *l;
 
   /* No more frames to send */
-  if (frame == NULL)
+  if (g_queue_is_empty (&pv->outgoing))
     {
       stop_output (self);
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
+  /*
+   * Gather the pieces of as many whole frames as fit in the budget,
+   * but always at least the first one. Only the first frame can have
+   * been partially sent.
+   */
+  for (l = pv->outgoing.head; l != NULL; l = g_list_next (l))
+    {
+      frame = l->data;
+      if (n_vectors > 0 &&
+          (n_vectors + FRAME_VECTORS > MAX_OUTPUT_VECTORS ||
+           total + frame->length > pv->output_budget))
+        break;
+
+      n_vectors += frame_get_vectors (frame, vectors + n_vectors);
+      total += frame->length - frame->sent;
 
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+      if (frame->last)
+        break;
+    }
+
+  g_assert (n_vectors > 0);
+
+  count = write_vectors (self, vectors, n_vectors, &error);
 
   if (count < 0)
     {
@@ -1191,27 +1689,41 @@ on_web_socket_output (GObject *pollable_stream,
         }
     }
 
-  frame->sent += count;
-  if (frame->sent >= len)
+  /* Retire the frames that were completely written */
+  while (count > 0)
     {
-      g_debug ("sent frame");
+      frame = g_queue_peek_head (&pv->outgoing);
+      g_assert (frame != NULL);
+
+      if (count < frame->length - frame->sent)
+        {
+          frame->sent += count;
+          break;
+        }
+
+      count -= frame->length - frame->sent;
       g_queue_pop_head (&pv->outgoing);
+      g_debug ("sent frame");
 
-      if (frame->last)
+      if (frame->amount > 0)
         {
-          if (pv->server_side)
-            {
-              close_io_stream (self);
-            }
-          else
-            {
-              shutdown_wr_io_stream (self);
-              close_io_after_timeout (self);
-            }
+          pv->buffered_amount -= frame->amount;
+          retired = TRUE;
         }
+
+      last = frame->last;
       frame_free (frame);
+      if (last)
+        {
+          sent_last_frame (self);
+          break;
+        }
     }
 
+  /* Lets callers that watch the backlog know it drained */
+  if (retired)
+    g_object_notify (G_OBJECT (self), "buffered-amount");
+
   return TRUE;
 }
 
@@ -1229,25 +1741,23 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = self->pv;
-  Frame *frame;
   Frame *prev;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
-  g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
+  g_assert (frame->length > 0);
+
+  if (pv->close_sent)
+    {
+      g_critical ("cannot queue WebSocket frame after close was sent");
+      frame_free (frame);
+      return;
+    }
 
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
   frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
 
   /* If urgent put at front of queue */
@@ -1275,9 +1785,34 @@ _web_socket_connection_queue (WebSocketConnection *self,
       g_queue_push_tail (&pv->outgoing, frame);
     }
 
+  pv->buffered_amount += frame->amount;
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  WebSocketConnectionPrivate *pv = self->pv;
+  GBytes *bytes;
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (pv->close_sent == FALSE);
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  frame = frame_new (amount);
+  bytes = g_bytes_new_take (data, len);
+  frame_add_part (frame, bytes);
+  g_bytes_unref (bytes);
+
+  queue_frame (self, flags, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1298,6 +1833,65 @@ check_streams (WebSocketConnection *self)
   return TRUE;
 }
 
+gboolean
+_web_socket_connection_get_deflate (WebSocketConnection *self,
+                                    gint *window_bits)
+{
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), FALSE);
+
+  if (window_bits)
+    *window_bits = self->pv->deflate_window_bits;
+  return self->pv->deflate;
+}
+
+/*
+ * Called by the derived classes once permessage-deflate has been
+ * negotiated in the handshake. We always decompress with the largest
+ * window, which handles anything the peer chose.
+ */
+gboolean
+_web_socket_connection_start_deflate (WebSocketConnection *self,
+                                      gint window_bits,
+                                      gboolean no_context_takeover,
+                                      gboolean peer_no_context_takeover)
+{
+  WebSocketConnectionPrivate *pv;
+
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), FALSE);
+  g_return_val_if_fail (window_bits >= 9 && window_bits <= MAX_WBITS, FALSE);
+
+  pv = self->pv;
+  g_return_val_if_fail (pv->deflater == NULL, FALSE);
+
+  pv->deflater = g_new0 (z_stream, 1);
+  if (deflateInit2 (pv->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      g_warning ("couldn't setup WebSocket compression");
+      g_free (pv->deflater);
+      pv->deflater = NULL;
+      return FALSE;
+    }
+
+  pv->inflater = g_new0 (z_stream, 1);
+  if (inflateInit2 (pv->inflater, -MAX_WBITS) != Z_OK)
+    {
+      g_warning ("couldn't setup WebSocket decompression");
+      deflateEnd (pv->deflater);
+      g_free (pv->deflater);
+      g_free (pv->inflater);
+      pv->deflater = pv->inflater = NULL;
+      return FALSE;
+    }
+
+  pv->deflate_no_context_takeover = no_context_takeover;
+  pv->inflate_no_context_takeover = peer_no_context_takeover;
+
+  g_debug ("compressing messages with %d window bits%s", window_bits,
+           no_context_takeover ? " and no context takeover" : "");
+  return TRUE;
+}
+
 void
 _web_socket_connection_take_incoming (WebSocketConnection *self,
                                       GByteArray *input_buffer)
@@ -1347,6 +1941,10 @@ _web_socket_connection_take_io_stream (WebSocketConnection *self,
   if (G_IS_POLLABLE_OUTPUT_STREAM (os))
     pv->output = G_POLLABLE_OUTPUT_STREAM (os);
 
+  /* Plain sockets get frames written with one writev(), and sized reads */
+  if (G_IS_SOCKET_CONNECTION (io_stream))
+    pv->socket_fd = g_socket_get_fd (g_socket_connection_get_socket (G_SOCKET_CONNECTION (io_stream)));
+
   pv->io_open = TRUE;
   g_object_notify (G_OBJECT (self), "io-stream");
 
@@ -1409,6 +2007,22 @@ web_socket_connection_get_property (GObject *object,
       g_value_set_object (value, web_socket_connection_get_io_stream (self));
       break;
 
+    case PROP_OUTPUT_BUDGET:
+      g_value_set_ulong (value, self->pv->output_budget);
+      break;
+
+    case PROP_DEFLATE:
+      g_value_set_boolean (value, self->pv->deflate);
+      break;
+
+    case PROP_DEFLATE_THRESHOLD:
+      g_value_set_ulong (value, self->pv->deflate_threshold);
+      break;
+
+    case PROP_DEFLATE_WINDOW_BITS:
+      g_value_set_int (value, self->pv->deflate_window_bits);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1450,6 +2064,24 @@ web_socket_connection_set_property (GObject *object,
       _web_socket_connection_set_flavor (self, flavor);
       break;
 
+    case PROP_OUTPUT_BUDGET:
+      pv->output_budget = g_value_get_ulong (value);
+      break;
+
+    case PROP_DEFLATE:
+      g_return_if_fail (pv->handshake_done == FALSE);
+      pv->deflate = g_value_get_boolean (value);
+      break;
+
+    case PROP_DEFLATE_THRESHOLD:
+      pv->deflate_threshold = g_value_get_ulong (value);
+      break;
+
+    case PROP_DEFLATE_WINDOW_BITS:
+      g_return_if_fail (pv->handshake_done == FALSE);
+      pv->deflate_window_bits = g_value_get_int (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1484,6 +2116,7 @@ web_socket_connection_finalize (GObject *object)
     g_byte_array_free (pv->incoming, TRUE);
   while (!g_queue_is_empty (&pv->outgoing))
     frame_free (g_queue_pop_head (&pv->outgoing));
+  g_byte_array_free (pv->batch, TRUE);
 
   g_clear_object (&pv->io_stream);
   g_assert (!pv->input_source);
@@ -1497,6 +2130,17 @@ web_socket_connection_finalize (GObject *object)
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
 
+  if (pv->deflater)
+    {
+      deflateEnd (pv->deflater);
+      g_free (pv->deflater);
+    }
+  if (pv->inflater)
+    {
+      inflateEnd (pv->inflater);
+      g_free (pv->inflater);
+    }
+
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
 
@@ -1593,6 +2237,53 @@ web_socket_connection_class_init (WebSocketConnectionClass *klass)
                                    g_param_spec_int ("flavor", "WebSocket flavor", "Flavor of WebSockets to speak with peer",
                                                      0, G_MAXINT, 0, G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * WebSocketConnection:output-budget:
+   *
+   * Small queued frames are coalesced and written together, up to
+   * this many bytes per write. Frames larger than this are written
+   * on their own.
+   */
+  g_object_class_install_property (gobject_class, PROP_OUTPUT_BUDGET,
+                                   g_param_spec_ulong ("output-budget", "Output budget", "Maximum bytes to coalesce into one write",
+                                                       1, G_MAXULONG, DEFAULT_OUTPUT_BUDGET,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:deflate:
+   *
+   * Whether to compress messages with the permessage-deflate extension
+   * of RFC 7692. Clients offer it to the server, and servers accept it
+   * when offered. Must be set before the handshake.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEFLATE,
+                                   g_param_spec_boolean ("deflate", "Deflate", "Negotiate permessage-deflate", FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:deflate-threshold:
+   *
+   * Messages smaller than this are sent uncompressed, even when
+   * permessage-deflate has been negotiated.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEFLATE_THRESHOLD,
+                                   g_param_spec_ulong ("deflate-threshold", "Deflate threshold", "Smallest message to compress",
+                                                       0, G_MAXULONG, DEFAULT_DEFLATE_THRESHOLD,
+                                                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketConnection:deflate-window-bits:
+   *
+   * The largest compression window this side uses, as a power of two.
+   * Smaller windows use less memory per connection, but compress less.
+   * The peer may ask for an even smaller window. Must be set before
+   * the handshake.
+   */
+  g_object_class_install_property (gobject_class, PROP_DEFLATE_WINDOW_BITS,
+                                   g_param_spec_int ("deflate-window-bits", "Deflate window bits", "Size of compression window",
+                                                     9, MAX_WBITS, MAX_WBITS,
+                                                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   /**
    * WebSocketConnection::open:
    * @self: the WebSocket
@@ -1768,19 +2459,8 @@ web_socket_connection_get_ready_state (WebSocketConnection *self)
 gsize
 web_socket_connection_get_buffered_amount (WebSocketConnection *self)
 {
-  gsize amount = 0;
-  Frame *frame;
-  GList *l;
-
   g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), 0);
-
-  for (l = self->pv->outgoing.head; l != NULL; l = g_list_next (l))
-    {
-      frame = l->data;
-      amount += frame->amount;
-    }
-
-  return amount;
+  return self->pv->buffered_amount;
 }
 
 /**
@@ -1908,10 +2588,9 @@ web_socket_connection_send (WebSocketConnection *self,
     }
 
   if (self->pv->flavor == WEB_SOCKET_FLAVOR_HIXIE76)
-    send_text_hixie76 (self, pref, prefix_len, payload, payload_len);
+    send_text_hixie76 (self, prefix, message);
   else if (self->pv->flavor == WEB_SOCKET_FLAVOR_RFC6455)
-    send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                   pref, prefix_len, payload, payload_len);
+    send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, prefix, message);
   else
     g_assert_not_reached ();
 
@@ -41,6 +41,16 @@ gboolean     _web_socket_util_header_contains   (GHashTable *headers,
 gboolean     _web_socket_util_header_empty      (GHashTable *headers,
                                                  const gchar *name);
 
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  gint server_max_window_bits;    /* Zero if not present */
+  gint client_max_window_bits;    /* Zero if not present, -1 if without a value */
+} WebSocketDeflateParams;
+
+gboolean     _web_socket_util_parse_deflate     (const gchar *extension,
+                                                 WebSocketDeflateParams *params);
+
 typedef enum {
   WEB_SOCKET_QUEUE_NORMAL = 0,
   WEB_SOCKET_QUEUE_URGENT = 1 << 0,
@@ -75,6 +85,14 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+gboolean         _web_socket_connection_get_deflate       (WebSocketConnection *self,
+                                                           gint *window_bits);
+
+gboolean         _web_socket_connection_start_deflate     (WebSocketConnection *self,
+                                                           gint window_bits,
+                                                           gboolean no_context_takeover,
+                                                           gboolean peer_no_context_takeover);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
 guint8 *         _web_socket_complete_challenge_hixie76   (guint number_1,
@@ -278,6 +278,56 @@ validate_rfc6455_websocket_key (const gchar *key)
   return length == 16;
 }
 
+/*
+ * Accept the first permessage-deflate offer that we can honor, and
+ * return the Sec-WebSocket-Extensions response for it, or NULL.
+ */
+static gchar *
+negotiate_deflate (WebSocketConnection *conn,
+                   const gchar *offers)
+{
+  WebSocketDeflateParams params;
+  GString *response = NULL;
+  gchar **extensions;
+  gint window_bits;
+  guint i;
+
+  if (!offers || !_web_socket_connection_get_deflate (conn, &window_bits))
+    return NULL;
+
+  extensions = g_strsplit (offers, ",", -1);
+  for (i = 0; extensions[i] != NULL; i++)
+    {
+      if (!_web_socket_util_parse_deflate (extensions[i], &params))
+        continue;
+
+      /* zlib can't compress raw deflate with a window of 8 bits */
+      if (params.server_max_window_bits)
+        {
+          if (params.server_max_window_bits < 9)
+            continue;
+          window_bits = MIN (window_bits, params.server_max_window_bits);
+        }
+
+      if (!_web_socket_connection_start_deflate (conn, window_bits,
+                                                 params.server_no_context_takeover,
+                                                 params.client_no_context_takeover))
+        break;
+
+      response = g_string_new ("permessage-deflate");
+      if (params.server_no_context_takeover)
+        g_string_append (response, "; server_no_context_takeover");
+      if (params.client_no_context_takeover)
+        g_string_append (response, "; client_no_context_takeover");
+      if (params.server_max_window_bits || window_bits < 15)
+        g_string_append_printf (response, "; server_max_window_bits=%d", window_bits);
+      break;
+    }
+
+  g_strfreev (extensions);
+  return response ? g_string_free (response, FALSE) : NULL;
+}
+
 static gboolean
 respond_handshake_rfc6455 (WebSocketServer *self,
                            WebSocketConnection *conn,
@@ -288,6 +338,7 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   const gchar *origin;
   const gchar *host;
   gchar *accept_key;
+  gchar *extensions;
   gchar *key;
   GString *handshake;
   gsize len;
@@ -357,6 +408,11 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = negotiate_deflate (conn, g_hash_table_lookup (headers, "Sec-WebSocket-Extensions"));
+  if (extensions)
+    g_string_append_printf (handshake, "Sec-WebSocket-Extensions: %s\r\n", extensions);
+  g_free (extensions);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
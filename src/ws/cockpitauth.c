@@ -157,11 +157,24 @@ session_child_setup (gpointer data)
   close (auth_fd);
 }
 
-static CockpitPipe *
-spawn_session_process (const gchar *type,
-                       GBytes *input,
-                       const gchar *remote_peer,
-                       CockpitPipe **auth_pipe)
+/**
+ * cockpit_auth_spawn_session:
+ * @type: the authorization type, such as "basic"
+ * @input: the authorization data to pass to cockpit-session
+ * @remote_peer: the remote host, or NULL
+ * @auth_pipe: location to return the pipe on which results arrive
+ *
+ * Run cockpit-session which authenticates the user and then runs
+ * a bridge for them. The returned pipe speaks the cockpit protocol
+ * with that bridge once authentication completes.
+ *
+ * Returns: (transfer full): the session pipe or NULL if it couldn't start
+ */
+CockpitPipe *
+cockpit_auth_spawn_session (const gchar *type,
+                            GBytes *input,
+                            const gchar *remote_peer,
+                            CockpitPipe **auth_pipe)
 {
   CockpitPipe *pipe;
   int pwfds[2] = { -1, -1 };
@@ -382,7 +395,7 @@ cockpit_auth_session_login_async (CockpitAuth *self,
       login->authorization = input;
       g_simple_async_result_set_op_res_gpointer (result, login, login_data_free);
 
-      login->session_pipe = spawn_session_process (type, input, remote_peer, &login->auth_pipe);
+      login->session_pipe = cockpit_auth_spawn_session (type, input, remote_peer, &login->auth_pipe);
 
       if (login->session_pipe)
         {
@@ -459,7 +472,7 @@ parse_auth_results (LoginData *login,
                     GError **error)
 {
   CockpitCreds *creds = NULL;
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   GError *json_error = NULL;
   const gchar *pam_user;
   JsonObject *results;
@@ -91,6 +91,11 @@ CockpitWebService *  cockpit_auth_check_cookie    (CockpitAuth *self,
 GBytes *        cockpit_auth_parse_authorization  (GHashTable *headers,
                                                    gchar **type);
 
+CockpitPipe *   cockpit_auth_spawn_session   (const gchar *type,
+                                              GBytes *input,
+                                              const gchar *remote_peer,
+                                              CockpitPipe **auth_pipe);
+
 G_END_DECLS
 
 #endif
@@ -27,6 +27,7 @@
 
 #include "cockpitsshtransport.h"
 
+#include "common/cockpitfairqueue.h"
 #include "common/cockpitpipe.h"
 
 #include <libssh/libssh.h>
@@ -528,6 +529,7 @@ struct _CockpitSshTransport {
   struct ssh_channel_callbacks_struct channel_cbs;
 
   /* Output */
+  CockpitFairQueue *frames;
   GQueue *queue;
   gsize partial;
   gboolean send_eof;
@@ -535,7 +537,7 @@ struct _CockpitSshTransport {
   gboolean sent_close;
 
   /* Input */
-  GByteArray *buffer;
+  CockpitPipeBuffer *buffer;
   gboolean drain_buffer;
   gboolean received_eof;
   gboolean received_close;
@@ -613,7 +615,7 @@ on_channel_data (ssh_session session,
   else
     {
       g_debug ("%s: received %d bytes", self->logname, (int)len);
-      g_byte_array_append (self->buffer, data, len);
+      cockpit_pipe_buffer_append (self->buffer, data, len);
       self->drain_buffer = TRUE;
     }
   return len;
@@ -740,7 +742,8 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
   self->data->session = ssh_new ();
   g_return_if_fail (self->data->session != NULL);
 
-  self->buffer = g_byte_array_new ();
+  self->buffer = cockpit_pipe_buffer_new ();
+  self->frames = cockpit_fair_queue_new (16 * 1024);
   self->queue = g_queue_new ();
 
   memcpy (&self->channel_cbs, &channel_cbs, sizeof (channel_cbs));
@@ -809,7 +812,9 @@ drain_buffer (CockpitSshTransport *self)
 {
   GBytes *message;
   GBytes *payload;
-  gchar *channel;
+  GBytes *inflated;
+  const gchar *channel;
+  gboolean compressed;
   guint32 size;
 
   for (;;)
@@ -823,6 +828,8 @@ drain_buffer (CockpitSshTransport *self)
 
       memcpy (&size, self->buffer->data, sizeof (size));
       size = GUINT32_FROM_BE (size);
+      compressed = (size & COCKPIT_TRANSPORT_COMPRESSED) ? TRUE : FALSE;
+      size &= ~COCKPIT_TRANSPORT_COMPRESSED;
       if (self->buffer->len < size + sizeof (size))
         {
           g_debug ("%s: want %d have %d", self->logname,
@@ -831,13 +838,27 @@ drain_buffer (CockpitSshTransport *self)
         }
 
       message = cockpit_pipe_consume (self->buffer, sizeof (size), size);
-      payload = cockpit_transport_parse_frame (message, &channel);
+      if (compressed)
+        {
+          inflated = cockpit_transport_inflate_frame ((CockpitTransport *)self, message);
+          g_bytes_unref (message);
+          if (!inflated)
+            {
+              g_warning ("%s: received invalid compressed frame", self->logname);
+              close_immediately (self, "protocol-error");
+              break;
+            }
+          message = inflated;
+        }
+
+      payload = cockpit_transport_parse_frame_interned (message, &channel);
       if (payload)
         {
           g_debug ("%s: received a %d byte payload", self->logname, (int)g_bytes_get_size (payload));
-          cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
+          cockpit_transport_emit_recv_interned ((CockpitTransport *)self, channel, payload);
           g_bytes_unref (payload);
-          g_free (channel);
+          if (channel)
+            cockpit_transport_release_channel (channel);
         }
       g_bytes_unref (message);
     }
@@ -918,6 +939,8 @@ dispatch_eof (CockpitSshTransport *self)
 static gboolean
 dispatch_queue (CockpitSshTransport *self)
 {
+  GBytes *prefix;
+  GBytes *payload;
   GBytes *block;
   const guchar *data;
   gsize length;
@@ -931,9 +954,17 @@ dispatch_queue (CockpitSshTransport *self)
 
   for (;;)
     {
+      /* Only pick the next frame once this one is written */
+      if (g_queue_is_empty (self->queue))
+        {
+          if (!cockpit_fair_queue_pop (self->frames, &prefix, &payload))
+            return FALSE;
+          cockpit_transport_deflate_frame ((CockpitTransport *)self, &prefix, &payload);
+          g_queue_push_tail (self->queue, prefix);
+          g_queue_push_tail (self->queue, payload);
+        }
+
       block = g_queue_peek_head (self->queue);
-      if (!block)
-        return FALSE;
 
       data = g_bytes_get_data (block, &length);
       g_assert (self->partial <= length);
@@ -1053,7 +1084,7 @@ cockpit_ssh_source_prepare (GSource *source,
     cs->pfd.events |= G_IO_OUT;
 
   /* We have something in our queue: want to write */
-  else if (!g_queue_is_empty (self->queue))
+  else if (!g_queue_is_empty (self->queue) || !cockpit_fair_queue_is_empty (self->frames))
     cs->pfd.events |= G_IO_OUT;
 
   /* We are closing and need to send eof: want to write */
@@ -1296,19 +1327,26 @@ cockpit_ssh_transport_finalize (GObject *object)
   g_free (self->logname);
 
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
-  g_byte_array_free (self->buffer, TRUE);
+  cockpit_fair_queue_free (self->frames);
+  cockpit_pipe_buffer_free (self->buffer);
 
   g_assert (self->io == NULL);
 
   G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->finalize (object);
 }
 
+/*
+ * Data goes out on @channel, control messages on the control channel.
+ * A control message about a channel is queued with that channel's data,
+ * given as @control_channel.
+ */
 static void
-cockpit_ssh_transport_send (CockpitTransport *transport,
-                            const gchar *channel,
-                            GBytes *payload)
+queue_frame (CockpitSshTransport *self,
+             const gchar *channel,
+             const gchar *control_channel,
+             GBytes *payload)
 {
-  CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (transport);
+  GBytes *block;
   gchar *prefix;
   gsize length;
   guint32 size;
@@ -1322,12 +1360,32 @@ cockpit_ssh_transport_send (CockpitTransport *transport,
   size = GUINT32_TO_BE (g_bytes_get_size (payload) + length - 4);
   memcpy (prefix, &size, 4);
 
-  g_queue_push_tail (self->queue, g_bytes_new_take (prefix, length));
-  g_queue_push_tail (self->queue, g_bytes_ref (payload));
+  block = g_bytes_new_take (prefix, length);
+  if (channel)
+    cockpit_fair_queue_push (self->frames, channel, block, payload);
+  else
+    cockpit_fair_queue_push_control (self->frames, control_channel, block, payload);
+  g_bytes_unref (block);
 
   g_debug ("%s: queued %d byte payload", self->logname, (int)g_bytes_get_size (payload));
 }
 
+static void
+cockpit_ssh_transport_send (CockpitTransport *transport,
+                            const gchar *channel,
+                            GBytes *payload)
+{
+  queue_frame (COCKPIT_SSH_TRANSPORT (transport), channel, NULL, payload);
+}
+
+static void
+cockpit_ssh_transport_send_control (CockpitTransport *transport,
+                                    const gchar *channel,
+                                    GBytes *payload)
+{
+  queue_frame (COCKPIT_SSH_TRANSPORT (transport), NULL, channel, payload);
+}
+
 static void
 cockpit_ssh_transport_close (CockpitTransport *transport,
                              const gchar *problem)
@@ -1348,6 +1406,7 @@ cockpit_ssh_transport_class_init (CockpitSshTransportClass *klass)
   const gchar *env;
 
   transport_class->send = cockpit_ssh_transport_send;
+  transport_class->send_control = cockpit_ssh_transport_send_control;
   transport_class->close = cockpit_ssh_transport_close;
 
   env = g_getenv ("G_MESSAGES_DEBUG");
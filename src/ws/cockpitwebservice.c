@@ -21,7 +21,10 @@
 
 #include "cockpitwebservice.h"
 
+#include <errno.h>
+#include <pwd.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <json-glib/json-glib.h>
 #include <gio/gunixinputstream.h>
@@ -29,6 +32,7 @@
 
 #include "common/cockpitjson.h"
 #include "common/cockpitlog.h"
+#include "common/cockpitmemory.h"
 #include "common/cockpitpipetransport.h"
 
 #include "cockpitauth.h"
@@ -43,6 +47,8 @@
 
 #include "reauthorize/reauthorize.h"
 
+#include <security/pam_appl.h>
+
 /* Some tunables that can be set from tests */
 const gchar *cockpit_ws_session_program =
     PACKAGE_LIBEXEC_DIR "/cockpit-session";
@@ -61,6 +67,13 @@ guint cockpit_ws_ping_interval = 5;
 
 gint cockpit_ws_session_timeout = 30;
 
+/* Pause channels when this much is queued for a web socket */
+gsize cockpit_ws_flow_high_water = 4 * 1024 * 1024;
+gsize cockpit_ws_flow_low_water = 1024 * 1024;
+
+/* Compress frames at least this big sent over SSH */
+gsize cockpit_ws_compress_threshold = 1024;
+
 /*
  * How to use:
  *
@@ -123,7 +136,8 @@ cockpit_session_free (gpointer data)
 static void
 cockpit_sessions_init (CockpitSessions *sessions)
 {
-  sessions->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
+  /* Channel ids are interned, see cockpit_transport_intern_channel() */
+  sessions->by_channel = g_hash_table_new (g_direct_hash, g_direct_equal);
   sessions->by_host = g_hash_table_new (g_str_hash, g_str_equal);
 
   /* This owns the session */
@@ -131,6 +145,7 @@ cockpit_sessions_init (CockpitSessions *sessions)
                                                   NULL, cockpit_session_free);
 }
 
+/* The @channel must be interned, see cockpit_transport_intern_channel() */
 inline static CockpitSession *
 cockpit_session_by_channel (CockpitSessions *sessions,
                             const gchar *channel)
@@ -203,11 +218,11 @@ cockpit_session_add_channel (CockpitSessions *sessions,
                              CockpitSession *session,
                              const gchar *channel)
 {
-  gchar *chan;
+  const gchar *chan;
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sessions->by_channel, chan, session);
-  g_hash_table_add (session->channels, chan);
+  chan = cockpit_transport_intern_channel (channel, -1);
+  g_hash_table_insert (sessions->by_channel, (gpointer)chan, session);
+  g_hash_table_add (session->channels, (gpointer)chan);
 
   g_debug ("%s: added channel %s to session", session->host, channel);
 
@@ -231,7 +246,8 @@ cockpit_session_track (CockpitSessions *sessions,
   g_debug ("%s: new session", host);
 
   session = g_new0 (CockpitSession, 1);
-  session->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  session->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             (GDestroyNotify)cockpit_transport_release_channel, NULL);
   session->transport = g_object_ref (transport);
   session->host = g_strdup (host);
   session->private = private;
@@ -244,8 +260,12 @@ cockpit_session_track (CockpitSessions *sessions,
   /* This owns the session */
   g_hash_table_insert (sessions->by_transport, transport, session);
 
-  /* Always send an init message down the new transport */
+  /*
+   * Always send an init message down the new transport. Compression
+   * only pays off over the network, not for a local bridge.
+   */
   command = build_control ("command", "init",
+                           "compress", COCKPIT_IS_SSH_TRANSPORT (transport) ? "zlib" : NULL,
                            BUILD_INTS,
                            "version", 0,
                            NULL);
@@ -293,6 +313,7 @@ typedef struct {
   WebSocketConnection *connection;
   GHashTable *channels;
   gboolean init_received;
+  gboolean paused;
 } CockpitSocket;
 
 typedef struct {
@@ -316,7 +337,7 @@ cockpit_sockets_init (CockpitSockets *sockets)
 {
   sockets->next_socket_id = 1;
 
-  sockets->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
+  sockets->by_channel = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   /* This owns the socket */
   sockets->by_connection = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -330,6 +351,7 @@ cockpit_socket_lookup_by_connection (CockpitSockets *sockets,
   return g_hash_table_lookup (sockets->by_connection, connection);
 }
 
+/* The @channel must be interned, see cockpit_transport_intern_channel() */
 inline static CockpitSocket *
 cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
                                   const gchar *channel)
@@ -352,11 +374,11 @@ cockpit_socket_add_channel (CockpitSockets *sockets,
                             CockpitSocket *socket,
                             const gchar *channel)
 {
-  gchar *chan;
+  const gchar *chan;
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sockets->by_channel, chan, socket);
-  g_hash_table_add (socket->channels, chan);
+  chan = cockpit_transport_intern_channel (channel, -1);
+  g_hash_table_insert (sockets->by_channel, (gpointer)chan, socket);
+  g_hash_table_add (socket->channels, (gpointer)chan);
 
   g_debug ("%s: added channel %s to socket", socket->id, channel);
 }
@@ -370,7 +392,8 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                            (GDestroyNotify)cockpit_transport_release_channel, NULL);
 
   g_debug ("%s new socket", socket->id);
 
@@ -690,15 +713,22 @@ process_session_init (CockpitWebService *self,
                       CockpitSession *session,
                       JsonObject *options)
 {
+  const gchar *compress;
   gint64 version;
 
   if (!cockpit_json_get_int (options, "version", -1, &version))
     version = -1;
+  if (!cockpit_json_get_string (options, "compress", NULL, &compress))
+    compress = NULL;
 
   if (version == 0)
     {
       g_debug ("%s: received init message", session->host);
       session->init_received = TRUE;
+
+      if (compress && COCKPIT_IS_SSH_TRANSPORT (session->transport) &&
+          !cockpit_transport_set_compress (session->transport, compress, cockpit_ws_compress_threshold))
+        g_debug ("%s: unsupported compression: %s", session->host, compress);
       return TRUE;
     }
   else
@@ -813,8 +843,6 @@ on_session_recv (CockpitTransport *transport,
   CockpitWebService *self = user_data;
   CockpitSession *session;
   CockpitSocket *socket;
-  gchar *string;
-  GBytes *prefix;
 
   if (!channel)
     return FALSE;
@@ -837,10 +865,8 @@ on_session_recv (CockpitTransport *transport,
   socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
   if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
     {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
-      web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT, prefix, payload);
-      g_bytes_unref (prefix);
+      web_socket_connection_send (socket->connection, WEB_SOCKET_DATA_TEXT,
+                                  cockpit_transport_get_channel_prefix (channel), payload);
     }
 
   return FALSE;
@@ -907,6 +933,156 @@ on_session_closed (CockpitTransport *transport,
     }
 }
 
+static void
+clear_free_authorization (gpointer data)
+{
+  cockpit_secclear (data, strlen (data));
+  g_free (data);
+}
+
+/*
+ * The bridge never inherits the environment of cockpit-ws. Like
+ * cockpit-session we start it with a minimal environment for the
+ * user, and let only the GLib debug variables leak through.
+ */
+static gchar **
+build_local_environment (const gchar *user)
+{
+  const gchar *transfer[] = { "G_DEBUG", "G_MESSAGES_DEBUG", NULL };
+  struct passwd *pwd;
+  GPtrArray *env;
+  const gchar *value;
+  gint i;
+
+  errno = 0;
+  pwd = getpwnam (user);
+  if (pwd == NULL)
+    {
+      g_message ("%s: couldn't lookup user: %s", user,
+                 errno ? g_strerror (errno) : "not found");
+      return NULL;
+    }
+
+  env = g_ptr_array_new ();
+  g_ptr_array_add (env, g_strdup ("PATH=/usr/sbin:/usr/bin:/sbin:/bin"));
+  g_ptr_array_add (env, g_strdup_printf ("USER=%s", pwd->pw_name));
+  g_ptr_array_add (env, g_strdup_printf ("LOGNAME=%s", pwd->pw_name));
+  g_ptr_array_add (env, g_strdup_printf ("HOME=%s", pwd->pw_dir));
+  g_ptr_array_add (env, g_strdup_printf ("SHELL=%s", pwd->pw_shell));
+
+  for (i = 0; transfer[i] != NULL; i++)
+    {
+      value = g_getenv (transfer[i]);
+      if (value)
+        g_ptr_array_add (env, g_strdup_printf ("%s=%s", transfer[i], value));
+    }
+
+  g_ptr_array_add (env, NULL);
+  return (gchar **)g_ptr_array_free (env, FALSE);
+}
+
+/*
+ * cockpit-session reports the result of PAM authentication on the
+ * auth pipe, the same way as for a login. Close the transport with
+ * the matching problem when it failed.
+ */
+static void
+on_local_auth_close (CockpitPipe *auth_pipe,
+                     const gchar *problem,
+                     gpointer user_data)
+{
+  CockpitTransport *transport = user_data;
+  CockpitPipeBuffer *buffer;
+  JsonObject *results;
+  gint64 code = -1;
+
+  buffer = cockpit_pipe_get_buffer (auth_pipe);
+  results = cockpit_json_parse_object ((const gchar *)buffer->data, buffer->len, NULL);
+  if (results && !cockpit_json_get_int (results, "result-code", -1, &code))
+    code = -1;
+
+  if (code == PAM_SUCCESS)
+    problem = NULL;
+  else if (code == PAM_AUTH_ERR || code == PAM_USER_UNKNOWN)
+    problem = "authentication-failed";
+  else if (code == PAM_PERM_DENIED)
+    problem = "not-authorized";
+  else
+    problem = "internal-error";
+
+  if (problem)
+    {
+      g_debug ("local session authentication failed: %d", (int)code);
+      cockpit_transport_close (transport, problem);
+    }
+
+  if (results)
+    json_object_unref (results);
+}
+
+static CockpitTransport *
+spawn_local_transport (CockpitCreds *creds)
+{
+  CockpitTransport *transport;
+  CockpitPipe *auth_pipe = NULL;
+  CockpitPipe *pipe = NULL;
+  const gchar *password;
+  const gchar *user;
+  gchar *authorization;
+  GBytes *input;
+  gchar **env;
+
+  const gchar *argv[] = {
+      cockpit_ws_bridge_program ? cockpit_ws_bridge_program : PACKAGE_BIN_DIR "/cockpit-bridge",
+      NULL
+  };
+
+  user = cockpit_creds_get_user (creds);
+  password = cockpit_creds_get_password (creds);
+
+  /*
+   * Already running unprivileged as this user, so just run the bridge.
+   * When running as root, the user always gets a real login session
+   * from cockpit-session, including for root itself.
+   */
+  if (geteuid () != 0 && g_strcmp0 (user, g_get_user_name ()) == 0)
+    {
+      g_debug ("%s: running local bridge directly", user);
+      env = build_local_environment (user);
+      if (env)
+        pipe = cockpit_pipe_spawn (argv, (const gchar **)env, NULL);
+      g_strfreev (env);
+    }
+
+  /* Have cockpit-session open a session for the user and run the bridge */
+  else if (password)
+    {
+      g_debug ("%s: running local bridge via cockpit-session", user);
+      authorization = g_strdup_printf ("%s:%s", user, password);
+      input = g_bytes_new_with_free_func (authorization, strlen (authorization),
+                                          clear_free_authorization, authorization);
+      pipe = cockpit_auth_spawn_session ("basic", input, cockpit_creds_get_rhost (creds), &auth_pipe);
+      g_bytes_unref (input);
+    }
+
+  if (!pipe)
+    {
+      g_clear_object (&auth_pipe);
+      return NULL;
+    }
+
+  transport = cockpit_pipe_transport_new (pipe);
+  g_object_unref (pipe);
+
+  if (auth_pipe)
+    {
+      g_signal_connect_object (auth_pipe, "close", G_CALLBACK (on_local_auth_close), transport, 0);
+      g_signal_connect (auth_pipe, "close", G_CALLBACK (g_object_unref), NULL);
+    }
+
+  return transport;
+}
+
 static CockpitSession *
 lookup_or_open_session_for_host (CockpitWebService *self,
                                  const gchar *host,
@@ -915,7 +1091,7 @@ lookup_or_open_session_for_host (CockpitWebService *self,
                                  gboolean private)
 {
   CockpitSession *session = NULL;
-  CockpitTransport *transport;
+  CockpitTransport *transport = NULL;
 
   if (host == NULL || g_strcmp0 (host, "") == 0)
     host = "localhost";
@@ -924,21 +1100,32 @@ lookup_or_open_session_for_host (CockpitWebService *self,
     session = cockpit_session_by_host (&self->sessions, host);
   if (!session)
     {
-      /* Used during testing */
       if (g_strcmp0 (host, "localhost") == 0)
         {
+          /* Used during testing */
           if (cockpit_ws_specific_ssh_port != 0)
             host = "127.0.0.1";
+
+          /*
+           * No need to go through SSH for the local machine, unless a
+           * specific host key was asked for. Falls back to SSH when we
+           * have no way to run a bridge as this user.
+           */
+          else if (!host_key)
+            transport = spawn_local_transport (creds);
         }
 
-      transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
-                                "host", host,
-                                "port", cockpit_ws_specific_ssh_port,
-                                "command", cockpit_ws_bridge_program,
-                                "creds", creds,
-                                "known-hosts", cockpit_ws_known_hosts,
-                                "host-key", host_key,
-                                NULL);
+      if (!transport)
+        {
+          transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
+                                    "host", host,
+                                    "port", cockpit_ws_specific_ssh_port,
+                                    "command", cockpit_ws_bridge_program,
+                                    "creds", creds,
+                                    "known-hosts", cockpit_ws_known_hosts,
+                                    "host-key", host_key,
+                                    NULL);
+        }
 
       g_signal_connect_after (transport, "control", G_CALLBACK (on_session_control), self);
       g_signal_connect_after (transport, "recv", G_CALLBACK (on_session_recv), self);
@@ -1092,13 +1279,65 @@ inbound_protocol_error (CockpitWebService *self,
     }
 }
 
+static void
+send_channel_pause (CockpitWebService *self,
+                    const gchar *channel,
+                    gboolean paused)
+{
+  CockpitSession *session;
+  GBytes *bytes;
+
+  session = cockpit_session_by_channel (&self->sessions, channel);
+  if (session && !session->sent_eof)
+    {
+      bytes = build_control ("command", paused ? "pause" : "resume",
+                             "channel", channel, NULL);
+      cockpit_transport_send_control (session->transport, channel, bytes);
+      g_bytes_unref (bytes);
+    }
+}
+
+static void
+on_web_socket_buffered (WebSocketConnection *connection,
+                        GParamSpec *pspec,
+                        CockpitWebService *self)
+{
+  CockpitSocket *socket;
+  GHashTableIter iter;
+  const gchar *chan;
+  gboolean paused;
+  gsize amount;
+
+  socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
+  if (!socket)
+    return;
+
+  amount = web_socket_connection_get_buffered_amount (connection);
+
+  if (!socket->paused && amount >= cockpit_ws_flow_high_water)
+    paused = TRUE;
+  else if (socket->paused && amount <= cockpit_ws_flow_low_water)
+    paused = FALSE;
+  else
+    return;
+
+  g_debug ("%s: %s channels with %" G_GSIZE_FORMAT " bytes buffered",
+           socket->id, paused ? "pausing" : "resuming", amount);
+
+  socket->paused = paused;
+  g_hash_table_iter_init (&iter, socket->channels);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
+    send_channel_pause (self, chan, paused);
+}
+
 static void
 dispatch_inbound_command (CockpitWebService *self,
                           CockpitSocket *socket,
                           GBytes *payload)
 {
   const gchar *command;
-  const gchar *channel;
+  const gchar *channel = NULL;
+  const gchar *inner_channel;
   JsonObject *options = NULL;
   gboolean valid = FALSE;
   gboolean forward = TRUE;
@@ -1106,10 +1345,14 @@ dispatch_inbound_command (CockpitWebService *self,
   GHashTableIter iter;
   GBytes *bytes;
 
-  valid = cockpit_transport_parse_command (payload, &command, &channel, &options);
+  valid = cockpit_transport_parse_command (payload, &command, &inner_channel, &options);
   if (!valid)
     goto out;
 
+  /* The lookup tables are keyed by interned channel ids */
+  if (inner_channel)
+    channel = cockpit_transport_intern_channel (inner_channel, -1);
+
   if (g_strcmp0 (command, "init") == 0)
     {
       valid = process_socket_init (self, socket, options);
@@ -1162,7 +1405,7 @@ dispatch_inbound_command (CockpitWebService *self,
           if (!session->sent_eof)
             {
               bytes = cockpit_json_write_bytes (options);
-              cockpit_transport_send (session->transport, NULL, bytes);
+              cockpit_transport_send_control (session->transport, channel, bytes);
               g_bytes_unref (bytes);
             }
         }
@@ -1170,9 +1413,15 @@ dispatch_inbound_command (CockpitWebService *self,
         g_debug ("dropping control message with unknown channel %s", channel);
     }
 
+  /* A channel opened on a backed up socket starts out paused */
+  if (socket->paused && channel && g_strcmp0 (command, "open") == 0)
+    send_channel_pause (self, channel, TRUE);
+
 out:
   if (!valid)
     inbound_protocol_error (self, socket->connection);
+  if (channel)
+    cockpit_transport_release_channel (channel);
   if (options)
     json_object_unref (options);
 }
@@ -1186,12 +1435,12 @@ on_web_socket_message (WebSocketConnection *connection,
   CockpitSession *session;
   CockpitSocket *socket;
   GBytes *payload;
-  gchar *channel;
+  const gchar *channel;
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
-  payload = cockpit_transport_parse_frame (message, &channel);
+  payload = cockpit_transport_parse_frame_interned (message, &channel);
   if (!payload)
     return;
 
@@ -1216,7 +1465,8 @@ on_web_socket_message (WebSocketConnection *connection,
         }
     }
 
-  g_free (channel);
+  if (channel)
+    cockpit_transport_release_channel (channel);
   g_bytes_unref (payload);
 }
 
@@ -1305,7 +1555,7 @@ on_web_socket_closing (WebSocketConnection *connection,
                                "channel", channel,
                                "reason", "disconnected",
                                NULL);
-      cockpit_transport_send (session->transport, NULL, payload);
+      cockpit_transport_send_control (session->transport, channel, payload);
       g_bytes_unref (payload);
     }
   g_hash_table_destroy (snapshot);
@@ -1327,6 +1577,7 @@ on_web_socket_close (WebSocketConnection *connection,
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_error, self);
+  g_signal_handlers_disconnect_by_func (connection, on_web_socket_buffered, self);
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
@@ -1419,6 +1670,39 @@ cockpit_web_service_new (CockpitCreds *creds,
   return self;
 }
 
+/*
+ * Whether the peer is on this machine, in which case compressing
+ * WebSocket messages costs more than it saves.
+ */
+static gboolean
+is_local_stream (GIOStream *io_stream)
+{
+  GSocketAddress *address;
+  GIOStream *base = NULL;
+  gboolean local = FALSE;
+
+  /* The socket is underneath the TLS */
+  if (G_IS_TLS_CONNECTION (io_stream))
+    g_object_get (io_stream, "base-io-stream", &base, NULL);
+  else
+    base = g_object_ref (io_stream);
+
+  if (G_IS_SOCKET_CONNECTION (base))
+    {
+      address = g_socket_connection_get_remote_address (G_SOCKET_CONNECTION (base), NULL);
+      if (G_IS_INET_SOCKET_ADDRESS (address))
+        local = g_inet_address_get_is_loopback (g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address)));
+      else if (address)
+        local = (g_socket_address_get_family (address) == G_SOCKET_FAMILY_UNIX);
+      if (address)
+        g_object_unref (address);
+    }
+
+  if (base)
+    g_object_unref (base);
+  return local;
+}
+
 static WebSocketConnection *
 create_web_socket_server_for_stream (GIOStream *io_stream,
                                      GHashTable *headers,
@@ -1445,6 +1729,9 @@ create_web_socket_server_for_stream (GIOStream *io_stream,
   connection = web_socket_server_new_for_stream (url, origin, protocols,
                                                  io_stream, headers,
                                                  input_buffer);
+
+  /* Before the handshake, which happens from the main loop */
+  g_object_set (connection, "deflate", !is_local_stream (io_stream), NULL);
   g_free (origin);
   g_free (url);
 
@@ -1476,6 +1763,7 @@ cockpit_web_service_socket (CockpitWebService *self,
   g_signal_connect (connection, "closing", G_CALLBACK (on_web_socket_closing), self);
   g_signal_connect (connection, "close", G_CALLBACK (on_web_socket_close), self);
   g_signal_connect (connection, "error", G_CALLBACK (on_web_socket_error), NULL);
+  g_signal_connect (connection, "notify::buffered-amount", G_CALLBACK (on_web_socket_buffered), self);
 
   cockpit_socket_track (&self->sockets, connection);
   g_object_unref (connection);
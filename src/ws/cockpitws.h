@@ -38,6 +38,9 @@ extern const gchar *cockpit_ws_default_host_header;
 extern gint cockpit_ws_specific_ssh_port;
 extern guint cockpit_ws_ping_interval;
 extern gint cockpit_ws_session_timeout;
+extern gsize cockpit_ws_flow_high_water;
+extern gsize cockpit_ws_flow_low_water;
+extern gsize cockpit_ws_compress_threshold;
 
 /* From cockpitwebserver */
 extern guint cockpit_ws_request_timeout;
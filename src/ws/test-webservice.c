@@ -40,6 +40,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #define TIMEOUT 30
 
@@ -69,6 +70,9 @@ typedef struct {
 
   /* serve_socket */
   CockpitWebService *service;
+
+  /* setup_for_local */
+  gint saved_ssh_port;
 } TestCase;
 
 typedef struct {
@@ -259,6 +263,33 @@ setup_for_socket_spec (TestCase *test,
   setup_for_socket (test, data);
 }
 
+static void
+setup_for_local (TestCase *test,
+                 gconstpointer data)
+{
+  alarm (TIMEOUT);
+
+  setup_mock_webserver (test, data);
+  setup_io_streams (test, data);
+
+  /* Without a specific ssh port localhost gets a local bridge */
+  test->saved_ssh_port = cockpit_ws_specific_ssh_port;
+  cockpit_ws_specific_ssh_port = 0;
+}
+
+static void
+teardown_for_local (TestCase *test,
+                    gconstpointer data)
+{
+  teardown_mock_webserver (test, data);
+  teardown_io_streams (test, data);
+
+  cockpit_ws_specific_ssh_port = test->saved_ssh_port;
+
+  cockpit_assert_expected ();
+  alarm (0);
+}
+
 static void
 teardown_for_socket (TestCase *test,
                      gconstpointer data)
@@ -627,6 +658,96 @@ test_echo_large (TestCase *test,
   close_client_and_stop_web_service (test, ws, service);
 }
 
+#define PERF_BLOCK_SIZE (32 * 1024)
+#define PERF_BLOCK_COUNT 32
+
+static void
+test_perf_echo (TestCase *test,
+                gconstpointer data)
+{
+  WebSocketConnection *ws;
+  GBytes *received = NULL;
+  CockpitWebService *service;
+  gchar *contents;
+  GBytes *sent;
+  gulong handler;
+  gdouble elapsed;
+  gint i;
+
+  /* Channel open latency includes starting the bridge */
+  g_test_timer_start ();
+  start_web_service_and_connect_client (test, data, &ws, &service);
+  handler = g_signal_connect (ws, "message", G_CALLBACK (on_message_get_non_control), &received);
+
+  sent = g_bytes_new_static ("4\nfirst", 7);
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  elapsed = g_test_timer_elapsed ();
+  g_test_minimized_result (elapsed, "channel open to first echo: %.3f s", elapsed);
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  contents = g_strnfill (PERF_BLOCK_SIZE, '?');
+  contents[0] = '4'; /* channel */
+  contents[1] = '\n';
+  sent = g_bytes_new_take (contents, PERF_BLOCK_SIZE);
+
+  g_test_timer_start ();
+  for (i = 0; i < PERF_BLOCK_COUNT; i++)
+    {
+      web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+      WAIT_UNTIL (received != NULL);
+      g_assert (g_bytes_equal (received, sent));
+      g_bytes_unref (received);
+      received = NULL;
+    }
+  elapsed = g_test_timer_elapsed ();
+  g_test_maximized_result (PERF_BLOCK_SIZE * PERF_BLOCK_COUNT / elapsed / 1024,
+                           "bulk echo throughput: %.1f KiB/s",
+                           PERF_BLOCK_SIZE * PERF_BLOCK_COUNT / elapsed / 1024);
+  g_bytes_unref (sent);
+
+  g_signal_handler_disconnect (ws, handler);
+  close_client_and_stop_web_service (test, ws, service);
+}
+
+static void
+test_local_echo (TestCase *test,
+                 gconstpointer data)
+{
+  WebSocketConnection *ws;
+  GBytes *received = NULL;
+  CockpitWebService *service;
+  GBytes *sent;
+  gulong handler;
+
+  /* As root the local bridge always goes through a real cockpit-session */
+  if (geteuid () == 0)
+    {
+      g_test_message ("running as root, skipping local bridge test");
+      return;
+    }
+
+  /* No mock-sshd is running, so this must go to a local bridge */
+  start_web_service_and_connect_client (test, data, &ws, &service);
+
+  sent = g_bytes_new_static ("4\nthe message", 13);
+  handler = g_signal_connect (ws, "message", G_CALLBACK (on_message_get_non_control), &received);
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+
+  WAIT_UNTIL (received != NULL);
+
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+  received = NULL;
+
+  g_signal_handler_disconnect (ws, handler);
+
+  close_client_and_stop_web_service (test, ws, service);
+}
+
 static void
 test_close_error (TestCase *test,
                   gconstpointer data)
@@ -1708,6 +1829,10 @@ main (int argc,
               &fixture_rfc6455, setup_for_socket,
               test_echo_large, teardown_for_socket);
 
+  g_test_add ("/web-service/echo-message/local", TestCase,
+              &fixture_rfc6455, setup_for_local,
+              test_local_echo, teardown_for_local);
+
   g_test_add ("/web-service/close-error", TestCase,
               NULL, setup_for_socket,
               test_close_error, teardown_for_socket);
@@ -1780,5 +1905,15 @@ main (int argc,
   g_test_add ("/web-service/resource/bad-checksum", TestResourceCase, NULL,
               setup_resource, test_resource_bad_checksum, teardown_resource);
 
+  if (g_test_perf ())
+    {
+      g_test_add ("/web-service/perf/echo-ssh", TestCase,
+                  &fixture_rfc6455, setup_for_socket,
+                  test_perf_echo, teardown_for_socket);
+      g_test_add ("/web-service/perf/echo-local", TestCase,
+                  &fixture_rfc6455, setup_for_local,
+                  test_perf_echo, teardown_for_local);
+    }
+
   return g_test_run ();
 }